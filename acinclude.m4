@@ -588,4 +588,46 @@ AC_DEFUN([DM_UPGRADE_STEPS], [dnl
 	AC_SUBST(PGSQL_32004)
 	AC_SUBST(MYSQL_32004)
 	AC_SUBST(SQLITE_32004)
+
+	PGSQL_32005=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/postgresql/upgrades/32005.psql`
+	MYSQL_32005=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/mysql/upgrades/32005.mysql`
+	SQLITE_32005=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/sqlite/upgrades/32005.sqlite`
+	AC_SUBST(PGSQL_32005)
+	AC_SUBST(MYSQL_32005)
+	AC_SUBST(SQLITE_32005)
+
+	PGSQL_32006=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/postgresql/upgrades/32006.psql`
+	MYSQL_32006=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/mysql/upgrades/32006.mysql`
+	SQLITE_32006=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/sqlite/upgrades/32006.sqlite`
+	AC_SUBST(PGSQL_32006)
+	AC_SUBST(MYSQL_32006)
+	AC_SUBST(SQLITE_32006)
+
+	PGSQL_32007=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/postgresql/upgrades/32007.psql`
+	MYSQL_32007=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/mysql/upgrades/32007.mysql`
+	SQLITE_32007=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/sqlite/upgrades/32007.sqlite`
+	AC_SUBST(PGSQL_32007)
+	AC_SUBST(MYSQL_32007)
+	AC_SUBST(SQLITE_32007)
+
+	PGSQL_32008=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/postgresql/upgrades/32008.psql`
+	MYSQL_32008=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/mysql/upgrades/32008.mysql`
+	SQLITE_32008=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/sqlite/upgrades/32008.sqlite`
+	AC_SUBST(PGSQL_32008)
+	AC_SUBST(MYSQL_32008)
+	AC_SUBST(SQLITE_32008)
+
+	PGSQL_32009=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/postgresql/upgrades/32009.psql`
+	MYSQL_32009=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/mysql/upgrades/32009.mysql`
+	SQLITE_32009=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/sqlite/upgrades/32009.sqlite`
+	AC_SUBST(PGSQL_32009)
+	AC_SUBST(MYSQL_32009)
+	AC_SUBST(SQLITE_32009)
+
+	PGSQL_32010=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/postgresql/upgrades/32010.psql`
+	MYSQL_32010=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/mysql/upgrades/32010.mysql`
+	SQLITE_32010=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/sqlite/upgrades/32010.sqlite`
+	AC_SUBST(PGSQL_32010)
+	AC_SUBST(MYSQL_32010)
+	AC_SUBST(SQLITE_32010)
 ])
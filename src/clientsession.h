@@ -36,6 +36,7 @@ void socket_write_cb(int fd, short what, void *arg);
  
 int pop3_handle_connection(client_sock *c);
 int imap_handle_connection(client_sock *c);
+void imap_handle_change(uint64_t mailbox_id, uint64_t seq);
 int tims_handle_connection(client_sock *c);
 int lmtp_handle_connection(client_sock *c);
 
@@ -153,7 +153,6 @@ typedef struct {
 	String_T crlf; 
 
 	// Mappings
-	GHashTable *header_dict;
 	GTree *header_name;
 	GTree *header_value;
 	
@@ -162,6 +161,9 @@ typedef struct {
 	int part_depth;
 	int part_order;
 
+	// batched ingest (see dbmail_message_store_batched)
+	struct message_batch *batch;
+
 } DbmailMessage;
 
 /**********************************************************************
@@ -223,7 +225,8 @@ enum IMAP_COMMAND_TYPES {
 	IMAP_COMM_IDLE,                 // 37
 	IMAP_COMM_STARTTLS,             // 38
 	IMAP_COMM_ID,                   // 39
-	IMAP_COMM_LAST                  // 40
+	IMAP_COMM_NOTIFY,               // 40
+	IMAP_COMM_LAST                  // 41
 };
 
 typedef enum { 
@@ -416,6 +419,7 @@ typedef struct {
         Field_T tls_key;
         Field_T tls_ciphers;
 	int (*ClientHandler) (client_sock *);
+	void (*ChangeHandler) (uint64_t, uint64_t);
 	void (*cb) (struct evhttp_request *, void *);
 	GTree *security_actions;
 } ServerConfig_T;
@@ -474,20 +478,40 @@ typedef enum {
 	SEARCH_THREAD_REFERENCES
 } search_order;
 
+typedef enum {
+	SORT_NONE = 0,
+	SORT_ARRIVAL,
+	SORT_CC,
+	SORT_DATE,
+	SORT_FROM,
+	SORT_SIZE,
+	SORT_SUBJECT,
+	SORT_TO,
+	SORT_DISPLAY
+} sort_criterion;
+
+#define SORT_MAX_CRITERIA 16
+
 typedef struct {
 	int type;
 	uint64_t size;
 	char table[MAX_SEARCH_LEN];
 	char order[MAX_SEARCH_LEN];
-	char field[MAX_SEARCH_LEN];
+	char field[MAX_SEARCH_LEN];	// IST_SORT: order over the sort keys
+	int criteria[SORT_MAX_CRITERIA+1];	// IST_SORT: SORT_*, negated for REVERSE
 	char op[MAX_SEARCH_LEN];
 	char search[MAX_SEARCH_LEN];
 	char hdrfld[MIME_FIELD_MAX];
+	int flags_mask;		// IST_FLAG: flags tested, as 1 << IMAP_FLAG_*
+	int flags_set;		// IST_FLAG: those of flags_mask that must be set
+	time_t since;		// IST_IDATE: internal dates in [since, before),
+	time_t before;		// 0 leaves that end open
 //	int match;
 	GTree *found;
 	gboolean reverse;
 	gboolean searched;
 	gboolean merged;
+	gboolean compiled;	// found holds the result of the whole subtree
 } search_key;
 
 
@@ -504,6 +528,8 @@ typedef struct {
 	gchar *hdrplist;
 	GTree *headers;
 	GList *names;
+	uint64_t lo;		/* header prefetch position in ids_list */
+	uint64_t ceiling;	/* highest prefetched message id */
 } body_fetch;
 
 
@@ -547,6 +573,47 @@ typedef struct {
 	String_T known_uidset;
 } qresync_args;
 
+/* SEARCH and SORT RETURN options (RFC 4731, RFC 5267) */
+#define SEARCH_RETURN_ESEARCH	0x01	// answer with ESEARCH
+#define SEARCH_RETURN_MIN	0x02
+#define SEARCH_RETURN_MAX	0x04
+#define SEARCH_RETURN_COUNT	0x08
+#define SEARCH_RETURN_ALL	0x10
+#define SEARCH_RETURN_PARTIAL	0x20
+#define SEARCH_RETURN_SAVE	0x40	// keep the result for $ (RFC 5182)
+
+typedef struct {
+	int options;
+	int64_t partial_lo;	// PARTIAL range as given, negative counts from the end
+	int64_t partial_hi;
+} search_return;
+
+/* NOTIFY events (RFC 5465) */
+#define NOTIFY_MESSAGENEW		0x01
+#define NOTIFY_MESSAGEEXPUNGE		0x02
+#define NOTIFY_FLAGCHANGE		0x04
+#define NOTIFY_MAILBOXNAME		0x08
+#define NOTIFY_SUBSCRIPTIONCHANGE	0x10
+
+typedef struct {
+	uint64_t id;
+	char *name;		// mailbox name as seen by the client
+	int events;
+	uint64_t seq;		// seq at the last report
+	bool known;		// counters below have been reported
+	unsigned exists;
+	unsigned unseen;
+	uint64_t uidnext;
+} notify_mailbox;
+
+typedef struct {
+	int selected;		// events for the selected mailbox
+	GTree *mailboxes;	// notify_mailbox for other mailboxes, by id
+	bool pending;		// changes arrived while a command was running
+	bool running;		// a change report is being prepared
+	uint64_t listed;	// selected mailbox the session is listed under
+} notify_args;
+
 
 /************************************************************************ 
  *                      simple cache mechanism
@@ -557,16 +624,13 @@ typedef struct {
  */
 #define IMAP_NFLAGS 6
 typedef struct { // map dbmail_messages
-	uint64_t mailbox_id;
-	uint64_t msn;
 	uint64_t uid;
 	uint64_t rfcsize;
 	uint64_t seq;
-	int status;
-	char internaldate[IMAP_INTERNALDATE_LEN];
-	int flags[IMAP_NFLAGS];
-	// reference dbmail_keywords
-	GList *keywords;
+	time_t internaldate;
+	char status;
+	char flags[IMAP_NFLAGS];
+	// keywords are kept by the MailboxState index
 } MessageInfo;
 
 
@@ -671,6 +735,8 @@ typedef enum {
 	SQL_RETURNING,
 	SQL_TABLE_EXISTS,
 	SQL_ESCAPE_COLUMN,
-	SQL_COMPARE_BLOB
+	SQL_COMPARE_BLOB,
+	SQL_UPSERT_MIMEPART,
+	SQL_INDEX_EXISTS
 } sql_fragment;
 #endif
@@ -30,7 +30,7 @@
 #define THIS_MODULE "db"
 
 // Flag order defined in dbmailtypes.h
-static const char *db_flag_desc[] = {
+const char *db_flag_desc[] = {
 	"seen_flag",
        	"answered_flag",
        	"deleted_flag",
@@ -681,6 +681,12 @@ static const char * db_get_sqlite_sql(sql_fragment frag)
 		case SQL_COMPARE_BLOB:
 			return "%s=?";
 		break;
+		case SQL_UPSERT_MIMEPART:
+			return "INSERT OR IGNORE INTO %smimeparts (hash, data, size, compressed) VALUES (?, ?, ?, ?)";
+		break;
+		case SQL_INDEX_EXISTS:
+			return "SELECT 1=1 FROM sqlite_master WHERE type='index' AND name='%s%s'";
+		break;
 	}
 	return NULL;
 }
@@ -737,6 +743,14 @@ static const char * db_get_mysql_sql(sql_fragment frag)
 		case SQL_COMPARE_BLOB:
 			return "%s=?";
 		break;
+		case SQL_UPSERT_MIMEPART:
+			return "INSERT INTO %smimeparts (hash, data, `size`, compressed) VALUES (?, ?, ?, ?) "
+				"ON DUPLICATE KEY UPDATE id = LAST_INSERT_ID(id)";
+		break;
+		case SQL_INDEX_EXISTS:
+			return "SELECT 1=1 FROM information_schema.statistics "
+				"WHERE table_schema=DATABASE() AND index_name='%s%s' LIMIT 1";
+		break;
 	}
 	return NULL;
 }
@@ -796,6 +810,13 @@ static const char * db_get_pgsql_sql(sql_fragment frag)
 		case SQL_COMPARE_BLOB:
 			return "%s=?";
 		break;
+		case SQL_UPSERT_MIMEPART:
+			return "INSERT INTO %smimeparts (hash, data, \"size\", compressed) VALUES (?, ?, ?, ?) "
+				"ON CONFLICT (hash, \"size\") DO UPDATE SET hash = EXCLUDED.hash RETURNING id";
+		break;
+		case SQL_INDEX_EXISTS:
+			return "SELECT 1=1 FROM pg_indexes WHERE indexname='%s%s'";
+		break;
 	}
 	return NULL;
 }
@@ -852,6 +873,11 @@ static const char * db_get_oracle_sql(sql_fragment frag)
 		case SQL_COMPARE_BLOB:
 			return "DBMS_LOB.COMPARE(%s,?) = 0";
 		break;
+		case SQL_UPSERT_MIMEPART:
+		break;
+		case SQL_INDEX_EXISTS:
+			return "SELECT INDEX_NAME FROM USER_INDEXES WHERE INDEX_NAME=UPPER('%s%s')";
+		break;
 	}
 	return NULL;
 }
@@ -900,6 +926,25 @@ static ResultSet_T check_table_exists(Connection_T c, const char *table)
 	return db_query(c, db_get_sql(SQL_TABLE_EXISTS), DBPFX, table);
 }
 
+gboolean db_index_exists(const char *index)
+{
+	Connection_T c; ResultSet_T r;
+	volatile gboolean t = FALSE;
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, db_get_sql(SQL_INDEX_EXISTS), DBPFX, index);
+		if (db_result_next(r))
+			t = TRUE;
+	CATCH(SQLException)
+		LOG_SQLERROR;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
+}
+
 static int check_upgrade_step(int from_version, int to_version)
 {
 	const char *query = NULL;
@@ -934,18 +979,36 @@ static int check_upgrade_step(int from_version, int to_version)
 			if (to_version == 32002) query = DM_SQLITE_32002;
 			if (to_version == 32003) query = DM_SQLITE_32003;
 			if (to_version == 32004) query = DM_SQLITE_32004;
+			if (to_version == 32005) query = DM_SQLITE_32005;
+			if (to_version == 32006) query = DM_SQLITE_32006;
+			if (to_version == 32007) query = DM_SQLITE_32007;
+			if (to_version == 32008) query = DM_SQLITE_32008;
+			if (to_version == 32009) query = DM_SQLITE_32009;
+			if (to_version == 32010) query = DM_SQLITE_32010;
 		break;
 		case DM_DRIVER_MYSQL:
 			if (to_version == 32001) query = DM_MYSQL_32001;
 			if (to_version == 32002) query = DM_MYSQL_32002;
 			if (to_version == 32003) query = DM_MYSQL_32003;
 			if (to_version == 32004) query = DM_MYSQL_32004;
+			if (to_version == 32005) query = DM_MYSQL_32005;
+			if (to_version == 32006) query = DM_MYSQL_32006;
+			if (to_version == 32007) query = DM_MYSQL_32007;
+			if (to_version == 32008) query = DM_MYSQL_32008;
+			if (to_version == 32009) query = DM_MYSQL_32009;
+			if (to_version == 32010) query = DM_MYSQL_32010;
 		break;
 		case DM_DRIVER_POSTGRESQL:
 			if (to_version == 32001) query = DM_PGSQL_32001;
 			if (to_version == 32002) query = DM_PGSQL_32002;
 			if (to_version == 32003) query = DM_MYSQL_32003;
 			if (to_version == 32004) query = DM_MYSQL_32004;
+			if (to_version == 32005) query = DM_PGSQL_32005;
+			if (to_version == 32006) query = DM_PGSQL_32006;
+			if (to_version == 32007) query = DM_PGSQL_32007;
+			if (to_version == 32008) query = DM_PGSQL_32008;
+			if (to_version == 32009) query = DM_PGSQL_32009;
+			if (to_version == 32010) query = DM_PGSQL_32010;
 		break;
 		default:
 			TRACE(TRACE_WARNING, "Migrations not supported for database driver");
@@ -1028,12 +1091,24 @@ int db_check_version(void)
 			break;
 		if ((ok = check_upgrade_step(32001, 32004)) == DM_EQUERY)
 			break;
+		if ((ok = check_upgrade_step(32001, 32005)) == DM_EQUERY)
+			break;
+		if ((ok = check_upgrade_step(32001, 32006)) == DM_EQUERY)
+			break;
+		if ((ok = check_upgrade_step(32001, 32007)) == DM_EQUERY)
+			break;
+		if ((ok = check_upgrade_step(32001, 32008)) == DM_EQUERY)
+			break;
+		if ((ok = check_upgrade_step(32001, 32009)) == DM_EQUERY)
+			break;
+		if ((ok = check_upgrade_step(32001, 32010)) == DM_EQUERY)
+			break;
 		break;
 	} while (true);
 
 	db_con_close(c);
 
-	if (ok == 32004) {
+	if (ok == 32010) {
 		TRACE(TRACE_DEBUG, "Schema check successful");
 	} else {
 		TRACE(TRACE_WARNING,"Schema version incompatible [%d]. Bailing out",
@@ -1868,6 +1943,199 @@ int db_icheck_envelope(GList **lost)
 }
 
 
+int db_set_bodystructure(GList *lost)
+{
+	uint64_t *id;
+	DbmailMessage *msg;
+	Mempool_T pool;
+	if (! lost)
+		return DM_SUCCESS;
+
+	pool = mempool_open();
+	lost = g_list_first(lost);
+	while (lost) {
+		id = (uint64_t *)lost->data;
+
+		msg = dbmail_message_new(pool);
+		if (! msg) {
+			mempool_close(&pool);
+			return DM_EQUERY;
+		}
+
+		if (! (msg = dbmail_message_retrieve(msg, *id))) {
+			TRACE(TRACE_WARNING,"error retrieving physmessage: [%" PRIu64 "]", *id);
+			fprintf(stderr,"E");
+		} else if (dbmail_message_cache_bodystructure(msg) != DM_SUCCESS) {
+			fprintf(stderr,"E");
+		} else {
+			fprintf(stderr,".");
+		}
+		dbmail_message_free(msg);
+		if (! g_list_next(lost)) break;
+		lost = g_list_next(lost);
+	}
+
+	mempool_close(&pool);
+	return DM_SUCCESS;
+}
+
+int db_icheck_bodystructure(GList **lost)
+{
+	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
+	uint64_t *id;
+
+	if (db_params.db_driver == DM_DRIVER_ORACLE)
+		return t;
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT physmessage_id FROM %senvelope WHERE bodystructure IS NULL", DBPFX);
+		while (db_result_next(r)) {
+			id = g_new0(uint64_t,1);
+			*id = db_result_get_u64(r, 0);
+			*(GList **)lost = g_list_prepend(*(GList **)lost,id);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
+}
+
+
+int db_set_fulltext(GList *lost)
+{
+	uint64_t *id;
+	DbmailMessage *msg;
+	Mempool_T pool;
+	if (! lost)
+		return DM_SUCCESS;
+
+	pool = mempool_open();
+	lost = g_list_first(lost);
+	while (lost) {
+		id = (uint64_t *)lost->data;
+
+		msg = dbmail_message_new(pool);
+		if (! msg) {
+			mempool_close(&pool);
+			return DM_EQUERY;
+		}
+
+		if (! (msg = dbmail_message_retrieve(msg, *id))) {
+			TRACE(TRACE_WARNING,"error retrieving physmessage: [%" PRIu64 "]", *id);
+			fprintf(stderr,"E");
+		} else if (dbmail_message_cache_fulltext(msg) != DM_SUCCESS) {
+			fprintf(stderr,"E");
+		} else {
+			fprintf(stderr,".");
+		}
+		dbmail_message_free(msg);
+		if (! g_list_next(lost)) break;
+		lost = g_list_next(lost);
+	}
+
+	mempool_close(&pool);
+	return DM_SUCCESS;
+}
+
+int db_icheck_fulltext(GList **lost)
+{
+	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
+	uint64_t *id;
+
+	if (! fulltext_backend())
+		return t;
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT p.id FROM %sphysmessage p "
+				"LEFT JOIN %sfulltext_messages f ON p.id = f.physmessage_id "
+				"WHERE f.physmessage_id IS NULL", DBPFX, DBPFX);
+		while (db_result_next(r)) {
+			id = g_new0(uint64_t,1);
+			*id = db_result_get_u64(r, 0);
+			*(GList **)lost = g_list_prepend(*(GList **)lost,id);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
+}
+
+
+int db_set_sortkeys(GList *lost)
+{
+	uint64_t *id;
+	DbmailMessage *msg;
+	Mempool_T pool;
+	if (! lost)
+		return DM_SUCCESS;
+
+	pool = mempool_open();
+	lost = g_list_first(lost);
+	while (lost) {
+		id = (uint64_t *)lost->data;
+
+		msg = dbmail_message_new(pool);
+		if (! msg) {
+			mempool_close(&pool);
+			return DM_EQUERY;
+		}
+
+		if (! (msg = dbmail_message_retrieve(msg, *id))) {
+			TRACE(TRACE_WARNING,"error retrieving physmessage: [%" PRIu64 "]", *id);
+			fprintf(stderr,"E");
+		} else if (dbmail_message_cache_sortkeys(msg) != DM_SUCCESS) {
+			fprintf(stderr,"E");
+		} else {
+			fprintf(stderr,".");
+		}
+		dbmail_message_free(msg);
+		if (! g_list_next(lost)) break;
+		lost = g_list_next(lost);
+	}
+
+	mempool_close(&pool);
+	return DM_SUCCESS;
+}
+
+int db_icheck_sortkeys(GList **lost)
+{
+	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
+	uint64_t *id;
+
+	if (db_params.db_driver == DM_DRIVER_ORACLE)
+		return t;
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT p.id FROM %sphysmessage p "
+				"LEFT JOIN %ssortkeys k ON p.id = k.physmessage_id "
+				"WHERE k.physmessage_id IS NULL", DBPFX, DBPFX);
+		while (db_result_next(r)) {
+			id = g_new0(uint64_t,1);
+			*id = db_result_get_u64(r, 0);
+			*(GList **)lost = g_list_prepend(*(GList **)lost,id);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
+}
+
+
 int db_set_message_status(uint64_t message_idnr, MessageStatus_T status)
 {
 	return db_update("UPDATE %smessages SET status = %d WHERE message_idnr = %" PRIu64 "", 
@@ -2838,8 +3106,11 @@ int db_movemsg(uint64_t mailbox_to, uint64_t mailbox_from)
 	c = db_con_get();
 	TRY
 		db_begin_transaction(c);
-		db_exec(c, "UPDATE %smessages SET mailbox_idnr=%" PRIu64 " WHERE mailbox_idnr=%" PRIu64 "", 
-				DBPFX, mailbox_to, mailbox_from);
+		/* moved messages are new to mailbox_to: stamp them with its next seq */
+		db_exec(c, "UPDATE %smessages SET mailbox_idnr=%" PRIu64 ", "
+				"seq=(SELECT seq + 1 FROM %smailboxes WHERE mailbox_idnr=%" PRIu64 ") "
+				"WHERE mailbox_idnr=%" PRIu64 "", 
+				DBPFX, mailbox_to, DBPFX, mailbox_to, mailbox_from);
 		count = Connection_rowsChanged(c);
 		db_commit_transaction(c);
 	CATCH(SQLException)
@@ -3142,7 +3413,7 @@ int db_get_msgflag(const char *flag_name, uint64_t msg_idnr)
 	return val;
 }
 
-static long long int db_set_msgkeywords(Connection_T c, uint64_t msg_idnr, GList *keywords, int action_type, MessageInfo *msginfo)
+static long long int db_set_msgkeywords(Connection_T c, uint64_t msg_idnr, GList *keywords, int action_type, MailboxState_T M, MessageInfo *msginfo)
 {
 	PreparedStatement_T s;
 	INIT_QUERY;
@@ -3160,9 +3431,7 @@ static long long int db_set_msgkeywords(Connection_T c, uint64_t msg_idnr, GList
 
 		keywords = g_list_first(keywords);
 		while (keywords) {
-			if ((msginfo) && (g_list_find_custom(msginfo->keywords, 
-							(char *)keywords->data, 
-							(GCompareFunc)g_ascii_strcasecmp))) {
+			if ((msginfo) && MailboxState_messageHasKeyword(M, msginfo, (char *)keywords->data)) {
 				db_stmt_set_str(s,2,(char *)keywords->data);
 				db_stmt_exec(s);
 				count++;
@@ -3184,9 +3453,7 @@ static long long int db_set_msgkeywords(Connection_T c, uint64_t msg_idnr, GList
 
 		keywords = g_list_first(keywords);
 		while (keywords) {
-			if ((! msginfo) || (! g_list_find_custom(msginfo->keywords, 
-							(char *)keywords->data, 
-							(GCompareFunc)g_ascii_strcasecmp))) {
+			if ((! msginfo) || (! MailboxState_messageHasKeyword(M, msginfo, (char *)keywords->data))) {
 
 				if (action_type == IMAPFA_ADD) { // avoid duplicate key errors in case of concurrent inserts
 					s = db_stmt_prepare(c, "DELETE FROM %skeywords WHERE message_idnr=? AND keyword=?", DBPFX);
@@ -3209,13 +3476,17 @@ static long long int db_set_msgkeywords(Connection_T c, uint64_t msg_idnr, GList
 	return count;
 }
 
-int db_set_msgflag(uint64_t msg_idnr, int *flags, GList *keywords, int action_type, uint64_t seq, MessageInfo *msginfo)
+int db_set_msgflag(uint64_t msg_idnr, int *flags, GList *keywords, int action_type, uint64_t seq, MailboxState_T M)
 {
 	Connection_T c;
 	size_t i, pos = 0;
 	volatile int seen = 0, count = 0;
+	MessageInfo *msginfo = NULL;
 	INIT_QUERY;
 
+	if (M)
+		msginfo = MailboxState_editMessage(M, msg_idnr);
+
 	memset(query,0,DEF_QUERYSIZE);
 	pos += snprintf(query, DEF_QUERYSIZE-1, "UPDATE %smessages SET ", DBPFX);
 
@@ -3271,7 +3542,7 @@ int db_set_msgflag(uint64_t msg_idnr, int *flags, GList *keywords, int action_ty
 			if (Connection_rowsChanged(c))
 				count = 1;
 		}
-		if (db_set_msgkeywords(c, msg_idnr, keywords, action_type, msginfo))
+		if (db_set_msgkeywords(c, msg_idnr, keywords, action_type, M, msginfo))
 			count = 1;
 
 		db_commit_transaction(c);
@@ -4236,6 +4507,161 @@ int db_user_log_login(uint64_t user_idnr)
 	return db_update("UPDATE %susers SET last_login = '%s' WHERE user_idnr = %" PRIu64 "",DBPFX, timestring, user_idnr);
 }
 
+/*
+ * mailbox seq probes
+ *
+ * seqs read from the database are kept for seq_cache_ttl seconds (IMAP
+ * section, default 1, 0 disables) so that polling sessions and sweeps
+ * over many folders share their lookups. Updates made through
+ * db_mailbox_seq_update are written through.
+ */
+struct seq_probe {
+	uint64_t id;
+	uint64_t seq;
+	time_t stamp;
+};
+
+static GTree *seq_cache = NULL;
+static int seq_cache_ttl = 1;
+G_LOCK_DEFINE_STATIC(seq_cache);
+
+/* call with the lock held */
+static void seq_cache_init(void)
+{
+	Field_T val;
+
+	if (seq_cache)
+		return;
+
+	seq_cache = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, NULL, g_free);
+	config_get_value("seq_cache_ttl", "IMAP", val);
+	if (strlen(val))
+		seq_cache_ttl = atoi(val);
+}
+
+static gboolean _seq_expired(uint64_t *id, struct seq_probe *p, GList **expired)
+{
+	if ((time(NULL) - p->stamp) >= seq_cache_ttl)
+		*expired = g_list_prepend(*expired, id);
+	return FALSE;
+}
+
+/* call with the lock held */
+static void seq_cache_store(uint64_t id, uint64_t seq)
+{
+	struct seq_probe *p;
+	GList *expired = NULL;
+
+	if (g_tree_nnodes(seq_cache) > 1024) {
+		g_tree_foreach(seq_cache, (GTraverseFunc)_seq_expired, &expired);
+		expired = g_list_first(expired);
+		while (expired) {
+			g_tree_remove(seq_cache, expired->data);
+			if (! g_list_next(expired)) break;
+			expired = g_list_next(expired);
+		}
+		g_list_free(g_list_first(expired));
+	}
+
+	if (! (p = g_tree_lookup(seq_cache, &id))) {
+		p = g_new0(struct seq_probe, 1);
+		p->id = id;
+		g_tree_insert(seq_cache, &p->id, p);
+	}
+	// seqs only go up
+	p->seq = max(p->seq, seq);
+	p->stamp = time(NULL);
+}
+
+/* call with the lock held */
+static gboolean seq_cache_lookup(uint64_t id, uint64_t *seq, gboolean fresh)
+{
+	struct seq_probe *p;
+
+	if (! (p = g_tree_lookup(seq_cache, &id)))
+		return FALSE;
+	if (fresh && ((time(NULL) - p->stamp) >= seq_cache_ttl))
+		return FALSE;
+
+	*seq = p->seq;
+	return TRUE;
+}
+
+int db_mailbox_seq_probe(GList *ids)
+{
+	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
+	GList *missing = NULL, *slices;
+	uint64_t id, seq;
+
+	G_LOCK(seq_cache);
+	seq_cache_init();
+	ids = g_list_first(ids);
+	while (ids) {
+		if (! seq_cache_lookup(*(uint64_t *)ids->data, &seq, TRUE))
+			missing = g_list_prepend(missing, ids->data);
+		if (! g_list_next(ids)) break;
+		ids = g_list_next(ids);
+	}
+	G_UNLOCK(seq_cache);
+
+	if (! missing)
+		return t;
+
+	slices = g_list_slices_u64(missing, 500);
+	g_list_free(missing);
+
+	c = db_con_get();
+	TRY
+		slices = g_list_first(slices);
+		while (slices) {
+			r = db_query(c, "SELECT mailbox_idnr, seq FROM %smailboxes "
+					"WHERE mailbox_idnr IN (%s)", DBPFX, (char *)slices->data);
+			while (db_result_next(r)) {
+				id = db_result_get_u64(r, 0);
+				seq = db_result_get_u64(r, 1);
+				G_LOCK(seq_cache);
+				seq_cache_store(id, seq);
+				G_UNLOCK(seq_cache);
+			}
+			if (! g_list_next(slices)) break;
+			slices = g_list_next(slices);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+		g_list_destroy(slices);
+	END_TRY;
+
+	return t;
+}
+
+uint64_t db_mailbox_seq(uint64_t mailbox_id)
+{
+	GList *ids = NULL;
+	uint64_t seq = 0;
+	gboolean found;
+
+	G_LOCK(seq_cache);
+	seq_cache_init();
+	found = seq_cache_lookup(mailbox_id, &seq, TRUE);
+	G_UNLOCK(seq_cache);
+
+	if (found)
+		return seq;
+
+	ids = g_list_prepend(ids, &mailbox_id);
+	db_mailbox_seq_probe(ids);
+	g_list_free(ids);
+
+	G_LOCK(seq_cache);
+	seq_cache_lookup(mailbox_id, &seq, FALSE);
+	G_UNLOCK(seq_cache);
+
+	return seq;
+}
+
 uint64_t db_mailbox_seq_update(uint64_t mailbox_id, uint64_t message_id)
 {
 	Connection_T c; ResultSet_T r; PreparedStatement_T st1, st2, st3;
@@ -4269,9 +4695,24 @@ uint64_t db_mailbox_seq_update(uint64_t mailbox_id, uint64_t message_id)
 	END_TRY;
 	TRACE(TRACE_DEBUG, "mailbox_id [%" PRIu64 "] message_id [%" PRIu64 "] -> [%" PRIu64 "]",
 			mailbox_id, message_id, seq);
+	if (seq) {
+		G_LOCK(seq_cache);
+		seq_cache_init();
+		seq_cache_store(mailbox_id, seq);
+		G_UNLOCK(seq_cache);
+		notify_publish(mailbox_id, seq);
+	}
 	return seq;
 }
 
+void db_mailbox_seq_cache(uint64_t mailbox_id, uint64_t seq)
+{
+	G_LOCK(seq_cache);
+	seq_cache_init();
+	seq_cache_store(mailbox_id, seq);
+	G_UNLOCK(seq_cache);
+}
+
 void db_message_set_seq(uint64_t message_id, uint64_t seq)
 {
 	Connection_T c; PreparedStatement_T st;
@@ -4290,6 +4731,35 @@ void db_message_set_seq(uint64_t message_id, uint64_t seq)
 	END_TRY;
 }
 
+void db_messages_set_seq(GList *ids, uint64_t seq)
+{
+	Connection_T c;
+	GList *slices;
+
+	if (! (slices = g_list_slices_u64(ids, 100)))
+		return;
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		slices = g_list_first(slices);
+		while (slices) {
+			db_exec(c, "UPDATE %s %smessages SET seq = %" PRIu64 " WHERE seq < %" PRIu64
+					" AND message_idnr IN (%s)", db_get_sql(SQL_IGNORE), DBPFX,
+					seq, seq, (char *)slices->data);
+			if (! g_list_next(slices)) break;
+			slices = g_list_next(slices);
+		}
+		db_commit_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+	FINALLY
+		db_con_close(c);
+		g_list_destroy(slices);
+	END_TRY;
+}
+
 int db_rehash_store(void)
 {
 	GList *ids = NULL;
@@ -4325,19 +4795,35 @@ int db_rehash_store(void)
 			uint64_t *id = ids->data;
 
 			db_con_clear(c);
-			s = db_stmt_prepare(c, "SELECT data FROM %smimeparts WHERE id=?", DBPFX);
+			s = db_stmt_prepare(c, "SELECT data, %s FROM %smimeparts WHERE id=?",
+					db_params.db_driver == DM_DRIVER_ORACLE ? "0" : "compressed", DBPFX);
 			db_stmt_set_u64(s,1, *id);
 			r = db_stmt_query(s);
 			db_result_next(r);
-			buf = db_result_get(r, 0);
 			memset(hash, 0, sizeof(hash));
-			dm_get_hash_for_string(buf, hash);
+			if (db_result_get_int(r, 1)) {
+				char *data;
+				size_t len = 0;
+				int l = 0;
+				buf = db_result_get_blob(r, 0, &l);
+				if ((data = dm_gzip(buf, l, FALSE, &len))) {
+					dm_get_hash_for_string(data, hash);
+					g_free(data);
+				} else {
+					TRACE(TRACE_ERR, "corrupt compressed mimepart [%" PRIu64 "]", *id);
+				}
+			} else {
+				buf = db_result_get(r, 0);
+				dm_get_hash_for_string(buf, hash);
+			}
 
-			db_con_clear(c);
-			s = db_stmt_prepare(c, "UPDATE %smimeparts SET hash=? WHERE id=?", DBPFX);
-			db_stmt_set_str(s, 1, hash);
-			db_stmt_set_u64(s, 2, *id);
-			db_stmt_exec(s);
+			if (hash[0]) {
+				db_con_clear(c);
+				s = db_stmt_prepare(c, "UPDATE %smimeparts SET hash=? WHERE id=?", DBPFX);
+				db_stmt_set_str(s, 1, hash);
+				db_stmt_set_u64(s, 2, *id);
+				db_stmt_exec(s);
+			}
 
 			if (! g_list_next(ids)) break;
 			ids = g_list_next(ids);
@@ -390,6 +390,27 @@ int db_update_rfcsize(GList *lost);
 int db_icheck_envelope(GList **lost);
 int db_set_envelope(GList *lost);
 
+/**
+ * \brief check for envelopes without cached BODYSTRUCTURE
+ *
+ */
+int db_icheck_bodystructure(GList **lost);
+int db_set_bodystructure(GList *lost);
+
+/**
+ * \brief check for physmessages missing from the full-text index
+ *
+ */
+int db_icheck_fulltext(GList **lost);
+int db_set_fulltext(GList *lost);
+
+/**
+ * \brief check for physmessages without sort keys
+ *
+ */
+int db_icheck_sortkeys(GList **lost);
+int db_set_sortkeys(GList *lost);
+
 /**
  * \brief set status of a message
  * \param message_idnr
@@ -689,11 +710,13 @@ int db_get_msgflag(const char *flag_name, uint64_t msg_idnr);
  *          in flags
  * \param seq
  *        - only modify message flags if modsequence for message <= seq
+ * \param M
+ *        - mailbox state to keep in sync, or NULL
  * \return 
  * 		- -1 on failure
  * 		-  1 on success
  */
-int db_set_msgflag(uint64_t msg_idnr, int *flags, GList *keywords, int action_type, uint64_t seq, MessageInfo *msginfo);
+int db_set_msgflag(uint64_t msg_idnr, int *flags, GList *keywords, int action_type, uint64_t seq, MailboxState_T M);
 
 /**
  * \brief set one right in an acl for a user
@@ -774,9 +797,23 @@ int db_replycache_unregister(const char *to, const char *from, const char *handl
 /* get driver specific SQL snippets */
 const char * db_get_sql(sql_fragment frag);
 char * db_returning(const char *s);
+/** \brief TRUE if the index exists, name without the table prefix */
+gboolean db_index_exists(const char *index);
 
+/**
+ * \brief read the current seq for a list of mailboxes into the seq cache
+ * \param ids list of uint64_t * mailbox ids; ids looked up recently are skipped
+ * \return DM_SUCCESS or DM_EQUERY
+ */
+int db_mailbox_seq_probe(GList *ids);
+/** \brief current seq of a mailbox, served from the seq cache when fresh */
+uint64_t db_mailbox_seq(uint64_t mailbox_id);
 uint64_t db_mailbox_seq_update(uint64_t mailbox_id, uint64_t message_id);
+/** \brief record a seq announced by another process in the seq cache */
+void db_mailbox_seq_cache(uint64_t mailbox_id, uint64_t seq);
 void db_message_set_seq(uint64_t message_id, uint64_t seq);
+/** \brief stamp a list of messages with a new modseq */
+void db_messages_set_seq(GList *ids, uint64_t seq);
 
 int db_rehash_store(void);
 
@@ -0,0 +1,615 @@
+/*
+
+ Copyright (c) 2004-2012 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * full-text index
+ *
+ * at delivery the header values and the decoded text parts of a message
+ * are split into words. Each distinct word is stored once per message,
+ * lowercased. Words longer than FULLTEXT_TERM_MAX bytes are stored as
+ * overlapping pieces. BODY and TEXT searches use the stored terms to
+ * find the candidate messages that can contain the search string, and
+ * only those are checked with the substring match of a plain scan.
+ *
+ * A message that does not fit (too many words, or a text part that is
+ * too large) is not listed in fulltext_messages, and is always scanned.
+ */
+
+#include "dbmail.h"
+
+#define THIS_MODULE "fulltext"
+
+#define FULLTEXT_TERM_MIN 2	// characters
+#define FULLTEXT_TERM_MAX 64	// bytes
+#define FULLTEXT_TERM_STEP 32	// bytes between the pieces of a long word
+#define FULLTEXT_PIECE_MAX 16	// bytes, fits in one piece of a long word
+#define FULLTEXT_TERMS_MAX 20000 // per message
+#define FULLTEXT_PART_MAX (1024 * 1024)
+
+/* sorts after every term that starts with the same prefix */
+#define FULLTEXT_PREFIX_END "\xf4\x8f\xbf\xbf"
+
+extern DBParam_T db_params;
+#define DBPFX db_params.pfx
+
+/*
+ * tokenizer
+ */
+
+typedef struct {
+	GHashTable *terms;
+	gboolean complete;
+} fulltext_terms;
+
+static void fulltext_term(fulltext_terms *T, char *term, int scope)
+{
+	int bits = GPOINTER_TO_INT(g_hash_table_lookup(T->terms, term));
+
+	if ((! bits) && (g_hash_table_size(T->terms) >= FULLTEXT_TERMS_MAX)) {
+		T->complete = FALSE;
+		g_free(term);
+		return;
+	}
+	g_hash_table_replace(T->terms, term, GINT_TO_POINTER(bits | scope));
+}
+
+/* the longest run of whole characters from s that fits in max bytes */
+static size_t fulltext_fit(const char *s, size_t len, size_t max)
+{
+	const char *end;
+
+	if (len <= max)
+		return len;
+	end = g_utf8_find_prev_char(s, s + max + 1);
+	return end ? (size_t)(end - s) : 0;
+}
+
+/*
+ * a long word is stored from its start, and then again every
+ * FULLTEXT_TERM_STEP bytes, so any FULLTEXT_PIECE_MAX bytes of it
+ * are found inside one of the stored pieces
+ */
+static void fulltext_add(fulltext_terms *T, const char *word, size_t len, int scope)
+{
+	char *term;
+	const char *p;
+	size_t l, n;
+
+	if (g_utf8_strlen(word, len) < FULLTEXT_TERM_MIN)
+		return;
+
+	term = g_utf8_strdown(word, len);
+	l = strlen(term);
+	p = term;
+	while (l) {
+		n = fulltext_fit(p, l, FULLTEXT_TERM_MAX);
+		fulltext_term(T, g_strndup(p, n), scope);
+		if (n == l)
+			break;
+		n = fulltext_fit(p, l, FULLTEXT_TERM_STEP);
+		p += n;
+		l -= n;
+	}
+	g_free(term);
+}
+
+/* words are runs of letters and digits */
+static void fulltext_tokenize(fulltext_terms *T, const char *text, int scope)
+{
+	const char *p = text, *word = NULL;
+	gunichar c;
+
+	while (p && *p) {
+		c = g_utf8_get_char_validated(p, -1);
+		if (c == (gunichar)-1 || c == (gunichar)-2) {
+			if (word) fulltext_add(T, word, p - word, scope);
+			word = NULL;
+			p++;
+			continue;
+		}
+
+		if (g_unichar_isalnum(c)) {
+			if (! word) word = p;
+		} else if (word) {
+			fulltext_add(T, word, p - word, scope);
+			word = NULL;
+		}
+
+		p = g_utf8_next_char(p);
+	}
+	if (word)
+		fulltext_add(T, word, p - word, scope);
+}
+
+/* header values are indexed both as stored and decoded */
+static void fulltext_header(const char UNUSED *name, const char *raw, gpointer data)
+{
+	fulltext_terms *T = (fulltext_terms *)data;
+	char *value;
+
+	fulltext_tokenize(T, raw, FULLTEXT_HEADER);
+	if (! (value = dbmail_iconv_decode_field(raw, NULL, FALSE)))
+		return;
+	fulltext_tokenize(T, value, FULLTEXT_HEADER);
+	g_free(value);
+}
+
+/* the headers of body parts and attached messages are part of BODY */
+static void fulltext_body_header(const char *name, const char *raw, gpointer data)
+{
+	fulltext_terms *T = (fulltext_terms *)data;
+
+	fulltext_tokenize(T, name, FULLTEXT_BODY);
+	fulltext_tokenize(T, raw, FULLTEXT_BODY);
+}
+
+static void fulltext_part(GMimeObject UNUSED *parent, GMimeObject *part, gpointer data)
+{
+	fulltext_terms *T = (fulltext_terms *)data;
+	GMimeContentType *type;
+	GMimeDataWrapper *wrapper;
+	GMimeStream *stream;
+	GByteArray *bytes;
+	GMimeMessage *message;
+	const char *charset;
+	char *text;
+
+	g_mime_header_list_foreach(g_mime_object_get_header_list(part),
+			(GMimeHeaderForeachFunc)fulltext_body_header, T);
+
+	if (GMIME_IS_MESSAGE_PART(part)) {
+		message = g_mime_message_part_get_message(GMIME_MESSAGE_PART(part));
+		if (message) {
+			g_mime_header_list_foreach(g_mime_object_get_header_list(GMIME_OBJECT(message)),
+					(GMimeHeaderForeachFunc)fulltext_body_header, T);
+			g_mime_message_foreach(message, fulltext_part, data);
+		}
+		return;
+	}
+
+	if (! GMIME_IS_PART(part))
+		return;
+
+	type = g_mime_object_get_content_type(part);
+	if (! g_mime_content_type_is_type(type, "text", "*"))
+		return;
+
+	if (! (wrapper = g_mime_part_get_content_object(GMIME_PART(part))))
+		return;
+
+	// decode the transfer encoding
+	stream = g_mime_stream_mem_new();
+	g_mime_data_wrapper_write_to_stream(wrapper, stream);
+	bytes = g_mime_stream_mem_get_byte_array(GMIME_STREAM_MEM(stream));
+	if (bytes->len > FULLTEXT_PART_MAX) {
+		T->complete = FALSE;
+		g_byte_array_set_size(bytes, FULLTEXT_PART_MAX);
+	}
+	g_byte_array_append(bytes, (guint8 *)"", 1);
+
+	charset = g_mime_object_get_content_type_parameter(part, "charset");
+	if ((text = dbmail_iconv_str_to_utf8((const char *)bytes->data, charset))) {
+		fulltext_tokenize(T, text, FULLTEXT_BODY);
+		g_free(text);
+	}
+
+	g_object_unref(stream);
+}
+
+GHashTable * fulltext_message_terms(GMimeObject *message, gboolean *complete)
+{
+	fulltext_terms T;
+
+	g_return_val_if_fail(GMIME_IS_MESSAGE(message), NULL);
+
+	T.terms = g_hash_table_new_full((GHashFunc)g_str_hash,
+			(GEqualFunc)g_str_equal, (GDestroyNotify)g_free, NULL);
+	T.complete = TRUE;
+
+	g_mime_header_list_foreach(g_mime_object_get_header_list(message),
+			(GMimeHeaderForeachFunc)fulltext_header, &T);
+	g_mime_message_foreach(GMIME_MESSAGE(message), fulltext_part, &T);
+
+	TRACE(TRACE_DEBUG, "[%u] terms%s", g_hash_table_size(T.terms),
+			T.complete ? "" : ", incomplete");
+
+	if (complete)
+		*complete = T.complete;
+
+	return T.terms;
+}
+
+/*
+ * a message that contains the search string has, for each word of it:
+ * - the first word, unless the string starts between words, somewhere
+ *   inside a stored term. Only FULLTEXT_PIECE_MAX bytes of it are used,
+ *   which always fall within one piece of a long word;
+ * - any other word as the start of a stored term.
+ */
+GList * fulltext_query_terms(const char *query)
+{
+	GList *result = NULL;
+	const char *p = query, *word = NULL;
+	char *term, *piece;
+	gunichar c;
+	size_t n;
+
+	while (p) {
+		c = *p ? g_utf8_get_char_validated(p, -1) : 0;
+		if (c == (gunichar)-1 || c == (gunichar)-2)
+			break;
+
+		if (c && g_unichar_isalnum(c)) {
+			if (! word) word = p;
+			p = g_utf8_next_char(p);
+			continue;
+		}
+
+		if (word && g_utf8_strlen(word, p - word) >= FULLTEXT_TERM_MIN) {
+			term = g_utf8_strdown(word, p - word);
+			if (word == query) {
+				n = fulltext_fit(term, strlen(term), FULLTEXT_PIECE_MAX);
+				piece = g_strndup(term, n);
+				result = g_list_append(result, g_strdup_printf("%%%s%%", piece));
+				g_free(piece);
+			} else {
+				term[fulltext_fit(term, strlen(term), FULLTEXT_TERM_MAX)] = '\0';
+				result = g_list_append(result, g_strdup(term));
+			}
+			g_free(term);
+		}
+		word = NULL;
+
+		if (! c)
+			break;
+		p = g_utf8_next_char(p);
+	}
+
+	// an invalid search string can still match the stored bytes
+	if (p && *p) {
+		g_list_destroy(result);
+		return NULL;
+	}
+
+	return result;
+}
+
+/*
+ * the built-in backend: one row per term and message in a token table
+ */
+
+static int sql_index(Connection_T c, uint64_t physmessage_id, GHashTable *terms, gboolean complete)
+{
+	PreparedStatement_T s;
+	GHashTableIter iter;
+	gpointer key, value;
+	int bits;
+
+	db_exec(c, "DELETE FROM %sfulltext WHERE physmessage_id = %" PRIu64, DBPFX, physmessage_id);
+	db_exec(c, "DELETE FROM %sfulltext_messages WHERE physmessage_id = %" PRIu64, DBPFX, physmessage_id);
+
+	// searches keep scanning what the index does not fully cover
+	if (! complete)
+		return DM_SUCCESS;
+
+	s = db_stmt_prepare(c, "INSERT INTO %sfulltext (physmessage_id, term, is_header) VALUES (?,?,?)", DBPFX);
+	g_hash_table_iter_init(&iter, terms);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		bits = GPOINTER_TO_INT(value);
+		db_stmt_set_u64(s, 1, physmessage_id);
+		db_stmt_set_str(s, 2, (char *)key);
+		if (bits & FULLTEXT_BODY) {
+			db_stmt_set_int(s, 3, 0);
+			db_stmt_exec(s);
+		}
+		if (bits & FULLTEXT_HEADER) {
+			db_stmt_set_int(s, 3, 1);
+			db_stmt_exec(s);
+		}
+	}
+
+	db_exec(c, "INSERT INTO %sfulltext_messages (physmessage_id) VALUES (%" PRIu64 ")", DBPFX, physmessage_id);
+
+	return DM_SUCCESS;
+}
+
+static int sql_search(uint64_t mailbox_id, GList *terms, int scope, GList **ids)
+{
+	Connection_T c; PreparedStatement_T s; ResultSet_T r;
+	volatile int t = DM_SUCCESS;
+	GString *q;
+	GList *l;
+	uint64_t *id;
+	char *end;
+	int i;
+
+	q = g_string_new("");
+	g_string_printf(q, "SELECT m.message_idnr FROM %smessages m "
+			"WHERE m.mailbox_idnr = ? AND m.status IN (?,?) ", DBPFX);
+	for (l = g_list_first(terms); l; l = g_list_next(l)) {
+		if (((char *)l->data)[0] == '%')
+			g_string_append_printf(q, "AND EXISTS (SELECT 1 FROM %sfulltext f "
+					"WHERE f.physmessage_id = m.physmessage_id "
+					"AND f.term LIKE ?%s) ", DBPFX,
+					(scope == FULLTEXT_BODY) ? " AND f.is_header = 0" : "");
+		else
+			g_string_append_printf(q, "AND m.physmessage_id IN ("
+					"SELECT physmessage_id FROM %sfulltext "
+					"WHERE term >= ? AND term < ?%s) ", DBPFX,
+					(scope == FULLTEXT_BODY) ? " AND is_header = 0" : "");
+	}
+	g_string_append(q, "ORDER BY m.message_idnr");
+
+	c = db_con_get();
+	TRY
+		s = db_stmt_prepare(c, q->str);
+		db_stmt_set_u64(s, 1, mailbox_id);
+		db_stmt_set_int(s, 2, MESSAGE_STATUS_NEW);
+		db_stmt_set_int(s, 3, MESSAGE_STATUS_SEEN);
+		for (i = 4, l = g_list_first(terms); l; l = g_list_next(l)) {
+			if (((char *)l->data)[0] == '%') {
+				db_stmt_set_str(s, i++, (char *)l->data);
+				continue;
+			}
+			end = g_strconcat((char *)l->data, FULLTEXT_PREFIX_END, NULL);
+			db_stmt_set_str(s, i++, (char *)l->data);
+			db_stmt_set_str(s, i++, end);
+			g_free(end);
+		}
+		r = db_stmt_query(s);
+		while (db_result_next(r)) {
+			id = g_new0(uint64_t, 1);
+			*id = db_result_get_u64(r, 0);
+			*ids = g_list_prepend(*ids, id);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	g_string_free(q, TRUE);
+	*ids = g_list_reverse(*ids);
+
+	return t;
+}
+
+static gboolean sql_pending(uint64_t mailbox_id)
+{
+	Connection_T c; ResultSet_T r;
+	volatile gboolean t = TRUE;
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT 1 FROM %smessages m "
+				"LEFT JOIN %sfulltext_messages f ON m.physmessage_id = f.physmessage_id "
+				"WHERE m.mailbox_idnr = %" PRIu64 " AND m.status IN (%d,%d) "
+				"AND f.physmessage_id IS NULL LIMIT 1",
+				DBPFX, DBPFX, mailbox_id,
+				MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN);
+		t = db_result_next(r);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
+}
+
+static const FulltextBackend backends[] = {
+	{ "sql", sql_index, sql_search, sql_pending },
+	{ NULL, NULL, NULL, NULL }
+};
+
+const FulltextBackend * fulltext_backend(void)
+{
+	Field_T config;
+	int i;
+
+	if (db_params.db_driver == DM_DRIVER_ORACLE)
+		return NULL;
+
+	config_get_value("fulltext_index", "DBMAIL", config);
+	for (i = 0; strlen(config) && backends[i].name; i++) {
+		if (SMATCH(config, backends[i].name))
+			return &backends[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * header trigram index
+ *
+ * substring searches on header values can not use a btree index, and
+ * dbmail_headervalue is shared by all users. With header_trigram_index
+ * every header value is split into the overlapping three character
+ * sequences of its folded text. A search only looks at the values
+ * that have all trigrams of the pattern, and checks those with LIKE.
+ *
+ * The fold drops accents and case, so it is at least as coarse as the
+ * case and accent insensitive collations LIKE may compare with: the
+ * trigrams may find too many values, never too few. Values that can
+ * not be split (not UTF-8, or too short) get a single TRIGRAM_SCAN row
+ * instead, and are always checked with LIKE.
+ *
+ * PostgreSQL with pg_trgm does the same with a GIN index on the
+ * headervalue column itself, so the side table is not maintained there.
+ */
+
+#define TRIGRAM_QUERY_MAX 16
+
+static volatile int trigram_pg = -1;
+G_LOCK_DEFINE_STATIC(trigram_pg);
+
+static gboolean trigram_pg_available(void)
+{
+	Connection_T c; ResultSet_T r;
+	volatile int found = 0;
+
+	if (db_params.db_driver != DM_DRIVER_POSTGRESQL)
+		return FALSE;
+
+	G_LOCK(trigram_pg);
+	if (trigram_pg < 0) {
+		c = db_con_get();
+		TRY
+			r = db_query(c, "SELECT 1 FROM pg_extension WHERE extname = 'pg_trgm'");
+			found = db_result_next(r) ? 1 : 0;
+		CATCH(SQLException)
+			LOG_SQLERROR;
+		FINALLY
+			db_con_close(c);
+		END_TRY;
+		trigram_pg = found;
+		TRACE(TRACE_INFO, "pg_trgm [%s]", found ? "available" : "not available");
+	}
+	found = trigram_pg;
+	G_UNLOCK(trigram_pg);
+
+	return found ? TRUE : FALSE;
+}
+
+int trigram_mode(void)
+{
+	Field_T config;
+
+	if (db_params.db_driver == DM_DRIVER_ORACLE)
+		return TRIGRAM_OFF;
+
+	config_get_value("header_trigram_index", "DBMAIL", config);
+	if (! (SMATCH(config, "yes") || SMATCH(config, "build")))
+		return TRIGRAM_OFF;
+
+	if (trigram_pg_available())
+		return TRIGRAM_PG;
+
+	return TRIGRAM_TABLE;
+}
+
+gboolean trigram_search_enabled(void)
+{
+	Field_T config;
+
+	config_get_value("header_trigram_index", "DBMAIL", config);
+	return SMATCH(config, "yes") ? TRUE : FALSE;
+}
+
+/* value without accents and case, NULL if it is not UTF-8 */
+static char * trigram_fold(const char *value)
+{
+	GString *s;
+	char *nfd, *folded;
+	const char *p;
+	gunichar u;
+
+	if (! g_utf8_validate(value, -1, NULL))
+		return NULL;
+
+	nfd = g_utf8_normalize(value, -1, G_NORMALIZE_NFKD);
+	s = g_string_sized_new(strlen(nfd));
+	for (p = nfd; *p; p = g_utf8_next_char(p)) {
+		u = g_utf8_get_char(p);
+		switch (g_unichar_type(u)) {
+			case G_UNICODE_NON_SPACING_MARK:
+			case G_UNICODE_SPACING_MARK:
+			case G_UNICODE_ENCLOSING_MARK:
+				break;
+			default:
+				g_string_append_unichar(s, u);
+				break;
+		}
+	}
+	g_free(nfd);
+
+	folded = g_utf8_casefold(s->str, -1);
+	g_string_free(s, TRUE);
+
+	return folded;
+}
+
+/* the distinct trigrams of a folded string */
+static GHashTable * trigram_split(const char *value)
+{
+	GHashTable *trigrams;
+	char *lower;
+	const char *a, *b, *c, *end;
+
+	trigrams = g_hash_table_new_full((GHashFunc)g_str_hash,
+			(GEqualFunc)g_str_equal, (GDestroyNotify)g_free, NULL);
+
+	if (! (lower = trigram_fold(value)))
+		return trigrams;
+
+	a = lower;
+	b = *a ? g_utf8_next_char(a) : a;
+	c = *b ? g_utf8_next_char(b) : b;
+	while (*c) {
+		end = g_utf8_next_char(c);
+		g_hash_table_replace(trigrams, g_strndup(a, end - a), NULL);
+		a = b;
+		b = c;
+		c = end;
+	}
+	g_free(lower);
+
+	return trigrams;
+}
+
+void trigram_index_value(Connection_T c, uint64_t headervalue_id, const char *value)
+{
+	PreparedStatement_T s;
+	GHashTable *trigrams;
+	GHashTableIter iter;
+	gpointer key;
+
+	trigrams = trigram_split(value);
+	if (! g_hash_table_size(trigrams))
+		g_hash_table_replace(trigrams, g_strdup(TRIGRAM_SCAN), NULL);
+
+	s = db_stmt_prepare(c, "INSERT INTO %sheadervalue_trigrams (trigram, headervalue_id) VALUES (?,?)", DBPFX);
+	g_hash_table_iter_init(&iter, trigrams);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		db_stmt_set_str(s, 1, (char *)key);
+		db_stmt_set_u64(s, 2, headervalue_id);
+		db_stmt_exec(s);
+	}
+
+	g_hash_table_destroy(trigrams);
+}
+
+GList * trigram_query_terms(const char *pattern)
+{
+	GHashTable *trigrams;
+	GList *keys, *l, *result = NULL;
+	int n = 0;
+
+	trigrams = trigram_split(pattern);
+	keys = g_hash_table_get_keys(trigrams);
+	// any subset still finds every match, LIKE does the rest
+	for (l = g_list_first(keys); l && n < TRIGRAM_QUERY_MAX; l = g_list_next(l), n++)
+		result = g_list_prepend(result, g_strdup((char *)l->data));
+	g_list_free(keys);
+	g_hash_table_destroy(trigrams);
+
+	return result;
+}
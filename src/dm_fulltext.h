@@ -0,0 +1,91 @@
+/*
+
+ Copyright (c) 2004-2012 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * full-text index for BODY and TEXT searches, and
+ * trigram index for header substring searches
+ */
+
+#ifndef DM_FULLTEXT_H
+#define DM_FULLTEXT_H
+
+#include "dbmail.h"
+
+#define FULLTEXT_HEADER 1
+#define FULLTEXT_BODY 2
+
+typedef struct {
+	const char *name;
+	/* store terms (term -> FULLTEXT_* bits) for a physmessage, and
+	 * list it as indexed if they are complete */
+	int (*index)(Connection_T c, uint64_t physmessage_id, GHashTable *terms, gboolean complete);
+	/* message_idnr's in a mailbox whose indexed text may match all terms */
+	int (*search)(uint64_t mailbox_id, GList *terms, int scope, GList **ids);
+	/* TRUE if the mailbox has messages that are not indexed yet */
+	gboolean (*pending)(uint64_t mailbox_id);
+} FulltextBackend;
+
+/**
+ * \brief the backend selected by fulltext_index
+ * \return NULL if the index is disabled
+ */
+const FulltextBackend * fulltext_backend(void);
+
+/**
+ * \brief extract the terms of a message
+ * \param complete set to FALSE if some text did not fit in the index
+ * \return hash table of term -> FULLTEXT_HEADER|FULLTEXT_BODY
+ */
+GHashTable * fulltext_message_terms(GMimeObject *message, gboolean *complete);
+
+/**
+ * \brief the terms every message containing a search string has
+ * terms are prefixes of stored terms, or LIKE patterns ("%...%")
+ * that match inside stored terms
+ * \return list of terms, or NULL if the index can not answer it
+ */
+GList * fulltext_query_terms(const char *query);
+
+#define TRIGRAM_OFF 0
+#define TRIGRAM_TABLE 1	/* dbmail_headervalue_trigrams side table */
+#define TRIGRAM_PG 2	/* pg_trgm index on dbmail_headervalue */
+
+/* trigram of the values that can not be split, always checked with LIKE */
+#define TRIGRAM_SCAN "-"
+
+/** \brief how header values are indexed, if at all */
+int trigram_mode(void);
+
+/** \brief TRUE if header searches may rely on the trigram index */
+gboolean trigram_search_enabled(void);
+
+/**
+ * \brief add the trigrams of a new header value to the side table
+ * runs on the caller's connection and throws SQLException
+ */
+void trigram_index_value(Connection_T c, uint64_t headervalue_id, const char *value);
+
+/**
+ * \brief trigrams that every header value containing pattern has
+ * \return list of trigrams, or NULL if pattern is too short
+ */
+GList * trigram_query_terms(const char *pattern);
+
+#endif
@@ -260,15 +260,12 @@ void Http_getMailboxes(T R)
 		 */
 
 		MailboxState_T b = MailboxState_new(NULL, id);
-		GTree *msns = MailboxState_getMsn(b);
-		GList *ids = g_tree_keys(msns);
-		GTree *msginfo = MailboxState_getMsginfo(b);
+		GList *ids = MailboxState_getUids(b);
 
 		evbuffer_add_printf(buf, "{\"messages\": {\n");
 		while (ids && ids->data) {
-			uint64_t *msn = (uint64_t *)ids->data;
-			uint64_t *uid = (uint64_t *)g_tree_lookup(msns, msn);
-			MessageInfo *info = (MessageInfo *)g_tree_lookup(msginfo, uid);
+			uint64_t *uid = (uint64_t *)ids->data;
+			MessageInfo *info = MailboxState_getMessage(b, *uid);
 			evbuffer_add_printf(buf, "    \"%" PRIu64 "\":{\"size\":%" PRIu64 "}", *uid, info->rfcsize);
 			if (! g_list_next(ids)) break;
 			ids = g_list_next(ids);
@@ -118,15 +118,25 @@ ImapSession * dbmail_imap_session_new(Mempool_T pool)
 	Capa_remove(self->preauth_capa, "NAMESPACE");
 	Capa_remove(self->preauth_capa, "CHILDREN");
 	Capa_remove(self->preauth_capa, "SORT");
+	Capa_remove(self->preauth_capa, "SORT=DISPLAY");
+	Capa_remove(self->preauth_capa, "ESORT");
 	Capa_remove(self->preauth_capa, "QUOTA");
 	Capa_remove(self->preauth_capa, "THREAD=ORDEREDSUBJECT");
+	Capa_remove(self->preauth_capa, "THREAD=REFERENCES");
 	Capa_remove(self->preauth_capa, "UNSELECT");
 	Capa_remove(self->preauth_capa, "IDLE");
 	Capa_remove(self->preauth_capa, "UIDPLUS");
 	Capa_remove(self->preauth_capa, "WITHIN");
+	Capa_remove(self->preauth_capa, "ESEARCH");
+	Capa_remove(self->preauth_capa, "SEARCHRES");
 	Capa_remove(self->preauth_capa, "CONDSTORE");
 	Capa_remove(self->preauth_capa, "ENABLE");
 	Capa_remove(self->preauth_capa, "QRESYNC");
+	Capa_remove(self->preauth_capa, "NOTIFY");
+
+	// without change notifications there is nothing to drive NOTIFY
+	if (! notify_listening())
+		Capa_remove(self->capa, "NOTIFY");
 
 	if (! (server_conf && server_conf->ssl))
 		Capa_remove(self->preauth_capa, "STARTTLS");
@@ -159,9 +169,137 @@ ImapSession * dbmail_imap_session_new(Mempool_T pool)
 	return self;
 }
 
+/*
+ * FETCH loads messages in windows of at most fetch_window uids and
+ * fetch_window_size kilobytes: one query resolves their physmessage ids
+ * and sizes, another retrieves all their parts.
+ */
+static uint64_t fetch_window_count(void)
+{
+	Field_T val;
+	config_get_value("fetch_window", "IMAP", val);
+	if (strlen(val))
+		return strtoull(val, NULL, 10);
+	return 20;
+}
+
+static uint64_t fetch_window_limit(void)
+{
+	Field_T val;
+	config_get_value("fetch_window_size", "IMAP", val);
+	if (strlen(val))
+		return strtoull(val, NULL, 10) * 1024;
+	return 4 * 1024 * 1024;
+}
+
+static void dbmail_imap_session_prefetch(ImapSession *self, uint64_t size)
+{
+	Connection_T c; ResultSet_T r; volatile int t = FALSE;
+	GList *uids = NULL, *physids = NULL, *node;
+	GHashTable *sizes;
+	GString *range;
+	uint64_t i, total = 0, limit = fetch_window_limit();
+
+	if (! self->ids_list)
+		return;
+
+	/* position the window at the current message */
+	if (! self->window)
+		self->window = g_list_first(self->ids_list);
+	while (self->window && *(uint64_t *)self->window->data < self->msg_idnr)
+		self->window = g_list_next(self->window);
+	if (! (self->window && *(uint64_t *)self->window->data == self->msg_idnr)) {
+		self->window = NULL;
+		return;
+	}
+
+	for (i = 0, node = self->window; node && i < size; i++, node = g_list_next(node))
+		uids = g_list_prepend(uids, node->data);
+	uids = g_list_reverse(uids);
+	range = g_list_join_u64(uids, ",");
+	g_list_free(uids);
+
+	sizes = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT m.message_idnr, m.physmessage_id, ph.messagesize "
+				"FROM %smessages m JOIN %sphysmessage ph ON ph.id = m.physmessage_id "
+				"WHERE m.message_idnr IN (%s)", DBPFX, DBPFX, range->str);
+		while (db_result_next(r)) {
+			uint64_t *uid, *id, *len, msgid = db_result_get_u64(r, 0);
+			if (! (id = g_tree_lookup(self->physids, &msgid))) {
+				uid = mempool_pop(self->pool, sizeof(uint64_t));
+				id = mempool_pop(self->pool, sizeof(uint64_t));
+				*uid = msgid;
+				*id = db_result_get_u64(r, 1);
+				g_tree_insert(self->physids, uid, id);
+			}
+			len = g_new0(uint64_t, 1);
+			*len = db_result_get_u64(r, 2);
+			g_hash_table_insert(sizes, id, len);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	g_string_free(range, TRUE);
+
+	/* cut the window short once it holds limit bytes, but always
+	 * take the current message */
+	for (i = 0; self->window && i < size; i++) {
+		uint64_t *id = g_tree_lookup(self->physids, self->window->data);
+		uint64_t *len = id ? g_hash_table_lookup(sizes, id) : NULL;
+		if (len) {
+			if (i && limit && total + *len > limit)
+				break;
+			total += *len;
+			physids = g_list_prepend(physids, id);
+		}
+		self->window_hi = *(uint64_t *)self->window->data;
+		self->window = g_list_next(self->window);
+	}
+
+	g_hash_table_destroy(sizes);
+
+	if (t != DM_EQUERY) {
+		if (! self->prefetched)
+			self->prefetched = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL,
+					(GDestroyNotify)g_free, (GDestroyNotify)dbmail_message_free);
+		dbmail_message_retrieve_range(physids, self->prefetched, self->pool);
+		TRACE(TRACE_DEBUG, "[%p] prefetched [%d] messages [%" PRIu64 "] bytes", self,
+				g_tree_nnodes(self->prefetched), total);
+	}
+
+	g_list_free(physids);
+}
+
+/* take a prefetched message out of the window */
+static DbmailMessage * dbmail_imap_session_prefetched(ImapSession *self, uint64_t physid)
+{
+	gpointer key = NULL, value = NULL;
+
+	if (! self->prefetched)
+		return NULL;
+	if (! g_tree_lookup_extended(self->prefetched, &physid, &key, &value))
+		return NULL;
+
+	g_tree_steal(self->prefetched, key);
+	g_free(key);
+
+	return (DbmailMessage *)value;
+}
+
 static uint64_t dbmail_imap_session_message_load(ImapSession *self)
 {
 	uint64_t *id = NULL;
+	uint64_t window = fetch_window_count();
+
+	if (window > 1 && self->msg_idnr > self->window_hi)
+		dbmail_imap_session_prefetch(self, window);
 
 	if (! (id = g_tree_lookup(self->physids, &(self->msg_idnr)))) {
 		uint64_t *uid;
@@ -186,6 +324,9 @@ static uint64_t dbmail_imap_session_message_load(ImapSession *self)
 
 	assert(id);
 
+	if (! self->message)
+		self->message = dbmail_imap_session_prefetched(self, *id);
+
 	if (! self->message) {
 		DbmailMessage *msg = dbmail_message_new(self->pool);
 		if ((msg = dbmail_message_retrieve(msg, *id)) != NULL)
@@ -221,12 +362,16 @@ void dbmail_imap_session_delete(ImapSession ** s)
 	Mempool_T pool;
 
 	TRACE(TRACE_DEBUG, "[%p]", self);
+	imap_idle_unsubscribe(self);
+	imap_notify_unsubscribe(self);
+	dbmail_imap_session_notify_free(self);
 	Capa_free(&self->preauth_capa);
 	Capa_free(&self->capa);
 
 	dbmail_imap_session_args_free(self, TRUE);
 	dbmail_imap_session_fetch_free(self, TRUE);
 
+	dbmail_imap_session_searchres(self, NULL);
 	if (self->mailbox) {
 		dbmail_mailbox_free(self->mailbox);
 		self->mailbox = NULL;
@@ -258,6 +403,12 @@ void dbmail_imap_session_delete(ImapSession ** s)
 
 void dbmail_imap_session_fetch_free(ImapSession *self, gboolean all) 
 {
+	if (self->prefetched) {
+		g_tree_destroy(self->prefetched);
+		self->prefetched = NULL;
+	}
+	self->window = NULL;
+	self->window_hi = 0;
 	if (self->envelopes) {
 		g_tree_destroy(self->envelopes);
 		self->envelopes = NULL;
@@ -490,7 +641,6 @@ static int _imap_session_fetch_parse_octet_range(ImapSession *self)
 		/* read the numbers */
 		token[strlen(token) - 1] = '\0';
 		token[delimpos] = '\0';
-		self->fi->msgparse_needed=1;
 		guint64 octetstart = strtoull(&token[1], NULL, 10);
 		gint64 octetcnt = strtoll(&token [delimpos + 1], NULL, 10);
 		//TRACE(TRACE_DEBUG, "octetstart [%lu] octetcnt [%lu]", octetstart, octetcnt);
@@ -514,6 +664,31 @@ static int _imap_session_fetch_parse_octet_range(ImapSession *self)
 #define NEXTTOKEN TOKENAT(1)
 #define TOKEN TOKENAT(0)
 
+/*
+ * fetch planner: once all items are parsed decide whether the message
+ * itself must be retrieved. Flags, sizes, dates, envelopes and (cached)
+ * body structures come from metadata. So do top-level HEADER.FIELDS,
+ * partial or not, which are prefetched from the header cache in one
+ * query per batch of messages. Anything else needs the parsed message.
+ */
+void dbmail_imap_session_fetch_plan(ImapSession *self)
+{
+	List_T head = p_list_first(self->fi->bodyfetch);
+
+	while (head) {
+		body_fetch *bodyfetch = (body_fetch *)p_list_data(head);
+		if (bodyfetch && bodyfetch->itemtype >= BFIT_TEXT) {
+			if (bodyfetch->partspec[0] || (bodyfetch->itemtype != BFIT_HEADER_FIELDS 
+						&& bodyfetch->itemtype != BFIT_HEADER_FIELDS_NOT))
+				self->fi->msgparse_needed = 1;
+		}
+		head = p_list_next(head);
+	}
+
+	TRACE(TRACE_DEBUG, "[%p] %s", self, self->fi->msgparse_needed ? 
+			"message retrieval needed" : "metadata only");
+}
+
 int dbmail_imap_session_fetch_parse_args(ImapSession * self)
 {
 	int ispeek = 0;
@@ -566,7 +741,6 @@ int dbmail_imap_session_fetch_parse_args(ImapSession * self)
 		
 		if (! nexttoken || ! MATCH(nexttoken,"[")) {
 			if (ispeek) return -2;	/* error DONE */
-			self->fi->msgparse_needed = 1;
 			self->fi->getMIME_IMB_noextension = 1;	/* just BODY specified */
 		} else {
 			int res = 0;
@@ -610,20 +784,17 @@ int dbmail_imap_session_fetch_parse_args(ImapSession * self)
 			return res;
 		}
 	} else if (MATCH(token,"all")) {		
-		self->fi->msgparse_needed=1; // because of getEnvelope
 		self->fi->getInternalDate = 1;
 		self->fi->getEnvelope = 1;
 		self->fi->getFlags = 1;
 		self->fi->getSize = 1;
 	} else if (MATCH(token,"full")) {
-		self->fi->msgparse_needed=1;
 		self->fi->getInternalDate = 1;
 		self->fi->getEnvelope = 1;
 		self->fi->getMIME_IMB_noextension = 1;
 		self->fi->getFlags = 1;
 		self->fi->getSize = 1;
 	} else if (MATCH(token,"bodystructure")) {
-		self->fi->msgparse_needed=1;
 		self->fi->getMIME_IMB = 1;
 	} else if (MATCH(token,"envelope")) {
 		self->fi->getEnvelope = 1;
@@ -656,16 +827,17 @@ int dbmail_imap_session_fetch_parse_args(ImapSession * self)
 
 #define QUERY_BATCHSIZE 2000
 
-void _send_headers(ImapSession *self, const body_fetch *bodyfetch, gboolean not)
+#define FETCH_STRUCTURE(fi) ((fi)->getMIME_IMB || (fi)->getMIME_IMB_noextension)
+
+static void _send_header_fields(ImapSession *self, const body_fetch *bodyfetch, gboolean not, const gchar *s)
 {
 	long long cnt = 0;
 	gchar *tmp;
-	gchar *s;
 	String_T ts;
 
 	dbmail_imap_session_buff_printf(self,"HEADER.FIELDS%s %s] ", not ? ".NOT" : "", bodyfetch->hdrplist);
 
-	if (! (s = g_tree_lookup(bodyfetch->headers, &(self->msg_idnr)))) {
+	if (! s) {
 		dbmail_imap_session_buff_printf(self, "{2}\r\n\r\n");
 		return;
 	}
@@ -700,6 +872,63 @@ void _send_headers(ImapSession *self, const body_fetch *bodyfetch, gboolean not)
 	tmp = NULL;
 }
 
+void _send_headers(ImapSession *self, const body_fetch *bodyfetch, gboolean not)
+{
+	_send_header_fields(self, bodyfetch, not,
+			g_tree_lookup(bodyfetch->headers, &(self->msg_idnr)));
+}
+
+struct header_fields {
+	GList *names;
+	gboolean not;
+	GString *out;
+};
+
+static void _part_header_field(const char *name, const char *value, gpointer data)
+{
+	struct header_fields *f = (struct header_fields *)data;
+	gboolean found = FALSE;
+	GList *n = g_list_first(f->names);
+
+	while (n && ! found) {
+		found = MATCH((const char *)n->data, name);
+		n = g_list_next(n);
+	}
+
+	if (found != f->not)
+		g_string_append_printf(f->out, "%s: %s\n", name, value);
+}
+
+/* HEADER.FIELDS of a body part: not in the header cache, so use the parsed part */
+static void _fetch_part_headers(ImapSession *self, body_fetch *bodyfetch, GMimeObject *part, gboolean not)
+{
+	struct header_fields f;
+	int k;
+
+	if (! bodyfetch->hdrplist) {
+		GList *tlist = NULL;
+		for (k = 0; k < bodyfetch->argcnt; k++) 
+			tlist = g_list_append(tlist, (void *)p_string_str(self->args[k + bodyfetch->argstart]));
+		bodyfetch->hdrplist = dbmail_imap_plist_as_string(tlist);
+		bodyfetch->names = tlist;
+	}
+
+	if (part && GMIME_IS_MESSAGE_PART(part))
+		part = GMIME_OBJECT(g_mime_message_part_get_message(GMIME_MESSAGE_PART(part)));
+
+	memset(&f, 0, sizeof(f));
+	f.names = bodyfetch->names;
+	f.not = not;
+	f.out = g_string_new("");
+
+	if (part)
+		g_mime_header_list_foreach(g_mime_object_get_header_list(part), _part_header_field, &f);
+
+	_send_header_fields(self, bodyfetch, not, f.out->len ? f.out->str : NULL);
+
+	g_string_free(f.out, TRUE);
+}
+
 
 /* get headers or not */
 static void _fetch_headers(ImapSession *self, body_fetch *bodyfetch, gboolean not)
@@ -707,7 +936,7 @@ static void _fetch_headers(ImapSession *self, body_fetch *bodyfetch, gboolean no
 	Connection_T c; ResultSet_T r; volatile int t = FALSE;
 	gchar *fld, *val, *old, *new = NULL;
 	uint64_t *mid;
-	uint64_t id;
+	uint64_t id, hi;
 	GList *last;
 	GString *fieldorder = NULL;
 	int k;
@@ -718,9 +947,8 @@ static void _fetch_headers(ImapSession *self, body_fetch *bodyfetch, gboolean no
 	if (! bodyfetch->headers) {
 		TRACE(TRACE_DEBUG, "[%p] init bodyfetch->headers", self);
 		bodyfetch->headers = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)uint64_free,(GDestroyNotify)g_free);
-		self->ceiling = 0;
-		self->hi = 0;
-		self->lo = 0;
+		bodyfetch->ceiling = 0;
+		bodyfetch->lo = 0;
 	}
 
 	if (! bodyfetch->hdrnames) {
@@ -745,7 +973,7 @@ static void _fetch_headers(ImapSession *self, body_fetch *bodyfetch, gboolean no
 	TRACE(TRACE_DEBUG,"[%p] for %" PRIu64 "%s [%s]", self, self->msg_idnr, not?"NOT":"", bodyfetch->hdrplist);
 
 	// did we prefetch this message already?
-	if (self->msg_idnr <= self->ceiling) {
+	if (self->msg_idnr <= bodyfetch->ceiling) {
 		_send_headers(self, bodyfetch, not);
 		return;
 	}
@@ -754,16 +982,16 @@ static void _fetch_headers(ImapSession *self, body_fetch *bodyfetch, gboolean no
 	range = p_string_new(self->pool, "");
 	query = p_string_new(self->pool, "");
 
-	if (! (last = g_list_nth(self->ids_list, self->lo+(uint64_t)QUERY_BATCHSIZE)))
+	if (! (last = g_list_nth(self->ids_list, bodyfetch->lo+(uint64_t)QUERY_BATCHSIZE)))
 		last = g_list_last(self->ids_list);
-	self->hi = *(uint64_t *)last->data;
+	hi = *(uint64_t *)last->data;
 
-	if (self->msg_idnr == self->hi)
+	if (self->msg_idnr == hi)
 		p_string_printf(range, "= %" PRIu64 "", self->msg_idnr);
 	else
-		p_string_printf(range, "BETWEEN %" PRIu64 " AND %" PRIu64 "", self->msg_idnr, self->hi);
+		p_string_printf(range, "BETWEEN %" PRIu64 " AND %" PRIu64 "", self->msg_idnr, hi);
 
-	TRACE(TRACE_DEBUG,"[%p] prefetch %" PRIu64 ":%" PRIu64 " ceiling %" PRIu64 " [%s]", self, self->msg_idnr, self->hi, self->ceiling, bodyfetch->hdrplist);
+	TRACE(TRACE_DEBUG,"[%p] prefetch %" PRIu64 ":%" PRIu64 " ceiling %" PRIu64 " [%s]", self, self->msg_idnr, hi, bodyfetch->ceiling, bodyfetch->hdrplist);
 
 	if (! not) {
 		fieldorder = g_string_new(", CASE ");
@@ -845,8 +1073,8 @@ static void _fetch_headers(ImapSession *self, body_fetch *bodyfetch, gboolean no
 
 	if (t == DM_EQUERY) return;
 	
-	self->lo += QUERY_BATCHSIZE;
-	self->ceiling = self->hi;
+	bodyfetch->lo += QUERY_BATCHSIZE;
+	bodyfetch->ceiling = hi;
 
 	_send_headers(self, bodyfetch, not);
 
@@ -941,7 +1169,10 @@ static int _imap_show_body_section(body_fetch *bodyfetch, gpointer data)
 		case BFIT_HEADER_FIELDS_NOT:
 			condition=TRUE;
 		case BFIT_HEADER_FIELDS:
-			_fetch_headers(self, bodyfetch, condition);
+			if (bodyfetch->partspec[0])
+				_fetch_part_headers(self, bodyfetch, part, condition);
+			else
+				_fetch_headers(self, bodyfetch, condition);
 			break;
 		default:
 			dbmail_imap_session_buff_clear(self);
@@ -952,28 +1183,44 @@ static int _imap_show_body_section(body_fetch *bodyfetch, gpointer data)
 	return 0;
 }
 
-/* get envelopes */
-static void _fetch_envelopes(ImapSession *self)
+/* cached ENVELOPE, BODYSTRUCTURE and BODY of a message */
+struct envelope_cache {
+	char *envelope;
+	char *bodystructure;
+	char *body;
+};
+
+static void envelope_cache_free(struct envelope_cache *e)
+{
+	g_free(e->envelope);
+	g_free(e->bodystructure);
+	g_free(e->body);
+	g_free(e);
+}
+
+/* get envelopes, and the cached body structures when requested */
+static struct envelope_cache * _fetch_envelopes(ImapSession *self)
 {
 	Connection_T c; ResultSet_T r; volatile int t = FALSE;
 	INIT_QUERY;
-	gchar *s;
+	struct envelope_cache *e;
 	uint64_t *mid;
 	uint64_t id;
 	char range[DEF_FRAGSIZE];
 	GList *last;
+	gboolean structure;
 	memset(range,0,sizeof(range));
 
 	if (! self->envelopes) {
-		self->envelopes = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)uint64_free,(GDestroyNotify)g_free);
+		self->envelopes = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)uint64_free,(GDestroyNotify)envelope_cache_free);
 		self->lo = 0;
 		self->hi = 0;
 	}
 
-	if ((s = g_tree_lookup(self->envelopes, &(self->msg_idnr))) != NULL) {
-		dbmail_imap_session_buff_printf(self, "ENVELOPE %s", s);
-		return;
-	}
+	if ((e = g_tree_lookup(self->envelopes, &(self->msg_idnr))) != NULL)
+		return e;
+
+	structure = FETCH_STRUCTURE(self->fi) && db_params.db_driver != DM_DRIVER_ORACLE;
 
 	TRACE(TRACE_DEBUG,"[%p] lo: %" PRIu64 "", self, self->lo);
 
@@ -986,11 +1233,12 @@ static void _fetch_envelopes(ImapSession *self)
 	else
 		snprintf(range,DEF_FRAGSIZE-1,"BETWEEN %" PRIu64 " AND %" PRIu64 "", self->msg_idnr, self->hi);
 
-	snprintf(query, DEF_QUERYSIZE-1, "SELECT message_idnr,envelope "
+	snprintf(query, DEF_QUERYSIZE-1, "SELECT message_idnr,envelope,%s "
 			"FROM %senvelope e "
 			"LEFT JOIN %smessages m USING (physmessage_id) "
 			"WHERE m.mailbox_idnr = %" PRIu64 " "
 			"AND message_idnr %s",
+			structure ? "bodystructure,body" : "NULL,NULL",
 			DBPFX, DBPFX,  
 			self->mailbox->id, range);
 	c = db_con_get();
@@ -1004,8 +1252,13 @@ static void _fetch_envelopes(ImapSession *self)
 			
 			mid = mempool_pop(small_pool, sizeof(uint64_t));
 			*mid = id;
+
+			e = g_new0(struct envelope_cache, 1);
+			e->envelope = g_strdup(ResultSet_getString(r, 2));
+			e->bodystructure = g_strdup(ResultSet_getString(r, 3));
+			e->body = g_strdup(ResultSet_getString(r, 4));
 			
-			g_tree_insert(self->envelopes,mid,g_strdup(ResultSet_getString(r, 2)));
+			g_tree_insert(self->envelopes,mid,e);
 		}
 	CATCH(SQLException)
 		LOG_SQLERROR;
@@ -1014,12 +1267,11 @@ static void _fetch_envelopes(ImapSession *self)
 		db_con_close(c);
 	END_TRY;
 
-	if (t == DM_EQUERY) return;
+	if (t == DM_EQUERY) return NULL;
 
 	self->lo += QUERY_BATCHSIZE;
 
-	s = g_tree_lookup(self->envelopes, &(self->msg_idnr));
-	dbmail_imap_session_buff_printf(self, "ENVELOPE %s", s?s:"");
+	return g_tree_lookup(self->envelopes, &(self->msg_idnr));
 }
 
 static void _imap_show_body_sections(ImapSession *self) 
@@ -1045,15 +1297,16 @@ static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 	uint64_t *id = uid;
 	gboolean reportflags = FALSE;
 	String_T stream = NULL;
+	struct envelope_cache *cache = NULL;
 
-	MessageInfo *msginfo = g_tree_lookup(MailboxState_getMsginfo(self->mailbox->mbstate), uid);
+	MessageInfo *msginfo = MailboxState_getMessage(self->mailbox->mbstate, *uid);
 
 	if (! msginfo) {
 		TRACE(TRACE_INFO, "[%p] failed to lookup msginfo struct for message [%" PRIu64 "]", self, *uid);
 		return 0;
 	}
 	
-	id = g_tree_lookup(MailboxState_getIds(self->mailbox->mbstate),uid);
+	id = MailboxState_getMsn(self->mailbox->mbstate, *uid);
 
 	g_return_val_if_fail(id,-1);
 
@@ -1063,12 +1316,19 @@ static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 	self->msg_idnr = *uid;
 	self->fi->isfirstfetchout = 1;
 
+	if (self->fi->getEnvelope || FETCH_STRUCTURE(self->fi))
+		cache = _fetch_envelopes(self);
+
 	if (self->fi->msgparse_needed) {
 		if (! (dbmail_imap_session_message_load(self)))
 			return 0;
 
 		stream = self->message->crlf;
 		size = p_string_len(stream);
+	} else if (FETCH_STRUCTURE(self->fi) && ! (cache && cache->bodystructure && cache->body)) {
+		/* not cached yet: fall back to parsing the message */
+		if (! (dbmail_imap_session_message_load(self)))
+			return 0;
 	}
 
 	dbmail_imap_session_buff_printf(self, "* %" PRIu64 " FETCH (", *id);
@@ -1080,7 +1340,7 @@ static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 	}
 	if (self->fi->getInternalDate) {
 		SEND_SPACE;
-		char *s =date_sql2imap(msginfo->internaldate);
+		char *s = date_epoch2imap(msginfo->internaldate);
 		dbmail_imap_session_buff_printf(self, "INTERNALDATE \"%s\"", s);
 		g_free(s);
 	}
@@ -1102,7 +1362,10 @@ static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 		SEND_SPACE;
 		dbmail_imap_session_buff_printf(self, "UID %" PRIu64 "", msginfo->uid);
 	}
-	if (self->fi->getMIME_IMB) {
+	if (self->fi->getMIME_IMB && cache && cache->bodystructure) {
+		SEND_SPACE;
+		dbmail_imap_session_buff_printf(self, "BODYSTRUCTURE %s", cache->bodystructure);
+	} else if (self->fi->getMIME_IMB) {
 		SEND_SPACE;
 		if ((s = imap_get_structure(GMIME_MESSAGE((self->message)->content), 1))==NULL) {
 			dbmail_imap_session_buff_clear(self);
@@ -1113,7 +1376,10 @@ static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 		g_free(s);
 	}
 
-	if (self->fi->getMIME_IMB_noextension) {
+	if (self->fi->getMIME_IMB_noextension && cache && cache->body) {
+		SEND_SPACE;
+		dbmail_imap_session_buff_printf(self, "BODY %s", cache->body);
+	} else if (self->fi->getMIME_IMB_noextension) {
 		SEND_SPACE;
 		if ((s = imap_get_structure(GMIME_MESSAGE((self->message)->content), 0))==NULL) {
 			dbmail_imap_session_buff_clear(self);
@@ -1126,7 +1392,7 @@ static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 
 	if (self->fi->getEnvelope) {
 		SEND_SPACE;
-		_fetch_envelopes(self);
+		dbmail_imap_session_buff_printf(self, "ENVELOPE %s", (cache && cache->envelope) ? cache->envelope : "");
 	}
 
 	if (self->fi->getRFC822 || self->fi->getRFC822Peek) {
@@ -1194,7 +1460,7 @@ static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 		
 		if (result == 1) {
 			reportflags = TRUE;
-			result = db_set_msgflag(self->msg_idnr, setSeenSet, NULL, IMAPFA_ADD, 0, msginfo);
+			result = db_set_msgflag(self->msg_idnr, setSeenSet, NULL, IMAPFA_ADD, 0, self->mailbox->mbstate);
 			if (result == -1) {
 				dbmail_imap_session_buff_clear(self);
 				dbmail_imap_session_buff_printf(self, "\r\n* BYE internal dbase error\r\n");
@@ -1214,6 +1480,8 @@ static int _fetch_get_items(ImapSession *self, uint64_t *uid)
 		if (self->use_uid)
 			t = g_strdup_printf("UID %" PRIu64 " ", *uid);
 		
+		// setting the flag may have given this session its own copy
+		msginfo = MailboxState_getMessage(self->mailbox->mbstate, *uid);
 		sublist = MailboxState_message_flags(self->mailbox->mbstate, msginfo);
 		s = dbmail_imap_plist_as_string(sublist);
 		g_list_destroy(sublist);
@@ -1389,16 +1657,16 @@ static void notify_fetch(ImapSession *self, MailboxState_T N, uint64_t *uid)
 
 	assert(uid);
 
-	if (! (MailboxState_getMsginfo(N) && *uid && (new = g_tree_lookup(MailboxState_getMsginfo(N), uid))))
+	if (! (*uid && (new = MailboxState_getMessage(N, *uid))))
 		return;
 
-	if (! (msn = g_tree_lookup(MailboxState_getIds(M), uid)))
+	if (! (msn = MailboxState_getMsn(M, *uid)))
 		return;
 
 	MailboxState_merge_recent(N, M);
 
 	// FETCH
-	if ((old = g_tree_lookup(MailboxState_getMsginfo(M), uid)))
+	if ((old = MailboxState_getMessage(M, *uid)))
 		ol = MailboxState_message_flags(M, old);
 	oldflags = dbmail_imap_plist_as_string(ol);
 
@@ -1449,7 +1717,7 @@ static gboolean notify_expunge(ImapSession *self, uint64_t *uid)
 {
 	uint64_t *msn = NULL, m = 0;
 
-	if (! (msn = g_tree_lookup(MailboxState_getIds(self->mailbox->mbstate), uid))) {
+	if (! (msn = MailboxState_getMsn(self->mailbox->mbstate, *uid))) {
 		TRACE(TRACE_DEBUG,"[%p] can't find uid [%" PRIu64 "]", self, *uid);
 		return TRUE;
 	}
@@ -1480,14 +1748,14 @@ static void mailbox_notify_expunge(ImapSession *self, MailboxState_T N)
 
 	M = self->mailbox->mbstate;
 
-	ids  = g_tree_keys(MailboxState_getIds(M));
+	ids = MailboxState_getUids(M);
 	ids = g_list_reverse(ids);
 
 	// send expunge updates
 	
 	if (ids) {
 		uid = (uint64_t *)ids->data;
-		msn = g_tree_lookup(MailboxState_getIds(self->mailbox->mbstate), uid);
+		msn = MailboxState_getMsn(self->mailbox->mbstate, *uid);
 		if (msn && (*msn > MailboxState_getExists(M))) {
 			TRACE(TRACE_DEBUG,"exists new [%d] old: [%d]", MailboxState_getExists(N), MailboxState_getExists(M)); 
 			dbmail_imap_session_buff_printf(self, "* %d EXISTS\r\n", MailboxState_getExists(M));
@@ -1496,7 +1764,7 @@ static void mailbox_notify_expunge(ImapSession *self, MailboxState_T N)
 
 	while (ids) {
 		uid = (uint64_t *)ids->data;
-		if (! g_tree_lookup(MailboxState_getIds(N), uid)) {
+		if (! MailboxState_getMsn(N, *uid)) {
 			notify_expunge(self, uid);
 		}
 
@@ -1514,7 +1782,7 @@ static void mailbox_notify_fetch(ImapSession *self, MailboxState_T N)
 	if (! N) return;
 
 	// send fetch updates
-	ids = g_tree_keys(MailboxState_getIds(self->mailbox->mbstate));
+	ids = MailboxState_getUids(self->mailbox->mbstate);
 	ids = g_list_first(ids);
 	while (ids) {
 		uid = (uint64_t *)ids->data;
@@ -1550,7 +1818,7 @@ int dbmail_imap_session_mailbox_status(ImapSession * self, gboolean update)
 	if (self->state != CLIENTSTATE_SELECTED) return FALSE;
 
 	if (update) {
-		unsigned oldseq, newseq;
+		uint64_t oldseq, newseq;
 		uint64_t olduidnext;
 		char *oldflags, *newflags;
 
@@ -1562,16 +1830,12 @@ int dbmail_imap_session_mailbox_status(ImapSession * self, gboolean update)
 
                 // check the mailbox sequence without a 
 		// full reload
-		N = MailboxState_new(self->pool, 0);
-		MailboxState_setId(N, self->mailbox->id);
-		newseq = MailboxState_getSeq(N);
-		MailboxState_free(&N);
-		N = NULL;
+		newseq = db_mailbox_seq(self->mailbox->id);
 
-		TRACE(TRACE_DEBUG, "seq: [%u] -> [%u]", oldseq, newseq);
+		TRACE(TRACE_DEBUG, "seq: [%" PRIu64 "] -> [%" PRIu64 "]", oldseq, newseq);
 		if (oldseq != newseq) {
-			// do a full reload: re-read flags and counters
-			N = MailboxState_new(self->pool, self->mailbox->id);
+			// re-read counters and the messages changed since M was loaded
+			N = MailboxState_update(self->pool, M);
 			unsigned newexists = MailboxState_getExists(N);
 			MailboxState_setExists(N, max(oldexists, newexists));
 
@@ -1647,19 +1911,15 @@ MailboxState_T dbmail_imap_session_mbxinfo_lookup(ImapSession *self, uint64_t ma
 			M = MailboxState_new(self->pool, mailbox_id);
 			g_tree_replace(self->mbxinfo, id, M);
 		} else {
-			unsigned newseq = 0, oldseq = 0;
+			uint64_t newseq = 0, oldseq = 0;
 			unsigned newexists = 0, oldexists = 0;
-			MailboxState_T N = NULL;
-			N = MailboxState_new(self->pool, 0);
-			MailboxState_setId(N, mailbox_id);
 			oldseq = MailboxState_getSeq(M);
-			newseq = MailboxState_getSeq(N);
+			newseq = db_mailbox_seq(mailbox_id);
 			oldexists = MailboxState_getExists(M);
-			MailboxState_free(&N);
 			if (oldseq < newseq) {
 				id = mempool_pop(small_pool, sizeof(uint64_t));
 				*id = mailbox_id;
-				M = MailboxState_new(self->pool, mailbox_id);
+				M = MailboxState_update(self->pool, M);
 				newexists = MailboxState_getExists(M);
 				MailboxState_setExists(M, max(oldexists, newexists));
 				g_tree_replace(self->mbxinfo, id, M);
@@ -1674,6 +1934,149 @@ MailboxState_T dbmail_imap_session_mbxinfo_lookup(ImapSession *self, uint64_t ma
 	return M;
 }
 
+static void notify_mailbox_free(notify_mailbox *N)
+{
+	g_free(N->name);
+	g_free(N);
+}
+
+void dbmail_imap_session_notify_set(ImapSession *self, int selected, GTree *mailboxes)
+{
+	dbmail_imap_session_notify_free(self);
+	self->notify.selected = selected;
+	self->notify.mailboxes = mailboxes;
+}
+
+void dbmail_imap_session_notify_free(ImapSession *self)
+{
+	if (self->notify.mailboxes) {
+		g_tree_destroy(self->notify.mailboxes);
+		self->notify.mailboxes = NULL;
+	}
+	self->notify.selected = 0;
+	self->notify.pending = false;
+}
+
+notify_mailbox * dbmail_imap_session_notify_add(GTree *mailboxes, uint64_t mailbox_id, const char *name, int events)
+{
+	notify_mailbox *N;
+
+	if ((N = g_tree_lookup(mailboxes, &mailbox_id))) {
+		N->events |= events;
+		return N;
+	}
+
+	N = g_new0(notify_mailbox, 1);
+	N->id = mailbox_id;
+	N->name = g_strdup(name);
+	N->events = events;
+	g_tree_insert(mailboxes, &N->id, N);
+	return N;
+}
+
+static gboolean _notify_ids(uint64_t *id, notify_mailbox *N UNUSED, GList **ids)
+{
+	*ids = g_list_prepend(*ids, id);
+	return FALSE;
+}
+
+static gboolean _notify_baseline(uint64_t *id, notify_mailbox *N, gpointer data UNUSED)
+{
+	N->seq = db_mailbox_seq(*id);
+	return FALSE;
+}
+
+void dbmail_imap_session_notify_probe(ImapSession *self, gboolean baseline)
+{
+	GList *ids = NULL;
+
+	if (! self->notify.mailboxes)
+		return;
+
+	g_tree_foreach(self->notify.mailboxes, (GTraverseFunc)_notify_ids, &ids);
+	db_mailbox_seq_probe(ids);
+	g_list_free(ids);
+
+	if (baseline)
+		g_tree_foreach(self->notify.mailboxes, (GTraverseFunc)_notify_baseline, NULL);
+}
+
+GTree * dbmail_imap_session_notify_new(void)
+{
+	return g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, NULL, (GDestroyNotify)notify_mailbox_free);
+}
+
+int dbmail_imap_session_notify_status(ImapSession *self, uint64_t mailbox_id, gboolean all)
+{
+	/*
+		S: * STATUS Lists/Lemonade (UIDNEXT 4 MESSAGES 9)
+	*/
+
+	notify_mailbox *N;
+	MailboxState_T M;
+	GList *plst = NULL;
+	unsigned exists, unseen;
+	uint64_t uidnext, seq;
+	gchar *astring, *pstring;
+
+	if (! (self->notify.mailboxes && (N = g_tree_lookup(self->notify.mailboxes, &mailbox_id))))
+		return 0;
+
+	// the selected mailbox is reported through EXISTS/EXPUNGE/FETCH
+	if (self->mailbox && (dbmail_mailbox_get_id(self->mailbox) == mailbox_id))
+		return 0;
+
+	seq = db_mailbox_seq(mailbox_id);
+	if ((! all) && (seq == N->seq))
+		return 0;
+
+	// counters only: the messages themselves are of no interest here
+	M = MailboxState_new(self->pool, 0);
+	MailboxState_setId(M, mailbox_id);
+	if (MailboxState_info(M)) {
+		MailboxState_free(&M);
+		return 0;
+	}
+	MailboxState_count(M);
+
+	exists = MailboxState_getExists(M);
+	unseen = MailboxState_getUnseen(M);
+	uidnext = MailboxState_getUidnext(M);
+	MailboxState_free(&M);
+
+	if (! N->known)
+		all = TRUE;
+
+	if ((N->events & NOTIFY_MESSAGENEW) && (all || (uidnext != N->uidnext))) {
+		plst = g_list_append_printf(plst, "MESSAGES %u", exists);
+		plst = g_list_append_printf(plst, "UIDNEXT %" PRIu64, uidnext);
+	} else if ((N->events & NOTIFY_MESSAGEEXPUNGE) && (all || (exists != N->exists))) {
+		plst = g_list_append_printf(plst, "MESSAGES %u", exists);
+	}
+	if ((N->events & NOTIFY_FLAGCHANGE) && (all || (unseen != N->unseen)))
+		plst = g_list_append_printf(plst, "UNSEEN %u", unseen);
+	if (plst && self->enabled.condstore)
+		plst = g_list_append_printf(plst, "HIGHESTMODSEQ %" PRIu64, seq);
+
+	N->seq = seq;
+	N->known = true;
+	N->exists = exists;
+	N->unseen = unseen;
+	N->uidnext = uidnext;
+
+	if (! plst)
+		return 0;
+
+	astring = dbmail_imap_astring_as_string(N->name);
+	pstring = dbmail_imap_plist_as_string(plst);
+	g_list_destroy(plst);
+
+	dbmail_imap_session_buff_printf(self, "* STATUS %s %s\r\n", astring, pstring);
+	g_free(astring); g_free(pstring);
+
+	return 1;
+}
+
 int dbmail_imap_session_set_state(ImapSession *self, ClientState_T state)
 {
 	ClientState_T current;
@@ -1718,14 +2121,27 @@ int dbmail_imap_session_set_state(ImapSession *self, ClientState_T state)
 	return 0;
 }
 
+void dbmail_imap_session_searchres(ImapSession *self, char *set)
+{
+	g_free(self->searchres);
+	self->searchres = set;
+	if (self->mailbox)
+		self->mailbox->searchres = set;
+}
+
 static gboolean _do_expunge(uint64_t *id, ImapSession *self)
 {
-	MessageInfo *msginfo = g_tree_lookup(MailboxState_getMsginfo(self->mailbox->mbstate), id);
+	MessageInfo *msginfo = MailboxState_getMessage(self->mailbox->mbstate, *id);
 	assert(msginfo);
 
 	if (! msginfo->flags[IMAP_FLAG_DELETED]) return FALSE;
 
-	if (db_exec(self->c, "UPDATE %smessages SET status=%d WHERE message_idnr=%" PRIu64 " ", DBPFX, MESSAGE_STATUS_DELETE, *id) == DM_EQUERY)
+	/* stamp with the modseq the expunge will publish, so delta loads
+	 * in other sessions pick up the status change */
+	if (! db_exec(self->c, "UPDATE %smessages SET status=%d, "
+				"seq=(SELECT seq + 1 FROM %smailboxes WHERE mailbox_idnr=%" PRIu64 ") "
+				"WHERE message_idnr=%" PRIu64 " ",
+				DBPFX, MESSAGE_STATUS_DELETE, DBPFX, self->mailbox->id, *id))
 		return TRUE;
 
 	return notify_expunge(self, id);
@@ -1734,12 +2150,12 @@ static gboolean _do_expunge(uint64_t *id, ImapSession *self)
 int dbmail_imap_session_mailbox_expunge(ImapSession *self, const char *set, uint64_t *modseq)
 {
 	uint64_t mailbox_size;
-	int i;
-	GList *ids;
+	int i, changed = 0;
+	GList *ids, *expunged = NULL;
 	GTree *uids = NULL;
 	MailboxState_T M = self->mailbox->mbstate;
 
-	if (! (i = g_tree_nnodes(MailboxState_getIds(M))))
+	if (! (i = MailboxState_getIdCount(M)))
 		return DM_SUCCESS;
 
 	if (db_get_mailbox_size(self->mailbox->id, 1, &mailbox_size) == DM_EQUERY)
@@ -1749,7 +2165,7 @@ int dbmail_imap_session_mailbox_expunge(ImapSession *self, const char *set, uint
 		uids = dbmail_mailbox_get_set(self->mailbox, set, self->use_uid);
 		ids = g_tree_keys(uids);
 	} else {
-		ids = g_tree_keys(MailboxState_getIds(M));
+		ids = MailboxState_getUids(M);
 	}
 
 	ids = g_list_reverse(ids);
@@ -1761,19 +2177,30 @@ int dbmail_imap_session_mailbox_expunge(ImapSession *self, const char *set, uint
 		db_commit_transaction(self->c);
 		db_con_close(self->c);
 		self->c = NULL;
-		g_list_free(g_list_first(ids));
+		ids = g_list_first(ids);
+		while (ids) {
+			if (! MailboxState_getMsn(M, *(uint64_t *)ids->data))
+				expunged = g_list_prepend(expunged, ids->data);
+			if (! g_list_next(ids)) break;
+			ids = g_list_next(ids);
+		}
 	}
 
-	if (uids)
-		g_tree_destroy(uids);
-
 	*modseq = 0;
-	if (i > g_tree_nnodes(MailboxState_getIds(M))) {
+	if ((changed = (i > (int)MailboxState_getIdCount(M)))) {
 		*modseq = db_mailbox_seq_update(self->mailbox->id, 0);
-		if (! dm_quota_user_dec(self->userid, mailbox_size))
-			return DM_EQUERY;
+		// stamp the expunged messages so delta loads and VANISHED see them
+		db_messages_set_seq(expunged, *modseq);
 	}
 
+	g_list_free(expunged);
+	g_list_free(g_list_first(ids));
+	if (uids)
+		g_tree_destroy(uids);
+
+	if (changed && (! dm_quota_user_dec(self->userid, mailbox_size)))
+		return DM_EQUERY;
+
 	return 0;
 }
 
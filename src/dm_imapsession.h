@@ -34,15 +34,18 @@ typedef struct {
 	uint64_t args_idx;
 
 	int loop;              // IDLE loop counter
+	uint64_t idle_mailbox; // IDLE subscribed to changes in this mailbox
 
 	fetch_items *fi;       // FETCH
 	qresync_args qresync; // SELECT ... (QRESYNC ...)
 	search_order order;    // SORT/SEARCH
+	search_return ret;     // SORT/SEARCH RETURN (...)
+	notify_args notify;    // NOTIFY SET
 
 	DbmailMailbox *mailbox; // currently selected mailbox
+	char *searchres;        // saved search result ($), uid set
 	uint64_t lo;            // lower boundary for message ids
 	uint64_t hi;            // upper boundary for message ids
-	uint64_t ceiling;       // upper boundary during prefetching
 
 	DbmailMessage *message;
 
@@ -51,6 +54,9 @@ typedef struct {
 	GTree *ids;
 	GList *new_ids; // store new uids after a COPY command
 	GTree *physids;		// cache physmessage_ids for uids 
+	GTree *prefetched;	// messages retrieved ahead, by physmessage_id
+	GList *window;		// next uid in ids_list to prefetch
+	uint64_t window_hi;	// last uid in the prefetched window
 	GTree *envelopes;
 	GTree *mbxinfo; 	// cache MailboxState_T 
 	GList *ids_list;
@@ -85,6 +91,11 @@ ImapSession * dbmail_imap_session_set_command(ImapSession * self, const char * c
 
 void dbmail_imap_session_reset(ImapSession *session);
 
+void imap_idle_subscribe(ImapSession *session);
+void imap_idle_unsubscribe(ImapSession *session);
+void imap_notify_subscribe(ImapSession *session);
+void imap_notify_unsubscribe(ImapSession *session);
+
 void dbmail_imap_session_args_free(ImapSession *self, gboolean all);
 void dbmail_imap_session_fetch_free(ImapSession *self, gboolean all);
 void dbmail_imap_session_delete(ImapSession ** self);
@@ -94,15 +105,28 @@ void dbmail_imap_session_buff_flush(ImapSession *self);
 int dbmail_imap_session_buff_printf(ImapSession * self, char * message, ...);
 
 int dbmail_imap_session_set_state(ImapSession *self, ClientState_T state);
+/** \brief keep set (a uid set, or NULL) as the saved search result, taking ownership */
+void dbmail_imap_session_searchres(ImapSession *self, char *set);
 int dbmail_imap_session_handle_auth(ImapSession * self, const char * username, const char * password);
 
 MailboxState_T dbmail_imap_session_mbxinfo_lookup(ImapSession *self, uint64_t mailbox_idnr);
 
 int dbmail_imap_session_mailbox_status(ImapSession * self, gboolean update);
+
+GTree * dbmail_imap_session_notify_new(void);
+notify_mailbox * dbmail_imap_session_notify_add(GTree *mailboxes, uint64_t mailbox_id, const char *name, int events);
+void dbmail_imap_session_notify_set(ImapSession *self, int selected, GTree *mailboxes);
+void dbmail_imap_session_notify_free(ImapSession *self);
+/** \brief read the seqs of all mailboxes in the NOTIFY set, and take them as reported if baseline is TRUE */
+void dbmail_imap_session_notify_probe(ImapSession *self, gboolean baseline);
+/** \brief send STATUS for a mailbox in the NOTIFY set if it changed, or always if all is TRUE */
+int dbmail_imap_session_notify_status(ImapSession *self, uint64_t mailbox_id, gboolean all);
 int dbmail_imap_session_mailbox_expunge(ImapSession *self, const char *set, uint64_t *modseq);
 
 int dbmail_imap_session_fetch_get_items(ImapSession *self);
 int dbmail_imap_session_fetch_parse_args(ImapSession * self);
+/** \brief decide whether the parsed FETCH items need the message itself */
+void dbmail_imap_session_fetch_plan(ImapSession *self);
 
 void dbmail_imap_session_bodyfetch_free(ImapSession *self);
 
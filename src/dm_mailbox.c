@@ -27,10 +27,12 @@
 
 extern DBParam_T db_params;
 extern Mempool_T small_pool;
+extern const char *db_flag_desc[];
 
 #define DBPFX db_params.pfx
 
 /* internal utilities */
+static char * _search_inset(DbmailMailbox *self);
 
 
 /* class methods */
@@ -72,6 +74,7 @@ void dbmail_mailbox_free(DbmailMailbox *self)
 	gboolean freepool = self->freepool;
 	if (self->found) g_tree_destroy(self->found);
 	if (self->sorted) g_list_destroy(self->sorted);
+	thread_graph_free(self->threads);
 	if (self->search) {
 		g_node_traverse(g_node_get_root(self->search), G_POST_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc)_node_free, self);
 		g_node_destroy(self->search);
@@ -406,6 +409,21 @@ char * dbmail_mailbox_orderedsubject(DbmailMailbox *self)
 	return res;
 }
 
+/*
+ * THREAD=REFERENCES over the messages found
+ */
+char * dbmail_mailbox_references(DbmailMailbox *self)
+{
+	if (! self->threads)
+		self->threads = thread_graph_new(self->id);
+
+	if (thread_graph_load(self->threads, self->found) != DM_SUCCESS)
+		return NULL;
+
+	return thread_graph_references(self->threads, self->found,
+			dbmail_mailbox_get_uid(self));
+}
+
 /*
  * return self->ids as a string
  */
@@ -414,8 +432,6 @@ char * dbmail_mailbox_ids_as_string(DbmailMailbox *self, gboolean uid, const cha
 	GString *t;
 	gchar *s = NULL;
 	GList *l = NULL, *h = NULL;
-	GTree *msginfo;
-	GTree *msn;
 	uint64_t maxseq = 0;
 
 	if ((self->found == NULL) || g_tree_nnodes(self->found) <= 0) {
@@ -432,21 +448,19 @@ char * dbmail_mailbox_ids_as_string(DbmailMailbox *self, gboolean uid, const cha
 
 	h = l;
 
-	msginfo = MailboxState_getMsginfo(self->mbstate);
-	msn = MailboxState_getMsn(self->mbstate);
-
 	while(l->data) {
 		uint64_t *key = (uint64_t *)l->data;
 		if (self->modseq) {
 			uint64_t *id;
+			MessageInfo *info = NULL;
 			if (uid || dbmail_mailbox_get_uid(self)) {
 				id = key;
 			} else {
-				id = g_tree_lookup(msn, key);
+				id = MailboxState_getUid(self->mbstate, *key);
 			}
 
-			MessageInfo *info = g_tree_lookup(msginfo, id);
-			maxseq = max(maxseq, info->seq);
+			if (id && (info = MailboxState_getMessage(self->mbstate, *id)))
+				maxseq = max(maxseq, info->seq);
 		}
 		g_string_append_printf(t,"%" PRIu64 "", *key);
 		if (! g_list_next(l))
@@ -501,6 +515,196 @@ char * dbmail_mailbox_sorted_as_string(DbmailMailbox *self)
 }
 
 
+/*
+ * ESEARCH return data
+ *
+ * ids are taken in result order and written as runs of consecutive
+ * numbers, so ALL costs a few bytes per run instead of per message.
+ */
+struct seqset {
+	GString *s;
+	uint64_t lo, hi;
+	gboolean open;
+};
+
+static void _seqset_close(struct seqset *q)
+{
+	if (! q->open) return;
+	if (q->s->len)
+		g_string_append_c(q->s, ',');
+	if (q->lo == q->hi)
+		g_string_append_printf(q->s, "%" PRIu64, q->lo);
+	else
+		g_string_append_printf(q->s, "%" PRIu64 ":%" PRIu64, q->lo, q->hi);
+	q->open = FALSE;
+}
+
+static void _seqset_add(struct seqset *q, uint64_t id)
+{
+	if (q->open && (id == q->hi + 1)) {
+		q->hi = id;
+		return;
+	}
+	_seqset_close(q);
+	q->lo = q->hi = id;
+	q->open = TRUE;
+}
+
+struct esearch {
+	DbmailMailbox *self;
+	const search_return *ret;
+	gboolean uid;
+	uint64_t pos;
+	uint64_t last;		// stop after this position, 0 to walk all
+	uint64_t plo, phi;	// PARTIAL positions
+	uint64_t min, max;
+	uint64_t maxseq;
+	struct seqset all;
+	struct seqset partial;
+};
+
+static gboolean _esearch_add(uint64_t *uid, uint64_t *msn, struct esearch *e)
+{
+	uint64_t id = e->uid ? *uid : *msn;
+	MessageInfo *info;
+
+	e->pos++;
+	if (e->pos == 1)
+		e->min = id;
+	e->max = id;
+
+	if (e->ret->options & SEARCH_RETURN_ALL)
+		_seqset_add(&e->all, id);
+	if ((e->ret->options & SEARCH_RETURN_PARTIAL) && (e->pos >= e->plo) && (e->pos <= e->phi))
+		_seqset_add(&e->partial, id);
+
+	if (e->self->modseq && (info = MailboxState_getMessage(e->self->mbstate, *uid)))
+		e->maxseq = max(e->maxseq, info->seq);
+
+	return (e->last && (e->pos >= e->last));
+}
+
+static void _esearch_walk(struct esearch *e, gboolean sorted)
+{
+	DbmailMailbox *self = e->self;
+	GList *l;
+	uint64_t *msn;
+
+	if (sorted) {
+		l = g_list_first(self->sorted);
+		while (l) {
+			if ((msn = g_tree_lookup(self->found, l->data)) && _esearch_add((uint64_t *)l->data, msn, e))
+				break;
+			l = g_list_next(l);
+		}
+	} else if (self->found) {
+		g_tree_foreach(self->found, (GTraverseFunc)_esearch_add, e);
+	}
+	_seqset_close(&e->all);
+	_seqset_close(&e->partial);
+}
+
+char * dbmail_mailbox_esearch(DbmailMailbox *self, const search_return *ret, gboolean sorted)
+{
+	struct esearch e;
+	GString *t;
+	uint64_t count = 0;
+	int64_t lo, hi;
+
+	memset(&e, 0, sizeof(e));
+	e.self = self;
+	e.ret = ret;
+	e.uid = dbmail_mailbox_get_uid(self);
+	e.all.s = g_string_new("");
+	e.partial.s = g_string_new("");
+
+	if (sorted)
+		count = g_list_length(self->sorted);
+	else if (self->found)
+		count = g_tree_nnodes(self->found);
+
+	if (ret->options & SEARCH_RETURN_PARTIAL) {
+		// the range may come in either order
+		lo = min(ret->partial_lo, ret->partial_hi);
+		hi = max(ret->partial_lo, ret->partial_hi);
+		if (lo < 0) { // counted from the last message
+			lo = (int64_t)count + lo + 1;
+			hi = (int64_t)count + hi + 1;
+		}
+		e.plo = (uint64_t)max(lo, 1);
+		e.phi = (uint64_t)max(hi, 0);
+	}
+
+	// MIN and PARTIAL only need the start of the result
+	if (! ((ret->options & (SEARCH_RETURN_ALL|SEARCH_RETURN_MAX)) || self->modseq)) {
+		if (ret->options & SEARCH_RETURN_PARTIAL)
+			e.last = max(e.phi, 1);
+		else
+			e.last = 1;
+	}
+
+	if (count && (ret->options & ~(SEARCH_RETURN_ESEARCH|SEARCH_RETURN_COUNT)))
+		_esearch_walk(&e, sorted);
+
+	t = g_string_new("");
+	if (count && (ret->options & SEARCH_RETURN_MIN))
+		g_string_append_printf(t, " MIN %" PRIu64, e.min);
+	if (count && (ret->options & SEARCH_RETURN_MAX))
+		g_string_append_printf(t, " MAX %" PRIu64, e.max);
+	if (ret->options & SEARCH_RETURN_COUNT)
+		g_string_append_printf(t, " COUNT %" PRIu64, count);
+	if (count && (ret->options & SEARCH_RETURN_ALL))
+		g_string_append_printf(t, " ALL %s", e.all.s->str);
+	if (ret->options & SEARCH_RETURN_PARTIAL) {
+		g_string_append_printf(t, " PARTIAL (%" PRId64 ":%" PRId64 " %s)",
+				ret->partial_lo, ret->partial_hi,
+				e.partial.s->len ? e.partial.s->str : "NIL");
+	}
+	if (count && self->modseq && e.maxseq)
+		g_string_append_printf(t, " MODSEQ %" PRIu64, e.maxseq);
+
+	g_string_free(e.all.s, TRUE);
+	g_string_free(e.partial.s, TRUE);
+
+	return g_string_free(t, FALSE);
+}
+
+char * dbmail_mailbox_save(DbmailMailbox *self, const search_return *ret, gboolean sorted)
+{
+	struct esearch e;
+	search_return r;
+	char *s;
+
+	memset(&r, 0, sizeof(r));
+	memset(&e, 0, sizeof(e));
+	e.self = self;
+	e.ret = &r;
+	e.uid = TRUE;
+	e.all.s = g_string_new("");
+	e.partial.s = g_string_new("");
+
+	// SAVE with MIN or MAX but no ALL or COUNT keeps just those
+	if ((ret->options & (SEARCH_RETURN_MIN|SEARCH_RETURN_MAX)) &&
+			(! (ret->options & (SEARCH_RETURN_ALL|SEARCH_RETURN_COUNT)))) {
+		_esearch_walk(&e, sorted);
+		if (e.pos) {
+			if (ret->options & SEARCH_RETURN_MIN)
+				_seqset_add(&e.all, e.min);
+			if ((ret->options & SEARCH_RETURN_MAX) && (e.max != e.min))
+				_seqset_add(&e.all, e.max);
+			_seqset_close(&e.all);
+		}
+	} else {
+		r.options = SEARCH_RETURN_ALL;
+		_esearch_walk(&e, FALSE);
+	}
+
+	s = g_string_free(e.all.s, FALSE);
+	g_string_free(e.partial.s, TRUE);
+
+	return s;
+}
+
 /* imap sorted search */
 static int append_search(DbmailMailbox *self, search_key *value, gboolean descend)
 {
@@ -528,6 +732,8 @@ static void _append_join(char *join, char *table)
         char tmp[BUFSIZE+1];
 	memset(tmp, 0, sizeof(tmp));
         g_snprintf(tmp, BUFSIZE, "LEFT JOIN %s%s ON m.physmessage_id=%s%s.physmessage_id ", DBPFX, table, DBPFX, table);
+	if (strstr(join, tmp))
+		return;
         g_strlcat(join, tmp, MAX_SEARCH_LEN);
 }
 
@@ -539,6 +745,21 @@ static void _append_sort(char *order, char *field, gboolean reverse)
 	g_strlcat(order, tmp, MAX_SEARCH_LEN);
 }
 
+static gboolean _append_criterion(search_key *value, int criterion, gboolean reverse)
+{
+	int i;
+	for (i = 0; i < SORT_MAX_CRITERIA; i++) {
+		if (! value->criteria[i]) {
+			value->criteria[i] = reverse ? -criterion : criterion;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* more sort criteria than SORT_MAX_CRITERIA are refused */
+#define APPEND_CRITERION(v, c, r) if (! _append_criterion((v), (c), (r))) return -2
+
 static int _handle_sort_args(DbmailMailbox *self, String_T *search_keys, search_key *value, uint64_t *idx)
 {
 	value->type = IST_SORT;
@@ -558,44 +779,66 @@ static int _handle_sort_args(DbmailMailbox *self, String_T *search_keys, search_
 	
 	if ( MATCH(key, "arrival") ) {
 		_append_sort(value->order, "internal_date", reverse);
+		_append_sort(value->field, "p.internal_date", reverse);
+		APPEND_CRITERION(value, SORT_ARRIVAL, reverse);
 		(*idx)++;
 	} 
 	
 	else if ( MATCH(key, "size") ) {
 		_append_sort(value->order, "messagesize", reverse);
+		_append_sort(value->field, "p.rfcsize", reverse);
+		APPEND_CRITERION(value, SORT_SIZE, reverse);
 		(*idx)++;
 	} 
 	
 	else if ( MATCH(key, "from") ) {
 		_append_join(value->table, "fromfield");
 		_append_sort(value->order, "fromfield", reverse);
+		_append_sort(value->field, "k.fromaddr", reverse);
+		APPEND_CRITERION(value, SORT_FROM, reverse);
 		(*idx)++;
 	} 
 	
 	else if ( MATCH(key, "subject") ) {
 		_append_join(value->table, "subjectfield");
 		_append_sort(value->order, "sortfield", reverse);
+		_append_sort(value->field, "k.subject", reverse);
+		APPEND_CRITERION(value, SORT_SUBJECT, reverse);
 		(*idx)++;
 	} 
 	
 	else if ( MATCH(key, "cc") ) {
 		_append_join(value->table, "ccfield");
 		_append_sort(value->order, "ccfield", reverse);
+		_append_sort(value->field, "k.ccaddr", reverse);
+		APPEND_CRITERION(value, SORT_CC, reverse);
 		(*idx)++;
 	} 
 	
 	else if ( MATCH(key, "to") ) {
 		_append_join(value->table, "tofield");
 		_append_sort(value->order, "tofield", reverse);
+		_append_sort(value->field, "k.toaddr", reverse);
+		APPEND_CRITERION(value, SORT_TO, reverse);
 		(*idx)++;
 	} 
 	
 	else if ( MATCH(key, "date") ) {
 		_append_join(value->table, "datefield");
 		_append_sort(value->order, "sortfield", reverse);
+		_append_sort(value->field, "k.sentdate", reverse);
+		APPEND_CRITERION(value, SORT_DATE, reverse);
 		(*idx)++;
 	}	
 
+	else if ( MATCH(key, "display") ) {
+		_append_join(value->table, "fromfield");
+		_append_sort(value->order, "fromfield", reverse);
+		_append_sort(value->field, "k.fromname", reverse);
+		APPEND_CRITERION(value, SORT_DISPLAY, reverse);
+		(*idx)++;
+	}
+
 	else if ( MATCH(key, "(") )
 		(*idx)++;
 
@@ -633,9 +876,53 @@ static void pop_search(DbmailMailbox *self)
 		self->search = self->search->parent;
 }
 
+/* flag search keys: the flags tested, and which of those must be set */
+#define SEARCH_FLAG(f) (1 << IMAP_FLAG_##f)
+static const struct {
+	const char *key;
+	int mask;
+	int set;
+} search_flags[] = {
+	{ "answered",	SEARCH_FLAG(ANSWERED),	SEARCH_FLAG(ANSWERED) },
+	{ "deleted",	SEARCH_FLAG(DELETED),	SEARCH_FLAG(DELETED) },
+	{ "flagged",	SEARCH_FLAG(FLAGGED),	SEARCH_FLAG(FLAGGED) },
+	{ "recent",	SEARCH_FLAG(RECENT),	SEARCH_FLAG(RECENT) },
+	{ "seen",	SEARCH_FLAG(SEEN),	SEARCH_FLAG(SEEN) },
+	{ "draft",	SEARCH_FLAG(DRAFT),	SEARCH_FLAG(DRAFT) },
+	{ "new",	SEARCH_FLAG(SEEN)|SEARCH_FLAG(RECENT), SEARCH_FLAG(RECENT) },
+	{ "old",	SEARCH_FLAG(RECENT),	0 },
+	{ "unanswered",	SEARCH_FLAG(ANSWERED),	0 },
+	{ "undeleted",	SEARCH_FLAG(DELETED),	0 },
+	{ "unflagged",	SEARCH_FLAG(FLAGGED),	0 },
+	{ "unseen",	SEARCH_FLAG(SEEN),	0 },
+	{ "undraft",	SEARCH_FLAG(DRAFT),	0 },
+	{ NULL, 0, 0 }
+};
+#undef SEARCH_FLAG
+
+static int search_flag(const char *key)
+{
+	int i;
+	for (i = 0; search_flags[i].key; i++) {
+		if (MATCH(key, search_flags[i].key))
+			return i;
+	}
+	return -1;
+}
+
+/* start of an IMAP date, as internal dates are read from the database */
+static time_t search_date(const char *imapdate)
+{
+	char s[SQL_INTERNALDATE_LEN];
+	memset(s, 0, sizeof(s));
+	if (date_imap2sql(imapdate, s))
+		return 0;
+	return date_sql2epoch(s);
+}
+
 static int _handle_search_args(DbmailMailbox *self, String_T *search_keys, uint64_t *idx)
 {
-	int result = 0;
+	int result = 0, f;
 
 	if (! (search_keys && search_keys[*idx]))
 		return 1;
@@ -675,71 +962,11 @@ static int _handle_search_args(DbmailMailbox *self, String_T *search_keys, uint6
 	 * FLAG search keys
 	 */
 
-	else if ( MATCH(key, "answered") ) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "answered_flag=1", MAX_SEARCH_LEN-1);
-		(*idx)++;
-		
-	} else if ( MATCH(key, "deleted") ) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "deleted_flag=1", MAX_SEARCH_LEN-1);
-		(*idx)++;
-		
-	} else if ( MATCH(key, "flagged") ) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "flagged_flag=1", MAX_SEARCH_LEN-1);
-		(*idx)++;
-		
-	} else if ( MATCH(key, "recent") ) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "recent_flag=1", MAX_SEARCH_LEN-1);
-		(*idx)++;
-		
-	} else if ( MATCH(key, "seen") ) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "seen_flag=1", MAX_SEARCH_LEN-1);
-		(*idx)++;
-		
-	} else if ( MATCH(key, "draft") ) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "draft_flag=1", MAX_SEARCH_LEN-1);
-		(*idx)++;
-		
-	} else if ( MATCH(key, "new") ) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "(seen_flag=0 AND recent_flag=1)", MAX_SEARCH_LEN-1);
-		(*idx)++;
-		
-	} else if ( MATCH(key, "old") ) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "recent_flag=0", MAX_SEARCH_LEN-1);
-		(*idx)++;
-		
-	} else if ( MATCH(key, "unanswered") ) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "answered_flag=0", MAX_SEARCH_LEN-1);
-		(*idx)++;
-
-	} else if ( MATCH(key, "undeleted") ) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "deleted_flag=0", MAX_SEARCH_LEN-1);
-		(*idx)++;
-	
-	} else if ( MATCH(key, "unflagged") ) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "flagged_flag=0", MAX_SEARCH_LEN-1);
-		(*idx)++;
-	
-	} else if ( MATCH(key, "unseen") ) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "seen_flag=0", MAX_SEARCH_LEN-1);
-		(*idx)++;
-	
-	} else if ( MATCH(key, "undraft") ) {
+	else if ((f = search_flag(key)) >= 0) {
 		value->type = IST_FLAG;
-		strncpy(value->search, "draft_flag=0", MAX_SEARCH_LEN-1);
+		value->flags_mask = search_flags[f].mask;
+		value->flags_set = search_flags[f].set;
 		(*idx)++;
-	
 	}
 
 #define IMAP_SET_SEARCH		(*idx)++; \
@@ -838,44 +1065,32 @@ static int _handle_search_args(DbmailMailbox *self, String_T *search_keys, uint6
 	 */
 
 	else if ( MATCH(key, "before") ) {
-		char s[SQL_INTERNALDATE_LEN];
-		memset(s, 0, sizeof(s));
 		RETURN_IF_FAIL(search_keys[*idx + 1], -1);
 		RETURN_IF_FAIL(check_date(p_string_str(search_keys[*idx + 1])),-1);
 		value->type = IST_IDATE;
 		(*idx)++;
-		date_imap2sql(p_string_str(search_keys[*idx]), s);
-		g_snprintf(value->search, MAX_SEARCH_LEN-1, "p.internal_date < '%s'", s);
+		value->before = search_date(p_string_str(search_keys[*idx]));
 		(*idx)++;
 		
 	} else if ( MATCH(key, "on") ) {
-		char s[SQL_INTERNALDATE_LEN], d[MIME_FIELD_MAX];
-		memset(s, 0, sizeof(s));
-		memset(d, 0, sizeof(d));
 		RETURN_IF_FAIL(search_keys[*idx + 1], -1);
 		RETURN_IF_FAIL(check_date(p_string_str(search_keys[*idx + 1])),-1);
 		value->type = IST_IDATE;
 		(*idx)++;
-		date_imap2sql(p_string_str(search_keys[*idx]), s);
-		g_snprintf(d, MIME_FIELD_MAX-1, db_get_sql(SQL_TO_DATE), "p.internal_date");
-		g_snprintf(value->search, MAX_SEARCH_LEN-1, "%s = '%s'", d, s);
+		value->since = search_date(p_string_str(search_keys[*idx]));
+		value->before = value->since + 86400;
 		(*idx)++;
 		
 	} else if ( MATCH(key, "since") ) {
-		char s[SQL_INTERNALDATE_LEN];
-		memset(s, 0, sizeof(s));
 		RETURN_IF_FAIL(search_keys[*idx + 1], -1);
 		RETURN_IF_FAIL(check_date(p_string_str(search_keys[*idx + 1])),-1);
 		value->type = IST_IDATE;
 		(*idx)++;
-		date_imap2sql(p_string_str(search_keys[*idx]), s);
-		g_snprintf(value->search, MAX_SEARCH_LEN-1, "p.internal_date > '%s'", s);
+		value->since = search_date(p_string_str(search_keys[*idx]));
 		(*idx)++;
 
 	} else if (MATCH(key, "older") ) {
 		uint64_t seconds;
-		char partial[DEF_FRAGSIZE];
-		memset(partial, 0, sizeof(partial));
 		RETURN_IF_FAIL(search_keys[*idx + 1], -1);
 		errno = 0;
 		seconds = dm_strtoull(p_string_str(search_keys[*idx + 1]), NULL, 10);
@@ -886,14 +1101,11 @@ static int _handle_search_args(DbmailMailbox *self, String_T *search_keys, uint6
 		}
 		value->type = IST_IDATE;
 		(*idx)++;
-		g_snprintf(partial, DEF_FRAGSIZE-1, db_get_sql(SQL_WITHIN), seconds);
-		g_snprintf(value->search, MAX_SEARCH_LEN-1, "p.internal_date < %s", partial);
+		value->before = time(NULL) - seconds;
 		(*idx)++;
 
 	} else if (MATCH(key, "younger") ) {
 		uint64_t seconds;
-		char partial[DEF_FRAGSIZE];
-		memset(partial, 0, sizeof(partial));
 		RETURN_IF_FAIL(search_keys[*idx + 1], -1);
 		errno = 0;
 		seconds = dm_strtoull(p_string_str(search_keys[*idx + 1]), NULL, 10);
@@ -904,8 +1116,7 @@ static int _handle_search_args(DbmailMailbox *self, String_T *search_keys, uint6
 		}
 		value->type = IST_IDATE;
 		(*idx)++;
-		g_snprintf(partial, DEF_FRAGSIZE-1, db_get_sql(SQL_WITHIN), seconds);
-		g_snprintf(value->search, MAX_SEARCH_LEN-1, "p.internal_date > %s", partial);
+		value->since = time(NULL) - seconds;
 		(*idx)++;
 
 	} else if (MATCH(key, "modseq") ) {
@@ -982,44 +1193,12 @@ static int _handle_search_args(DbmailMailbox *self, String_T *search_keys, uint6
 
 		nextkey = p_string_str(search_keys[*idx+1]);
 
-		if ( MATCH(nextkey, "answered") ) {
-			value->type = IST_FLAG;
-			strncpy(value->search, "answered_flag=0", MAX_SEARCH_LEN-1);
-			(*idx)+=2;
-			
-		} else if ( MATCH(nextkey, "deleted") ) {
+		f = search_flag(nextkey);
+		if ((f >= 0) && (! (search_flags[f].mask & (search_flags[f].mask - 1)))) {
+			// a single flag is inverted in place
 			value->type = IST_FLAG;
-			strncpy(value->search, "deleted_flag=0", MAX_SEARCH_LEN-1);
-			(*idx)+=2;
-			
-		} else if ( MATCH(nextkey, "flagged") ) {
-			value->type = IST_FLAG;
-			strncpy(value->search, "flagged_flag=0", MAX_SEARCH_LEN-1);
-			(*idx)+=2;
-			
-		} else if ( MATCH(nextkey, "recent") ) {
-			value->type = IST_FLAG;
-			strncpy(value->search, "recent_flag=0", MAX_SEARCH_LEN-1);
-			(*idx)+=2;
-			
-		} else if ( MATCH(nextkey, "seen") ) {
-			value->type = IST_FLAG;
-			strncpy(value->search, "seen_flag=0", MAX_SEARCH_LEN-1);
-			(*idx)+=2;
-			
-		} else if ( MATCH(nextkey, "draft") ) {
-			value->type = IST_FLAG;
-			strncpy(value->search, "draft_flag=0", MAX_SEARCH_LEN-1);
-			(*idx)+=2;
-			
-		} else if ( MATCH(nextkey, "new") ) {
-			value->type = IST_FLAG;
-			strncpy(value->search, "(seen_flag=1 AND recent_flag=0)", MAX_SEARCH_LEN-1);
-			(*idx)+=2;
-			
-		} else if ( MATCH(nextkey, "old") ) {
-			value->type = IST_FLAG;
-			strncpy(value->search, "recent_flag=1", MAX_SEARCH_LEN-1);
+			value->flags_mask = search_flags[f].mask;
+			value->flags_set = search_flags[f].mask ^ search_flags[f].set;
 			(*idx)+=2;
 			
 		} else {
@@ -1126,6 +1305,8 @@ int dbmail_mailbox_build_imap_search(DbmailMailbox *self, String_T *search_keys,
 			while(((result = _handle_sort_args(self, search_keys, value, idx)) == 0) && search_keys[*idx]);
 			if (result < 0)
 				mempool_push(self->pool, s, sizeof(search_key));
+			if (result == -2)
+				return -1;
 		break;
 		case SEARCH_THREAD_ORDEREDSUBJECT:
 		case SEARCH_THREAD_REFERENCES:
@@ -1157,27 +1338,16 @@ int dbmail_mailbox_build_imap_search(DbmailMailbox *self, String_T *search_keys,
 }
 
 
-static gboolean _do_sort(GNode *node, DbmailMailbox *self)
+/*
+ * run a sort query, keeping the messages in self->found. With keyed set
+ * the second column is the sort key row, DM_EGENERAL means a message
+ * has none yet.
+ */
+static int _sort_query(DbmailMailbox *self, const char *query, gboolean keyed)
 {
-	GString *q;
 	uint64_t tid, *id;
-	Connection_T c; ResultSet_T r; volatile int t = FALSE;
-	search_key *s = (search_key *)node->data;
+	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
 	GTree *z;
-	
-	TRACE(TRACE_DEBUG,"type [%d]", s->type);
-
-	if (s->type != IST_SORT) return FALSE;
-	
-	if (s->searched) return FALSE;
-
-	q = g_string_new("");
-	g_string_printf(q, "SELECT m.message_idnr FROM %smessages m "
-			"LEFT JOIN %sphysmessage p ON m.physmessage_id=p.id "
-			"%s"
-			"WHERE m.mailbox_idnr = %" PRIu64 " AND m.status IN (%d,%d) "
-			"ORDER BY %smessage_idnr", DBPFX, DBPFX, s->table,
-			dbmail_mailbox_get_id(self), MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN, s->order);
 
         if (self->sorted) {
                 g_list_destroy(self->sorted);
@@ -1187,8 +1357,12 @@ static gboolean _do_sort(GNode *node, DbmailMailbox *self)
 	z = g_tree_new((GCompareFunc)ucmp);
 	c = db_con_get();
 	TRY
-		r = db_query(c,q->str);
+		r = db_query(c, query);
 		while (db_result_next(r)) {
+			if (keyed && (! db_result_get_u64(r, 1))) {
+				t = DM_EGENERAL;
+				break;
+			}
 			tid = db_result_get_u64(r,0);
 			if (g_tree_lookup(self->found,&tid) && (! g_tree_lookup(z, &tid))) {
 				id = g_new0(uint64_t,1);
@@ -1205,81 +1379,383 @@ static gboolean _do_sort(GNode *node, DbmailMailbox *self)
 		g_tree_destroy(z);
 	END_TRY;
 
-	if (t == DM_EQUERY) return TRUE;
+	if (t != DM_SUCCESS) {
+		g_list_destroy(self->sorted);
+		self->sorted = NULL;
+		return t;
+	}
 
         self->sorted = g_list_reverse(self->sorted);
 
+	return t;
+}
+
+/*
+ * with sort_cache set the sort keys are kept with the mailbox state,
+ * so sorting the same mailbox again only costs cpu
+ */
+static gboolean _sort_cache_enabled(void)
+{
+	Field_T val;
+	config_get_value("sort_cache", "IMAP", val);
+	return SMATCH(val, "yes") ? TRUE : FALSE;
+}
+
+static gboolean _do_sort(GNode *node, DbmailMailbox *self)
+{
+	GString *q;
+	char *inset;
+	int t = DM_EGENERAL;
+	search_key *s = (search_key *)node->data;
+	
+	TRACE(TRACE_DEBUG,"type [%d]", s->type);
+
+	if (s->type != IST_SORT) return FALSE;
+	
+	if (s->searched) return FALSE;
+
+	q = g_string_new("");
+
+	if (_sort_cache_enabled() && s->criteria[0]) {
+		if (! self->mbstate)
+			dbmail_mailbox_open(self);
+		if (self->sorted) {
+			g_list_destroy(self->sorted);
+			self->sorted = NULL;
+		}
+		t = MailboxState_sort(self->mbstate, self->found, s->criteria, &self->sorted);
+	}
+
+	// one pass over the sort keys, unless some are still missing
+	if ((t == DM_EGENERAL) && (db_params.db_driver != DM_DRIVER_ORACLE)) {
+		inset = _search_inset(self);
+		g_string_printf(q, "SELECT m.message_idnr, k.physmessage_id FROM %smessages m "
+				"JOIN %sphysmessage p ON m.physmessage_id=p.id "
+				"LEFT JOIN %ssortkeys k ON m.physmessage_id=k.physmessage_id "
+				"WHERE m.mailbox_idnr = %" PRIu64 " AND m.status IN (%d,%d) %s "
+				"ORDER BY %sm.message_idnr", DBPFX, DBPFX, DBPFX,
+				dbmail_mailbox_get_id(self), MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN,
+				inset?inset:"", s->field);
+		g_free(inset);
+		t = _sort_query(self, q->str, TRUE);
+	}
+
+	if (t == DM_EGENERAL) {
+		TRACE(TRACE_DEBUG, "sorting through the header tables");
+		g_string_printf(q, "SELECT m.message_idnr FROM %smessages m "
+				"LEFT JOIN %sphysmessage p ON m.physmessage_id=p.id "
+				"%s"
+				"WHERE m.mailbox_idnr = %" PRIu64 " AND m.status IN (%d,%d) "
+				"ORDER BY %smessage_idnr", DBPFX, DBPFX, s->table,
+				dbmail_mailbox_get_id(self), MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN, s->order);
+		t = _sort_query(self, q->str, FALSE);
+	}
+
 	g_string_free(q,TRUE);
 
+	if (t == DM_EQUERY) return TRUE;
+
 	s->searched = TRUE;
 	
 	return FALSE;
 }
-static GTree * mailbox_search(DbmailMailbox *self, search_key *s)
+/*
+ * restricting a query to a set of messages
+ *
+ * The set is written as runs of messages that are neighbours in the
+ * mailbox, or else as the runs of messages that are not in it,
+ * whichever takes fewer. When that still takes too many runs, the ids
+ * themselves are passed: as an array on PostgreSQL, as a list elsewhere.
+ * A list longer than SEARCH_MAX_IDS is not written at all, since it
+ * could exceed the statement size limits of MySQL and SQLite: the set
+ * is then left to be applied in memory.
+ * The search candidates, the full-text candidates and the sequence sets
+ * in a compiled search are written this way.
+ */
+
+#define SEARCH_MAX_RANGES 100
+#define SEARCH_MAX_IDS 10000
+
+struct search_runs {
+	GTree *found;
+	GArray *runs[2];	// first,last pairs of non-candidates, candidates
+	GArray *ids[2];
+	uint64_t last;
+	int state;
+};
+
+static gboolean _search_run(uint64_t *uid, gpointer UNUSED msn, struct search_runs *r)
 {
-	uint64_t *k, *v, *w;
-	uint64_t id;
-	char gt_lt = 0;
-	const char *op;
-	char partial[DEF_FRAGSIZE];
-	Connection_T c; ResultSet_T r; PreparedStatement_T st;
-	GTree *ids;
-	char *inset = NULL;
-	
-	GString *t;
-	String_T q;
+	int in = g_tree_lookup_extended(r->found, uid, NULL, NULL) ? 1 : 0;
+	GArray *runs = r->runs[in];
 
-	if (self->found && g_tree_nnodes(self->found) <= 200) {
-		char *setlist = dbmail_mailbox_ids_as_string(self, TRUE, ",");
-		if (setlist) {
-			inset = g_strdup_printf("AND m.message_idnr IN (%s)", setlist);
-			g_free(setlist);
-		}
+	if (r->state == in) {
+		g_array_index(runs, uint64_t, runs->len - 1) = *uid;
+	} else {
+		g_array_append_val(runs, *uid);
+		g_array_append_val(runs, *uid);
 	}
+	g_array_append_val(r->ids[in], *uid);
+	r->state = in;
+	r->last = *uid;
 
-	c = db_con_get();
-	t = g_string_new("");
-	q = p_string_new(self->pool, "");
-	TRY
-		switch (s->type) {
-			case IST_HDRDATE_ON:
-			case IST_HDRDATE_SINCE:
-			case IST_HDRDATE_BEFORE:
-			{		
-				char qs[DEF_FRAGSIZE];
-				char field[DEF_FRAGSIZE];
-				char d[SQL_INTERNALDATE_LEN];
-				char date[DEF_FRAGSIZE];
-				memset(d, 0, sizeof(d));
-				memset(qs, 0, sizeof(qs));
-				memset(date, 0, sizeof(date));
-				memset(field, 0, sizeof(field));
+	return FALSE;
+}
 
-				g_snprintf(field, DEF_FRAGSIZE-1, db_get_sql(SQL_TO_DATE), s->hdrfld);
-				date_imap2sql(s->search, d);
-				g_snprintf(qs, DEF_FRAGSIZE-1, "'%s'", d);
-				g_snprintf(date, DEF_FRAGSIZE-1, db_get_sql(SQL_TO_DATE), qs);
+/*
+ * condition on m.message_idnr for the messages in set, NULL if that is
+ * all of them. Returns FALSE if the set is too large to be written.
+ */
+static gboolean _search_encode(DbmailMailbox *self, GTree *set, char **cond)
+{
+	struct search_runs r;
+	GArray *runs, *ids;
+	GString *s;
+	uint64_t first, last;
+	gboolean result = TRUE;
+	unsigned i;
+	int in;
 
-				if (s->type == IST_HDRDATE_SINCE)
-					op = ">=";
-				else if (s->type == IST_HDRDATE_BEFORE)
-					op = "<";
-				else
-					op = "=";
+	*cond = NULL;
 
-				p_string_printf(q,"SELECT message_idnr FROM %smessages m "
-						"LEFT JOIN %sheader h USING (physmessage_id) "
-						"LEFT JOIN %sheadername n ON h.headername_id = n.id "
-						"LEFT JOIN %sheadervalue v ON h.headervalue_id = v.id "
-						"WHERE m.mailbox_idnr=? AND m.status IN (?,?) "
-						"%s "
-						"AND n.headername = 'date' "
-						"AND %s %s %s ORDER BY message_idnr", 
-						DBPFX, DBPFX, DBPFX, DBPFX,
-						inset?inset:"",
-						field, op, date);
+	if (g_tree_nnodes(set) >= MailboxState_getIdCount(self->mbstate))
+		return TRUE;
 
-				st = db_stmt_prepare(c, p_string_str(q));
+	memset(&r, 0, sizeof(r));
+	r.found = set;
+	r.state = -1;
+	for (in = 0; in < 2; in++) {
+		r.runs[in] = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+		r.ids[in] = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+	}
+
+	MailboxState_foreach_id(self->mbstate, (GTraverseFunc)_search_run, &r);
+
+	in = (r.runs[1]->len <= r.runs[0]->len) ? 1 : 0;
+	runs = r.runs[in];
+	ids = r.ids[in];
+
+	if (r.ids[1]->len && ! r.ids[0]->len) {
+		// all of them after all
+	} else if ((db_params.db_driver != DM_DRIVER_POSTGRESQL) &&
+			((runs->len / 2) > SEARCH_MAX_RANGES) && (ids->len > SEARCH_MAX_IDS)) {
+		TRACE(TRACE_DEBUG, "[%u] ids are too many to pass", ids->len);
+		result = FALSE;
+	} else {
+		s = g_string_new("(");
+		if (! ids->len) {
+			g_string_append(s, "1=0");
+		} else if ((runs->len / 2) <= SEARCH_MAX_RANGES) {
+			g_string_append_printf(s, "%s(", in ? "" : "NOT ");
+			for (i = 0; i < runs->len; i += 2) {
+				first = g_array_index(runs, uint64_t, i);
+				last = g_array_index(runs, uint64_t, i + 1);
+				if (i)
+					g_string_append(s, " OR ");
+				if (first == last)
+					g_string_append_printf(s, "m.message_idnr = %" PRIu64, first);
+				else
+					g_string_append_printf(s, "m.message_idnr BETWEEN %" PRIu64 " AND %" PRIu64, first, last);
+			}
+			g_string_append_c(s, ')');
+		} else {
+			if (db_params.db_driver == DM_DRIVER_POSTGRESQL)
+				g_string_append_printf(s, "%sm.message_idnr = ANY('{", in ? "" : "NOT ");
+			else
+				g_string_append_printf(s, "m.message_idnr %sIN (", in ? "" : "NOT ");
+			for (i = 0; i < ids->len; i++)
+				g_string_append_printf(s, "%s%" PRIu64, i ? "," : "", g_array_index(ids, uint64_t, i));
+			if (db_params.db_driver == DM_DRIVER_POSTGRESQL)
+				g_string_append(s, "}'::bigint[])");
+			else
+				g_string_append_c(s, ')');
+		}
+
+		// messages that arrived after the mailbox was read are not in the set
+		if (! in)
+			g_string_append_printf(s, " AND m.message_idnr <= %" PRIu64, r.last);
+		g_string_append_c(s, ')');
+
+		TRACE(TRACE_DEBUG, "[%d] messages in [%u] runs", g_tree_nnodes(set), runs->len / 2);
+		*cond = g_string_free(s, FALSE);
+	}
+
+	for (in = 0; in < 2; in++) {
+		g_array_free(r.runs[in], TRUE);
+		g_array_free(r.ids[in], TRUE);
+	}
+
+	return result;
+}
+
+/* the candidates as a condition, NULL to leave them to the merge */
+static char * _search_inset(DbmailMailbox *self)
+{
+	char *cond, *inset;
+
+	if (! (self->found && self->mbstate))
+		return NULL;
+	if (! (_search_encode(self, self->found, &cond) && cond))
+		return NULL;
+
+	inset = g_strconcat("AND ", cond, NULL);
+	g_free(cond);
+
+	return inset;
+}
+
+/* uid -> msn tree of the message_idnr's in the first column */
+static GTree * _search_rows(MailboxState_T M, ResultSet_T r)
+{
+	uint64_t *k, *v, *w;
+	uint64_t id;
+	GTree *found;
+
+	found = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)uint64_free, (GDestroyNotify)uint64_free);
+
+	while (db_result_next(r)) {
+		id = db_result_get_u64(r,0);
+		if (! (w = MailboxState_getMsn(M, id))) {
+			TRACE(TRACE_ERR, "key missing in ids: [%" PRIu64 "]\n", id);
+			continue;
+		}
+		assert(w);
+
+		k = mempool_pop(small_pool, sizeof(uint64_t));
+		v = mempool_pop(small_pool, sizeof(uint64_t));
+		*k = id;
+		*v = *w;
+
+		g_tree_insert(found, k, v);
+	}
+
+	return found;
+}
+
+/*
+ * BODY and TEXT against compressed mimeparts: the database can not look
+ * inside them, so they are unpacked and matched here, the same way the
+ * LIKE on the data column matches: case-sensitive substrings.
+ * Every candidate part crosses the wire, so this is only done for
+ * candidates already narrowed down by the full-text index.
+ */
+static void mailbox_search_compressed(DbmailMailbox *self, search_key *s, const char *inset, const char *pending)
+{
+	Connection_T c; ResultSet_T r; PreparedStatement_T st;
+	MailboxState_T M = self->mbstate;
+	uint64_t id, *k, *v, *w;
+	const void *data;
+	char *part;
+	size_t plen;
+	int l;
+
+	if (! s->found)
+		s->found = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)uint64_free, (GDestroyNotify)uint64_free);
+
+	c = db_con_get();
+	TRY
+		st = db_stmt_prepare(c, "SELECT m.message_idnr, k.data FROM %smessages m "
+				"JOIN %spartlists l ON l.physmessage_id=m.physmessage_id "
+				"JOIN %smimeparts k ON k.id=l.part_id "
+				"WHERE m.mailbox_idnr=? AND m.status IN (?,?) AND k.compressed=1 "
+				"%s %s %s "
+				"ORDER BY m.message_idnr",
+				DBPFX, DBPFX, DBPFX,
+				inset?inset:"", pending?pending:"",
+				(s->type == IST_DATA_BODY) ? "AND (l.part_key > 1 OR l.is_header=0)" : "");
+		db_stmt_set_u64(st, 1, dbmail_mailbox_get_id(self));
+		db_stmt_set_int(st, 2, MESSAGE_STATUS_NEW);
+		db_stmt_set_int(st, 3, MESSAGE_STATUS_SEEN);
+		r = db_stmt_query(st);
+		while (db_result_next(r)) {
+			id = db_result_get_u64(r, 0);
+			if (g_tree_lookup(s->found, &id))
+				continue;
+			if (! (w = MailboxState_getMsn(M, id)))
+				continue;
+			l = 0;
+			data = db_result_get_blob(r, 1, &l);
+			if (! (part = dm_gzip(data, l, FALSE, &plen)))
+				continue;
+			if (strstr(part, s->search)) {
+				k = mempool_pop(small_pool, sizeof(uint64_t));
+				v = mempool_pop(small_pool, sizeof(uint64_t));
+				*k = id;
+				*v = *w;
+				g_tree_insert(s->found, k, v);
+			}
+			g_free(part);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+}
+
+static GTree * mailbox_search(DbmailMailbox *self, search_key *s, const char *filter)
+{
+	const char *op;
+	char partial[DEF_FRAGSIZE];
+	Connection_T c; ResultSet_T r; PreparedStatement_T st;
+	MailboxState_T M = self->mbstate;
+	char *inset, *narrow = NULL;
+	GList * volatile trigrams = NULL;
+	GList *l;
+	int i;
+	
+	GString *t;
+	String_T q;
+
+	inset = _search_inset(self);
+
+	/* extra condition on m, e.g. the full-text candidates */
+	if (filter)
+		narrow = g_strdup(filter);
+
+	c = db_con_get();
+	t = g_string_new("");
+	q = p_string_new(self->pool, "");
+	TRY
+		switch (s->type) {
+			case IST_HDRDATE_ON:
+			case IST_HDRDATE_SINCE:
+			case IST_HDRDATE_BEFORE:
+			{		
+				char qs[DEF_FRAGSIZE];
+				char field[DEF_FRAGSIZE];
+				char d[SQL_INTERNALDATE_LEN];
+				char date[DEF_FRAGSIZE];
+				memset(d, 0, sizeof(d));
+				memset(qs, 0, sizeof(qs));
+				memset(date, 0, sizeof(date));
+				memset(field, 0, sizeof(field));
+
+				g_snprintf(field, DEF_FRAGSIZE-1, db_get_sql(SQL_TO_DATE), s->hdrfld);
+				date_imap2sql(s->search, d);
+				g_snprintf(qs, DEF_FRAGSIZE-1, "'%s'", d);
+				g_snprintf(date, DEF_FRAGSIZE-1, db_get_sql(SQL_TO_DATE), qs);
+
+				if (s->type == IST_HDRDATE_SINCE)
+					op = ">=";
+				else if (s->type == IST_HDRDATE_BEFORE)
+					op = "<";
+				else
+					op = "=";
+
+				p_string_printf(q,"SELECT message_idnr FROM %smessages m "
+						"LEFT JOIN %sheader h USING (physmessage_id) "
+						"LEFT JOIN %sheadername n ON h.headername_id = n.id "
+						"LEFT JOIN %sheadervalue v ON h.headervalue_id = v.id "
+						"WHERE m.mailbox_idnr=? AND m.status IN (?,?) "
+						"%s "
+						"AND n.headername = 'date' "
+						"AND %s %s %s ORDER BY message_idnr", 
+						DBPFX, DBPFX, DBPFX, DBPFX,
+						inset?inset:"",
+						field, op, date);
+
+				st = db_stmt_prepare(c, p_string_str(q));
 				db_stmt_set_u64(st, 1, dbmail_mailbox_get_id(self));
 				db_stmt_set_int(st, 2, MESSAGE_STATUS_NEW);
 				db_stmt_set_int(st, 3, MESSAGE_STATUS_SEEN);
@@ -1288,6 +1764,48 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key *s)
 			break;
 				
 			case IST_HDR:
+
+			if ((trigram_mode() == TRIGRAM_TABLE) && trigram_search_enabled() &&
+					(trigrams = trigram_query_terms(s->search))) {
+				// start from the header values that have every trigram,
+				// and those that could not be split
+				GString *in = g_string_new("");
+				for (l = g_list_first(trigrams); l; l = g_list_next(l))
+					g_string_append_printf(in, "%s?", in->len ? "," : "");
+
+				p_string_printf(q, "SELECT m.message_idnr FROM ("
+						"SELECT headervalue_id FROM %sheadervalue_trigrams "
+						"WHERE trigram IN (%s) GROUP BY headervalue_id "
+						"HAVING COUNT(*) = %u "
+						"UNION ALL SELECT headervalue_id FROM %sheadervalue_trigrams "
+						"WHERE trigram = '" TRIGRAM_SCAN "') t "
+						"JOIN %sheader h ON h.headervalue_id = t.headervalue_id "
+						"JOIN %sheadername n ON h.headername_id = n.id "
+						"JOIN %sheadervalue v ON h.headervalue_id = v.id "
+						"JOIN %smessages m ON m.physmessage_id = h.physmessage_id "
+						"WHERE m.mailbox_idnr=? AND m.status IN (?,?) "
+						"%s "
+						"AND n.headername = '%s' AND v.headervalue %s ? "
+						"ORDER BY m.message_idnr",
+						DBPFX, in->str, g_list_length(trigrams), DBPFX,
+						DBPFX, DBPFX, DBPFX, DBPFX,
+						inset?inset:"",
+						s->hdrfld, db_get_sql(SQL_INSENSITIVE_LIKE));
+				g_string_free(in, TRUE);
+
+				st = db_stmt_prepare(c, p_string_str(q));
+				i = 1;
+				for (l = g_list_first(trigrams); l; l = g_list_next(l))
+					db_stmt_set_str(st, i++, (char *)l->data);
+				db_stmt_set_u64(st, i++, dbmail_mailbox_get_id(self));
+				db_stmt_set_int(st, i++, MESSAGE_STATUS_NEW);
+				db_stmt_set_int(st, i++, MESSAGE_STATUS_SEEN);
+				memset(partial,0,sizeof(partial));
+				snprintf(partial, DEF_FRAGSIZE-1, "%%%s%%", s->search);
+				db_stmt_set_str(st, i, partial);
+
+				break;
+			}
 			
 			p_string_printf(q, "SELECT message_idnr FROM %smessages m "
 					"LEFT JOIN %sheader h USING (physmessage_id) "
@@ -1321,11 +1839,11 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key *s)
 					"LEFT JOIN %sheadervalue v ON h.headervalue_id=v.id "
 					"LEFT JOIN %smessages m ON m.physmessage_id=p.id "
 					"WHERE m.mailbox_idnr = ? AND m.status IN (?,?) "
-					"%s "
+					"%s %s "
 					"AND (v.headervalue %s ? OR k.data %s ?) "
 					"ORDER BY m.message_idnr",
 					DBPFX, DBPFX, DBPFX, DBPFX, DBPFX, DBPFX,
-					inset?inset:"",
+					inset?inset:"", narrow?narrow:"",
 					db_get_sql(SQL_INSENSITIVE_LIKE), 
 					db_get_sql(SQL_SENSITIVE_LIKE)); // pgsql will trip over ilike against bytea 
 
@@ -1340,23 +1858,6 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key *s)
 
 			break;
 				
-			case IST_IDATE:
-			p_string_printf(q, "SELECT message_idnr FROM %smessages m "
-					"LEFT JOIN %sphysmessage p ON m.physmessage_id=p.id "
-					"WHERE mailbox_idnr = ? AND status IN (?,?) "
-					"%s "
-					"AND %s "
-					"ORDER BY message_idnr", 
-					DBPFX, DBPFX, 
-					inset?inset:"",
-					s->search);
-
-			st = db_stmt_prepare(c, p_string_str(q));
-			db_stmt_set_u64(st, 1, dbmail_mailbox_get_id(self));
-			db_stmt_set_int(st, 2, MESSAGE_STATUS_NEW);
-			db_stmt_set_int(st, 3, MESSAGE_STATUS_SEEN);
-			break;
-			
 			case IST_DATA_BODY:
 			g_string_printf(t,db_get_sql(SQL_ENCODE_ESCAPE), "p.data");
 			p_string_printf(q,"SELECT DISTINCT m.message_idnr FROM %smimeparts p "
@@ -1365,12 +1866,12 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key *s)
 					"LEFT JOIN %smessages m ON m.physmessage_id=s.id "
 					"LEFT JOIN %smailboxes b ON m.mailbox_idnr = b.mailbox_idnr "
 					"WHERE b.mailbox_idnr=? AND m.status IN (?,?) "
-					"%s "
+					"%s %s "
 					"AND (l.part_key > 1 OR l.is_header=0) "
 					"AND %s %s ? "
 					"ORDER BY m.message_idnr",
 					DBPFX,DBPFX,DBPFX,DBPFX,DBPFX,
-					inset?inset:"",
+					inset?inset:"", narrow?narrow:"",
 					t->str, db_get_sql(SQL_SENSITIVE_LIKE)); // pgsql will trip over ilike against bytea 
 
 			st = db_stmt_prepare(c, p_string_str(q));
@@ -1383,49 +1884,6 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key *s)
 
 			break;
 
-			case IST_SIZE_LARGER:
-				gt_lt = '>';
-				// fallthrough
-
-			case IST_SIZE_SMALLER:
-				if (!gt_lt) gt_lt = '<';
-
-			p_string_printf(q, "SELECT m.message_idnr FROM %smessages m "
-				"LEFT JOIN %sphysmessage p ON m.physmessage_id = p.id "
-				"WHERE m.mailbox_idnr = ? AND m.status IN (?,?) "
-				"%s "
-				"AND p.rfcsize %c ? "
-				"ORDER BY message_idnr", 
-				DBPFX, DBPFX, 
-				inset?inset:"",
-				gt_lt);
-
-			st = db_stmt_prepare(c, p_string_str(q));
-			db_stmt_set_u64(st, 1, dbmail_mailbox_get_id(self));
-			db_stmt_set_int(st, 2, MESSAGE_STATUS_NEW);
-			db_stmt_set_int(st, 3, MESSAGE_STATUS_SEEN);
-			db_stmt_set_u64(st, 4, s->size);
-
-			break;
-
-			case IST_KEYWORD:
-			case IST_UNKEYWORD:
-			p_string_printf(q, "SELECT m.message_idnr FROM %smessages m "
-					"JOIN %skeywords k ON m.message_idnr=k.message_idnr "
-					"WHERE mailbox_idnr=? AND status IN (?,?) "
-					"%s "
-					"AND k.keyword = ? ORDER BY message_idnr",
-					DBPFX, DBPFX, 
-					inset?inset:"");
-
-			st = db_stmt_prepare(c, p_string_str(q));
-			db_stmt_set_u64(st, 1, dbmail_mailbox_get_id(self));
-			db_stmt_set_int(st, 2, MESSAGE_STATUS_NEW);
-			db_stmt_set_int(st, 3, MESSAGE_STATUS_SEEN);
-			db_stmt_set_str(st, 4, s->search);
-
-			break;
-
 			default:
 			p_string_printf(q, "SELECT message_idnr FROM %smessages "
 				"WHERE mailbox_idnr = ? AND status IN (?,?) AND %s "
@@ -1441,83 +1899,103 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key *s)
 		}
 
 		r = db_stmt_query(st);
+		s->found = _search_rows(M, r);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
 
-		s->found = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)uint64_free, (GDestroyNotify)uint64_free);
-
-		ids = MailboxState_getIds(self->mbstate);
-		while (db_result_next(r)) {
-			id = db_result_get_u64(r,0);
-			if (! (w = g_tree_lookup(ids, &id))) {
-				TRACE(TRACE_ERR, "key missing in ids: [%" PRIu64 "]\n", id);
-				continue;
-			}
-			assert(w);
-
-			k = mempool_pop(small_pool, sizeof(uint64_t));
-			v = mempool_pop(small_pool, sizeof(uint64_t));
-			*k = id;
-			*v = *w;
-
-			g_tree_insert(s->found, k, v);
-		}
-
-		if (s->type == IST_UNKEYWORD) {
-			GTree *old = NULL;
-			GTree *invert = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)uint64_free, (GDestroyNotify)uint64_free);
-			GList *uids = g_tree_keys(ids);
-			uids = g_list_first(uids);
-			while (uids) {
-				uint64_t id = *(uint64_t *)uids->data;
-				if (! (w = g_tree_lookup(ids, &id))) {
-					TRACE(TRACE_ERR, "key missing in ids: [%" PRIu64 "]", id);
-
-					if (! g_list_next(uids)) break;
-					uids = g_list_next(uids);
-					continue;
-				}
-
-				assert(w);
+	if (((s->type == IST_DATA_BODY) || (s->type == IST_DATA_TEXT)) && narrow && dm_message_compressed_parts())
+		mailbox_search_compressed(self, s, inset, narrow);
 
-				if (g_tree_lookup(s->found, &id)) {
-					TRACE(TRACE_DEBUG, "skip key [%" PRIu64 "]", id);
+	if (inset)
+		g_free(inset);
+	g_free(narrow);
+	g_list_destroy(trigrams);
 
-					if (! g_list_next(uids)) break;
-					uids = g_list_next(uids);
-					continue;
-				}
+	p_string_free(q,TRUE);
+	g_string_free(t,TRUE);
 
-				k = mempool_pop(small_pool, sizeof(uint64_t));
-				v = mempool_pop(small_pool, sizeof(uint64_t));
-				*k = id;
-				*v = *w;
+	return s->found;
+}
 
-				g_tree_insert(invert, k, v);
+/*
+ * BODY and TEXT through the full-text index: the index only narrows
+ * down the indexed messages to candidates, which are then checked with
+ * the same substring match as a plain scan. Messages the index does
+ * not cover are scanned as before.
+ * Returns FALSE if the index can not answer this key.
+ */
+static gboolean mailbox_search_fulltext(DbmailMailbox *self, search_key *s)
+{
+	const FulltextBackend *backend;
+	GList *terms, *ids = NULL, *l;
+	GString *filter;
+	GTree *candidates;
+	char *cond = NULL;
+	uint64_t mailbox_id = dbmail_mailbox_get_id(self);
+	gboolean pending;
+	int r;
+
+	if (! (backend = fulltext_backend()))
+		return FALSE;
+	if (! (terms = fulltext_query_terms(s->search)))
+		return FALSE;
 
+	r = backend->search(mailbox_id, terms,
+			(s->type == IST_DATA_BODY) ? FULLTEXT_BODY : (FULLTEXT_HEADER|FULLTEXT_BODY), &ids);
+	g_list_destroy(terms);
+	if (r != DM_SUCCESS)
+		return FALSE;
 
-				if (! g_list_next(uids)) break;
-				uids = g_list_next(uids);
+	pending = backend->pending(mailbox_id);
+	TRACE(TRACE_DEBUG, "[%s] candidates [%u]%s", s->search, g_list_length(ids),
+			pending ? " and unindexed messages" : "");
 
-			}
+	if (! (ids || pending)) {
+		s->found = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)uint64_free, (GDestroyNotify)uint64_free);
+		return TRUE;
+	}
 
-			old = s->found;
-			s->found = invert;
-			g_tree_destroy(old);
-			g_list_free(g_list_first(uids));
+	if (ids) {
+		gboolean encoded;
+		candidates = g_tree_new((GCompareFunc)ucmp);
+		for (l = g_list_first(ids); l; l = g_list_next(l)) {
+			if (MailboxState_getMsn(self->mbstate, *(uint64_t *)l->data))
+				g_tree_insert(candidates, l->data, l->data);
 		}
+		encoded = _search_encode(self, candidates, &cond);
+		g_tree_destroy(candidates);
+		if (! encoded) {
+			// too many to pass: a plain scan is as good
+			g_list_destroy(ids);
+			return FALSE;
+		}
+		if (! cond)
+			cond = g_strdup("1=1");
+	}
+	g_list_destroy(ids);
+
+	filter = g_string_new("AND (");
+	if (pending)
+		g_string_append_printf(filter, "m.physmessage_id NOT IN "
+				"(SELECT physmessage_id FROM %sfulltext_messages)", DBPFX);
+	if (cond) {
+		g_string_append_printf(filter, "%s%s", pending ? " OR " : "", cond);
+		g_free(cond);
+	}
+	g_string_append_c(filter, ')');
 
-	CATCH(SQLException)
-		LOG_SQLERROR;
-	FINALLY
-		db_con_close(c);
-	END_TRY;
+	mailbox_search(self, s, filter->str);
+	g_string_free(filter, TRUE);
 
-	if (inset)
-		g_free(inset);
+	if (! s->found)
+		s->found = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)uint64_free, (GDestroyNotify)uint64_free);
 
-	p_string_free(q,TRUE);
-	g_string_free(t,TRUE);
+	TRACE(TRACE_DEBUG, "[%s] found [%d]", s->search, g_tree_nnodes(s->found));
 
-	return s->found;
+	return TRUE;
 }
 
 static int checkset(const char *s)
@@ -1531,7 +2009,7 @@ static int checkset(const char *s)
 }
 
 struct filter_modseq_helper {
-	GTree *msginfo;
+	MailboxState_T M;
 	uint64_t modseq;
 	GList *remove;
 };
@@ -1542,7 +2020,7 @@ static int filter_modseq(gpointer key, gpointer UNUSED value, gpointer data)
 	uint64_t *id;
 
 	id = (uint64_t *)key;
-	MessageInfo *info = g_tree_lookup(d->msginfo, id);
+	MessageInfo *info = MailboxState_getMessage(d->M, *id);
 	if (! info)
 		return TRUE;
 
@@ -1557,7 +2035,7 @@ GTree * find_modseq(DbmailMailbox *self, GTree *in)
 		return in;
 	GList *remove;
 	struct filter_modseq_helper data;
-	data.msginfo = MailboxState_getMsginfo(self->mbstate);
+	data.M = self->mbstate;
 	data.modseq = self->modseq;
 	data.remove = NULL;
 
@@ -1577,7 +2055,6 @@ GTree * find_modseq(DbmailMailbox *self, GTree *in)
 
 GTree * dbmail_mailbox_get_set(DbmailMailbox *self, const char *set, gboolean uid)
 {
-	GTree *uids;
 	GTree *b;
 	
 	TRACE(TRACE_DEBUG, "[%s] uid [%d]", set, uid);
@@ -1587,8 +2064,15 @@ GTree * dbmail_mailbox_get_set(DbmailMailbox *self, const char *set, gboolean ui
 
 	assert (self && self->mbstate && set);
 
-	uids = MailboxState_getIds(self->mbstate);
-	if ((! uid) && (g_tree_nnodes(uids) == 0))
+	// the saved search result (RFC 5182) holds uids
+	if (MATCH(set, "$")) {
+		if (! (self->searchres && self->searchres[0]))
+			return g_tree_new_full((GCompareDataFunc)ucmpdata,NULL, (GDestroyNotify)uint64_free, (GDestroyNotify)uint64_free);
+		set = self->searchres;
+		uid = TRUE;
+	}
+
+	if ((! uid) && (MailboxState_getIdCount(self->mbstate) == 0))
 		return NULL;
 
 	if (! checkset(set)) // invalid chars
@@ -1649,6 +2133,324 @@ static gboolean _prescan_search(GNode *node, DbmailMailbox *self)
 	return FALSE;
 }
 
+/*
+ * search planning
+ *
+ * Keys the mailbox index answers cost no query. Every other key costs a
+ * query of its own, and the results are merged in memory. Where a subtree
+ * needs the database and every key in it can be expressed in SQL, the
+ * subtree is compiled into a single statement instead.
+ */
+
+/* number of keys below node that need a query */
+static int _search_plan(GNode *node)
+{
+	search_key *s = (search_key *)node->data;
+	GNode *child;
+	int n = 0;
+
+	switch (s->type) {
+		case IST_HDR:
+		case IST_HDRDATE_BEFORE:
+		case IST_HDRDATE_SINCE:
+		case IST_HDRDATE_ON:
+		case IST_DATA_TEXT:
+		case IST_DATA_BODY:
+			n++;
+			break;
+		case IST_SUBSEARCH_AND:
+		case IST_SUBSEARCH_OR:
+		case IST_SUBSEARCH_NOT:
+			for (child = g_node_first_child(node); child; child = g_node_next_sibling(child))
+				n += _search_plan(child);
+			break;
+		default:
+			break;
+	}
+
+	return n;
+}
+
+/*
+ * append the condition for the subtree at node to sql, and the values
+ * for its placeholders to args. Returns FALSE if a key in it can not
+ * be expressed in SQL.
+ */
+static gboolean _compile_search(DbmailMailbox *self, GNode *node, GString *sql, GList **args)
+{
+	search_key *s = (search_key *)node->data;
+	char partial[DEF_FRAGSIZE];
+	char *cond;
+	GList *trigrams, *l;
+	GNode *child;
+	GTree *set;
+	const char *sep;
+	int i, n = 0;
+
+	memset(partial, 0, sizeof(partial));
+	snprintf(partial, DEF_FRAGSIZE-1, "%%%s%%", s->search);
+
+	switch (s->type) {
+		case IST_SET:
+		case IST_UIDSET:
+			if (! self->mbstate)
+				return FALSE;
+			if (! (set = dbmail_mailbox_get_set(self, (const char *)s->search, (s->type == IST_UIDSET))))
+				return FALSE;
+			if (! _search_encode(self, set, &cond)) {
+				g_tree_destroy(set);
+				return FALSE;
+			}
+			g_tree_destroy(set);
+			g_string_append(sql, cond ? cond : "1=1");
+			g_free(cond);
+			break;
+
+		case IST_FLAG:
+			// \Recent belongs to the session, not to the recent_flag column
+			if (s->flags_mask & (1 << IMAP_FLAG_RECENT))
+				return FALSE;
+			sep = "";
+			g_string_append_c(sql, '(');
+			for (i = 0; i < IMAP_FLAG_RECENT; i++) {
+				if (! (s->flags_mask & (1 << i)))
+					continue;
+				g_string_append_printf(sql, "%sm.%s=%d", sep, db_flag_desc[i],
+						(s->flags_set & (1 << i)) ? 1 : 0);
+				sep = " AND ";
+			}
+			g_string_append_c(sql, ')');
+			break;
+
+		case IST_KEYWORD:
+		case IST_UNKEYWORD:
+			// fold case like the message index does
+			g_string_append_printf(sql, "%sEXISTS (SELECT 1 FROM %skeywords k "
+					"WHERE k.message_idnr=m.message_idnr AND LOWER(k.keyword)=?)",
+					(s->type == IST_UNKEYWORD) ? "NOT " : "", DBPFX);
+			*args = g_list_append(*args, g_ascii_strdown(s->search, -1));
+			break;
+
+		case IST_SIZE_LARGER:
+		case IST_SIZE_SMALLER:
+			g_string_append_printf(sql, "EXISTS (SELECT 1 FROM %sphysmessage p "
+					"WHERE p.id=m.physmessage_id AND p.rfcsize %s %" PRIu64 ")",
+					DBPFX, (s->type == IST_SIZE_LARGER) ? ">" : "<", s->size);
+			break;
+
+		case IST_HDRDATE_ON:
+		case IST_HDRDATE_SINCE:
+		case IST_HDRDATE_BEFORE:
+		{
+			char qs[DEF_FRAGSIZE];
+			char field[DEF_FRAGSIZE];
+			char d[SQL_INTERNALDATE_LEN];
+			char date[DEF_FRAGSIZE];
+			memset(d, 0, sizeof(d));
+			memset(qs, 0, sizeof(qs));
+			memset(date, 0, sizeof(date));
+			memset(field, 0, sizeof(field));
+
+			g_snprintf(field, DEF_FRAGSIZE-1, db_get_sql(SQL_TO_DATE), s->hdrfld);
+			date_imap2sql(s->search, d);
+			g_snprintf(qs, DEF_FRAGSIZE-1, "'%s'", d);
+			g_snprintf(date, DEF_FRAGSIZE-1, db_get_sql(SQL_TO_DATE), qs);
+
+			g_string_append_printf(sql, "EXISTS (SELECT 1 FROM %sheader h "
+					"JOIN %sheadername n ON h.headername_id=n.id "
+					"JOIN %sheadervalue v ON h.headervalue_id=v.id "
+					"WHERE h.physmessage_id=m.physmessage_id "
+					"AND n.headername='date' AND %s %s %s)",
+					DBPFX, DBPFX, DBPFX, field,
+					(s->type == IST_HDRDATE_SINCE) ? ">=" :
+					(s->type == IST_HDRDATE_BEFORE) ? "<" : "=",
+					date);
+			break;
+		}
+
+		case IST_HDR:
+			g_string_append_printf(sql, "EXISTS (SELECT 1 FROM %sheader h "
+					"JOIN %sheadername n ON h.headername_id=n.id "
+					"JOIN %sheadervalue v ON h.headervalue_id=v.id "
+					"WHERE h.physmessage_id=m.physmessage_id "
+					"AND n.headername=? AND v.headervalue %s ?",
+					DBPFX, DBPFX, DBPFX, db_get_sql(SQL_INSENSITIVE_LIKE));
+			*args = g_list_append(*args, g_strdup(s->hdrfld));
+			*args = g_list_append(*args, g_strdup(partial));
+
+			if ((trigram_mode() == TRIGRAM_TABLE) && trigram_search_enabled() &&
+					(trigrams = trigram_query_terms(s->search))) {
+				g_string_append_printf(sql, " AND h.headervalue_id IN ("
+						"SELECT headervalue_id FROM %sheadervalue_trigrams "
+						"WHERE trigram IN (", DBPFX);
+				for (l = g_list_first(trigrams); l; l = g_list_next(l)) {
+					g_string_append_printf(sql, "%s?", l->prev ? "," : "");
+					*args = g_list_append(*args, g_strdup((char *)l->data));
+				}
+				g_string_append_printf(sql, ") GROUP BY headervalue_id "
+						"HAVING COUNT(*) = %u "
+						"UNION ALL SELECT headervalue_id FROM %sheadervalue_trigrams "
+						"WHERE trigram = '" TRIGRAM_SCAN "')", g_list_length(trigrams), DBPFX);
+				g_list_destroy(trigrams);
+			}
+			g_string_append_c(sql, ')');
+			break;
+
+		case IST_DATA_TEXT:
+			// the full-text index, and compressed parts with it, are searched separately
+			if (fulltext_backend())
+				return FALSE;
+			g_string_append_printf(sql, "(EXISTS (SELECT 1 FROM %sheader h "
+					"JOIN %sheadervalue v ON h.headervalue_id=v.id "
+					"WHERE h.physmessage_id=m.physmessage_id AND v.headervalue %s ?) "
+					"OR EXISTS (SELECT 1 FROM %spartlists l "
+					"JOIN %smimeparts k ON k.id=l.part_id "
+					"WHERE l.physmessage_id=m.physmessage_id AND k.data %s ?))",
+					DBPFX, DBPFX, db_get_sql(SQL_INSENSITIVE_LIKE),
+					DBPFX, DBPFX, db_get_sql(SQL_SENSITIVE_LIKE));
+			*args = g_list_append(*args, g_strdup(partial));
+			*args = g_list_append(*args, g_strdup(partial));
+			break;
+
+		case IST_DATA_BODY:
+			if (fulltext_backend())
+				return FALSE;
+			g_string_append_printf(sql, "EXISTS (SELECT 1 FROM %spartlists l "
+					"JOIN %smimeparts k ON k.id=l.part_id "
+					"WHERE l.physmessage_id=m.physmessage_id "
+					"AND (l.part_key > 1 OR l.is_header=0) AND ",
+					DBPFX, DBPFX);
+			g_string_append_printf(sql, db_get_sql(SQL_ENCODE_ESCAPE), "k.data");
+			g_string_append_printf(sql, " %s ?)", db_get_sql(SQL_SENSITIVE_LIKE));
+			*args = g_list_append(*args, g_strdup(partial));
+			break;
+
+		case IST_SUBSEARCH_NOT:
+			g_string_append(sql, "NOT ");
+			/* fall through */
+		case IST_SUBSEARCH_AND:
+		case IST_SUBSEARCH_OR:
+			sep = (s->type == IST_SUBSEARCH_OR) ? " OR " : " AND ";
+			g_string_append_c(sql, '(');
+			for (child = g_node_first_child(node); child; child = g_node_next_sibling(child)) {
+				if (((search_key *)child->data)->type == IST_SORT)
+					continue;
+				if (n++)
+					g_string_append(sql, sep);
+				if (! _compile_search(self, child, sql, args))
+					return FALSE;
+			}
+			if (! n)
+				g_string_append(sql, "1=1");
+			g_string_append_c(sql, ')');
+			break;
+
+		default:
+			// internal dates are compared in memory only
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean _search_done(GNode *node, gpointer UNUSED data)
+{
+	search_key *s = (search_key *)node->data;
+	s->searched = TRUE;
+	s->merged = TRUE;
+	return FALSE;
+}
+
+/*
+ * answer the (ANDed) subtrees in nodes that compile with a single query.
+ * The result is kept by the first of them, which stands in for all of
+ * them in _merge_search. Returns FALSE if no query was worth it.
+ */
+static gboolean _search_compiled(DbmailMailbox *self, GList *nodes)
+{
+	Connection_T c; ResultSet_T r; PreparedStatement_T st;
+	GTree * volatile found = NULL;
+	GString *where, *sql;
+	GList *args = NULL, *nargs, *used = NULL, *l;
+	search_key *s;
+	char *inset;
+	String_T q;
+	int i;
+
+	where = g_string_new("");
+	for (l = g_list_first(nodes); l; l = g_list_next(l)) {
+		sql = g_string_new("");
+		nargs = NULL;
+		if (_compile_search(self, (GNode *)l->data, sql, &nargs)) {
+			g_string_append_printf(where, "%s%s", where->len ? " AND " : "", sql->str);
+			args = g_list_concat(args, nargs);
+			used = g_list_append(used, l->data);
+		} else {
+			g_list_destroy(nargs);
+		}
+		g_string_free(sql, TRUE);
+	}
+
+	// a lone key is better served by its own query
+	if ((! used) || ((g_list_length(used) == 1) && G_NODE_IS_LEAF((GNode *)used->data))) {
+		g_string_free(where, TRUE);
+		g_list_destroy(args);
+		g_list_free(used);
+		return FALSE;
+	}
+
+	if (g_tree_nnodes(self->found) > 0) {
+		inset = _search_inset(self);
+		q = p_string_new(self->pool, "");
+		p_string_printf(q, "SELECT m.message_idnr FROM %smessages m "
+				"WHERE m.mailbox_idnr=? AND m.status IN (?,?) "
+				"%s AND %s ORDER BY m.message_idnr",
+				DBPFX, inset?inset:"", where->str);
+
+		c = db_con_get();
+		TRY
+			st = db_stmt_prepare(c, p_string_str(q));
+			db_stmt_set_u64(st, 1, dbmail_mailbox_get_id(self));
+			db_stmt_set_int(st, 2, MESSAGE_STATUS_NEW);
+			db_stmt_set_int(st, 3, MESSAGE_STATUS_SEEN);
+			i = 4;
+			for (l = g_list_first(args); l; l = g_list_next(l))
+				db_stmt_set_str(st, i++, (char *)l->data);
+			r = db_stmt_query(st);
+			found = _search_rows(self->mbstate, r);
+		CATCH(SQLException)
+			LOG_SQLERROR;
+		FINALLY
+			db_con_close(c);
+		END_TRY;
+
+		g_free(inset);
+		p_string_free(q, TRUE);
+	}
+
+	// no candidates left (or the query failed): nothing matches
+	if (! found)
+		found = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)uint64_free, (GDestroyNotify)uint64_free);
+
+	for (l = g_list_first(used); l; l = g_list_next(l))
+		g_node_traverse((GNode *)l->data, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+				(GNodeTraverseFunc)_search_done, NULL);
+
+	s = (search_key *)((GNode *)used->data)->data;
+	s->found = found;
+	s->compiled = TRUE;
+	s->merged = FALSE;
+
+	TRACE(TRACE_DEBUG, "[%u] subtrees in one query, found [%d]",
+			g_list_length(used), g_tree_nnodes(found));
+
+	g_string_free(where, TRUE);
+	g_list_destroy(args);
+	g_list_free(used);
+
+	return TRUE;
+}
+
 static gboolean _do_search(GNode *node, DbmailMailbox *self)
 {
 	search_key *s = (search_key *)node->data;
@@ -1673,20 +2475,35 @@ static gboolean _do_search(GNode *node, DbmailMailbox *self)
 		case IST_UNKEYWORD:
 		case IST_SIZE_LARGER:
 		case IST_SIZE_SMALLER:
+		case IST_IDATE:
+		case IST_FLAG:
+			// answered from the message index, no query needed
+			s->found = MailboxState_search(self->mbstate, s);
+			break;
+
 		case IST_HDRDATE_BEFORE:
 		case IST_HDRDATE_SINCE:
 		case IST_HDRDATE_ON:
-		case IST_IDATE:
-		case IST_FLAG:
 		case IST_HDR:
+			mailbox_search(self, s, NULL);
+			break;
+
 		case IST_DATA_TEXT:
 		case IST_DATA_BODY:
-			mailbox_search(self, s);
+			if (! mailbox_search_fulltext(self, s))
+				mailbox_search(self, s, NULL);
 			break;
 			
 		case IST_SUBSEARCH_NOT:
 		case IST_SUBSEARCH_AND:
 		case IST_SUBSEARCH_OR:
+			if (_search_plan(node)) {
+				GList *one = g_list_append(NULL, node);
+				gboolean compiled = _search_compiled(self, one);
+				g_list_free(one);
+				if (compiled)
+					break;
+			}
 			g_node_children_foreach(node, G_TRAVERSE_ALL, (GNodeForeachFunc)_do_search, (gpointer)self);
 			s->found = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)g_free, (GDestroyNotify)g_free);
 			break;
@@ -1717,6 +2534,14 @@ static gboolean _merge_search(GNode *node, GTree *found)
 	if (s->merged == TRUE)
 		return FALSE;
 
+	if (s->compiled) {
+		// one query answered the whole subtree
+		g_tree_merge(found, s->found, IST_SUBSEARCH_AND);
+		s->merged = TRUE;
+		g_tree_destroy(s->found);
+		s->found = NULL;
+		return FALSE;
+	}
 
 	switch(s->type) {
 		case IST_SUBSEARCH_AND:
@@ -1739,12 +2564,12 @@ static gboolean _merge_search(GNode *node, GTree *found)
 			a = (search_key *)x->data;
 			b = (search_key *)y->data;
 
-			if (a->type == IST_SUBSEARCH_AND) {
+			if ((a->type == IST_SUBSEARCH_AND) && (! a->compiled)) {
 				g_tree_foreach(found, (GTraverseFunc)_found_tree_copy, a->found);
 				g_node_children_foreach(x, G_TRAVERSE_ALL, (GNodeForeachFunc)_merge_search, (gpointer)a->found);
 			}
 
-			if (b->type == IST_SUBSEARCH_AND) {
+			if ((b->type == IST_SUBSEARCH_AND) && (! b->compiled)) {
 				g_tree_foreach(found, (GTraverseFunc)_found_tree_copy, b->found);
 				g_node_children_foreach(y, G_TRAVERSE_ALL, (GNodeForeachFunc)_merge_search, (gpointer)b->found);
 			}
@@ -1780,6 +2605,36 @@ static gboolean _merge_search(GNode *node, GTree *found)
 
 	return FALSE;
 }
+
+/*
+ * the top level keys are ANDed: those the mailbox index answers go
+ * first, so they narrow the candidates for the query that answers the
+ * rest of them.
+ */
+static void _plan_search(DbmailMailbox *self)
+{
+	GNode *root = g_node_get_root(self->search), *node;
+	GList *compile = NULL;
+	search_key *s;
+
+	for (node = g_node_first_child(root); node; node = g_node_next_sibling(node)) {
+		s = (search_key *)node->data;
+		if (s->searched || (s->type == IST_SORT))
+			continue;
+		if (_search_plan(node)) {
+			compile = g_list_append(compile, node);
+			continue;
+		}
+		g_node_traverse(node, G_PRE_ORDER, G_TRAVERSE_ALL, -1, 
+				(GNodeTraverseFunc)_do_search, (gpointer)self);
+		g_node_traverse(node, G_PRE_ORDER, G_TRAVERSE_ALL, -1, 
+				(GNodeTraverseFunc)_merge_search, (gpointer)self->found);
+	}
+
+	if (compile)
+		_search_compiled(self, compile);
+	g_list_free(compile);
+}
 	
 int dbmail_mailbox_sort(DbmailMailbox *self) 
 {
@@ -1794,7 +2649,6 @@ int dbmail_mailbox_sort(DbmailMailbox *self)
 
 int dbmail_mailbox_search(DbmailMailbox *self) 
 {
-	GTree *ids;
 	if (! self->search) return 0;
 	
 	if (! self->mbstate)
@@ -1803,13 +2657,13 @@ int dbmail_mailbox_search(DbmailMailbox *self)
 	if (self->found) g_tree_destroy(self->found);
 	self->found = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,NULL,NULL);
 
-	ids = MailboxState_getIds(self->mbstate);
-
-	g_tree_foreach(ids, (GTraverseFunc)_shallow_tree_copy, self->found);
+	MailboxState_foreach_id(self->mbstate, (GTraverseFunc)_shallow_tree_copy, self->found);
  
 	g_node_traverse(g_node_get_root(self->search), G_LEVEL_ORDER, G_TRAVERSE_ALL, 2, 
 			(GNodeTraverseFunc)_prescan_search, (gpointer)self);
 
+	_plan_search(self);
+
 	g_node_traverse(g_node_get_root(self->search), G_PRE_ORDER, G_TRAVERSE_ALL, -1, 
 			(GNodeTraverseFunc)_do_search, (gpointer)self);
 
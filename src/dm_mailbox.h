@@ -52,6 +52,8 @@ typedef struct {
 	GTree *found;		// search result (key: uid, value: msn)
 	GNode *search;
 	const char *charset;		// charset used during search/sort
+	struct thread_graph *threads;	// REFERENCES threading, loaded on first use
+	const char *searchres;	// saved search result ($), uid set owned by the session
 
 } DbmailMailbox;
 
@@ -74,7 +76,19 @@ void dbmail_mailbox_free(DbmailMailbox *self);
 
 char * dbmail_mailbox_ids_as_string(DbmailMailbox *self, gboolean uid, const char *sep);
 char * dbmail_mailbox_sorted_as_string(DbmailMailbox *self);
+/**
+ * \brief the return data of an ESEARCH response, each item with a
+ * leading space
+ * \param sorted take the messages in sort order
+ */
+char * dbmail_mailbox_esearch(DbmailMailbox *self, const search_return *ret, gboolean sorted);
+/**
+ * \brief the search result to keep for $ (RFC 5182)
+ * \return uid set, an empty string if nothing was found
+ */
+char * dbmail_mailbox_save(DbmailMailbox *self, const search_return *ret, gboolean sorted);
 char * dbmail_mailbox_orderedsubject(DbmailMailbox *self);
+char * dbmail_mailbox_references(DbmailMailbox *self);
 
 int dbmail_mailbox_build_imap_search(DbmailMailbox *self, String_T *search_keys, uint64_t *idx, search_order order);
 
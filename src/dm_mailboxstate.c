@@ -55,57 +55,310 @@ struct T {
 	//
 	String_T name;
 	GTree *keywords;
-	GTree *msginfo;
-	GTree *ids;
-	GTree *msn;
 	GTree *recent_queue;
+	gboolean recent_cleared;
+	struct msgindex *index;	// possibly shared, see state_own_index
+	// this state's view on the index
+	unsigned ids;		// messages that have a msn
+	unsigned vsize;		// allocated view rows
+	uint64_t *msn;		// by row, 0 for expunged messages
+	unsigned *row;		// row by msn-1
+	GTree *expunged;	// expunges announced by this state only
+	struct sortkeys *sortkeys;	// loaded by the first SORT
 };
+
+/*
+ * message index
+ *
+ * parallel arrays sorted by uid: a uid lookup is a binary search over
+ * one contiguous column. Keywords are interned per index and stored as
+ * a bitset of kwwords words per row.
+ *
+ * An index is reference counted and never changed once it is shared:
+ * states loaded for the same mailbox at the same seq share one index
+ * through the state cache, and a state copies it before it writes.
+ */
+struct msgindex {
+	gint refs;
+	unsigned rows;		// loaded messages, expunged ones included
+	unsigned size;		// allocated rows
+	uint64_t *uid;
+	MessageInfo *info;
+	GPtrArray *kwname;
+	GHashTable *kwbit;	// lowercase keyword -> bit+1
+	unsigned kwwords;
+	uint64_t *kw;
+};
+
+#define KW_WORD(x, r, b) ((x)->kw[(size_t)(r) * (x)->kwwords + ((b) >> 6)])
+#define KW_MASK(b) ((uint64_t)1 << ((b) & 63))
    
 static void db_getmailbox_seq(T M, Connection_T c);
 static void db_getmailbox_permission(T M, Connection_T c);
 static void state_load_metadata(T M, Connection_T c);
-static void MailboxState_setMsginfo(T M, GTree *msginfo);
+static gboolean mailbox_build_recent(uint64_t *uid, MessageInfo *msginfo, T M);
+static struct msgindex * state_cache_get(uint64_t id, uint64_t seq);
+static void sortkeys_free(struct sortkeys *k);
+static void state_cache_put(uint64_t id, uint64_t seq, struct msgindex *x);
 /* */
 
-static void MailboxState_uid_msn_new(T M)
+static struct msgindex * msgindex_new(void)
+{
+	struct msgindex *x = g_new0(struct msgindex, 1);
+	x->refs = 1;
+	x->kwname = g_ptr_array_new();
+	x->kwbit = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	return x;
+}
+
+static void msgindex_free(struct msgindex *x)
+{
+	unsigned i;
+
+	if (! x) return;
+
+	for (i = 0; i < x->kwname->len; i++)
+		g_free(g_ptr_array_index(x->kwname, i));
+	g_ptr_array_free(x->kwname, TRUE);
+	g_hash_table_destroy(x->kwbit);
+
+	g_free(x->uid);
+	g_free(x->info);
+	g_free(x->kw);
+	g_free(x);
+}
+
+static struct msgindex * msgindex_ref(struct msgindex *x)
+{
+	g_atomic_int_inc(&x->refs);
+	return x;
+}
+
+static void msgindex_unref(struct msgindex *x)
+{
+	if (x && g_atomic_int_dec_and_test(&x->refs))
+		msgindex_free(x);
+}
+
+static size_t msgindex_bytes(const struct msgindex *x)
+{
+	return sizeof(*x) + (size_t)x->size * (sizeof(uint64_t) + sizeof(MessageInfo)
+			+ x->kwwords * sizeof(uint64_t));
+}
+
+static void msgindex_reserve(struct msgindex *x, unsigned rows)
+{
+	unsigned size;
+
+	if (rows <= x->size) return;
+
+	size = max(max(rows, x->size * 2), 64);
+
+	x->uid  = g_renew(uint64_t, x->uid, size);
+	x->info = g_renew(MessageInfo, x->info, size);
+	if (x->kwwords) {
+		x->kw = g_renew(uint64_t, x->kw, (size_t)size * x->kwwords);
+		memset(x->kw + (size_t)x->size * x->kwwords, 0,
+				(size_t)(size - x->size) * x->kwwords * sizeof(uint64_t));
+	}
+	x->size = size;
+}
+
+/* find the row for uid, or the row where it would be inserted */
+static gboolean msgindex_find(const struct msgindex *x, uint64_t uid, unsigned *row)
+{
+	unsigned lo = 0, hi = x->rows, mid;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) >> 1);
+		if (x->uid[mid] < uid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*row = lo;
+
+	return (lo < x->rows && x->uid[lo] == uid);
+}
+
+static int msgindex_row(const struct msgindex *x, const MessageInfo *info)
+{
+	if (! (x && info && info >= x->info && info < x->info + x->rows))
+		return -1;
+	return (int)(info - x->info);
+}
+
+static void msgindex_clear_keywords(struct msgindex *x, unsigned row)
+{
+	if (x->kwwords)
+		memset(x->kw + (size_t)row * x->kwwords, 0, x->kwwords * sizeof(uint64_t));
+}
+
+/* return the row for uid, inserting an empty one if needed */
+static unsigned msgindex_insert(struct msgindex *x, uint64_t uid)
 {
-	if (M->msn) g_tree_destroy(M->msn);
-	M->msn = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,NULL,NULL);
+	unsigned row, tail;
+
+	if (msgindex_find(x, uid, &row))
+		return row;
+
+	msgindex_reserve(x, x->rows + 1);
+
+	if ((tail = x->rows - row)) {
+		memmove(x->uid + row + 1, x->uid + row, tail * sizeof(uint64_t));
+		memmove(x->info + row + 1, x->info + row, tail * sizeof(MessageInfo));
+		if (x->kwwords)
+			memmove(x->kw + (size_t)(row + 1) * x->kwwords,
+					x->kw + (size_t)row * x->kwwords,
+					(size_t)tail * x->kwwords * sizeof(uint64_t));
+	}
+
+	x->uid[row] = uid;
+	memset(&x->info[row], 0, sizeof(MessageInfo));
+	x->info[row].uid = uid;
+	msgindex_clear_keywords(x, row);
+	x->rows++;
 
-	if (M->ids) g_tree_destroy(M->ids);
-	M->ids = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,NULL,(GDestroyNotify)g_free);
+	return row;
 }
 
-static void MessageInfo_free(MessageInfo *m)
+static unsigned msgindex_lookup_keyword(const struct msgindex *x, const char *keyword)
 {
-	g_list_destroy(m->keywords);
-	g_free(m);
+	char *key = g_ascii_strdown(keyword, -1);
+	unsigned bit = GPOINTER_TO_UINT(g_hash_table_lookup(x->kwbit, key));
+	g_free(key);
+	return bit;
 }
 
-static T state_load_messages(T M, Connection_T c)
+static unsigned msgindex_intern(struct msgindex *x, const char *keyword)
 {
-	unsigned nrows = 0, i = 0, j;
-	const char *query_result, *keyword;
+	unsigned bit, i, words;
+	uint64_t *kw;
+
+	if ((bit = msgindex_lookup_keyword(x, keyword)))
+		return bit - 1;
+
+	g_ptr_array_add(x->kwname, g_strdup(keyword));
+	g_hash_table_insert(x->kwbit, g_ascii_strdown(keyword, -1), GUINT_TO_POINTER(x->kwname->len));
+
+	if (x->kwname->len > x->kwwords * 64) {
+		// widen the bitsets by one word
+		words = x->kwwords + 1;
+		kw = g_new0(uint64_t, (size_t)max(x->size, 1) * words);
+		for (i = 0; x->kwwords && i < x->rows; i++)
+			memcpy(kw + (size_t)i * words, x->kw + (size_t)i * x->kwwords,
+					x->kwwords * sizeof(uint64_t));
+		g_free(x->kw);
+		x->kw = kw;
+		x->kwwords = words;
+	}
+
+	return x->kwname->len - 1;
+}
+
+static struct msgindex * msgindex_copy(const struct msgindex *o)
+{
+	unsigned i;
+	struct msgindex *x = msgindex_new();
+
+	// same names in the same order give the same bits
+	for (i = 0; i < o->kwname->len; i++)
+		msgindex_intern(x, g_ptr_array_index(o->kwname, i));
+
+	msgindex_reserve(x, o->rows);
+	if (o->rows) {
+		memcpy(x->uid, o->uid, o->rows * sizeof(uint64_t));
+		memcpy(x->info, o->info, o->rows * sizeof(MessageInfo));
+		if (o->kwwords)
+			memcpy(x->kw, o->kw, (size_t)o->rows * o->kwwords * sizeof(uint64_t));
+	}
+	x->rows = o->rows;
+
+	return x;
+}
+
+/* switch M to index x, taking over the reference */
+static void MailboxState_setIndex(T M, struct msgindex *x)
+{
+	struct msgindex *old = M->index;
+	M->index = x;
+	MailboxState_remap(M);
+	msgindex_unref(old);
+}
+
+/* make sure M is the only user of its index before changing it */
+static struct msgindex * state_own_index(T M)
+{
+	struct msgindex *x;
+
+	if (! M->index) {
+		M->index = msgindex_new();
+		return M->index;
+	}
+	if (g_atomic_int_get(&M->index->refs) == 1)
+		return M->index;
+
+	// rows stay where they are, so the view remains valid
+	x = msgindex_copy(M->index);
+	msgindex_unref(M->index);
+	M->index = x;
+
+	return x;
+}
+
+static void state_view_reserve(T M, unsigned rows)
+{
+	unsigned size;
+
+	if (rows <= M->vsize) return;
+
+	size = max(max(rows, M->vsize * 2), 64);
+	M->msn = g_renew(uint64_t, M->msn, size);
+	M->row = g_renew(unsigned, M->row, size);
+	M->vsize = size;
+}
+
+/*
+ * load the message list for M
+ *
+ * if a previous state O is given, its index is copied and only the
+ * rows changed since O was loaded are read and merged. The boundary
+ * seq itself is included, since STORE bumps the mailbox seq before it
+ * stamps the messages.
+ */
+static T state_load_messages(T M, Connection_T c, T O)
+{
+	unsigned nrows = 0, i = 0, j, row, bit;
+	const char *keyword;
 	MessageInfo *result;
-	GTree *msginfo;
-	uint64_t *uid, id = 0;
+	struct msgindex *x;
+	uint64_t id = 0, since = 0;
 	ResultSet_T r;
 	PreparedStatement_T stmt;
 	Field_T frag;
 	INIT_QUERY;
 
+	if (O && O->index)
+		since = O->seq;
+
 	date2char_str("internal_date", &frag);
 	snprintf(query, DEF_QUERYSIZE-1,
 			"SELECT seen_flag, answered_flag, deleted_flag, flagged_flag, "
 			"draft_flag, recent_flag, %s, rfcsize, seq, message_idnr, status FROM %smessages m "
 			"LEFT JOIN %sphysmessage p ON p.id = m.physmessage_id "
-			"WHERE m.mailbox_idnr = ? AND m.status IN (%d,%d,%d) ORDER BY message_idnr ASC",
-			frag, DBPFX, DBPFX, MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN, MESSAGE_STATUS_DELETE);
+			"WHERE m.mailbox_idnr = ? AND m.status IN (%d,%d,%d) %s ORDER BY message_idnr ASC",
+			frag, DBPFX, DBPFX, MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN, MESSAGE_STATUS_DELETE,
+			since ? "AND m.seq >= ?" : "");
 
-	msginfo = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL,(GDestroyNotify)g_free,(GDestroyNotify)MessageInfo_free);
+	if (since)
+		x = msgindex_copy(O->index);
+	else
+		x = msgindex_new();
 
 	stmt = db_stmt_prepare(c, query);
 	db_stmt_set_u64(stmt, 1, M->id);
+	if (since)
+		db_stmt_set_u64(stmt, 2, since);
 	r = db_stmt_query(stmt);
 
 	i = 0;
@@ -114,26 +367,21 @@ static T state_load_messages(T M, Connection_T c)
 
 		id = db_result_get_u64(r, IMAP_NFLAGS + 3);
 
-		uid = g_new0(uint64_t,1); *uid = id;
+		// rows arrive in uid order, so this mostly appends
+		row = msgindex_insert(x, id);
+		msgindex_clear_keywords(x, row);
 
-		result = g_new0(MessageInfo,1);
+		result = &x->info[row];
 
 		/* id */
 		result->uid = id;
 
-		/* mailbox_id */
-		result->mailbox_id = M->id;
-
 		/* flags */
 		for (j = 0; j < IMAP_NFLAGS; j++)
 			result->flags[j] = db_result_get_bool(r,j);
 
 		/* internal date */
-		query_result = db_result_get(r,IMAP_NFLAGS);
-		strncpy(result->internaldate,
-				(query_result) ? query_result :
-				"01-Jan-1970 00:00:01 +0100",
-				IMAP_INTERNALDATE_LEN-1);
+		result->internaldate = date_sql2epoch(db_result_get(r,IMAP_NFLAGS));
 
 		/* rfcsize */
 		result->rfcsize = db_result_get_u64(r,IMAP_NFLAGS + 1);
@@ -141,13 +389,14 @@ static T state_load_messages(T M, Connection_T c)
 		result->seq = db_result_get_u64(r,IMAP_NFLAGS + 2);
 		/* status */
 		result->status = db_result_get_int(r, IMAP_NFLAGS + 4);
-
-		g_tree_insert(msginfo, uid, result); 
-
 	}
 
-	if (! i) { // empty mailbox
-		MailboxState_setMsginfo(M, msginfo);
+	if (since)
+		TRACE(TRACE_DEBUG, "[%" PRIu64 "] [%u] rows changed since seq [%" PRIu64 "]",
+				M->id, i, since);
+
+	if (! i) { // empty mailbox or nothing changed
+		MailboxState_setIndex(M, x);
 		return M;
 	}
 
@@ -158,25 +407,30 @@ static T state_load_messages(T M, Connection_T c)
 		"SELECT k.message_idnr, keyword FROM %skeywords k "
 		"LEFT JOIN %smessages m ON k.message_idnr=m.message_idnr "
 		"LEFT JOIN %smailboxes b ON m.mailbox_idnr=b.mailbox_idnr "
-		"WHERE b.mailbox_idnr = ? AND m.status IN (%d,%d)",
+		"WHERE b.mailbox_idnr = ? AND m.status IN (%d,%d) %s",
 		DBPFX, DBPFX, DBPFX,
-		MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN);
+		MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN,
+		since ? "AND m.seq >= ?" : "");
 
 	nrows = 0;
 	stmt = db_stmt_prepare(c, query);
 	db_stmt_set_u64(stmt, 1, M->id);
+	if (since)
+		db_stmt_set_u64(stmt, 2, since);
 	r = db_stmt_query(stmt);
 
 	while (db_result_next(r)) {
 		nrows++;
 		id = db_result_get_u64(r,0);
 		keyword = db_result_get(r,1);
-		if ((result = g_tree_lookup(msginfo, &id)) != NULL)
-			result->keywords = g_list_append(result->keywords, g_strdup(keyword));
+		if (keyword && msgindex_find(x, id, &row)) {
+			bit = msgindex_intern(x, keyword);
+			KW_WORD(x, row, bit) |= KW_MASK(bit);
+		}
 	}
 	if (! nrows) TRACE(TRACE_DEBUG, "no keywords");
 
-	MailboxState_setMsginfo(M, msginfo);
+	MailboxState_setIndex(M, x);
 
 	return M;
 }
@@ -189,6 +443,7 @@ gboolean _compare_data(gconstpointer a, gconstpointer b, gpointer UNUSED data)
 T MailboxState_new(Mempool_T pool, uint64_t id)
 {
 	T M; Connection_T c;
+	struct msgindex *x;
 	volatile int t = DM_SUCCESS;
 	gboolean freepool = FALSE;
 
@@ -211,7 +466,12 @@ T MailboxState_new(Mempool_T pool, uint64_t id)
 	TRY
 		db_begin_transaction(c); // we need read-committed isolation
 		state_load_metadata(M, c);
-		state_load_messages(M, c);
+		if ((x = state_cache_get(M->id, M->seq))) {
+			MailboxState_setIndex(M, x);
+		} else {
+			state_load_messages(M, c, NULL);
+			state_cache_put(M->id, M->seq, M->index);
+		}
 	CATCH(SQLException)
 		LOG_SQLERROR;
 		t = DM_EQUERY;
@@ -228,69 +488,145 @@ T MailboxState_new(Mempool_T pool, uint64_t id)
 	return M;
 }
 
-void MailboxState_remap(T M)
+T MailboxState_update(Mempool_T pool, T O)
 {
-	GList *ids = NULL;
-	uint64_t *uid, *msn = NULL, rows = 1;
-	MessageInfo *msginfo;
+	T M; Connection_T c;
+	struct msgindex *x;
+	volatile int t = DM_SUCCESS;
+	gboolean freepool = FALSE;
 
-	MailboxState_uid_msn_new(M);
+	if (! (O->seq && O->index))
+		return MailboxState_new(pool, O->id);
 
-	ids = g_tree_keys(M->msginfo);
-	ids = g_list_first(ids);
-	while (ids) {
-		uid = (uint64_t *)ids->data;
+	if (! pool) {
+		pool = mempool_open();
+		freepool = TRUE;
+	}
 
-		msginfo = g_tree_lookup(M->msginfo, uid);
-		if (msginfo->status < MESSAGE_STATUS_DELETE) {
-			msn = g_new0(uint64_t,1);
-			*msn = msginfo->msn = rows++;
+	M = mempool_pop(pool, sizeof(*M));
+	M->pool = pool;
+	M->freepool = freepool;
+	M->id = O->id;
+	M->recent_queue = g_tree_new((GCompareFunc)ucmp);
+	M->keywords     = g_tree_new_full((GCompareDataFunc)_compare_data,NULL,g_free,NULL);
 
-			g_tree_insert(M->ids, uid, msn);
-			g_tree_insert(M->msn, msn, uid);
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c); // we need read-committed isolation
+		state_load_metadata(M, c);
+		if ((x = state_cache_get(M->id, M->seq))) {
+			// another session already loaded this seq
+			MailboxState_setIndex(M, x);
+		} else {
+			state_load_messages(M, c, O);
+			/* 
+			 * expunges and moves into the mailbox stamp the rows they
+			 * touch. Rows that leave it (moves out, deletes from outside
+			 * IMAP) cannot be seen by the delta, so verify against the
+			 * counters and fall back to a full load if anything is left.
+			 */
+			if (M->ids != M->exists) {
+				TRACE(TRACE_DEBUG, "[%" PRIu64 "] delta mismatch [%u] != [%u], reloading",
+						M->id, M->ids, M->exists);
+				state_load_messages(M, c, NULL);
+			}
+			state_cache_put(M->id, M->seq, M->index);
 		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_commit_transaction(c);
+		db_con_close(c);
+	END_TRY;
 
-		if (! g_list_next(ids)) break;
-		ids = g_list_next(ids);
+	if (t == DM_EQUERY) {
+		TRACE(TRACE_ERR, "Error updating mailbox");
+		MailboxState_free(&M);
+		M = NULL;
+	} else {
+		M->sortkeys = O->sortkeys;
+		O->sortkeys = NULL;
 	}
 
-	g_list_free(g_list_first(ids));
-}
-	
-GTree * MailboxState_getMsginfo(T M)
-{
-	return M->msginfo;
+	return M;
 }
 
-static void MailboxState_setMsginfo(T M, GTree *msginfo)
+void MailboxState_remap(T M)
 {
-	GTree *oldmsginfo = M->msginfo;
-	M->msginfo = msginfo;
-	MailboxState_remap(M);
-	if (oldmsginfo) g_tree_destroy(oldmsginfo);
+	unsigned i;
+	struct msgindex *x = M->index;
+
+	if (! x) return;
+
+	state_view_reserve(M, x->rows);
+
+	M->ids = 0;
+	for (i = 0; i < x->rows; i++) {
+		if ((x->info[i].status < MESSAGE_STATUS_DELETE) && \
+				! (M->expunged && g_tree_lookup(M->expunged, &x->uid[i]))) {
+			M->row[M->ids++] = i;
+			M->msn[i] = M->ids;
+		} else {
+			M->msn[i] = 0;
+		}
+	}
 }
 
-void MailboxState_addMsginfo(T M, uint64_t uid, MessageInfo *msginfo)
+void MailboxState_addMessage(T M, const MessageInfo *msginfo, GList *keywords)
 {
-	uint64_t *id = g_new0(uint64_t,1);
-	*id = uid;
-	g_tree_insert(M->msginfo, id, msginfo); 
-	if (msginfo->flags[IMAP_FLAG_RECENT] == 1) {
+	unsigned rows, row, bit;
+	MessageInfo *info;
+	struct msgindex *x;
+
+	x = state_own_index(M);
+	rows = x->rows;
+
+	row = msgindex_insert(x, msginfo->uid);
+	info = &x->info[row];
+	memcpy(info, msginfo, sizeof(MessageInfo));
+
+	msgindex_clear_keywords(x, row);
+	keywords = g_list_first(keywords);
+	while (keywords) {
+		bit = msgindex_intern(x, (const char *)keywords->data);
+		KW_WORD(x, row, bit) |= KW_MASK(bit);
+		if (! g_list_next(keywords)) break;
+		keywords = g_list_next(keywords);
+	}
+
+	if ((row == rows) && (x->rows == rows + 1) && (info->status < MESSAGE_STATUS_DELETE)) {
+		// appended: no need to renumber
+		state_view_reserve(M, x->rows);
+		M->row[M->ids++] = row;
+		M->msn[row] = M->ids;
+	} else {
+		MailboxState_remap(M);
+	}
+
+	if (info->flags[IMAP_FLAG_RECENT] == 1) {
 		M->seq--; // force resync
 		M->recent++;
+		if (M->recent_queue && MailboxState_getPermission(M) == IMAPPERM_READWRITE)
+			mailbox_build_recent(&x->uid[row], info, M);
 	}
-	MailboxState_build_recent(M);
-	MailboxState_remap(M);
 }
 
 int MailboxState_removeUid(T M, uint64_t uid)
 {
-	MessageInfo *msginfo = g_tree_lookup(M->msginfo, &uid);
-	if (! msginfo) {
+	uint64_t *copy;
+
+	if (! MailboxState_getMsn(M, uid)) {
 		TRACE(TRACE_WARNING,"trying to remove unknown UID [%" PRIu64 "]", uid);
 		return DM_EGENERAL;
 	}
-	msginfo->status = MESSAGE_STATUS_DELETE;
+
+	// keep the expunge in this state's view, the index may be shared
+	if (! M->expunged)
+		M->expunged = g_tree_new((GCompareFunc)ucmp);
+	copy = mempool_pop(M->pool, sizeof(uint64_t));
+	*copy = uid;
+	g_tree_insert(M->expunged, copy, copy);
 	M->exists--;
 
 	MailboxState_remap(M);
@@ -298,14 +634,559 @@ int MailboxState_removeUid(T M, uint64_t uid)
 	return DM_SUCCESS;
 }
 
-GTree * MailboxState_getIds(T M)
+MessageInfo * MailboxState_getMessage(T M, uint64_t uid)
+{
+	unsigned row;
+	if (M->index && msgindex_find(M->index, uid, &row))
+		return &M->index->info[row];
+	return NULL;
+}
+
+MessageInfo * MailboxState_editMessage(T M, uint64_t uid)
+{
+	if (! MailboxState_getMessage(M, uid))
+		return NULL;
+	state_own_index(M);
+	return MailboxState_getMessage(M, uid);
+}
+
+uint64_t * MailboxState_getMsn(T M, uint64_t uid)
+{
+	unsigned row;
+	if (M->index && msgindex_find(M->index, uid, &row) && M->msn[row])
+		return &M->msn[row];
+	return NULL;
+}
+
+uint64_t * MailboxState_getUid(T M, uint64_t msn)
+{
+	struct msgindex *x = M->index;
+	if (! (x && msn && msn <= M->ids))
+		return NULL;
+	return &x->uid[M->row[msn - 1]];
+}
+
+unsigned MailboxState_getIdCount(T M)
+{
+	return M->index ? M->ids : 0;
+}
+
+GList * MailboxState_getUids(T M)
+{
+	GList *ids = NULL;
+	unsigned i;
+	struct msgindex *x = M->index;
+
+	if (! x) return NULL;
+
+	for (i = M->ids; i > 0; i--)
+		ids = g_list_prepend(ids, &x->uid[M->row[i - 1]]);
+
+	return ids;
+}
+
+void MailboxState_foreach_id(T M, GTraverseFunc func, gpointer data)
+{
+	unsigned i, row;
+	struct msgindex *x = M->index;
+
+	if (! x) return;
+
+	for (i = 0; i < M->ids; i++) {
+		row = M->row[i];
+		if (func(&x->uid[row], &M->msn[row], data))
+			break;
+	}
+}
+
+void MailboxState_foreach_message(T M, GTraverseFunc func, gpointer data)
+{
+	unsigned i;
+	struct msgindex *x = M->index;
+
+	if (! x) return;
+
+	for (i = 0; i < x->rows; i++) {
+		if (func(&x->uid[i], &x->info[i], data))
+			break;
+	}
+}
+
+gboolean MailboxState_messageHasKeyword(T M, const MessageInfo *msginfo, const char *keyword)
 {
-	return M->ids;
+	int row;
+	unsigned bit;
+	struct msgindex *x = M->index;
+
+	if ((row = msgindex_row(x, msginfo)) < 0)
+		return FALSE;
+	if (! (bit = msgindex_lookup_keyword(x, keyword)))
+		return FALSE;
+	bit--;
+
+	return (KW_WORD(x, row, bit) & KW_MASK(bit)) ? TRUE : FALSE;
 }
 
-GTree * MailboxState_getMsn(T M)
+/*
+ * in-memory search
+ *
+ * keys that only look at message metadata are answered from the index
+ * by scanning this state's view in msn order, one column at a time.
+ */
+
+/* flags as seen by this state, like MailboxState_message_flags */
+static int state_flagbits(T M, unsigned row, int mask)
 {
-	return M->msn;
+	const MessageInfo *info = &M->index->info[row];
+	int j, bits = 0;
+
+	for (j = 0; j < IMAP_NFLAGS; j++) {
+		if (info->flags[j])
+			bits |= (1 << j);
+	}
+	if (mask & (1 << IMAP_FLAG_RECENT)) {
+		if (M->recent_cleared)
+			bits &= ~(1 << IMAP_FLAG_RECENT);
+		if (g_tree_lookup(M->recent_queue, &M->index->uid[row]))
+			bits |= (1 << IMAP_FLAG_RECENT);
+	}
+	return bits;
+}
+
+static void state_search_add(GTree *found, uint64_t uid, uint64_t msn)
+{
+	uint64_t *k = mempool_pop(small_pool, sizeof(uint64_t));
+	uint64_t *v = mempool_pop(small_pool, sizeof(uint64_t));
+	*k = uid;
+	*v = msn;
+	g_tree_insert(found, k, v);
+}
+
+#define STATE_SCAN(M, cond) \
+	for (i = 0; i < (M)->ids; i++) { \
+		row = (M)->row[i]; \
+		if (cond) \
+			state_search_add(found, x->uid[row], (M)->msn[row]); \
+	}
+
+GTree * MailboxState_search(T M, const search_key *s)
+{
+	GTree *found;
+	struct msgindex *x = M->index;
+	unsigned i, row, bit = 0;
+
+	switch (s->type) {
+		case IST_FLAG:
+		case IST_SIZE_LARGER:
+		case IST_SIZE_SMALLER:
+		case IST_IDATE:
+		case IST_KEYWORD:
+		case IST_UNKEYWORD:
+			break;
+		default:
+			return NULL;
+	}
+
+	found = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL, (GDestroyNotify)uint64_free, (GDestroyNotify)uint64_free);
+	if (! x)
+		return found;
+
+	switch (s->type) {
+		case IST_FLAG:
+			STATE_SCAN(M, (state_flagbits(M, row, s->flags_mask) & s->flags_mask) == s->flags_set);
+			break;
+		case IST_SIZE_LARGER:
+			STATE_SCAN(M, x->info[row].rfcsize > s->size);
+			break;
+		case IST_SIZE_SMALLER:
+			STATE_SCAN(M, x->info[row].rfcsize < s->size);
+			break;
+		case IST_IDATE:
+			STATE_SCAN(M, ((! s->since) || (x->info[row].internaldate >= s->since)) &&
+					((! s->before) || (x->info[row].internaldate < s->before)));
+			break;
+		case IST_KEYWORD:
+			if ((bit = msgindex_lookup_keyword(x, s->search))) {
+				bit--;
+				STATE_SCAN(M, KW_WORD(x, row, bit) & KW_MASK(bit));
+			}
+			break;
+		case IST_UNKEYWORD:
+			if ((bit = msgindex_lookup_keyword(x, s->search))) {
+				bit--;
+				STATE_SCAN(M, ! (KW_WORD(x, row, bit) & KW_MASK(bit)));
+			} else {
+				STATE_SCAN(M, TRUE);
+			}
+			break;
+	}
+
+	TRACE(TRACE_DEBUG, "type [%d] found [%d] of [%u]", s->type, g_tree_nnodes(found), M->ids);
+
+	return found;
+}
+
+#undef STATE_SCAN
+
+/*
+ * sort keys
+ *
+ * the sort key table rows of the messages in a mailbox, loaded the
+ * first time a session sorts it and kept with the state, so a SORT
+ * with other criteria is answered without a query. Strings are interned
+ * once per state and compared by rank, which is their byte order.
+ * Sort keys never change once stored, so a state updated from another
+ * takes over its keys and only reads those of new messages.
+ */
+struct sortkeys {
+	unsigned rows;
+	unsigned size;
+	uint64_t *uid;		// sorted
+	uint32_t *str;		// SORTKEY_STRINGS string ids per row
+	time_t *sentdate;
+	uint64_t loaded;	// highest uid read from the database
+	GStringChunk *chunk;
+	GHashTable *strings;	// string -> id+1
+	GPtrArray *strv;	// id -> string
+	uint32_t *rank;		// by string id
+	unsigned ranked;	// strings in rank
+};
+
+static struct sortkeys * sortkeys_new(void)
+{
+	struct sortkeys *k = g_new0(struct sortkeys, 1);
+	k->chunk = g_string_chunk_new(4096);
+	k->strings = g_hash_table_new(g_str_hash, g_str_equal);
+	k->strv = g_ptr_array_new();
+	return k;
+}
+
+static void sortkeys_free(struct sortkeys *k)
+{
+	if (! k) return;
+	g_string_chunk_free(k->chunk);
+	g_hash_table_destroy(k->strings);
+	g_ptr_array_free(k->strv, TRUE);
+	g_free(k->uid);
+	g_free(k->str);
+	g_free(k->sentdate);
+	g_free(k->rank);
+	g_free(k);
+}
+
+static uint32_t sortkeys_intern(struct sortkeys *k, const char *s)
+{
+	gpointer id;
+	char *v;
+
+	if (! s) s = "";
+	if ((id = g_hash_table_lookup(k->strings, s)))
+		return GPOINTER_TO_UINT(id) - 1;
+
+	v = g_string_chunk_insert(k->chunk, s);
+	g_ptr_array_add(k->strv, v);
+	g_hash_table_insert(k->strings, v, GUINT_TO_POINTER(k->strv->len));
+
+	return k->strv->len - 1;
+}
+
+static gint _sortkeys_strcmp(gconstpointer a, gconstpointer b, gpointer data)
+{
+	GPtrArray *strv = (GPtrArray *)data;
+	return strcmp(g_ptr_array_index(strv, *(const uint32_t *)a),
+			g_ptr_array_index(strv, *(const uint32_t *)b));
+}
+
+/* order the strings interned since the last sort */
+static void sortkeys_rank(struct sortkeys *k)
+{
+	uint32_t i, *order;
+
+	if (k->ranked == k->strv->len)
+		return;
+
+	order = g_new(uint32_t, k->strv->len);
+	for (i = 0; i < k->strv->len; i++)
+		order[i] = i;
+	g_qsort_with_data(order, k->strv->len, sizeof(uint32_t), _sortkeys_strcmp, k->strv);
+
+	k->rank = g_renew(uint32_t, k->rank, k->strv->len);
+	for (i = 0; i < k->strv->len; i++)
+		k->rank[order[i]] = i;
+	k->ranked = k->strv->len;
+
+	g_free(order);
+}
+
+static gboolean sortkeys_find(const struct sortkeys *k, uint64_t uid, unsigned *row)
+{
+	unsigned lo = 0, hi = k->rows, mid;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) >> 1);
+		if (k->uid[mid] < uid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*row = lo;
+
+	return (lo < k->rows && k->uid[lo] == uid);
+}
+
+void MailboxState_setSortkeys(T M, uint64_t uid, const char **keys, time_t sentdate)
+{
+	struct sortkeys *k;
+	unsigned row, j, size;
+
+	if (! M->sortkeys)
+		M->sortkeys = sortkeys_new();
+	k = M->sortkeys;
+
+	if (! sortkeys_find(k, uid, &row)) {
+		if (k->rows == k->size) {
+			size = max(k->size * 2, 64);
+			k->uid = g_renew(uint64_t, k->uid, size);
+			k->str = g_renew(uint32_t, k->str, (size_t)size * SORTKEY_STRINGS);
+			k->sentdate = g_renew(time_t, k->sentdate, size);
+			k->size = size;
+		}
+		if (row < k->rows) {
+			memmove(k->uid + row + 1, k->uid + row, (k->rows - row) * sizeof(uint64_t));
+			memmove(k->str + (size_t)(row + 1) * SORTKEY_STRINGS, k->str + (size_t)row * SORTKEY_STRINGS,
+					(size_t)(k->rows - row) * SORTKEY_STRINGS * sizeof(uint32_t));
+			memmove(k->sentdate + row + 1, k->sentdate + row, (k->rows - row) * sizeof(time_t));
+		}
+		k->rows++;
+		k->uid[row] = uid;
+	}
+
+	for (j = 0; j < SORTKEY_STRINGS; j++)
+		k->str[(size_t)row * SORTKEY_STRINGS + j] = sortkeys_intern(k, keys[j]);
+	k->sentdate[row] = sentdate;
+}
+
+/*
+ * read the sort keys of the messages added since the last load
+ * \return DM_EGENERAL if a message has no sort keys yet
+ */
+static int sortkeys_load(T M)
+{
+	Connection_T c; ResultSet_T r; PreparedStatement_T stmt;
+	const char *keys[SORTKEY_STRINGS];
+	volatile int t = DM_SUCCESS;
+	volatile unsigned n = 0;
+	uint64_t uid;
+	Field_T frag;
+	INIT_QUERY;
+
+	if (M->sortkeys && M->uidnext && (M->sortkeys->loaded >= M->uidnext - 1))
+		return DM_SUCCESS;
+
+	date2char_str("k.sentdate", &frag);
+	snprintf(query, DEF_QUERYSIZE-1,
+			"SELECT m.message_idnr, k.physmessage_id, k.subject, k.fromaddr, k.fromname, "
+			"k.toaddr, k.ccaddr, %s FROM %smessages m "
+			"LEFT JOIN %ssortkeys k ON m.physmessage_id=k.physmessage_id "
+			"WHERE m.mailbox_idnr = ? AND m.status IN (%d,%d) AND m.message_idnr > ? "
+			"ORDER BY m.message_idnr", frag, DBPFX, DBPFX,
+			MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN);
+
+	if (! M->sortkeys)
+		M->sortkeys = sortkeys_new();
+
+	c = db_con_get();
+	TRY
+		stmt = db_stmt_prepare(c, query);
+		db_stmt_set_u64(stmt, 1, M->id);
+		db_stmt_set_u64(stmt, 2, M->sortkeys->loaded);
+		r = db_stmt_query(stmt);
+		while (db_result_next(r)) {
+			uid = db_result_get_u64(r, 0);
+			if (! db_result_get_u64(r, 1)) {
+				t = DM_EGENERAL;
+				break;
+			}
+			keys[SORTKEY_SUBJECT] = db_result_get(r, 2);
+			keys[SORTKEY_FROM] = db_result_get(r, 3);
+			keys[SORTKEY_DISPLAY] = db_result_get(r, 4);
+			keys[SORTKEY_TO] = db_result_get(r, 5);
+			keys[SORTKEY_CC] = db_result_get(r, 6);
+			MailboxState_setSortkeys(M, uid, keys, date_sql2epoch(db_result_get(r, 7)));
+			M->sortkeys->loaded = uid;
+			n++;
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	TRACE(TRACE_DEBUG, "[%" PRIu64 "] loaded [%u] sort keys, [%u] cached",
+			M->id, n, M->sortkeys->rows);
+
+	return t;
+}
+
+struct sortrow {
+	uint64_t uid;
+	unsigned key;		// row in the sort keys
+	const MessageInfo *info;
+};
+
+struct sortctx {
+	const struct sortkeys *k;
+	const int *criteria;
+};
+
+#define SORT_CMP(a, b) (((a) > (b)) - ((a) < (b)))
+
+static gint _sortrow_cmp(gconstpointer pa, gconstpointer pb, gpointer data)
+{
+	const struct sortrow *a = pa, *b = pb;
+	const struct sortctx *ctx = data;
+	const struct sortkeys *k = ctx->k;
+	const int *c;
+	int col, r;
+
+	for (c = ctx->criteria; *c; c++) {
+		switch (abs(*c)) {
+			case SORT_ARRIVAL:
+				r = SORT_CMP(a->info->internaldate, b->info->internaldate);
+				break;
+			case SORT_SIZE:
+				r = SORT_CMP(a->info->rfcsize, b->info->rfcsize);
+				break;
+			case SORT_DATE:
+				r = SORT_CMP(k->sentdate[a->key], k->sentdate[b->key]);
+				break;
+			default:
+				switch (abs(*c)) {
+					case SORT_SUBJECT: col = SORTKEY_SUBJECT; break;
+					case SORT_FROM: col = SORTKEY_FROM; break;
+					case SORT_DISPLAY: col = SORTKEY_DISPLAY; break;
+					case SORT_TO: col = SORTKEY_TO; break;
+					default: col = SORTKEY_CC; break;
+				}
+				r = SORT_CMP(k->rank[k->str[(size_t)a->key * SORTKEY_STRINGS + col]],
+						k->rank[k->str[(size_t)b->key * SORTKEY_STRINGS + col]]);
+				break;
+		}
+		if (r)
+			return (*c < 0) ? -r : r;
+	}
+
+	return SORT_CMP(a->uid, b->uid);
+}
+
+#undef SORT_CMP
+
+struct sortfill {
+	T M;
+	struct sortrow *rows;
+	unsigned n;
+	gboolean missing;
+};
+
+static gboolean _sort_fill(uint64_t *uid, gpointer UNUSED msn, struct sortfill *f)
+{
+	struct sortrow *s = &f->rows[f->n];
+	unsigned row;
+
+	if (! (f->M->sortkeys && sortkeys_find(f->M->sortkeys, *uid, &s->key))) {
+		f->missing = TRUE;
+		return TRUE;
+	}
+	if (! msgindex_find(f->M->index, *uid, &row)) {
+		f->missing = TRUE;
+		return TRUE;
+	}
+	s->uid = *uid;
+	s->info = &f->M->index->info[row];
+	f->n++;
+
+	return FALSE;
+}
+
+int MailboxState_sort(T M, GTree *found, const int *criteria, GList **sorted)
+{
+	struct sortfill f;
+	struct sortctx ctx;
+	unsigned i;
+	uint64_t *id;
+	int t;
+
+	*sorted = NULL;
+
+	if (! (found && M->index))
+		return DM_EGENERAL;
+
+	memset(&f, 0, sizeof(f));
+	f.M = M;
+	f.rows = g_new0(struct sortrow, g_tree_nnodes(found) + 1);
+	g_tree_foreach(found, (GTraverseFunc)_sort_fill, &f);
+
+	if (f.missing && M->id) {
+		// new messages, or keys that were missing last time
+		if ((t = sortkeys_load(M)) != DM_SUCCESS) {
+			g_free(f.rows);
+			return t;
+		}
+		f.n = 0;
+		f.missing = FALSE;
+		g_tree_foreach(found, (GTraverseFunc)_sort_fill, &f);
+	}
+	if (f.missing) {
+		g_free(f.rows);
+		return DM_EGENERAL;
+	}
+
+	if (M->sortkeys)
+		sortkeys_rank(M->sortkeys);
+
+	ctx.k = M->sortkeys;
+	ctx.criteria = criteria;
+	g_qsort_with_data(f.rows, f.n, sizeof(struct sortrow), _sortrow_cmp, &ctx);
+
+	for (i = f.n; i > 0; i--) {
+		id = g_new0(uint64_t, 1);
+		*id = f.rows[i-1].uid;
+		*sorted = g_list_prepend(*sorted, id);
+	}
+	g_free(f.rows);
+
+	return DM_SUCCESS;
+}
+
+void MailboxState_setMessageKeywords(T M, MessageInfo *msginfo, GList *keywords, int action)
+{
+	int row;
+	unsigned bit;
+	struct msgindex *x;
+
+	if ((row = msgindex_row(M->index, msginfo)) < 0)
+		return;
+
+	x = state_own_index(M);
+
+	if (action == IMAPFA_REPLACE)
+		msgindex_clear_keywords(x, row);
+
+	keywords = g_list_first(keywords);
+	while (keywords) {
+		if (action == IMAPFA_REMOVE) {
+			if ((bit = msgindex_lookup_keyword(x, (const char *)keywords->data))) {
+				bit--;
+				KW_WORD(x, row, bit) &= ~KW_MASK(bit);
+			}
+		} else {
+			bit = msgindex_intern(x, (const char *)keywords->data);
+			KW_WORD(x, row, bit) |= KW_MASK(bit);
+		}
+		if (! g_list_next(keywords)) break;
+		keywords = g_list_next(keywords);
+	}
 }
 
 void MailboxState_setId(T M, uint64_t id)
@@ -319,23 +1200,15 @@ uint64_t MailboxState_getId(T M)
 
 uint64_t MailboxState_getSeq(T M)
 {
- 	if (! M->seq) {
-		Connection_T c = db_con_get();
-		TRY
-			db_getmailbox_seq(M, c);
-		CATCH(SQLException)
-			LOG_SQLERROR;
-		FINALLY
-			db_con_close(c);
-		END_TRY;
-	}
+ 	if (! M->seq)
+		M->seq = db_mailbox_seq(M->id);
  
 	return M->seq;
 }
 
 unsigned MailboxState_getExists(T M)
 {
-	int real = g_tree_nnodes(M->ids);
+	int real = MailboxState_getIdCount(M);
 	if (real > (int)M->exists) {
 		TRACE(TRACE_DEBUG, "[%" PRIu64 "] exists [%u] -> [%d]",
 				M->id, M->exists, real);
@@ -462,75 +1335,55 @@ unsigned MailboxState_getUnseen(T M)
 	return M->unseen;
 }
 
-struct filter_range_helper {  
-        gboolean uid;   
-        uint64_t min;      
-        uint64_t max;      
-        GTree *a;       
-};                      
-                        
-static int filter_range(gpointer key, gpointer value, gpointer data)
+/* collect uid -> msn for the messages in a uid or msn range */
+static void find_range(T M, uint64_t l, uint64_t r, GTree *a, gboolean uid)
 {                       
-	uint64_t *k, *v;   
-	struct filter_range_helper *d = (struct filter_range_helper *)data;
-
-	if (*(uint64_t *)key < d->min) return FALSE; // skip
-	if (*(uint64_t *)key > d->max) return TRUE; // done
-
-	k = mempool_pop(small_pool, sizeof(uint64_t));
-	v = mempool_pop(small_pool, sizeof(uint64_t));
-
-	*k = *(uint64_t *)key;
-	*v = *(uint64_t *)value;
-
-	if (d->uid)     
-		g_tree_insert(d->a, k, v);
-	else            
-		g_tree_insert(d->a, v, k);
-
-	return FALSE;   
-}                       
-
-static void find_range(GTree *c, uint64_t l, uint64_t r, GTree *a, gboolean uid)
-{                       
-	struct filter_range_helper data;
-
-	data.uid = uid; 
-	data.min = l;   
-	data.max = r;   
-	data.a = a;     
-
-	g_tree_foreach(c, (GTraverseFunc)filter_range, &data);
+	unsigned row;
+	uint64_t i, *k, *v;
+	struct msgindex *x = M->index;
+
+	if (! x) return;
+
+	if (uid) {
+		msgindex_find(x, l, &row);
+		for (; row < x->rows && x->uid[row] <= r; row++) {
+			if (! M->msn[row])
+				continue;
+			k = mempool_pop(small_pool, sizeof(uint64_t));
+			v = mempool_pop(small_pool, sizeof(uint64_t));
+			*k = x->uid[row];
+			*v = M->msn[row];
+			g_tree_insert(a, k, v);
+		}
+	} else {
+		for (i = max(l, 1); i <= r && i <= M->ids; i++) {
+			k = mempool_pop(small_pool, sizeof(uint64_t));
+			v = mempool_pop(small_pool, sizeof(uint64_t));
+			*k = x->uid[M->row[i - 1]];
+			*v = i;
+			g_tree_insert(a, k, v);
+		}
+	}
 }
 
 GTree * MailboxState_get_set(MailboxState_T M, const char *set, gboolean uid)
 {
-	GTree *inset, *a, *b;
+	GTree *a, *b;
 	GList *sets = NULL;
 	GString *t;
 	uint64_t lo = 0, hi = 0;
+	unsigned count = MailboxState_getIdCount(M);
 	gboolean error = FALSE;
 
-	if (uid)
-		inset = MailboxState_getIds(M);
-	else
-		inset = MailboxState_getMsn(M);
-
 	a = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL, (GDestroyNotify)uint64_free, (GDestroyNotify)uint64_free);
 	b = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL, (GDestroyNotify)uint64_free, (GDestroyNotify)uint64_free);
 
 	if (! uid) {
 		lo = 1;
 		hi = MailboxState_getExists(M);
-	} else {
-		GList *ids = g_tree_keys(inset);
-		if (ids) {
-			ids = g_list_last(ids);
-			hi = *((uint64_t *)ids->data);
-			ids = g_list_first(ids);
-			lo = *((uint64_t *)ids->data);
-			g_list_free(g_list_first(ids));
-		}
+	} else if (count) {
+		lo = *MailboxState_getUid(M, 1);
+		hi = *MailboxState_getUid(M, count);
 	}
 
 	t = g_string_new(set);
@@ -545,7 +1398,7 @@ GTree * MailboxState_get_set(MailboxState_T M, const char *set, gboolean uid)
 
 		if (strlen(rest) < 1) break;
 
-		if (g_tree_nnodes(inset) == 0) { // empty box
+		if (count == 0) { // empty box
 			if (rest[0] == '*') {
 				uint64_t *k = mempool_pop(small_pool, sizeof(uint64_t));
 				uint64_t *v = mempool_pop(small_pool, sizeof(uint64_t));
@@ -613,7 +1466,7 @@ GTree * MailboxState_get_set(MailboxState_T M, const char *set, gboolean uid)
 		
 			if (! (l && r)) break;
 
-			find_range(inset, min(l,r), max(l,r), a, uid);
+			find_range(M, min(l,r), max(l,r), a, uid);
 
 			if (g_tree_merge(b,a,IST_SUBSEARCH_OR)) {
 				error = TRUE;
@@ -653,17 +1506,24 @@ void MailboxState_free(T *M)
 	if (s->name) 
 		p_string_free(s->name, TRUE);
 
-	g_tree_destroy(s->keywords);
+	if (s->keywords) g_tree_destroy(s->keywords);
 	s->keywords = NULL;
 
-	if (s->msn) g_tree_destroy(s->msn);
+	msgindex_unref(s->index);
+	s->index = NULL;
+	g_free(s->msn);
+	g_free(s->row);
 	s->msn = NULL;
+	s->row = NULL;
 
-	if (s->ids) g_tree_destroy(s->ids);		
-	s->ids = NULL;
+	sortkeys_free(s->sortkeys);
+	s->sortkeys = NULL;
 
-	if (s->msginfo) g_tree_destroy(s->msginfo);
-	s->msginfo = NULL;
+	if (s->expunged) {
+		g_tree_foreach(s->expunged, (GTraverseFunc)_free_recent_queue, s);
+		g_tree_destroy(s->expunged);
+	}
+	s->expunged = NULL;
 
 	if (s->recent_queue) {
 		g_tree_foreach(s->recent_queue, (GTraverseFunc)_free_recent_queue, s);
@@ -1107,11 +1967,10 @@ static gboolean mailbox_build_recent(uint64_t *uid, MessageInfo *msginfo, T M)
 
 int MailboxState_build_recent(T M)
 {
-        if (MailboxState_getPermission(M) == IMAPPERM_READWRITE && MailboxState_getMsginfo(M)) {
-		GTree *info = MailboxState_getMsginfo(M);
-		g_tree_foreach(info, (GTraverseFunc)mailbox_build_recent, M);
-		TRACE(TRACE_DEBUG, "build list of [%d] [%d] recent messages...", 
-				g_tree_nnodes(info), g_tree_nnodes(M->recent_queue));
+        if (MailboxState_getPermission(M) == IMAPPERM_READWRITE && M->index) {
+		MailboxState_foreach_message(M, (GTraverseFunc)mailbox_build_recent, M);
+		TRACE(TRACE_DEBUG, "build list of [%u] [%d] recent messages...", 
+				M->index->rows, g_tree_nnodes(M->recent_queue));
 	}
 	return 0;
 }
@@ -1181,9 +2040,8 @@ int MailboxState_flush_recent(T M)
 	return 0;
 }
 
-static gboolean mailbox_clear_recent(uint64_t *uid, MessageInfo *msginfo, T M)
+static gboolean mailbox_clear_recent(uint64_t *uid, MessageInfo UNUSED *msginfo, T M)
 {
-	msginfo->flags[IMAP_FLAG_RECENT] = 0;
 	gpointer value;
 	gpointer orig_key;
 	if (g_tree_lookup_extended(M->recent_queue, uid, &orig_key, &value)) {
@@ -1195,9 +2053,10 @@ static gboolean mailbox_clear_recent(uint64_t *uid, MessageInfo *msginfo, T M)
 
 int MailboxState_clear_recent(T M)
 {
-        if (MailboxState_getPermission(M) == IMAPPERM_READWRITE && MailboxState_getMsginfo(M)) {
-		GTree *info = MailboxState_getMsginfo(M);
-		g_tree_foreach(info, (GTraverseFunc)mailbox_clear_recent, M);
+        if (MailboxState_getPermission(M) == IMAPPERM_READWRITE && M->index) {
+		// the stored recent flags belong to the shared index
+		M->recent_cleared = TRUE;
+		MailboxState_foreach_message(M, (GTraverseFunc)mailbox_clear_recent, M);
 	}
 
 	return 0;
@@ -1205,25 +2064,33 @@ int MailboxState_clear_recent(T M)
 
 GList * MailboxState_message_flags(T M, MessageInfo *msginfo)
 {
-	GList *t, *sublist = NULL;
-	int j;
+	GList *sublist = NULL;
+	int j, row;
+	unsigned bit;
+	const char *keyword;
+	struct msgindex *x = M->index;
 	uint64_t uid = msginfo->uid;
 
 	for (j = 0; j < IMAP_NFLAGS; j++) {
+		if ((j == IMAP_FLAG_RECENT) && M->recent_cleared)
+			continue;
 		if (msginfo->flags[j])
 			sublist = g_list_append(sublist,g_strdup((gchar *)imap_flag_desc_escaped[j]));
 	}
-	if ((msginfo->flags[IMAP_FLAG_RECENT] == 0) && g_tree_lookup(M->recent_queue, &uid)) {
+	if ((msginfo->flags[IMAP_FLAG_RECENT] == 0 || M->recent_cleared) && g_tree_lookup(M->recent_queue, &uid)) {
 		TRACE(TRACE_DEBUG,"set \\recent flag");
 		sublist = g_list_append(sublist, g_strdup((gchar *)imap_flag_desc_escaped[IMAP_FLAG_RECENT]));
 	}
 
-	t = g_list_first(msginfo->keywords);
-	while (t) {
-		if (MailboxState_hasKeyword(M, t->data))
-			sublist = g_list_append(sublist, g_strdup((gchar *)t->data));
-		if (! g_list_next(t)) break;
-		t = g_list_next(t);
+	if ((row = msgindex_row(x, msginfo)) < 0)
+		return sublist;
+
+	for (bit = 0; bit < x->kwname->len; bit++) {
+		if (! (KW_WORD(x, row, bit) & KW_MASK(bit)))
+			continue;
+		keyword = (const char *)g_ptr_array_index(x->kwname, bit);
+		if (MailboxState_hasKeyword(M, keyword))
+			sublist = g_list_append(sublist, g_strdup(keyword));
 	}
 	
 	return sublist;
@@ -1239,3 +2106,180 @@ int MailboxState_merge_recent(T M, T N)
 	M->recent = g_tree_nnodes(M->recent_queue);
 	return 0;
 }
+
+/*
+ * state cache
+ *
+ * holds a reference to the latest index loaded for each mailbox, so
+ * sessions that have the same mailbox selected load its messages once
+ * per change instead of once per session. Entries are dropped least
+ * recently used first once state_cache_size (in the IMAP section, in
+ * kilobytes) is exceeded. States keep their own reference, so an evicted
+ * index lives on until the last state using it lets go.
+ */
+struct snapshot {
+	uint64_t id;
+	uint64_t seq;
+	uint64_t used;
+	size_t bytes;
+	struct msgindex *index;
+};
+
+static struct {
+	GTree *entries;		// mailbox_idnr -> snapshot
+	uint64_t tick;
+	struct state_cache_stats stats;
+} state_cache;
+
+G_LOCK_DEFINE_STATIC(state_cache);
+
+static void snapshot_free(struct snapshot *s)
+{
+	state_cache.stats.bytes -= s->bytes;
+	msgindex_unref(s->index);
+	g_free(s);
+}
+
+/* call with the lock held */
+static void state_cache_init(void)
+{
+	Field_T val;
+
+	if (state_cache.entries)
+		return;
+
+	state_cache.entries = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL,
+			NULL, (GDestroyNotify)snapshot_free);
+
+	config_get_value("state_cache_size", "IMAP", val);
+	if (strlen(val))
+		state_cache.stats.limit = (size_t)strtoull(val, NULL, 10) * 1024;
+	else
+		state_cache.stats.limit = 64 * 1024 * 1024;
+}
+
+static gboolean _find_lru(uint64_t UNUSED *id, struct snapshot *s, struct snapshot **lru)
+{
+	if (! *lru || s->used < (*lru)->used)
+		*lru = s;
+	return FALSE;
+}
+
+/* call with the lock held */
+static void state_cache_evict(void)
+{
+	struct snapshot *lru;
+	unsigned evicted = 0;
+
+	while (state_cache.stats.bytes > state_cache.stats.limit) {
+		lru = NULL;
+		g_tree_foreach(state_cache.entries, (GTraverseFunc)_find_lru, &lru);
+		if (! lru)
+			break;
+		g_tree_remove(state_cache.entries, &lru->id);
+		evicted++;
+	}
+
+	if (evicted) {
+		state_cache.stats.evictions += evicted;
+		TRACE(TRACE_INFO, "evicted [%u] states: entries [%d] bytes [%zu/%zu] "
+				"hits [%" PRIu64 "] misses [%" PRIu64 "] evictions [%" PRIu64 "]",
+				evicted, g_tree_nnodes(state_cache.entries),
+				state_cache.stats.bytes, state_cache.stats.limit,
+				state_cache.stats.hits, state_cache.stats.misses,
+				state_cache.stats.evictions);
+	}
+}
+
+static struct msgindex * state_cache_get(uint64_t id, uint64_t seq)
+{
+	struct snapshot *s;
+	struct msgindex *x = NULL;
+
+	G_LOCK(state_cache);
+	state_cache_init();
+	if (state_cache.stats.limit) {
+		if ((s = g_tree_lookup(state_cache.entries, &id)) && (s->seq == seq)) {
+			s->used = ++state_cache.tick;
+			x = msgindex_ref(s->index);
+			state_cache.stats.hits++;
+		} else {
+			state_cache.stats.misses++;
+		}
+	}
+	G_UNLOCK(state_cache);
+
+	if (x)
+		TRACE(TRACE_DEBUG, "[%" PRIu64 "] shared state for seq [%" PRIu64 "]", id, seq);
+
+	return x;
+}
+
+static void state_cache_put(uint64_t id, uint64_t seq, struct msgindex *x)
+{
+	struct snapshot *s;
+	size_t bytes;
+
+	if (! (id && seq && x))
+		return;
+
+	bytes = msgindex_bytes(x);
+
+	G_LOCK(state_cache);
+	state_cache_init();
+	if (bytes > state_cache.stats.limit) {
+		G_UNLOCK(state_cache);
+		return;
+	}
+
+	if ((s = g_tree_lookup(state_cache.entries, &id))) {
+		if (s->seq >= seq) { // keep the newest
+			G_UNLOCK(state_cache);
+			return;
+		}
+		g_tree_remove(state_cache.entries, &id);
+	}
+
+	s = g_new0(struct snapshot, 1);
+	s->id = id;
+	s->seq = seq;
+	s->bytes = bytes;
+	s->used = ++state_cache.tick;
+	s->index = msgindex_ref(x);
+	g_tree_insert(state_cache.entries, &s->id, s);
+
+	state_cache.stats.bytes += bytes;
+	state_cache.stats.stores++;
+
+	state_cache_evict();
+	G_UNLOCK(state_cache);
+}
+
+void MailboxState_cache_stats(struct state_cache_stats *stats)
+{
+	G_LOCK(state_cache);
+	state_cache_init();
+	*stats = state_cache.stats;
+	stats->entries = g_tree_nnodes(state_cache.entries);
+	G_UNLOCK(state_cache);
+}
+
+void MailboxState_cache_setLimit(size_t limit)
+{
+	G_LOCK(state_cache);
+	state_cache_init();
+	state_cache.stats.limit = limit;
+	state_cache_evict();
+	G_UNLOCK(state_cache);
+}
+
+void MailboxState_cache_flush(void)
+{
+	G_LOCK(state_cache);
+	if (state_cache.entries) {
+		g_tree_destroy(state_cache.entries);
+		state_cache.entries = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL,
+				NULL, (GDestroyNotify)snapshot_free);
+	}
+	G_UNLOCK(state_cache);
+}
@@ -27,7 +27,22 @@
 
 typedef struct T *T;
 
+struct state_cache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t stores;
+	uint64_t evictions;
+	unsigned entries;
+	size_t bytes;
+	size_t limit;
+};
+
 extern T            MailboxState_new(Mempool_T pool, uint64_t id);
+/**
+ * \brief create a fresh state from a previous one, reading only
+ * the messages changed since it was loaded
+ */
+extern T            MailboxState_update(Mempool_T pool, T);
 
 extern int          MailboxState_info(T);
 extern int          MailboxState_count(T);
@@ -38,10 +53,54 @@ extern int          MailboxState_clear_recent(T);
 extern int          MailboxState_merge_recent(T, T);
 
 extern int          MailboxState_removeUid(T, uint64_t);
-extern void         MailboxState_addMsginfo(T, uint64_t, MessageInfo *);
-extern GTree *      MailboxState_getMsginfo(T);
-extern GTree *      MailboxState_getIds(T);
-extern GTree *      MailboxState_getMsn(T);
+extern void         MailboxState_addMessage(T, const MessageInfo *, GList *keywords);
+
+/*
+ * message index lookups. Returned pointers stay valid until messages
+ * are added to or reloaded into the state, or the state is edited.
+ *
+ * The index may be shared with other sessions: treat getMessage results
+ * as read-only and use editMessage to change a message.
+ */
+extern MessageInfo *MailboxState_getMessage(T, uint64_t uid);
+extern MessageInfo *MailboxState_editMessage(T, uint64_t uid);
+extern uint64_t *   MailboxState_getMsn(T, uint64_t uid);
+extern uint64_t *   MailboxState_getUid(T, uint64_t msn);
+extern unsigned     MailboxState_getIdCount(T);
+extern GList *      MailboxState_getUids(T);
+/** \brief call func(uid, msn, data) for each visible message in msn order */
+extern void         MailboxState_foreach_id(T, GTraverseFunc func, gpointer data);
+/** \brief call func(uid, MessageInfo, data) for each loaded message, expunged included */
+extern void         MailboxState_foreach_message(T, GTraverseFunc func, gpointer data);
+extern gboolean     MailboxState_messageHasKeyword(T, const MessageInfo *, const char *);
+extern void         MailboxState_setMessageKeywords(T, MessageInfo *, GList *keywords, int action);
+/**
+ * \brief answer a flag, size, internal date or keyword search key from
+ * the loaded messages
+ * \return tree of uid -> msn, or NULL if the key needs the database
+ */
+extern GTree *      MailboxState_search(T, const search_key *);
+
+/* string sort keys, in the order MailboxState_setSortkeys takes them */
+#define SORTKEY_SUBJECT 0
+#define SORTKEY_FROM 1
+#define SORTKEY_DISPLAY 2
+#define SORTKEY_TO 3
+#define SORTKEY_CC 4
+#define SORTKEY_STRINGS 5
+
+/**
+ * \brief order messages by their sort keys in memory, reading the keys
+ * of messages the state has not seen sorted before
+ * \param found tree of uid -> msn to sort
+ * \param criteria SORT_* values, negated for REVERSE, 0 terminated
+ * \param sorted list of allocated uids, in order
+ * \return DM_SUCCESS, DM_EGENERAL if a message has no sort keys yet, or
+ * DM_EQUERY
+ */
+extern int          MailboxState_sort(T, GTree *found, const int *criteria, GList **sorted);
+/** \brief set the sort keys of a message, SORTKEY_STRINGS strings */
+extern void         MailboxState_setSortkeys(T, uint64_t uid, const char **keys, time_t sentdate);
 
 
 extern void         MailboxState_setId(T, uint64_t);
@@ -79,6 +138,13 @@ extern GTree *      MailboxState_get_set(T, const char *, gboolean);
 
 extern void         MailboxState_free(T *);
 
+/*
+ * process wide cache of message indexes shared between states
+ */
+extern void         MailboxState_cache_stats(struct state_cache_stats *);
+extern void         MailboxState_cache_setLimit(size_t bytes);
+extern void         MailboxState_cache_flush(void);
+
 /**
  * \brief check if a user has a certain right to a mailbox
  */
@@ -46,9 +46,9 @@ extern DBParam_T db_params;
 
 static void _header_cache(const char *, const char *, gpointer);
 
-static gboolean _header_insert(uint64_t physmessage_id, uint64_t headername_id, uint64_t headervalue_id);
+static gboolean _header_insert(const DbmailMessage *self, uint64_t physmessage_id, uint64_t headername_id, uint64_t headervalue_id);
 static int _header_name_get_id(const DbmailMessage *self, const char *header, uint64_t *id);
-static int _header_value_get_id(const char *value, const char *sortfield, const char *datefield, uint64_t *id);
+static int _header_value_get_id(const DbmailMessage *self, const char *value, const char *sortfield, const char *datefield, uint64_t *id);
 
 static DbmailMessage * _retrieve(DbmailMessage *self, const char *query_template);
 static int _message_insert(DbmailMessage *self, 
@@ -57,6 +57,326 @@ static int _message_insert(DbmailMessage *self,
 		const char *unique_id); 
 
 
+/*
+ * batched ingest
+ *
+ * When enabled, all storage for a single message runs on one connection
+ * inside one transaction. Partlist, header and field-cache rows are queued
+ * while the message is walked, and written using multi-row INSERTs right
+ * before the commit.
+ */
+#define BATCH_ROWS 200
+
+struct message_batch {
+	Connection_T c;
+	volatile gboolean failed;
+	GList *partlists;	/* "(physid,is_header,key,depth,order,part_id)" */
+	GList *headers;		/* "(physid,headername_id,headervalue_id)" */
+	GHashTable *header_keys;
+	GHashTable *header_names;	/* uncommitted headername ids */
+	GHashTable *header_values;	/* uncommitted headervalue ids */
+	GHashTable *shared_names;	/* headername ids taken from the shared cache */
+	GHashTable *shared_values;	/* headervalue ids taken from the shared cache */
+	GList *fields;		/* gchar *[2] = { field, value } */
+};
+
+#define STORE_BATCHED(m) ((m) && (m)->batch)
+
+static void batch_shared(GHashTable *ids, uint64_t id)
+{
+	uint64_t *key;
+	if (g_hash_table_lookup_extended(ids, &id, NULL, NULL))
+		return;
+	key = g_new0(uint64_t, 1);
+	*key = id;
+	g_hash_table_insert(ids, key, GINT_TO_POINTER(1));
+}
+
+static Connection_T store_con_get(const DbmailMessage *m)
+{
+	if (STORE_BATCHED(m))
+		return m->batch->c;
+	return db_con_get();
+}
+
+static void store_begin(const DbmailMessage *m, Connection_T c)
+{
+	if (! STORE_BATCHED(m))
+		db_begin_transaction(c);
+}
+
+static void store_commit(const DbmailMessage *m, Connection_T c)
+{
+	if (! STORE_BATCHED(m))
+		db_commit_transaction(c);
+}
+
+static void store_rollback(const DbmailMessage *m, Connection_T c)
+{
+	if (STORE_BATCHED(m))
+		m->batch->failed = TRUE;
+	else
+		db_rollback_transaction(c);
+}
+
+static void store_con_close(const DbmailMessage *m, Connection_T c)
+{
+	if (! STORE_BATCHED(m))
+		db_con_close(c);
+}
+
+
+/*
+ * process-wide headername cache
+ *
+ * headername ids never change once assigned, so the lowercase
+ * name -> id map is shared by all threads. It is preloaded from the
+ * database on first use and filled on misses.
+ */
+#define HEADER_NAMES_REPORT 10000
+
+static GOnce header_names_once = G_ONCE_INIT;
+static GHashTable *header_names = NULL;
+static uint64_t header_names_hits = 0;
+static uint64_t header_names_misses = 0;
+G_LOCK_DEFINE_STATIC(header_names_lock);
+
+static gpointer header_names_load(gpointer UNUSED data)
+{
+	Connection_T c; ResultSet_T r;
+	GHashTable *names;
+	uint64_t *id;
+	gchar *name;
+
+	names = g_hash_table_new_full((GHashFunc)g_str_hash,
+			(GEqualFunc)g_str_equal, (GDestroyNotify)g_free, (GDestroyNotify)g_free);
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT id, headername FROM %sheadername", DBPFX);
+		while (db_result_next(r)) {
+			name = g_ascii_strdown(db_result_get(r, 1), -1);
+			if (g_hash_table_lookup(names, name)) {
+				g_free(name);
+				continue;
+			}
+			id = g_new0(uint64_t, 1);
+			*id = db_result_get_u64(r, 0);
+			g_hash_table_insert(names, name, id);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	TRACE(TRACE_INFO, "preloaded [%u] header names", g_hash_table_size(names));
+
+	header_names = names;
+
+	return (gpointer)names;
+}
+
+static gboolean header_names_lookup(const char *name, uint64_t *id)
+{
+	uint64_t *cacheid, hits, misses;
+
+	g_once(&header_names_once, header_names_load, NULL);
+
+	G_LOCK(header_names_lock);
+	if ((cacheid = g_hash_table_lookup(header_names, name)) != NULL) {
+		*id = *cacheid;
+		header_names_hits++;
+	} else {
+		header_names_misses++;
+	}
+	hits = header_names_hits;
+	misses = header_names_misses;
+	G_UNLOCK(header_names_lock);
+
+	if (((hits + misses) % HEADER_NAMES_REPORT) == 0)
+		TRACE(TRACE_INFO, "headername cache hits [%" PRIu64 "] misses [%" PRIu64 "]", hits, misses);
+
+	return cacheid ? TRUE : FALSE;
+}
+
+static void header_names_insert(const char *name, uint64_t id)
+{
+	uint64_t *cacheid;
+
+	g_once(&header_names_once, header_names_load, NULL);
+
+	G_LOCK(header_names_lock);
+	if (! g_hash_table_lookup(header_names, name)) {
+		cacheid = g_new0(uint64_t, 1);
+		*cacheid = id;
+		g_hash_table_insert(header_names, g_strdup(name), cacheid);
+	}
+	G_UNLOCK(header_names_lock);
+}
+
+/* ids may go stale when dbmail-util purges unused headernames,
+ * so drop everything once a cached id turns out to be missing */
+static void header_names_reset(void)
+{
+	g_once(&header_names_once, header_names_load, NULL);
+
+	G_LOCK(header_names_lock);
+	g_hash_table_remove_all(header_names);
+	G_UNLOCK(header_names_lock);
+}
+
+static void header_names_publish(gpointer key, gpointer value, gpointer UNUSED data)
+{
+	header_names_insert((const char *)key, *(uint64_t *)value);
+}
+
+
+/*
+ * process-wide headervalue cache
+ *
+ * a size-bounded LRU mapping the hash and length of a header value
+ * to its headervalue id. The memory budget is set in kilobytes through
+ * header_value_cache_size; 0 disables the cache.
+ */
+#define HEADER_VALUES_DEFAULT 1024
+#define HEADER_VALUES_REPORT 10000
+#define HEADER_VALUE_ENTRY_SIZE(k) (sizeof(struct header_value_entry) + \
+		sizeof(GList) + (4 * sizeof(gpointer)) + strlen(k) + 1)
+
+struct header_value_entry {
+	gchar *key;
+	uint64_t id;
+	GList *link;
+};
+
+static GOnce header_values_once = G_ONCE_INIT;
+static GHashTable *header_values = NULL;
+static GQueue *header_values_lru = NULL;
+static size_t header_values_size = 0;
+static size_t header_values_limit = 0;
+static uint64_t header_values_hits = 0;
+static uint64_t header_values_misses = 0;
+G_LOCK_DEFINE_STATIC(header_values_lock);
+
+static gpointer header_values_init(gpointer UNUSED data)
+{
+	Field_T val;
+
+	header_values_limit = HEADER_VALUES_DEFAULT * 1024;
+	config_get_value("header_value_cache_size", "DBMAIL", val);
+	if (strlen(val))
+		header_values_limit = (size_t)strtoul(val, NULL, 10) * 1024;
+
+	header_values = g_hash_table_new((GHashFunc)g_str_hash, (GEqualFunc)g_str_equal);
+	header_values_lru = g_queue_new();
+
+	TRACE(TRACE_DEBUG, "headervalue cache limit [%" PRIu64 "] bytes", (uint64_t)header_values_limit);
+
+	return NULL;
+}
+
+static void header_values_evict(struct header_value_entry *entry)
+{
+	g_hash_table_remove(header_values, entry->key);
+	header_values_size -= HEADER_VALUE_ENTRY_SIZE(entry->key);
+	g_free(entry->key);
+	g_free(entry);
+}
+
+static gboolean header_values_lookup(const char *key, uint64_t *id)
+{
+	struct header_value_entry *entry;
+	uint64_t hits, misses;
+
+	g_once(&header_values_once, header_values_init, NULL);
+	if (! header_values_limit)
+		return FALSE;
+
+	G_LOCK(header_values_lock);
+	if ((entry = g_hash_table_lookup(header_values, key)) != NULL) {
+		*id = entry->id;
+		g_queue_unlink(header_values_lru, entry->link);
+		g_queue_push_head_link(header_values_lru, entry->link);
+		header_values_hits++;
+	} else {
+		header_values_misses++;
+	}
+	hits = header_values_hits;
+	misses = header_values_misses;
+	G_UNLOCK(header_values_lock);
+
+	if (((hits + misses) % HEADER_VALUES_REPORT) == 0)
+		TRACE(TRACE_INFO, "headervalue cache hits [%" PRIu64 "] misses [%" PRIu64 "] hitrate [%.1f%%]",
+				hits, misses, (100.0 * hits) / (hits + misses));
+
+	return entry ? TRUE : FALSE;
+}
+
+static void header_values_insert(const char *key, uint64_t id)
+{
+	struct header_value_entry *entry;
+
+	g_once(&header_values_once, header_values_init, NULL);
+	if (! header_values_limit)
+		return;
+
+	G_LOCK(header_values_lock);
+	if (! g_hash_table_lookup(header_values, key)) {
+		entry = g_new0(struct header_value_entry, 1);
+		entry->key = g_strdup(key);
+		entry->id = id;
+		g_queue_push_head(header_values_lru, entry);
+		entry->link = g_queue_peek_head_link(header_values_lru);
+		g_hash_table_insert(header_values, entry->key, entry);
+		header_values_size += HEADER_VALUE_ENTRY_SIZE(entry->key);
+
+		while ((header_values_size > header_values_limit) &&
+				(entry = g_queue_pop_tail(header_values_lru)))
+			header_values_evict(entry);
+	}
+	G_UNLOCK(header_values_lock);
+}
+
+static void header_values_reset(void)
+{
+	struct header_value_entry *entry;
+
+	g_once(&header_values_once, header_values_init, NULL);
+
+	G_LOCK(header_values_lock);
+	while ((entry = g_queue_pop_tail(header_values_lru)))
+		header_values_evict(entry);
+	G_UNLOCK(header_values_lock);
+}
+
+static void header_values_publish(gpointer key, gpointer value, gpointer UNUSED data)
+{
+	header_values_insert((const char *)key, *(uint64_t *)value);
+}
+
+void dbmail_message_header_values_stats(uint64_t *hits, uint64_t *misses)
+{
+	G_LOCK(header_values_lock);
+	*hits = header_values_hits;
+	*misses = header_values_misses;
+	G_UNLOCK(header_values_lock);
+}
+
+void dbmail_message_header_names_init(void)
+{
+	g_once(&header_names_once, header_names_load, NULL);
+}
+
+void dbmail_message_header_names_stats(uint64_t *hits, uint64_t *misses)
+{
+	G_LOCK(header_names_lock);
+	*hits = header_names_hits;
+	*misses = header_names_misses;
+	G_UNLOCK(header_names_lock);
+}
+
+
 /* general mime utils (missing from gmime?) */
 
 unsigned find_end_of_header(const char *h)
@@ -109,18 +429,64 @@ gchar * g_mime_object_get_body(const GMimeObject *object)
 	return s;
 }
 
-static uint64_t blob_exists(const char *buf, const char *hash)
+/*
+ * a mimepart as it goes into the data column: either the part itself, or
+ * its gzip compressed form. hash and size always describe the uncompressed
+ * part, so deduplication is unaffected by the representation.
+ */
+struct mimepart_blob {
+	const char *plain;	// the part itself
+	const char *data;
+	size_t len;
+	size_t size;
+	int compressed;
+};
+
+/*
+ * compare mode matches on the part itself, not its stored form: a part
+ * may be stored compressed or not depending on the settings at the time.
+ * Uncompressed rows are compared by the database, compressed ones with
+ * the same hash and size are unpacked and compared here.
+ */
+static uint64_t blob_exists_compressed(Connection_T c, const struct mimepart_blob *blob, const char *hash)
+{
+	PreparedStatement_T s; ResultSet_T r;
+	uint64_t id = 0;
+	const void *data;
+	char *part;
+	size_t plen;
+	int l;
+
+	db_con_clear(c);
+	s = db_stmt_prepare(c, "SELECT id, data FROM %smimeparts WHERE hash=? AND %ssize%s=? AND compressed=1",
+			DBPFX, db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN));
+	db_stmt_set_str(s, 1, hash);
+	db_stmt_set_u64(s, 2, blob->size);
+	r = db_stmt_query(s);
+	while ((! id) && db_result_next(r)) {
+		l = 0;
+		data = db_result_get_blob(r, 1, &l);
+		if (! (part = dm_gzip(data, l, FALSE, &plen)))
+			continue;
+		if ((plen == blob->size) && (memcmp(part, blob->plain, plen) == 0))
+			id = db_result_get_u64(r, 0);
+		g_free(part);
+	}
+
+	return id;
+}
+
+static uint64_t blob_exists(const DbmailMessage *m, const struct mimepart_blob *blob, const char *hash)
 {
 	volatile uint64_t id = 0;
 	volatile uint64_t id_old = 0;
-	size_t l;
-	assert(buf);
+	const char *buf = blob->data;
+	size_t l = blob->len;
 	Connection_T c; PreparedStatement_T s; ResultSet_T r;
 	char blob_cmp[DEF_FRAGSIZE];
 	memset(blob_cmp, 0, sizeof(blob_cmp));
 
-	l = strlen(buf);
-	c = db_con_get();
+	c = store_con_get(m);
 	TRY
 		if (db_params.db_driver == DM_DRIVER_ORACLE  && l > DM_ORA_MAX_BYTES_LOB_CMP) {
 			db_begin_transaction(c);
@@ -152,45 +518,46 @@ static uint64_t blob_exists(const char *buf, const char *hash)
 			}
 		} else {
 			snprintf(blob_cmp, DEF_FRAGSIZE-1, db_get_sql(SQL_COMPARE_BLOB), "data");
-			s = db_stmt_prepare(c,"SELECT id FROM %smimeparts WHERE hash=? AND %ssize%s=? AND %s", 
+			s = db_stmt_prepare(c,"SELECT id FROM %smimeparts WHERE hash=? AND %ssize%s=? AND compressed=0 AND %s", 
 					DBPFX,db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN),
 					blob_cmp);
 			db_stmt_set_str(s,1,hash);
-			db_stmt_set_u64(s,2,l);
-			db_stmt_set_blob(s,3,buf,l);
+			db_stmt_set_u64(s,2,blob->size);
+			db_stmt_set_blob(s,3,blob->plain,blob->size);
 			r = db_stmt_query(s);
 			if (db_result_next(r))
 				id = db_result_get_u64(r,0);
+			else
+				id = blob_exists_compressed(c, blob, hash);
 		}
 	CATCH(SQLException)
 		LOG_SQLERROR;
-		if (db_params.db_driver == DM_DRIVER_ORACLE) 
+		if (STORE_BATCHED(m))
+			m->batch->failed = TRUE;
+		else if (db_params.db_driver == DM_DRIVER_ORACLE) 
 			db_rollback_transaction(c);
 	FINALLY
-		db_con_close(c);
+		store_con_close(m, c);
 	END_TRY;
 
 	return id;
 }
 
-static uint64_t blob_insert(const char *buf, const char *hash)
+static uint64_t blob_insert(const DbmailMessage *m, const struct mimepart_blob *blob, const char *hash)
 {
 	Connection_T c; PreparedStatement_T s; ResultSet_T r;
-	size_t l;
 	volatile uint64_t id = 0;
 	char *frag = db_returning("id");
 
-	assert(buf);
-	l = strlen(buf);
-
-	c = db_con_get();
+	c = store_con_get(m);
 	TRY
-		db_begin_transaction(c);
-		s = db_stmt_prepare(c, "INSERT INTO %smimeparts (hash, data, %ssize%s) VALUES (?, ?, ?) %s", 
-				DBPFX, db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN), frag);
+		store_begin(m, c);
+		s = db_stmt_prepare(c, "INSERT INTO %smimeparts (hash, data, %ssize%s%s) VALUES (?, ?, ?%s) %s", 
+				DBPFX, db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN),
+				blob->compressed ? ", compressed" : "", blob->compressed ? ", 1" : "", frag);
 		db_stmt_set_str(s, 1, hash);
-		db_stmt_set_blob(s, 2, buf, l);
-		db_stmt_set_int(s, 3, l);
+		db_stmt_set_blob(s, 2, blob->data, blob->len);
+		db_stmt_set_int(s, 3, blob->size);
 		if (db_params.db_driver == DM_DRIVER_ORACLE) {
 			db_stmt_exec(s);
 			id = db_get_pk(c, "mimeparts");
@@ -198,12 +565,12 @@ static uint64_t blob_insert(const char *buf, const char *hash)
 			r = db_stmt_query(s);
 			id = db_insert_result(c,r);
 		}
-		db_commit_transaction(c);
+		store_commit(m, c);
 	CATCH(SQLException)
 		LOG_SQLERROR;
-		db_rollback_transaction(c);
+		store_rollback(m, c);
 	FINALLY
-		db_con_close(c);
+		store_con_close(m, c);
 	END_TRY;
 
 	TRACE(TRACE_DEBUG,"inserted id [%" PRIu64 "]", id);
@@ -215,7 +582,6 @@ static uint64_t blob_insert(const char *buf, const char *hash)
 static int register_blob(DbmailMessage *m, uint64_t id, gboolean is_header)
 {
 	Connection_T c; volatile gboolean t = FALSE;
-	c = db_con_get();
 
 	if (m->part_depth > MAX_MIME_DEPTH) {
 		TRACE(TRACE_WARNING, "MIME part depth exceeds allowed limit. You should recompile "
@@ -223,6 +589,15 @@ static int register_blob(DbmailMessage *m, uint64_t id, gboolean is_header)
 				m->part_depth);
 	}
 
+	if (STORE_BATCHED(m)) {
+		m->batch->partlists = g_list_prepend(m->batch->partlists,
+				g_strdup_printf("(%" PRIu64 ",%d,%d,%d,%d,%" PRIu64 ")",
+					dbmail_message_get_physid(m), is_header, m->part_key,
+					m->part_depth, m->part_order, id));
+		return TRUE;
+	}
+
+	c = db_con_get();
 	TRY
 		db_begin_transaction(c);
 		t = db_exec(c, "INSERT INTO %spartlists (physmessage_id, is_header, part_key, part_depth, part_order, part_id) "
@@ -239,10 +614,187 @@ static int register_blob(DbmailMessage *m, uint64_t id, gboolean is_header)
 	return t;
 }
 
-static uint64_t blob_store(const char *buf)
+/*
+ * digest dedup: trust hash and size, backed by the unique index
+ * on mimeparts(hash,size). A hit costs a single index probe. A miss
+ * uses an insert-or-return-existing statement to resolve races with
+ * concurrent deliveries.
+ */
+static GOnce blob_digest_once = G_ONCE_INIT;
+
+static gpointer blob_digest_init(gpointer UNUSED data)
+{
+	Field_T config;
+
+	if (! db_get_sql(SQL_UPSERT_MIMEPART))
+		return GINT_TO_POINTER(FALSE);
+
+	config_get_value("mimepart_dedup", "DBMAIL", config);
+	if (! SMATCH(config, "digest"))
+		return GINT_TO_POINTER(FALSE);
+
+	// without the unique index nothing stops duplicate rows
+	if (! db_index_exists(MIMEPART_DIGEST_INDEX)) {
+		TRACE(TRACE_WARNING, "mimepart_dedup = digest needs the unique mimeparts index. "
+				"Run dbmail-util --dedup -y first. Using compare for now.");
+		return GINT_TO_POINTER(FALSE);
+	}
+
+	return GINT_TO_POINTER(TRUE);
+}
+
+static gboolean blob_digest_enabled(void)
+{
+	return GPOINTER_TO_INT(g_once(&blob_digest_once, blob_digest_init, NULL));
+}
+
+static uint64_t blob_digest_lookup(Connection_T c, const char *hash, size_t l)
+{
+	PreparedStatement_T s; ResultSet_T r;
+	uint64_t id = 0;
+
+	s = db_stmt_prepare(c, "SELECT id FROM %smimeparts WHERE hash=? AND %ssize%s=?",
+			DBPFX, db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN));
+	db_stmt_set_str(s, 1, hash);
+	db_stmt_set_u64(s, 2, l);
+	r = db_stmt_query(s);
+	if (db_result_next(r))
+		id = db_result_get_u64(r, 0);
+
+	return id;
+}
+
+static uint64_t blob_digest_store(const DbmailMessage *m, const struct mimepart_blob *blob, const char *hash)
+{
+	Connection_T c; PreparedStatement_T s; ResultSet_T r;
+	volatile uint64_t id = 0;
+	size_t l = blob->size;
+
+	c = store_con_get(m);
+	TRY
+		store_begin(m, c);
+		if (! (id = blob_digest_lookup(c, hash, l))) {
+			db_con_clear(c);
+			s = db_stmt_prepare(c, db_get_sql(SQL_UPSERT_MIMEPART), DBPFX);
+			db_stmt_set_str(s, 1, hash);
+			db_stmt_set_blob(s, 2, blob->data, blob->len);
+			db_stmt_set_u64(s, 3, l);
+			db_stmt_set_int(s, 4, blob->compressed);
+			if (db_params.db_driver == DM_DRIVER_SQLITE) {
+				db_stmt_exec(s);
+				if (Connection_rowsChanged(c))
+					id = (uint64_t)Connection_lastRowId(c);
+				else
+					id = blob_digest_lookup(c, hash, l);
+			} else {
+				r = db_stmt_query(s);
+				id = db_insert_result(c, r);
+			}
+		}
+		store_commit(m, c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		store_rollback(m, c);
+		id = 0;
+	FINALLY
+		store_con_close(m, c);
+	END_TRY;
+
+	TRACE(TRACE_DEBUG, "mimepart id [%" PRIu64 "]", id);
+
+	return id;
+}
+
+/*
+ * mimepart compression: parts of at least mimepart_compress_min bytes
+ * are stored gzip compressed when that actually saves space.
+ */
+static size_t blob_compress_threshold(void)
+{
+	Field_T config;
+
+	if (db_params.db_driver == DM_DRIVER_ORACLE)
+		return 0;
+
+	config_get_value("mimepart_compress", "DBMAIL", config);
+	if (! SMATCH(config, "yes"))
+		return 0;
+
+	config_get_value("mimepart_compress_min", "DBMAIL", config);
+	if (strlen(config))
+		return (size_t)MAX(strtoull(config, NULL, 10), 1);
+
+	return 1024;
+}
+
+/*
+ * TRUE if some mimeparts may be stored compressed: compression is on,
+ * or was on before and left compressed rows behind. Searches then can
+ * not rely on LIKE against the data column alone.
+ */
+static GOnce compressed_parts_once = G_ONCE_INIT;
+
+static gpointer compressed_parts_init(gpointer UNUSED data)
+{
+	Connection_T c; ResultSet_T r;
+	volatile gboolean t = FALSE;
+
+	if (db_params.db_driver == DM_DRIVER_ORACLE)
+		return GINT_TO_POINTER(FALSE);
+	if (blob_compress_threshold())
+		return GINT_TO_POINTER(TRUE);
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT 1=1 FROM %smimeparts WHERE compressed=1 LIMIT 1 OFFSET 0", DBPFX);
+		if (db_result_next(r))
+			t = TRUE;
+	CATCH(SQLException)
+		LOG_SQLERROR;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return GINT_TO_POINTER(t);
+}
+
+gboolean dm_message_compressed_parts(void)
+{
+	return GPOINTER_TO_INT(g_once(&compressed_parts_once, compressed_parts_init, NULL));
+}
+
+static void blob_prepare(struct mimepart_blob *blob, const char *buf, char **zbuf)
+{
+	size_t min, zlen = 0;
+
+	blob->plain = blob->data = buf;
+	blob->len = blob->size = strlen(buf);
+	blob->compressed = 0;
+	*zbuf = NULL;
+
+	if (! (min = blob_compress_threshold()) || blob->size < min)
+		return;
+
+	if (! (*zbuf = dm_gzip(buf, blob->size, TRUE, &zlen)))
+		return;
+
+	if (zlen >= blob->size) {
+		g_free(*zbuf);
+		*zbuf = NULL;
+		return;
+	}
+
+	blob->data = *zbuf;
+	blob->len = zlen;
+	blob->compressed = 1;
+}
+
+static uint64_t blob_store(const DbmailMessage *m, const char *buf)
 {
 	uint64_t id;
 	char hash[FIELDSIZE];
+	char *zbuf;
+	struct mimepart_blob blob;
 
 	if (! buf) return 0;
 
@@ -250,16 +802,17 @@ static uint64_t blob_store(const char *buf)
 	if (dm_get_hash_for_string(buf, hash))
 		return 0;
 
+	blob_prepare(&blob, buf, &zbuf);
+
+	if (blob_digest_enabled())
+		id = blob_digest_store(m, &blob, (const char *)hash);
 	// store this message fragment
-	if ((id = blob_exists(buf, (const char *)hash)) != 0) {
-		return id;
-	}
+	else if (! (id = blob_exists(m, &blob, (const char *)hash)))
+		id = blob_insert(m, &blob, (const char *)hash);
 
-	if ((id = blob_insert(buf, (const char *)hash)) != 0) {
-		return id;
-	}
-	
-	return 0;
+	g_free(zbuf);
+
+	return id;
 }
 
 static int store_blob(DbmailMessage *m, const char *buf, gboolean is_header)
@@ -276,7 +829,7 @@ static int store_blob(DbmailMessage *m, const char *buf, gboolean is_header)
 	dprint("<blob is_header=\"%d\" part_depth=\"%d\" part_key=\"%d\" part_order=\"%d\">\n%s\n</blob>\n", 
 			is_header, m->part_depth, m->part_key, m->part_order, buf);
 
-	if (! (id = blob_store(buf)))
+	if (! (id = blob_store(m, buf)))
 		return DM_EQUERY;
 
 	// register this message fragment
@@ -337,21 +890,214 @@ static GMimeContentType *find_type(const char *s)
 #define MAX_MIME_DEPTH 64
 #define MAX_MIME_BLEN 128
 
-static bool find_boundary(const char *s, char *boundary)
+/*
+ * parse the content-type of a header part once: report whether it
+ * encapsulates a message/rfc822 and copy its boundary parameter, if any.
+ * is_message is left untouched for parts without a content-type.
+ */
+static bool find_part_type(const char *s, char *boundary, gboolean *is_message)
+{
+	const gchar *param;
+	GMimeContentType *type = find_type(s);
+	if (! type)
+		return false;
+	*is_message = g_mime_content_type_is_type(type, "message", "rfc822");
+	param = g_mime_content_type_get_parameter(type, "boundary");
+	if (param) {
+		memset(boundary, 0, MAX_MIME_BLEN);
+		strncpy(boundary, param, MAX_MIME_BLEN-1);
+	}
+	g_object_unref(type);
+	return param ? true : false;
+}
+
+#define mime_append(m, s, l) g_byte_array_append((m), (const guint8 *)(s), (l))
+
+static void mime_append_boundary(GByteArray *m, const char *boundary, gboolean final)
+{
+	mime_append(m, "\n--", 3);
+	mime_append(m, boundary, strlen(boundary));
+	if (final)
+		mime_append(m, "--", 2);
+	mime_append(m, "\n", 1);
+}
+
+static DbmailMessage * _message_init_with_bytes(DbmailMessage *self, GByteArray *bytes);
+static DbmailMessage * _message_parse_stream(DbmailMessage *self, const char *from);
+
+/*
+ * reassembly state for one message. Rows from the partlists/mimeparts
+ * join are fed in (part_key, part_order) order; all parts are appended
+ * to a single buffer, preallocated from physmessage.messagesize, which
+ * then backs the GMime stream the message is parsed from. Only header
+ * parts are copied, for the content-type scan.
+ */
+struct mime_assembler {
+	GByteArray *m;
+	char internal_date[SQL_INTERNALDATE_LEN];
+	char boundary[MAX_MIME_BLEN];
+	char blist[MAX_MIME_DEPTH+1][MAX_MIME_BLEN];
+	int depth;
+	int row;
+	gboolean got_boundary;
+	gboolean is_header;
+	gboolean is_message;
+	gboolean finalized;
+	gboolean failed;
+};
+
+/* column layout shared by all mimepart retrieval queries */
+#define MIME_COLUMNS "l.physmessage_id,l.part_key,l.part_depth,l.part_order,l.is_header,%s,%s,ph.messagesize "
+#define MIME_FROM "FROM %smimeparts p " \
+	"JOIN %spartlists l ON p.id = l.part_id " \
+	"JOIN %sphysmessage ph ON ph.id = l.physmessage_id "
+
+static String_T mime_data_columns(Mempool_T pool)
+{
+	String_T n = p_string_new(pool, "");
+	/* compressed parts are fetched once, as raw bytes */
+	if (db_params.db_driver == DM_DRIVER_POSTGRESQL) {
+		p_string_append(n, "CASE WHEN p.compressed = 0 THEN ");
+		p_string_append_printf(n, db_get_sql(SQL_ENCODE_ESCAPE), "p.data");
+		p_string_append(n, " END,p.compressed,CASE WHEN p.compressed = 1 THEN p.data END");
+		return n;
+	}
+	p_string_printf(n,db_get_sql(SQL_ENCODE_ESCAPE), "data");
+	if (db_params.db_driver == DM_DRIVER_ORACLE)
+		p_string_append(n, ",0,NULL");
+	else
+		p_string_append(n, ",p.compressed,NULL");
+	return n;
+}
+
+static struct mime_assembler * mime_assembler_new(void)
+{
+	struct mime_assembler *a = g_new0(struct mime_assembler, 1);
+	a->is_header = TRUE;
+	return a;
+}
+
+static void mime_assembler_free(struct mime_assembler *a)
+{
+	if (a->m)
+		g_byte_array_free(a->m, TRUE);
+	g_free(a);
+}
+
+static int mime_assembler_add(struct mime_assembler *a, ResultSet_T r)
+{
+	int prevdepth, l;
+	gboolean prev_header, prev_boundary = FALSE, prev_is_message = FALSE;
+	const void *blob;
+	const char *zdata;
+	char *part = NULL;
+#if DPRINT
+	int order;
+	int key;
+#endif
+
+	if (a->failed)
+		return DM_EQUERY;
+
+	prevdepth	= a->depth;
+	prev_header	= a->is_header;
+#if DPRINT
+	key		= db_result_get_int(r,1);
+#endif
+	a->depth	= db_result_get_int(r,2);
+	if (a->depth > MAX_MIME_DEPTH) {
+		TRACE(TRACE_WARNING, "MIME part depth exceeds allowed maximum [%d]",
+				MAX_MIME_DEPTH);
+		a->depth = prevdepth;
+		return 0;
+	}
+
+#if DPRINT
+	order		= db_result_get_int(r,3);
+#endif
+	a->is_header	= db_result_get_bool(r,4);
+	if (! a->m) {
+		g_strlcpy(a->internal_date, db_result_get(r,5), SQL_INTERNALDATE_LEN-1);
+		/* room for the boundary lines added below */
+		a->m = g_byte_array_sized_new(db_result_get_u64(r,9) + 1024);
+	}
+	blob		= db_result_get_blob(r,6,&l);
+	if (db_result_get_int(r,7)) {
+		size_t zlen = 0;
+		int zl = 0;
+		if ((zdata = db_result_get_blob(r,8,&zl))) {
+			blob = zdata;
+			l = zl;
+		}
+		if (! (part = dm_gzip(blob, l, FALSE, &zlen))) {
+			a->failed = TRUE;
+			return DM_EQUERY;
+		}
+		blob = part;
+		l = zlen;
+	}
+
+	if (a->is_header) {
+		prev_boundary = a->got_boundary;
+		prev_is_message = a->is_message;
+	}
+
+	a->got_boundary = FALSE;
+
+	if (a->is_header) {
+		if (! part)
+			part = g_strndup(blob, l);
+		if (find_part_type(part, &a->boundary[0], &a->is_message)) {
+			a->got_boundary = TRUE;
+			dprint("<boundary depth=\"%d\">%s</boundary>\n", a->depth, a->boundary);
+			strncpy(a->blist[a->depth], a->boundary, MAX_MIME_BLEN-1);
+		}
+	}
+
+	while ((prevdepth > 0) && (prevdepth-1 >= a->depth) && a->blist[prevdepth-1][0]) {
+		dprint("\n--%s at %d -> %d--\n", a->blist[prevdepth-1], prevdepth, prevdepth-1);
+		mime_append_boundary(a->m, a->blist[prevdepth-1], TRUE);
+		memset(a->blist[prevdepth-1], 0, MAX_MIME_BLEN);
+		prevdepth--;
+		a->finalized=TRUE;
+	}
+
+	if ((a->depth > 0) && (a->blist[a->depth-1][0]))
+		strncpy(a->boundary, a->blist[a->depth-1], MAX_MIME_BLEN-1);
+
+	if (a->is_header && (!prev_header || prev_boundary || (prev_header && a->depth>0 && !prev_is_message))) {
+		dprint("\n--%s\n", a->boundary);
+		mime_append_boundary(a->m, a->boundary, FALSE);
+	}
+
+	mime_append(a->m, blob, l);
+	dprint("<part is_header=\"%d\" depth=\"%d\" key=\"%d\" order=\"%d\">\n%.*s\n</part>\n", 
+		a->is_header, a->depth, key, order, l, (const char *)blob);
+
+	if (a->is_header)
+		mime_append(a->m, "\n", 1);
+
+	g_free(part);
+	a->row++;
+
+	return 0;
+}
+
+/* close open boundaries and hand the buffer over to a message */
+static DbmailMessage * mime_assembler_finish(struct mime_assembler *a, DbmailMessage *self)
 {
-	const gchar *param;
-	GMimeContentType *type = find_type(s);
-	if (! type)
-		return false;
-	param = g_mime_content_type_get_parameter(type, "boundary");
-	if (! param) {
-		g_object_unref(type);
-		return false;
+	GByteArray *m = a->m;
+
+	if (a->row > 2 && a->boundary[0] && !a->finalized) {
+		dprint("\n--%s-- final\n", a->boundary);
+		mime_append_boundary(m, a->boundary, TRUE);
+		a->finalized=1;
 	}
-	memset(boundary, 0, MAX_MIME_BLEN);
-	strncpy(boundary, param, MAX_MIME_BLEN-1);
-	g_object_unref(type);
-	return true;
+
+	a->m = NULL;
+	self = _message_init_with_bytes(self, m);
+	dbmail_message_set_internal_date(self, a->internal_date);
+	return self;
 }
 
 static DbmailMessage * _mime_retrieve(DbmailMessage *self)
@@ -359,124 +1105,119 @@ static DbmailMessage * _mime_retrieve(DbmailMessage *self)
 	PreparedStatement_T stmt;
 	Connection_T c;
        	ResultSet_T r;
-	char internal_date[SQL_INTERNALDATE_LEN];
-	GMimeContentType *mimetype = NULL;
-	int prevdepth, depth = 0, row = 0;
 	volatile int t = FALSE;
-	gboolean got_boundary = FALSE, prev_boundary = FALSE, is_header = TRUE, prev_header, finalized=FALSE;
-	gboolean prev_is_message = FALSE, is_message = FALSE;
-	String_T m = NULL, n = NULL;
-	const void *blob;
+	struct mime_assembler *a;
+	String_T n;
 	Field_T frag;
 
 	assert(dbmail_message_get_physid(self));
 	date2char_str("ph.internal_date", &frag);
-	n = p_string_new(self->pool, "");
-	p_string_printf(n,db_get_sql(SQL_ENCODE_ESCAPE), "data");
+	n = mime_data_columns(self->pool);
+	a = mime_assembler_new();
 
 	c = db_con_get();
 	TRY
-		char boundary[MAX_MIME_BLEN];
-		char blist[MAX_MIME_DEPTH+1][MAX_MIME_BLEN];
-
-		memset(&boundary, 0, sizeof(boundary));
-		memset(&blist, 0, sizeof(blist));
-
 		stmt = db_stmt_prepare(c,
-			       	"SELECT l.part_key,l.part_depth,l.part_order,l.is_header,%s,%s "
-				"FROM %smimeparts p "
-				"JOIN %spartlists l ON p.id = l.part_id "
-				"JOIN %sphysmessage ph ON ph.id = l.physmessage_id "
+			       	"SELECT " MIME_COLUMNS MIME_FROM
 				"WHERE l.physmessage_id = ? ORDER BY l.part_key,l.part_order ASC", 
 				frag, p_string_str(n), DBPFX, DBPFX, DBPFX);
 		db_stmt_set_u64(stmt, 1, self->id);
 		r = db_stmt_query(stmt);
 		
-		m = p_string_new(self->pool, "");
-
-		row = 0;
 		while (db_result_next(r)) {
-			int l;
-#if DPRINT
-			int order;
-			int key;
-#endif
+			if ((t = mime_assembler_add(a, r)))
+				break;
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
 
-			prevdepth	= depth;
-			prev_header	= is_header;
-#if DPRINT
-			key		= db_result_get_int(r,0);
-#endif
-			depth		= db_result_get_int(r,1);
-			if (depth > MAX_MIME_DEPTH) {
-				TRACE(TRACE_WARNING, "MIME part depth exceeds allowed maximum [%d]",
-						MAX_MIME_DEPTH);
-				continue;
-			}
+	p_string_free(n, TRUE);
 
-#if DPRINT
-			order		= db_result_get_int(r,2);
-#endif
-			is_header	= db_result_get_bool(r,3);
-			if (row == 0) {
-				memset(internal_date, 0, sizeof(internal_date));
-				g_strlcpy(internal_date, db_result_get(r,4), SQL_INTERNALDATE_LEN-1);
-			}
-			blob		= db_result_get_blob(r,5,&l);
-			char *str = g_new0(char, l + 1);
-			str = strncpy(str, blob, l);
-
-			if (is_header) {
-				prev_boundary = got_boundary;
-				prev_is_message = is_message;
-				if ((mimetype = find_type(str))) {
-					is_message = g_mime_content_type_is_type(mimetype, "message", "rfc822");
-					g_object_unref(mimetype);
-				}
-			}
+	if ((a->row == 0) || (t == DM_EQUERY)) {
+		mime_assembler_free(a);
+		return NULL;
+	}
 
-			got_boundary = FALSE;
+	self = mime_assembler_finish(a, self);
+	mime_assembler_free(a);
 
-			if (is_header && find_boundary(str, &boundary[0])) {
-				got_boundary = TRUE;
-				dprint("<boundary depth=\"%d\">%s</boundary>\n", depth, boundary);
-				strncpy(blist[depth], boundary, MAX_MIME_BLEN-1);
-			}
+	return self;
+}
 
-			while ((prevdepth > 0) && (prevdepth-1 >= depth) && blist[prevdepth-1][0]) {
-				dprint("\n--%s at %d -> %d--\n", blist[prevdepth-1], prevdepth, prevdepth-1);
-				p_string_append_printf(m, "\n--%s--\n", blist[prevdepth-1]);
-				memset(blist[prevdepth-1], 0, MAX_MIME_BLEN);
-				prevdepth--;
-				finalized=TRUE;
-			}
+static void _retrieve_range_add(GTree *messages, Mempool_T pool, uint64_t physid, struct mime_assembler *a)
+{
+	uint64_t *key;
+	DbmailMessage *msg;
 
-			if ((depth > 0) && (blist[depth-1][0]))
-				strncpy(boundary, blist[depth-1], MAX_MIME_BLEN-1);
+	if (a->failed) {
+		TRACE(TRACE_WARNING, "retrieval failed for physid [%" PRIu64 "]", physid);
+		return;
+	}
+	if (! a->row)
+		return;
 
-			if (is_header && (!prev_header || prev_boundary || (prev_header && depth>0 && !prev_is_message))) {
-				dprint("\n--%s\n", boundary);
-				p_string_append_printf(m, "\n--%s\n", boundary);
-			}
+	msg = dbmail_message_new(pool);
+	dbmail_message_set_physid(msg, physid);
+	msg = mime_assembler_finish(a, msg);
+	if (! msg->content) {
+		dbmail_message_free(msg);
+		return;
+	}
 
-			p_string_append_printf(m, "%s", str);
-			dprint("<part is_header=\"%d\" depth=\"%d\" key=\"%d\" order=\"%d\">\n%s\n</part>\n", 
-				is_header, depth, key, order, str);
+	key = g_new0(uint64_t, 1);
+	*key = physid;
+	g_tree_insert(messages, key, msg);
+}
 
-			if (is_header)
-				p_string_append_printf(m,"\n");
-			
-			g_free(str);
-			row++;
-		}
+/*
+ * retrieve a window of messages in a single query. Retrieved messages are
+ * inserted into messages, keyed by their physmessage id. Messages without
+ * mimeparts (legacy messageblks) are left out; use dbmail_message_retrieve
+ * for those.
+ */
+int dbmail_message_retrieve_range(GList *physids, GTree *messages, Mempool_T pool)
+{
+	Connection_T c;
+       	ResultSet_T r;
+	volatile int t = DM_SUCCESS;
+	struct mime_assembler * volatile a = NULL;
+	volatile uint64_t current = 0;
+	GString *ids;
+	String_T n;
+	Field_T frag;
 
-		if (row > 2 && boundary[0] && !finalized) {
-			dprint("\n--%s-- final\n", boundary);
-			p_string_append_printf(m, "\n--%s--\n", boundary);
-			finalized=1;
-		}
+	if (! physids)
+		return DM_SUCCESS;
+
+	ids = g_list_join_u64(physids, ",");
+	date2char_str("ph.internal_date", &frag);
+	n = mime_data_columns(pool);
 
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT " MIME_COLUMNS MIME_FROM
+				"WHERE l.physmessage_id IN (%s) "
+				"ORDER BY l.physmessage_id,l.part_key,l.part_order ASC",
+				frag, p_string_str(n), DBPFX, DBPFX, DBPFX, ids->str);
 
+		while (db_result_next(r)) {
+			uint64_t physid = db_result_get_u64(r, 0);
+			if (physid != current) {
+				if (a) {
+					_retrieve_range_add(messages, pool, current, a);
+					mime_assembler_free(a);
+				}
+				a = mime_assembler_new();
+				current = physid;
+			}
+			mime_assembler_add(a, r);
+		}
+		if (a)
+			_retrieve_range_add(messages, pool, current, a);
 	CATCH(SQLException)
 		LOG_SQLERROR;
 		t = DM_EQUERY;
@@ -484,17 +1225,11 @@ static DbmailMessage * _mime_retrieve(DbmailMessage *self)
 		db_con_close(c);
 	END_TRY;
 
-	if ((row == 0) || (t == DM_EQUERY)) {
-		if (m) p_string_free(m, TRUE);
-		p_string_free(n, TRUE);
-		return NULL;
-	}
+	if (a) mime_assembler_free(a);
+	p_string_free(n, TRUE);
+	g_string_free(ids, TRUE);
 
-	self = dbmail_message_init_with_string(self,p_string_str(m));
-	dbmail_message_set_internal_date(self, internal_date);
-	p_string_free(m,TRUE);
-	p_string_free(n,TRUE);
-	return self;
+	return t;
 }
 
 static gboolean store_mime_object(GMimeObject *parent, GMimeObject *object, DbmailMessage *m);
@@ -688,10 +1423,6 @@ DbmailMessage * dbmail_message_new(Mempool_T pool)
 	/* provide quick case-sensitive header value searches */
 	self->header_value = g_tree_new((GCompareFunc)strcmp);
 	
-	/* internal cache: header_dict[headername.name] = headername.id */
-	self->header_dict = g_hash_table_new_full((GHashFunc)g_str_hash,
-			(GEqualFunc)g_str_equal, (GDestroyNotify)g_free, (GDestroyNotify)g_free);
-	
 	dbmail_message_set_class(self, DBMAIL_MESSAGE);
 	
 	return self;
@@ -719,7 +1450,6 @@ void dbmail_message_free(DbmailMessage *self)
 	}
 
 	p_string_free(self->envelope_recipient,TRUE);
-	g_hash_table_destroy(self->header_dict);
 	g_tree_destroy(self->header_name);
 	g_tree_destroy(self->header_value);
 	
@@ -768,12 +1498,8 @@ int dbmail_message_get_class(const DbmailMessage *self)
  */
 DbmailMessage * dbmail_message_init_with_string(DbmailMessage *self, const char *str)
 {
-	char *buf, *crlf;
-	GMimeObject *content;
-	GMimeParser *parser;
 #define FROMLINE 80
 	char from[FROMLINE];
-	size_t buflen = strlen(str);
 
 	assert(self->content == NULL);
 
@@ -795,9 +1521,30 @@ DbmailMessage * dbmail_message_init_with_string(DbmailMessage *self, const char
 	}
 
 	self->stream = g_mime_stream_mem_new();
-	g_mime_stream_write(self->stream, str, buflen);
-	g_mime_stream_reset(self->stream);
+	g_mime_stream_write(self->stream, str, strlen(str));
+
+	return _message_parse_stream(self, from);
+}
+
+/* \brief initialize a previously created DbmailMessage from a raw buffer
+ * without copying it. The message takes ownership of bytes.
+ */
+static DbmailMessage * _message_init_with_bytes(DbmailMessage *self, GByteArray *bytes)
+{
+	assert(self->content == NULL);
+
+	self->stream = g_mime_stream_mem_new_with_byte_array(bytes);
+
+	return _message_parse_stream(self, NULL);
+}
+
+static DbmailMessage * _message_parse_stream(DbmailMessage *self, const char *from)
+{
+	char *buf, *crlf;
+	GMimeObject *content;
+	GMimeParser *parser;
 
+	g_mime_stream_reset(self->stream);
 	parser = g_mime_parser_new_with_stream(self->stream);
 
 
@@ -806,7 +1553,7 @@ DbmailMessage * dbmail_message_init_with_string(DbmailMessage *self, const char
 		g_object_unref(parser);
 		dbmail_message_set_class(self, DBMAIL_MESSAGE);
 		self->content = content;
-		if (from[0])
+		if (from && from[0])
 			dbmail_message_set_internal_date(self, from);
 	} else {
 		content = GMIME_OBJECT(g_mime_parser_construct_part(parser));
@@ -1045,87 +1792,396 @@ static DbmailMessage * _retrieve(DbmailMessage *self, const char *query_template
 	}
 	db_con_close(c);
 
-	if (row == 0) {
-		g_string_free(m, TRUE);
-		return NULL;
-	}
-	
-	self = dbmail_message_init_with_string(self,m->str);
-	dbmail_message_set_internal_date(self, internal_date);
+	if (row == 0) {
+		g_string_free(m, TRUE);
+		return NULL;
+	}
+	
+	self = dbmail_message_init_with_string(self,m->str);
+	dbmail_message_set_internal_date(self, internal_date);
+
+	if (internal_date) g_free(internal_date);
+	g_string_free(m,TRUE);
+
+	return self;
+}
+
+/*
+ *
+ * retrieve the full message
+ *
+ */
+static DbmailMessage * _fetch_full(DbmailMessage *self) 
+{
+	const char *query_template = "SELECT b.messageblk, b.is_header, %s "
+		"FROM %smessageblks b "
+		"JOIN %sphysmessage p ON b.physmessage_id=p.id "
+		"WHERE b.physmessage_id = %" PRIu64 " "
+		"ORDER BY b.messageblk_idnr";
+	return _retrieve(self, query_template);
+}
+
+/* \brief retrieve message
+ * \param empty DbmailMessage
+ * \param physmessage_id
+ * \return filled DbmailMessage
+ */
+DbmailMessage * dbmail_message_retrieve(DbmailMessage *self, uint64_t physid)
+{
+	assert(physid);
+	DbmailMessage *ptr;
+	
+	dbmail_message_set_physid(self, physid);
+	ptr = self;
+	
+	self = _fetch_full(self);
+
+	if ((!self) || (! self->content)) {
+		TRACE(TRACE_ERR, "retrieval failed for physid [%" PRIu64 "]", physid);
+		dbmail_message_free(ptr);
+		return NULL;
+	}
+
+	return self;
+}
+
+
+/* \brief store a temporary copy of a message.
+ * \param 	filled DbmailMessage
+ * \return 
+ *     - -1 on error
+ *     -  1 on success
+ */
+static int _update_message(DbmailMessage *self)
+{
+	uint64_t size    = (uint64_t)dbmail_message_get_size(self,FALSE);
+	uint64_t rfcsize = (uint64_t)dbmail_message_get_size(self,TRUE);
+
+	assert(size);
+	assert(rfcsize);
+
+	if (STORE_BATCHED(self)) {
+		Connection_T c = self->batch->c;
+		if (! db_exec(c, "UPDATE %sphysmessage SET messagesize = %" PRIu64 ", rfcsize = %" PRIu64 " WHERE id = %" PRIu64 "", 
+				DBPFX, size, rfcsize, self->id))
+			return DM_EQUERY;
+		if (! db_exec(c, "UPDATE %smessages SET status = %d WHERE message_idnr = %" PRIu64 "", 
+				DBPFX, MESSAGE_STATUS_NEW, self->msg_idnr))
+			return DM_EQUERY;
+		/* owner quota is updated after the commit */
+		return DM_SUCCESS;
+	}
+
+	if (! db_update("UPDATE %sphysmessage SET messagesize = %" PRIu64 ", rfcsize = %" PRIu64 " WHERE id = %" PRIu64 "", 
+			DBPFX, size, rfcsize, self->id))
+		return DM_EQUERY;
+
+	if (! db_update("UPDATE %smessages SET status = %d WHERE message_idnr = %" PRIu64 "", 
+			DBPFX, MESSAGE_STATUS_NEW, self->msg_idnr))
+		return DM_EQUERY;
+
+	if (! dm_quota_user_inc(db_get_useridnr(self->msg_idnr), size))
+		return DM_EQUERY;
+
+	return DM_SUCCESS;
+}
+
+
+static gboolean store_batch_enabled(void)
+{
+	Field_T config;
+
+	/* oracle has no multi-row VALUES and needs its own
+	 * transactions for blob comparison in blob_exists */
+	if (db_params.db_driver == DM_DRIVER_ORACLE)
+		return FALSE;
+
+	config_get_value("message_store_batch", "DBMAIL", config);
+	if (SMATCH(config, "true") || SMATCH(config, "yes"))
+		return TRUE;
+
+	return FALSE;
+}
+
+static gboolean batch_insert_rows(struct message_batch *b, const char *into, GList *rows)
+{
+	GString *q = g_string_new("");
+	gboolean t = TRUE;
+	int n = 0;
+
+	rows = g_list_first(rows);
+	while (rows && t) {
+		if (n == 0)
+			g_string_printf(q, "INSERT INTO %s%s VALUES ", DBPFX, into);
+		else
+			g_string_append_c(q, ',');
+		g_string_append(q, (const char *)rows->data);
+
+		if ((++n == BATCH_ROWS) || (! rows->next)) {
+			t = db_exec(b->c, "%s", q->str);
+			n = 0;
+		}
+		rows = g_list_next(rows);
+	}
+	g_string_free(q, TRUE);
+
+	return t;
+}
+
+static gboolean batch_insert_fields(struct message_batch *b, uint64_t physid)
+{
+	GList *rows, *first;
+	GString *q = g_string_new("");
+	PreparedStatement_T s;
+	const char *field;
+	volatile gboolean t = TRUE;
+	int n, i;
+
+	rows = g_list_first(b->fields);
+	TRY
+		while (rows) {
+			/* one statement per run of up to BATCH_ROWS rows for the same field */
+			first = rows;
+			field = ((gchar **)first->data)[0];
+			g_string_printf(q, "INSERT INTO %s%sfield (physmessage_id, %sfield) VALUES (?,?)", DBPFX, field, field);
+			for (n = 1, rows = rows->next; rows && (n < BATCH_ROWS); n++, rows = rows->next) {
+				if (! MATCH(((gchar **)rows->data)[0], field))
+					break;
+				g_string_append(q, ",(?,?)");
+			}
+
+			s = db_stmt_prepare(b->c, "%s", q->str);
+			for (i = 0; i < n; i++, first = first->next) {
+				db_stmt_set_u64(s, (i * 2) + 1, physid);
+				db_stmt_set_str(s, (i * 2) + 2, ((gchar **)first->data)[1]);
+			}
+			db_stmt_exec(s);
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = FALSE;
+	END_TRY;
+
+	g_string_free(q, TRUE);
+
+	return t;
+}
+
+static void batch_flush(DbmailMessage *self)
+{
+	struct message_batch *b = self->batch;
+
+	b->partlists = g_list_reverse(b->partlists);
+	b->headers = g_list_reverse(b->headers);
+	b->fields = g_list_reverse(b->fields);
+
+	if (! batch_insert_rows(b, "partlists (physmessage_id, is_header, part_key, part_depth, part_order, part_id)", b->partlists))
+		b->failed = TRUE;
+	else if (! batch_insert_rows(b, "header (physmessage_id, headername_id, headervalue_id)", b->headers))
+		b->failed = TRUE;
+	else if (! batch_insert_fields(b, self->id))
+		b->failed = TRUE;
+}
+
+static void batch_free(struct message_batch *b)
+{
+	GList *fields;
+
+	g_list_destroy(b->partlists);
+	g_list_destroy(b->headers);
+
+	fields = g_list_first(b->fields);
+	while (fields) {
+		g_strfreev((gchar **)fields->data);
+		fields = g_list_next(fields);
+	}
+	g_list_free(g_list_first(b->fields));
+
+	g_hash_table_destroy(b->header_keys);
+	g_hash_table_destroy(b->header_names);
+	g_hash_table_destroy(b->header_values);
+	g_hash_table_destroy(b->shared_names);
+	g_hash_table_destroy(b->shared_values);
+	memset(b, 0, sizeof(struct message_batch));
+}
+
+/*
+ * after a failed batch: TRUE if any of the ids the batch took from
+ * a shared cache is no longer in table
+ */
+static gboolean batch_stale(GHashTable *ids, const char *table)
+{
+	Connection_T c; ResultSet_T r;
+	GHashTableIter iter;
+	gpointer key;
+	GString *q;
+	volatile gboolean stale = FALSE;
+
+	if (! g_hash_table_size(ids))
+		return FALSE;
+
+	q = g_string_new("");
+	g_hash_table_iter_init(&iter, ids);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		g_string_append_printf(q, "%s%" PRIu64, q->len ? "," : "", *(uint64_t *)key);
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT COUNT(*) FROM %s%s WHERE id IN (%s)", DBPFX, table, q->str);
+		if (db_result_next(r))
+			stale = ((unsigned)db_result_get_int(r, 0) != g_hash_table_size(ids));
+	CATCH(SQLException)
+		LOG_SQLERROR;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	g_string_free(q, TRUE);
+
+	if (stale)
+		TRACE(TRACE_INFO, "cached %s ids are stale", table);
+
+	return stale;
+}
+
+static int _message_store_batch(DbmailMessage *self, uint64_t user_idnr, const char *unique_id)
+{
+	struct message_batch batch;
+	uint64_t size;
+	gboolean failed;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.header_keys = g_hash_table_new_full((GHashFunc)g_str_hash,
+			(GEqualFunc)g_str_equal, (GDestroyNotify)g_free, NULL);
+	batch.header_names = g_hash_table_new_full((GHashFunc)g_str_hash,
+			(GEqualFunc)g_str_equal, (GDestroyNotify)g_free, (GDestroyNotify)g_free);
+	batch.header_values = g_hash_table_new_full((GHashFunc)g_str_hash,
+			(GEqualFunc)g_str_equal, (GDestroyNotify)g_free, (GDestroyNotify)g_free);
+	batch.shared_names = g_hash_table_new_full((GHashFunc)g_int64_hash,
+			(GEqualFunc)g_int64_equal, (GDestroyNotify)g_free, NULL);
+	batch.shared_values = g_hash_table_new_full((GHashFunc)g_int64_hash,
+			(GEqualFunc)g_int64_equal, (GDestroyNotify)g_free, NULL);
+	batch.c = db_con_get();
+
+	self->batch = &batch;
+	self->part_key = 0;
+	self->part_depth = 0;
+	self->part_order = 0;
+
+	TRY
+		db_begin_transaction(batch.c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		batch.failed = TRUE;
+	END_TRY;
+
+	/* create a message record */
+	if ((! batch.failed) && (_message_insert(self, user_idnr, DBMAIL_TEMPMBOX, unique_id) < 0))
+		batch.failed = TRUE;
+
+	/* update message meta-data */
+	if ((! batch.failed) && (_update_message(self) < 0))
+		batch.failed = TRUE;
+
+	/* store the message mime-parts */
+	if ((! batch.failed) && dm_message_store(self))
+		batch.failed = TRUE;
+
+	/* store message headers */
+	if ((! batch.failed) && (dbmail_message_cache_headers(self) < 0))
+		batch.failed = TRUE;
+
+	if (! batch.failed)
+		dbmail_message_cache_envelope(self);
+
+	if (! batch.failed)
+		dbmail_message_cache_sortkeys(self);
 
-	if (internal_date) g_free(internal_date);
-	g_string_free(m,TRUE);
+	if (! batch.failed)
+		dbmail_message_cache_fulltext(self);
 
-	return self;
-}
+	if (! batch.failed)
+		batch_flush(self);
 
-/*
- *
- * retrieve the full message
- *
- */
-static DbmailMessage * _fetch_full(DbmailMessage *self) 
-{
-	const char *query_template = "SELECT b.messageblk, b.is_header, %s "
-		"FROM %smessageblks b "
-		"JOIN %sphysmessage p ON b.physmessage_id=p.id "
-		"WHERE b.physmessage_id = %" PRIu64 " "
-		"ORDER BY b.messageblk_idnr";
-	return _retrieve(self, query_template);
-}
+	TRY
+		if (batch.failed)
+			db_rollback_transaction(batch.c);
+		else
+			db_commit_transaction(batch.c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		batch.failed = TRUE;
+	FINALLY
+		db_con_close(batch.c);
+	END_TRY;
 
-/* \brief retrieve message
- * \param empty DbmailMessage
- * \param physmessage_id
- * \return filled DbmailMessage
- */
-DbmailMessage * dbmail_message_retrieve(DbmailMessage *self, uint64_t physid)
-{
-	assert(physid);
-	DbmailMessage *ptr;
-	
-	dbmail_message_set_physid(self, physid);
-	ptr = self;
-	
-	self = _fetch_full(self);
+	failed = batch.failed;
+	self->batch = NULL;
 
-	if ((!self) || (! self->content)) {
-		TRACE(TRACE_ERR, "retrieval failed for physid [%" PRIu64 "]", physid);
-		dbmail_message_free(ptr);
-		return NULL;
+	/* headernames and headervalues inserted by this transaction
+	 * are only safe to share once they are committed; after a
+	 * rollback they are dropped with the batch. The shared caches
+	 * are only reset if they handed out an id that is gone. */
+	if (! failed) {
+		g_hash_table_foreach(batch.header_names, header_names_publish, NULL);
+		g_hash_table_foreach(batch.header_values, header_values_publish, NULL);
+	} else {
+		if (batch_stale(batch.shared_names, "headername"))
+			header_names_reset();
+		if (batch_stale(batch.shared_values, "headervalue"))
+			header_values_reset();
 	}
 
-	return self;
-}
+	batch_free(&batch);
 
+	if (failed) {
+		self->id = 0;
+		self->msg_idnr = 0;
+		return DM_EQUERY;
+	}
 
-/* \brief store a temporary copy of a message.
+	size = (uint64_t)dbmail_message_get_size(self,FALSE);
+	if (! dm_quota_user_inc(db_get_useridnr(self->msg_idnr), size))
+		return DM_EQUERY;
+
+	return DM_SUCCESS;
+}
+
+/* \brief store a message using a single connection and transaction
  * \param 	filled DbmailMessage
  * \return 
- *     - -1 on error
- *     -  1 on success
+ *     - DM_EQUERY on error
+ *     - DM_SUCCESS on success
  */
-static int _update_message(DbmailMessage *self)
+int dbmail_message_store_batched(DbmailMessage *self)
 {
-	uint64_t size    = (uint64_t)dbmail_message_get_size(self,FALSE);
-	uint64_t rfcsize = (uint64_t)dbmail_message_get_size(self,TRUE);
+	uint64_t user_idnr;
+	char unique_id[UID_SIZE];
+	int res = DM_EQUERY, i = 1, retry = 10, delay = 200;
 
-	assert(size);
-	assert(rfcsize);
-	if (! db_update("UPDATE %sphysmessage SET messagesize = %" PRIu64 ", rfcsize = %" PRIu64 " WHERE id = %" PRIu64 "", 
-			DBPFX, size, rfcsize, self->id))
+	if (db_params.db_driver == DM_DRIVER_ORACLE) {
+		TRACE(TRACE_INFO, "batched store not supported for this driver");
 		return DM_EQUERY;
+	}
 
-	if (! db_update("UPDATE %smessages SET status = %d WHERE message_idnr = %" PRIu64 "", 
-			DBPFX, MESSAGE_STATUS_NEW, self->msg_idnr))
+	if (! auth_user_exists(DBMAIL_DELIVERY_USERNAME, &user_idnr)) {
+		TRACE(TRACE_ERR, "unable to find user_idnr for user [%s]. Make sure this system user is in the database!", DBMAIL_DELIVERY_USERNAME);
 		return DM_EQUERY;
+	}
 
-	if (! dm_quota_user_inc(db_get_useridnr(self->msg_idnr), size))
-		return DM_EQUERY;
+	create_unique_id(unique_id, user_idnr);
 
-	return DM_SUCCESS;
-}
+	/* the whole message is rolled back on failure, so 
+	 * each retry starts from scratch */
+	while (i++ < retry) {
+		if ((res = _message_store_batch(self, user_idnr, unique_id)) == DM_SUCCESS)
+			break;
+		TRACE(TRACE_WARNING, "batched store failed, retry [%d]", i);
+		usleep(delay*i);
+	}
 
+	return res;
+}
 
 int dbmail_message_store(DbmailMessage *self)
 {
@@ -1134,6 +2190,9 @@ int dbmail_message_store(DbmailMessage *self)
 	int res = 0, i = 1, retry = 10, delay = 200;
 	int step = 0;
 	
+	if (store_batch_enabled())
+		return dbmail_message_store_batched(self);
+
 	if (! auth_user_exists(DBMAIL_DELIVERY_USERNAME, &user_idnr)) {
 		TRACE(TRACE_ERR, "unable to find user_idnr for user [%s]. Make sure this system user is in the database!", DBMAIL_DELIVERY_USERNAME);
 		return DM_EQUERY;
@@ -1177,6 +2236,8 @@ int dbmail_message_store(DbmailMessage *self)
 			}
 
 			dbmail_message_cache_envelope(self);
+			dbmail_message_cache_sortkeys(self);
+			dbmail_message_cache_fulltext(self);
 
 			step++;
 		}
@@ -1263,9 +2324,9 @@ int _message_insert(DbmailMessage *self,
 	/* insert a new physmessage entry */
 	
 	/* now insert an entry into the messages table */
-	c = db_con_get();
+	c = store_con_get(self);
 	TRY
-		db_begin_transaction(c);
+		store_begin(self, c);
 		insert_physmessage(self, c);
 
 		if (db_params.db_driver == DM_DRIVER_ORACLE) {
@@ -1290,13 +2351,13 @@ int _message_insert(DbmailMessage *self,
 		TRACE(TRACE_DEBUG,"new message_idnr [%" PRIu64 "]", self->msg_idnr);
 
 		t = DM_SUCCESS;
-		db_commit_transaction(c);
+		store_commit(self, c);
 	CATCH(SQLException)
 		LOG_SQLERROR;
-		db_rollback_transaction(c);
+		store_rollback(self, c);
 		t = DM_EQUERY;
 	FINALLY
-		db_con_close(c);
+		store_con_close(self, c);
 	END_TRY;
 
 	return t;
@@ -1328,12 +2389,12 @@ void _message_cache_envelope_date(const DbmailMessage *self)
 
 	_header_name_get_id(self, "Date", &headername_id);
 	if (headername_id)
-		_header_value_get_id(value, sortfield, datefield, &headervalue_id);
+		_header_value_get_id(self, value, sortfield, datefield, &headervalue_id);
 
 	g_free(value);
 
 	if (headervalue_id && headername_id)
-		_header_insert(self->id, headername_id, headervalue_id);
+		_header_insert(self, self->id, headername_id, headervalue_id);
 }
 
 int dbmail_message_cache_headers(const DbmailMessage *self)
@@ -1407,7 +2468,14 @@ static int _header_name_get_id(const DbmailMessage *self, const char *header, ui
 
 	// rfc822 headernames are case-insensitive
 	safe_header = g_ascii_strdown(header,-1);
-	if ((cacheid = g_hash_table_lookup(self->header_dict, (gconstpointer)safe_header)) != NULL) {
+	if (header_names_lookup(safe_header, id)) {
+		if (STORE_BATCHED(self))
+			batch_shared(self->batch->shared_names, *id);
+		g_free(safe_header);
+		return 1;
+	}
+
+	if (STORE_BATCHED(self) && (cacheid = g_hash_table_lookup(self->batch->header_names, safe_header))) {
 		*id = *(uint64_t *)cacheid;
 		g_free(safe_header);
 		return 1;
@@ -1423,10 +2491,10 @@ static int _header_name_get_id(const DbmailMessage *self, const char *header, ui
 	case_header = g_strdup_printf(db_get_sql(SQL_STRCASE),"headername");
 	tmp = g_new0(uint64_t,1);
 
-	c = db_con_get();
+	c = store_con_get(self);
 
 	TRY
-		db_begin_transaction(c);
+		store_begin(self, c);
 		*tmp = 0;
 		s = db_stmt_prepare(c, "SELECT id FROM %sheadername WHERE %s=?", DBPFX, case_header);
 		db_stmt_set_str(s,1,safe_header);
@@ -1456,14 +2524,14 @@ static int _header_name_get_id(const DbmailMessage *self, const char *header, ui
 			}
 		}
 		t = TRUE;
-		db_commit_transaction(c);
+		store_commit(self, c);
 
 	CATCH(SQLException)
 		LOG_SQLERROR;
-		db_rollback_transaction(c);
+		store_rollback(self, c);
 		t = DM_EQUERY;
 	FINALLY
-		db_con_close(c);
+		store_con_close(self, c);
 	END_TRY;
 
 	g_free(case_header);
@@ -1475,7 +2543,16 @@ static int _header_name_get_id(const DbmailMessage *self, const char *header, ui
 	}
 
 	*id = *tmp;
-	g_hash_table_insert(self->header_dict, (gpointer)(safe_header), (gpointer)(tmp));
+	if (*tmp == 0) {
+		g_free(safe_header);
+		g_free(tmp);
+	} else if (STORE_BATCHED(self)) {
+		g_hash_table_insert(self->batch->header_names, (gpointer)(safe_header), (gpointer)(tmp));
+	} else {
+		header_names_insert(safe_header, *tmp);
+		g_free(safe_header);
+		g_free(tmp);
+	}
 	return 1;
 }
 
@@ -1539,12 +2616,18 @@ static uint64_t _header_value_insert(Connection_T c, const char *value, const ch
 	}
 	TRACE(TRACE_DATABASE,"new headervalue.id [%" PRIu64 "]", id);
 
+	if (id && (trigram_mode() == TRIGRAM_TABLE))
+		trigram_index_value(c, id, value);
+
 	return id;
 }
 
-static int _header_value_get_id(const char *value, const char *sortfield, const char *datefield, uint64_t *id)
+static int _header_value_get_id(const DbmailMessage *self, const char *value, const char *sortfield, const char *datefield, uint64_t *id)
 {
-	uint64_t tmp = 0;
+	volatile uint64_t tmp = 0;
+	volatile gboolean inserted = FALSE;
+	gpointer cacheid;
+	gchar *key;
 	char hash[FIELDSIZE];
 	memset(hash, 0, sizeof(hash));
 
@@ -1552,30 +2635,120 @@ static int _header_value_get_id(const char *value, const char *sortfield, const
 	if (dm_get_hash_for_string(value, hash))
 		return FALSE;
 
-	c = db_con_get();
+	key = g_strdup_printf("%s:%" PRIu64, hash, (uint64_t)strlen(value));
+	if (header_values_lookup(key, id)) {
+		if (STORE_BATCHED(self))
+			batch_shared(self->batch->shared_values, *id);
+		g_free(key);
+		return TRUE;
+	}
+
+	if (STORE_BATCHED(self) && (cacheid = g_hash_table_lookup(self->batch->header_values, key))) {
+		*id = *(uint64_t *)cacheid;
+		g_free(key);
+		return TRUE;
+	}
+
+	c = store_con_get(self);
 	TRY
-		db_begin_transaction(c);
+		store_begin(self, c);
 		if ((tmp = _header_value_exists(c, value, (const char *)hash)) != 0)
 			*id = tmp;
-		else if ((tmp = _header_value_insert(c, value, sortfield, datefield, (const char *)hash)) != 0)
+		else if ((tmp = _header_value_insert(c, value, sortfield, datefield, (const char *)hash)) != 0) {
 			*id = tmp;
-		db_commit_transaction(c);
+			inserted = TRUE;
+		}
+		store_commit(self, c);
 	CATCH(SQLException)
 		LOG_SQLERROR;
-		db_rollback_transaction(c);
+		store_rollback(self, c);
 		*id = 0;
+		tmp = 0;
 	FINALLY
-		db_con_close(c);
+		store_con_close(self, c);
 	END_TRY;
 
+	if (tmp && inserted && STORE_BATCHED(self)) {
+		uint64_t *pending = g_new0(uint64_t, 1);
+		*pending = tmp;
+		g_hash_table_insert(self->batch->header_values, key, pending);
+		return TRUE;
+	}
+
+	if (tmp)
+		header_values_insert(key, tmp);
+
+	g_free(key);
+
 	return TRUE;
 }
 
-static gboolean _header_insert(uint64_t physmessage_id, uint64_t headername_id, uint64_t headervalue_id)
+/*
+ * a header row failed to insert: a repeated identical header maps onto
+ * the existing row, which is fine. Otherwise one of the cached ids may
+ * have gone stale, and only then is the cache that handed it out dropped.
+ *
+ * returns TRUE if the row exists
+ */
+static gboolean _header_insert_failed(uint64_t physmessage_id, uint64_t headername_id, uint64_t headervalue_id)
+{
+	Connection_T c; ResultSet_T r;
+	volatile gboolean exists = FALSE, name = TRUE, value = TRUE;
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT "
+				"(SELECT COUNT(*) FROM %sheader WHERE physmessage_id=%" PRIu64 " "
+				"AND headername_id=%" PRIu64 " AND headervalue_id=%" PRIu64 "), "
+				"(SELECT COUNT(*) FROM %sheadername WHERE id=%" PRIu64 "), "
+				"(SELECT COUNT(*) FROM %sheadervalue WHERE id=%" PRIu64 ")",
+				DBPFX, physmessage_id, headername_id, headervalue_id,
+				DBPFX, headername_id, DBPFX, headervalue_id);
+		if (db_result_next(r)) {
+			exists = db_result_get_int(r, 0) ? TRUE : FALSE;
+			name = db_result_get_int(r, 1) ? TRUE : FALSE;
+			value = db_result_get_int(r, 2) ? TRUE : FALSE;
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if (exists)
+		return TRUE;
+
+	if (! name) {
+		TRACE(TRACE_INFO, "headername id [%" PRIu64 "] is stale", headername_id);
+		header_names_reset();
+	}
+	if (! value) {
+		TRACE(TRACE_INFO, "headervalue id [%" PRIu64 "] is stale", headervalue_id);
+		header_values_reset();
+	}
+
+	return FALSE;
+}
+
+static gboolean _header_insert(const DbmailMessage *self, uint64_t physmessage_id, uint64_t headername_id, uint64_t headervalue_id)
 {
 
 	Connection_T c; PreparedStatement_T s; volatile gboolean t = TRUE;
 
+	if (STORE_BATCHED(self)) {
+		/* repeated identical headers map onto the same row */
+		gchar *key = g_strdup_printf("%" PRIu64 ":%" PRIu64, headername_id, headervalue_id);
+		if (g_hash_table_lookup(self->batch->header_keys, key)) {
+			g_free(key);
+			return TRUE;
+		}
+		g_hash_table_insert(self->batch->header_keys, key, GINT_TO_POINTER(1));
+		self->batch->headers = g_list_prepend(self->batch->headers,
+				g_strdup_printf("(%" PRIu64 ",%" PRIu64 ",%" PRIu64 ")",
+					physmessage_id, headername_id, headervalue_id));
+		return TRUE;
+	}
+
 	c = db_con_get();
 	db_con_clear(c);
 	TRY
@@ -1592,6 +2765,9 @@ static gboolean _header_insert(uint64_t physmessage_id, uint64_t headername_id,
 	FINALLY
 		db_con_close(c);
 	END_TRY;
+
+	if (! t)
+		t = _header_insert_failed(physmessage_id, headername_id, headervalue_id);
 	
 	return t;
 }
@@ -1762,14 +2938,15 @@ static void _header_cache(const char *header, const char *raw, gpointer user_dat
 		g_utf8_strncpy(sortfield, value, CACHE_WIDTH-1);
 
 	/* Fetch header value id if exists, else insert, and return new id */
-	_header_value_get_id(value, sortfield, datefield, &headervalue_id);
+	_header_value_get_id(self, value, sortfield, datefield, &headervalue_id);
 
 	g_free(value);
 
 	/* Insert relation between physmessage, header name and header value */
-	if (headervalue_id)
-		_header_insert(self->id, headername_id, headervalue_id);
-	else
+	if (headervalue_id) {
+		if (! _header_insert(self, self->id, headername_id, headervalue_id))
+			TRACE(TRACE_INFO, "error inserting header [%s]. skipping.", header);
+	} else
 		TRACE(TRACE_INFO, "error inserting headervalue. skipping.");
 
 	headervalue_id=0;
@@ -1778,7 +2955,7 @@ static void _header_cache(const char *header, const char *raw, gpointer user_dat
 	date=0;
 }
 
-static void insert_field_cache(uint64_t physid, const char *field, const char *value)
+static void insert_field_cache(const DbmailMessage *self, uint64_t physid, const char *field, const char *value)
 {
 	gchar *clean_value;
 	Connection_T c; PreparedStatement_T s;
@@ -1788,6 +2965,14 @@ static void insert_field_cache(uint64_t physid, const char *field, const char *v
 	/* field values are truncated to 255 bytes */
 	clean_value = g_strndup(value,CACHE_WIDTH);
 
+	if (STORE_BATCHED(self)) {
+		gchar **row = g_new0(gchar *, 3);
+		row[0] = g_strdup(field);
+		row[1] = clean_value;
+		self->batch->fields = g_list_prepend(self->batch->fields, row);
+		return;
+	}
+
 	c = db_con_get();
 	TRY
 		db_begin_transaction(c);
@@ -1836,7 +3021,7 @@ void dbmail_message_cache_referencesfield(const DbmailMessage *self)
 	
 	while (refs->msgid) {
 		if (! g_tree_lookup(tree,refs->msgid)) {
-			insert_field_cache(self->id, "references", refs->msgid);
+			insert_field_cache(self, self->id, "references", refs->msgid);
 			g_tree_insert(tree,refs->msgid,refs->msgid);
 		}
 		if (refs->next == NULL)
@@ -1848,33 +3033,248 @@ void dbmail_message_cache_referencesfield(const DbmailMessage *self)
 	g_mime_references_clear(&head);
 }
 	
+/*
+ * BODYSTRUCTURE and BODY are cached next to the envelope, so FETCH can
+ * answer them without retrieving the mimeparts.
+ */
+static gboolean structure_cache_enabled(void)
+{
+	return db_params.db_driver != DM_DRIVER_ORACLE;
+}
+
 void dbmail_message_cache_envelope(const DbmailMessage *self)
 {
-	char *envelope = NULL;
+	char *envelope = NULL, *bodystructure = NULL, *body = NULL;
 	Connection_T c; PreparedStatement_T s;
 
 	envelope = imap_get_envelope(GMIME_MESSAGE(self->content));
+	if (structure_cache_enabled()) {
+		bodystructure = imap_get_structure(GMIME_MESSAGE(self->content), 1);
+		body = imap_get_structure(GMIME_MESSAGE(self->content), 0);
+	}
 
-	c = db_con_get();
+	c = store_con_get(self);
 	TRY
-		db_begin_transaction(c);
-		s = db_stmt_prepare(c, "INSERT INTO %senvelope (physmessage_id, envelope) VALUES (?,?)", DBPFX);
+		store_begin(self, c);
+		if (bodystructure && body) {
+			s = db_stmt_prepare(c, "INSERT INTO %senvelope (physmessage_id, envelope, bodystructure, body) "
+					"VALUES (?,?,?,?)", DBPFX);
+			db_stmt_set_str(s, 3, bodystructure);
+			db_stmt_set_str(s, 4, body);
+		} else {
+			s = db_stmt_prepare(c, "INSERT INTO %senvelope (physmessage_id, envelope) VALUES (?,?)", DBPFX);
+		}
 		db_stmt_set_u64(s, 1, self->id);
 		db_stmt_set_str(s, 2, envelope);
 		db_stmt_exec(s);
-		db_commit_transaction(c);
+		store_commit(self, c);
 	CATCH(SQLException)
 		LOG_SQLERROR;
-		db_rollback_transaction(c);
+		store_rollback(self, c);
 		TRACE(TRACE_ERR, "insert envelope failed [%s]", envelope);
 	FINALLY
-		db_con_close(c);
+		store_con_close(self, c);
 	END_TRY;
 
 	g_free(envelope);
+	g_free(bodystructure);
+	g_free(body);
 	envelope = NULL;
 }
 
+int dbmail_message_cache_bodystructure(const DbmailMessage *self)
+{
+	char *bodystructure = NULL, *body = NULL;
+	Connection_T c; PreparedStatement_T s;
+	volatile int t = DM_SUCCESS;
+
+	if (! structure_cache_enabled())
+		return DM_SUCCESS;
+
+	bodystructure = imap_get_structure(GMIME_MESSAGE(self->content), 1);
+	body = imap_get_structure(GMIME_MESSAGE(self->content), 0);
+	if (! (bodystructure && body)) {
+		g_free(bodystructure);
+		g_free(body);
+		return DM_EQUERY;
+	}
+
+	c = db_con_get();
+	TRY
+		s = db_stmt_prepare(c, "UPDATE %senvelope SET bodystructure = ?, body = ? WHERE physmessage_id = ?", DBPFX);
+		db_stmt_set_str(s, 1, bodystructure);
+		db_stmt_set_str(s, 2, body);
+		db_stmt_set_u64(s, 3, self->id);
+		db_stmt_exec(s);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	g_free(bodystructure);
+	g_free(body);
+
+	return t;
+}
+
+/*
+ * full-text index: the words of the headers and decoded text parts
+ * are stored by the configured backend when fulltext_index is set.
+ */
+int dbmail_message_cache_fulltext(const DbmailMessage *self)
+{
+	const FulltextBackend *backend;
+	GHashTable *terms;
+	gboolean complete = TRUE;
+	Connection_T c;
+	volatile int t = DM_SUCCESS;
+
+	if (! (backend = fulltext_backend()))
+		return DM_SUCCESS;
+
+	if (! (terms = fulltext_message_terms(self->content, &complete)))
+		return DM_EQUERY;
+
+	c = store_con_get(self);
+	TRY
+		store_begin(self, c);
+		t = backend->index(c, self->id, terms, complete);
+		store_commit(self, c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		store_rollback(self, c);
+		t = DM_EQUERY;
+	FINALLY
+		store_con_close(self, c);
+	END_TRY;
+
+	g_hash_table_destroy(terms);
+
+	return t;
+}
+
+/*
+ * sort keys: what SORT compares, stored per physmessage so sorting a
+ * mailbox does not have to join the header tables. Strings are kept
+ * case-folded and dates in UTC, so they compare byte by byte.
+ */
+#define SORTKEY_WIDTH 255
+
+static void _sortkey_copy(char *dst, const char *src)
+{
+	char *t = g_utf8_casefold(src, -1);
+	g_utf8_strncpy(dst, t, SORTKEY_WIDTH-1);
+	g_free(t);
+}
+
+/* the mailbox part and display name of the first address in a header */
+static void _sortkey_address(const DbmailMessage *self, const char *header, char *mailbox, char *name)
+{
+	InternetAddressList *list;
+	InternetAddress *ia;
+	const char *raw, *addr, *display;
+	char *value, *at;
+
+	if (! (raw = dbmail_message_get_header(self, header)))
+		return;
+	if (! (value = dbmail_iconv_decode_field(raw, dbmail_message_get_charset(self), TRUE)))
+		return;
+
+	list = internet_address_list_parse_string(value);
+	g_free(value);
+	if (! list)
+		return;
+
+	if ((internet_address_list_length(list) > 0) &&
+			(ia = internet_address_list_get_address(list, 0)) &&
+			INTERNET_ADDRESS_IS_MAILBOX(ia) &&
+			(addr = internet_address_mailbox_get_addr((InternetAddressMailbox *)ia))) {
+		value = g_strdup(addr);
+		if ((at = strchr(value, '@')))
+			*at = '\0';
+		_sortkey_copy(mailbox, value);
+		g_free(value);
+
+		if (name) {
+			display = internet_address_get_name(ia);
+			_sortkey_copy(name, (display && strlen(display)) ? display : addr);
+		}
+	}
+
+	g_object_unref(list);
+}
+
+int dbmail_message_cache_sortkeys(const DbmailMessage *self)
+{
+	char subject[SORTKEY_WIDTH*4], fromaddr[SORTKEY_WIDTH*4], fromname[SORTKEY_WIDTH*4];
+	char toaddr[SORTKEY_WIDTH*4], ccaddr[SORTKEY_WIDTH*4];
+	char sentdate[SQL_INTERNALDATE_LEN];
+	const char *raw;
+	char *value, *base;
+	time_t date = 0;
+	int offset;
+	Connection_T c; PreparedStatement_T s;
+	volatile int t = DM_SUCCESS;
+
+	// there is no sort key table on oracle
+	if (db_params.db_driver == DM_DRIVER_ORACLE)
+		return DM_SUCCESS;
+
+	memset(subject, 0, sizeof(subject));
+	memset(fromaddr, 0, sizeof(fromaddr));
+	memset(fromname, 0, sizeof(fromname));
+	memset(toaddr, 0, sizeof(toaddr));
+	memset(ccaddr, 0, sizeof(ccaddr));
+	memset(sentdate, 0, sizeof(sentdate));
+
+	if ((raw = dbmail_message_get_header(self, "Subject")) &&
+			(value = dbmail_iconv_decode_field(raw, dbmail_message_get_charset(self), FALSE))) {
+		if ((base = dm_base_subject(value))) {
+			_sortkey_copy(subject, base);
+			g_free(base);
+		}
+		g_free(value);
+	}
+
+	_sortkey_address(self, "From", fromaddr, fromname);
+	_sortkey_address(self, "To", toaddr, NULL);
+	_sortkey_address(self, "Cc", ccaddr, NULL);
+
+	// messages without a usable Date: sort by their internal date
+	if ((raw = dbmail_message_get_header(self, "Date")))
+		date = g_mime_utils_header_decode_date(raw, &offset);
+	if (date <= 0)
+		date = self->internal_date;
+	strftime(sentdate, sizeof(sentdate), "%Y-%m-%d %H:%M:%S", gmtime(&date));
+
+	c = store_con_get(self);
+	TRY
+		store_begin(self, c);
+		s = db_stmt_prepare(c, "INSERT INTO %ssortkeys "
+				"(physmessage_id, subject, fromaddr, fromname, toaddr, ccaddr, sentdate) "
+				"VALUES (?,?,?,?,?,?,?)", DBPFX);
+		db_stmt_set_u64(s, 1, self->id);
+		db_stmt_set_str(s, 2, subject);
+		db_stmt_set_str(s, 3, fromaddr);
+		db_stmt_set_str(s, 4, fromname);
+		db_stmt_set_str(s, 5, toaddr);
+		db_stmt_set_str(s, 6, ccaddr);
+		db_stmt_set_str(s, 7, sentdate);
+		db_stmt_exec(s);
+		store_commit(self, c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		store_rollback(self, c);
+		t = DM_EQUERY;
+	FINALLY
+		store_con_close(self, c);
+	END_TRY;
+
+	return t;
+}
+
 // 
 // construct a new message where only sender, recipient, subject and 
 // a body are known. The body can be any kind of charset. Make sure
@@ -53,11 +53,31 @@ DbmailMessage * dbmail_message_construct(DbmailMessage *self,
  * database facilities
  */
 
+/* unique index on mimeparts(hash,size) that mimepart_dedup = digest
+ * relies on, created by dbmail-util --dedup */
+#define MIMEPART_DIGEST_INDEX "mimeparts_3"
+
+/** \brief TRUE if mimeparts may be stored compressed, so their data can not be searched by the database */
+gboolean dm_message_compressed_parts(void);
+
 int dbmail_message_store(DbmailMessage *message);
+int dbmail_message_store_batched(DbmailMessage *message);
 int dbmail_message_cache_headers(const DbmailMessage *message);
 gboolean dm_message_store(DbmailMessage *m);
 
 DbmailMessage * dbmail_message_retrieve(DbmailMessage *self, uint64_t physid);
+int dbmail_message_retrieve_range(GList *physids, GTree *messages, Mempool_T pool);
+
+/*
+ * process-wide headername cache
+ */
+void dbmail_message_header_names_init(void);
+void dbmail_message_header_names_stats(uint64_t *hits, uint64_t *misses);
+
+/*
+ * process-wide headervalue cache
+ */
+void dbmail_message_header_values_stats(uint64_t *hits, uint64_t *misses);
 
 /*
  * attribute accessors
@@ -97,6 +117,9 @@ GList * dbmail_message_get_header_repeated(const DbmailMessage *self, const char
 
 void dbmail_message_cache_referencesfield(const DbmailMessage *self);
 void dbmail_message_cache_envelope(const DbmailMessage *self);
+int dbmail_message_cache_bodystructure(const DbmailMessage *self);
+int dbmail_message_cache_fulltext(const DbmailMessage *self);
+int dbmail_message_cache_sortkeys(const DbmailMessage *self);
 
 /*
  * destructor
@@ -820,12 +820,15 @@ int check_date(const char *date)
 /*
  * check_msg_set()
  *
- * checks if s represents a valid message set 
+ * checks if s represents a valid message set, or $ for the
+ * saved search result
  */
 int check_msg_set(const char *s)
 {
 	int i, indigit=0, result = 1;
 	
+	if (s && MATCH(s, "$")) return 1;
+
 	if (!s || (!isdigit(s[0]) && s[0]!= '*') ) return 0;
 
 	for (i = 0; s[i]; i++) {
@@ -884,6 +887,47 @@ char *date_sql2imap(const char *sqldate)
 }
 
 
+/*
+ * convert a sql date (yyyy-mm-dd hh:mm:ss, UTC) to a timestamp
+ * returns 0 if the date can not be parsed
+ */
+time_t date_sql2epoch(const char *sqldate)
+{
+	struct tm tm_sql_date;
+	char *last;
+
+	if (! sqldate)
+		return 0;
+
+	memset(&tm_sql_date, 0, sizeof(struct tm));
+	last = strptime(sqldate,"%Y-%m-%d %H:%M:%S", &tm_sql_date);
+	if ( (last == NULL) || (*last != '\0') )
+		return 0;
+
+	return timegm(&tm_sql_date);
+}
+
+/*
+ * the IMAP internal date for a timestamp, as date_sql2imap would
+ * format the same sql date
+ */
+char *date_epoch2imap(time_t date)
+{
+	struct tm gmt;
+	char _imapdate[IMAP_INTERNALDATE_LEN] = IMAP_STANDARD_DATE;
+	char q[IMAP_INTERNALDATE_LEN];
+
+	if (! date)
+		return g_strdup(_imapdate);
+
+	memset(&gmt, 0, sizeof(struct tm));
+	gmtime_r(&date, &gmt);
+	strftime(q, sizeof(q), "%d-%b-%Y %H:%M:%S", &gmt);
+	snprintf(_imapdate,IMAP_INTERNALDATE_LEN, "%s +0000", q);
+
+	return g_strdup(_imapdate);
+}
+
 /*
  * convert TO a mySQL date (yyyy-mm-dd) FROM a valid IMAP internal date:
  *                          0123456789
@@ -2409,6 +2453,40 @@ char * dm_base64_decode(const gchar *s, uint64_t *len)
 	return r;
 }
 
+char * dm_gzip(const void *buf, size_t len, gboolean compress, size_t *outlen)
+{
+	GByteArray *result;
+	GMimeStream *out, *stream;
+	GMimeFilter *filter;
+	ssize_t written;
+
+	result = g_byte_array_sized_new(compress ? (len / 2) + 64 : (len * 4) + 1);
+
+	out = g_mime_stream_mem_new_with_byte_array(result);
+	g_mime_stream_mem_set_owner(GMIME_STREAM_MEM(out), FALSE);
+	stream = g_mime_stream_filter_new(out);
+	filter = g_mime_filter_gzip_new(compress ? GMIME_FILTER_GZIP_MODE_ZIP : GMIME_FILTER_GZIP_MODE_UNZIP, 6);
+	g_mime_stream_filter_add(GMIME_STREAM_FILTER(stream), filter);
+	g_object_unref(filter);
+
+	written = g_mime_stream_write(stream, (char *)buf, len);
+	g_mime_stream_flush(stream);
+	g_object_unref(stream);
+	g_object_unref(out);
+
+	if (written < 0 || (len && ! result->len)) {
+		TRACE(TRACE_ERR, "gzip %s failed on [%zu] bytes", compress ? "compression" : "decompression", len);
+		g_byte_array_free(result, TRUE);
+		*outlen = 0;
+		return NULL;
+	}
+
+	*outlen = result->len;
+	g_byte_array_append(result, (const guint8 *)"", 1);
+
+	return (char *)g_byte_array_free(result, FALSE);
+}
+
 
 uint64_t stridx(const char *s, char c)
 {
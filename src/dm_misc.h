@@ -127,6 +127,8 @@ int dm_valid_format(const char *str);
 
 
 char *date_sql2imap(const char *sqldate);
+time_t date_sql2epoch(const char *sqldate);
+char *date_epoch2imap(time_t date);
 int date_imap2sql(const char *imapdate, char *);
 
 int checkmailboxname(const char *s);
@@ -170,6 +172,10 @@ int dm_get_hash_for_string(const char *buf, char *hash);
 
 char * dm_base64_decode(const gchar *s, uint64_t *len);
 
+/* gzip (de)compress len bytes of buf. The result is NUL terminated,
+ * *outlen excludes the terminator. Free with g_free. */
+char * dm_gzip(const void *buf, size_t len, gboolean compress, size_t *outlen);
+
 uint64_t stridx(const char *s, char c);
 
 #define get_crlf_encoded(string) get_crlf_encoded_opt(string, 0)
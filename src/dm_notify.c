@@ -0,0 +1,232 @@
+/*
+
+ Copyright (c) 2004-2012 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * mailbox change notifications
+ *
+ * every process that wants to hear about changes binds a unix datagram
+ * socket in notify_directory. Publishers send the mailbox id and its
+ * new seq to each socket found there. Sends never block: a listener
+ * that falls behind loses notifications and catches up by polling.
+ * Sockets left behind by processes that went away are removed.
+ */
+
+#include "dbmail.h"
+#include <dirent.h>
+
+#define THIS_MODULE "notify"
+
+#define NOTIFY_SUFFIX ".sock"
+#define NOTIFY_RESCAN 5 // seconds
+
+struct notify_msg {
+	uint64_t mailbox_id;
+	uint64_t seq;
+};
+
+static int listen_fd = -1;
+static char listen_path[PATH_MAX];
+
+static GList *peers = NULL;	// socket paths in notify_directory
+static time_t peers_mtime = 0;
+static time_t peers_scanned = 0;
+static int publish_fd = -1;
+G_LOCK_DEFINE_STATIC(peers);
+
+static void notify_directory(char *dir, size_t len)
+{
+	Field_T val;
+	config_get_value("notify_directory", "DBMAIL", val);
+	if (strlen(val))
+		g_strlcpy(dir, val, len);
+	else
+		g_strlcpy(dir, DEFAULT_NOTIFY_DIR, len);
+}
+
+static int notify_address(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		TRACE(TRACE_WARNING, "socket path too long [%s]", path);
+		return -1;
+	}
+	g_strlcpy(addr->sun_path, path, sizeof(addr->sun_path));
+	return 0;
+}
+
+int notify_listen(void)
+{
+	struct sockaddr_un addr;
+	char dir[FIELDSIZE];
+	int fd, serr;
+
+	if (listen_fd >= 0)
+		return listen_fd;
+
+	notify_directory(dir, sizeof(dir));
+	if (g_mkdir_with_parents(dir, 0770)) {
+		serr = errno;
+		TRACE(TRACE_NOTICE, "unable to create [%s]: %s", dir, strerror(serr));
+		return -1;
+	}
+
+	g_snprintf(listen_path, sizeof(listen_path), "%s/%d%s", dir, (int)getpid(), NOTIFY_SUFFIX);
+	if (notify_address(&addr, listen_path))
+		return -1;
+
+	if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+		serr = errno;
+		TRACE(TRACE_NOTICE, "socket failed: %s", strerror(serr));
+		return -1;
+	}
+
+	unlink(listen_path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		serr = errno;
+		TRACE(TRACE_NOTICE, "unable to bind [%s]: %s", listen_path, strerror(serr));
+		close(fd);
+		return -1;
+	}
+	// delivery may run as another user in the same group
+	chmod(listen_path, 0660);
+
+	UNBLOCK(fd);
+	listen_fd = fd;
+
+	TRACE(TRACE_INFO, "listening for mailbox changes on [%s]", listen_path);
+
+	return listen_fd;
+}
+
+gboolean notify_listening(void)
+{
+	return (listen_fd >= 0);
+}
+
+int notify_recv(int fd, uint64_t *mailbox_id, uint64_t *seq)
+{
+	struct notify_msg msg;
+	ssize_t l;
+
+	while ((l = recv(fd, &msg, sizeof(msg), 0)) >= 0) {
+		if (l != (ssize_t)sizeof(msg))
+			continue;
+		*mailbox_id = msg.mailbox_id;
+		*seq = msg.seq;
+		return 1;
+	}
+
+	return 0;
+}
+
+void notify_unlisten(void)
+{
+	if (listen_fd < 0)
+		return;
+
+	close(listen_fd);
+	unlink(listen_path);
+	listen_fd = -1;
+}
+
+/* call with the lock held */
+static void peers_scan(const char *dir)
+{
+	struct stat st;
+	struct dirent *entry;
+	DIR *d;
+	time_t now = time(NULL);
+
+	if (stat(dir, &st)) {
+		if (peers) g_list_destroy(peers);
+		peers = NULL;
+		peers_mtime = 0;
+		return;
+	}
+
+	if ((st.st_mtime == peers_mtime) && ((now - peers_scanned) < NOTIFY_RESCAN))
+		return;
+
+	if (peers) g_list_destroy(peers);
+	peers = NULL;
+	peers_mtime = st.st_mtime;
+	peers_scanned = now;
+
+	if (! (d = opendir(dir)))
+		return;
+
+	while ((entry = readdir(d))) {
+		if (g_str_has_suffix(entry->d_name, NOTIFY_SUFFIX))
+			peers = g_list_prepend(peers, g_build_filename(dir, entry->d_name, NULL));
+	}
+	closedir(d);
+}
+
+void notify_publish(uint64_t mailbox_id, uint64_t seq)
+{
+	struct notify_msg msg;
+	struct sockaddr_un addr;
+	char dir[FIELDSIZE];
+	GList *p, *stale = NULL;
+	int serr;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.mailbox_id = mailbox_id;
+	msg.seq = seq;
+
+	notify_directory(dir, sizeof(dir));
+
+	G_LOCK(peers);
+	peers_scan(dir);
+
+	if (peers && (publish_fd < 0)) {
+		if ((publish_fd = socket(AF_UNIX, SOCK_DGRAM, 0)) >= 0)
+			UNBLOCK(publish_fd);
+	}
+
+	p = g_list_first(peers);
+	while (p && (publish_fd >= 0)) {
+		if ((notify_address(&addr, (char *)p->data) == 0) &&
+				(sendto(publish_fd, &msg, sizeof(msg), MSG_DONTWAIT,
+					(struct sockaddr *)&addr, sizeof(addr)) < 0)) {
+			serr = errno;
+			if ((serr == ECONNREFUSED) || (serr == ENOENT))
+				stale = g_list_prepend(stale, p);
+			else if (serr != EAGAIN)
+				TRACE(TRACE_DEBUG, "[%s]: %s", (char *)p->data, strerror(serr));
+		}
+		if (! g_list_next(p)) break;
+		p = g_list_next(p);
+	}
+
+	stale = g_list_first(stale);
+	while (stale) {
+		p = (GList *)stale->data;
+		TRACE(TRACE_INFO, "removing stale socket [%s]", (char *)p->data);
+		unlink((char *)p->data);
+		g_free(p->data);
+		peers = g_list_delete_link(peers, p);
+		if (! g_list_next(stale)) break;
+		stale = g_list_next(stale);
+	}
+	g_list_free(g_list_first(stale));
+	G_UNLOCK(peers);
+}
@@ -0,0 +1,56 @@
+/*
+
+ Copyright (c) 2004-2012 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * mailbox change notifications between processes on one host
+ */
+
+#ifndef DM_NOTIFY_H
+#define DM_NOTIFY_H
+
+#include "dbmail.h"
+
+/**
+ * \brief tell listening processes that a mailbox changed
+ * \param mailbox_id changed mailbox
+ * \param seq the new mailbox seq
+ */
+void notify_publish(uint64_t mailbox_id, uint64_t seq);
+
+/**
+ * \brief start receiving change notifications in this process
+ * \return a non-blocking descriptor to wait on, or -1 if
+ * notifications are not available
+ */
+int notify_listen(void);
+
+/** \brief TRUE if this process receives change notifications */
+gboolean notify_listening(void);
+
+/**
+ * \brief read one pending notification
+ * \return 1 if mailbox_id and seq were set, 0 if nothing is pending
+ */
+int notify_recv(int fd, uint64_t *mailbox_id, uint64_t *seq);
+
+/** \brief stop receiving and remove this process' socket */
+void notify_unlisten(void);
+
+#endif
@@ -0,0 +1,950 @@
+/*
+
+ Copyright (c) 2004-2012 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * REFERENCES threading
+ *
+ * the message-id, references, base subject and sent date of each
+ * message in a mailbox are read once into a thread graph, which lives
+ * as long as the mailbox is selected. Later THREAD commands only read
+ * the messages that arrived since. Threads are built from the graph in
+ * memory as described in RFC 5256, and the resulting forest is kept
+ * until the graph or the set of messages to thread changes.
+ *
+ * Strings are interned per graph, so message-ids and subjects compare
+ * by pointer while threading.
+ */
+
+#include "dbmail.h"
+
+#define THIS_MODULE "thread"
+
+#define THREAD_ID_WIDTH 255	// message-ids in the references cache are cut here
+
+extern DBParam_T db_params;
+#define DBPFX db_params.pfx
+
+struct thread_message {
+	uint64_t uid;
+	const char *msgid;	// NULL if the message has none
+	const char *subject;	// base subject
+	gboolean reply;
+	time_t date;
+	unsigned refs;		// first reference in refv
+	unsigned nrefs;
+};
+
+struct container {
+	int msg;		// row in messages, -1 for a dummy
+	int parent;
+	int child;		// first child
+	int next;		// next sibling
+	int removed;
+	time_t date;		// sort keys, of the first child for a dummy
+	uint64_t uid;
+};
+
+struct thread_graph {
+	uint64_t mailbox_id;
+	uint64_t loaded;	// highest uid read from the database
+	GArray *messages;	// struct thread_message, sorted by uid
+	GPtrArray *refv;
+	GStringChunk *chunk;
+	GHashTable *strings;
+	// the last forest built
+	GArray *forest;		// struct container
+	int roots;		// first root
+	uint64_t fingerprint;
+	unsigned forest_rows;	// messages in the graph at the time
+};
+
+#define M(g, i) (&g_array_index((g)->messages, struct thread_message, (i)))
+#define C(f, i) (&g_array_index((f), struct container, (i)))
+
+struct thread_graph * thread_graph_new(uint64_t mailbox_id)
+{
+	struct thread_graph *g = g_new0(struct thread_graph, 1);
+	g->mailbox_id = mailbox_id;
+	g->messages = g_array_new(FALSE, TRUE, sizeof(struct thread_message));
+	g->refv = g_ptr_array_new();
+	g->chunk = g_string_chunk_new(4096);
+	g->strings = g_hash_table_new(g_str_hash, g_str_equal);
+	g->roots = -1;
+	return g;
+}
+
+void thread_graph_free(struct thread_graph *g)
+{
+	if (! g) return;
+	g_array_free(g->messages, TRUE);
+	g_ptr_array_free(g->refv, TRUE);
+	g_string_chunk_free(g->chunk);
+	g_hash_table_destroy(g->strings);
+	if (g->forest)
+		g_array_free(g->forest, TRUE);
+	g_free(g);
+}
+
+static void thread_graph_clear(struct thread_graph *g)
+{
+	g_array_set_size(g->messages, 0);
+	g_ptr_array_set_size(g->refv, 0);
+	g_string_chunk_clear(g->chunk);
+	g_hash_table_remove_all(g->strings);
+	if (g->forest)
+		g_array_free(g->forest, TRUE);
+	g->forest = NULL;
+	g->roots = -1;
+	g->loaded = 0;
+}
+
+static const char * thread_intern(struct thread_graph *g, const char *s)
+{
+	char *v;
+
+	if (! s) return NULL;
+	if ((v = g_hash_table_lookup(g->strings, s)))
+		return v;
+
+	v = g_string_chunk_insert(g->chunk, s);
+	g_hash_table_insert(g->strings, v, v);
+
+	return v;
+}
+
+/* the row for uid, inserting an empty one if needed */
+static unsigned thread_graph_row(struct thread_graph *g, uint64_t uid, gboolean *found)
+{
+	struct thread_message m;
+	unsigned lo = 0, hi = g->messages->len, mid;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) >> 1);
+		if (M(g, mid)->uid < uid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	*found = (lo < g->messages->len && M(g, lo)->uid == uid);
+	if (*found)
+		return lo;
+
+	memset(&m, 0, sizeof(m));
+	m.uid = uid;
+	g_array_insert_val(g->messages, lo, m);
+
+	return lo;
+}
+
+static gboolean thread_graph_lookup(struct thread_graph *g, uint64_t uid, unsigned *row)
+{
+	unsigned lo = 0, hi = g->messages->len, mid;
+
+	while (lo < hi) {
+		mid = lo + ((hi - lo) >> 1);
+		if (M(g, mid)->uid < uid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*row = lo;
+
+	return (lo < g->messages->len && M(g, lo)->uid == uid);
+}
+
+/*
+ * a subject is a reply or forward if extracting the base subject
+ * removes a "Re:", "Fw:" or "Fwd:" leader, a "(fwd)" trailer or a
+ * "[fwd: ...]" wrapper
+ */
+static gboolean subject_is_reply(const char *subject)
+{
+	char *s, *p;
+	gboolean reply = FALSE;
+
+	if (! subject) return FALSE;
+
+	s = g_strstrip(g_strdup(subject));
+	p = s;
+
+	if ((strlen(p) >= 5) && (g_ascii_strcasecmp(p + strlen(p) - 5, "(fwd)") == 0))
+		reply = TRUE;
+
+	while (! reply) {
+		if (g_ascii_strncasecmp(p, "[fwd:", 5) == 0) {
+			reply = TRUE;
+			break;
+		}
+		if (*p != '[')
+			break;
+		// skip a blob like a list tag
+		while (*p && *p != ']') p++;
+		if (*p) p++;
+		while (g_ascii_isspace(*p)) p++;
+	}
+
+	if (! reply) {
+		if (g_ascii_strncasecmp(p, "fwd", 3) == 0)
+			p += 3;
+		else if ((g_ascii_strncasecmp(p, "re", 2) == 0) || (g_ascii_strncasecmp(p, "fw", 2) == 0))
+			p += 2;
+		else
+			p = NULL;
+
+		if (p) {
+			while (g_ascii_isspace(*p)) p++;
+			if (*p == '[') {
+				while (*p && *p != ']') p++;
+				if (*p) p++;
+				while (g_ascii_isspace(*p)) p++;
+			}
+			reply = (*p == ':');
+		}
+	}
+
+	g_free(s);
+
+	return reply;
+}
+
+static void thread_message_set(struct thread_graph *g, unsigned row, const char *messageid,
+		const char *subject, time_t date)
+{
+	struct thread_message *m = M(g, row);
+	char *base;
+
+	if (messageid && strlen(messageid)) {
+		char *id = g_strndup(messageid, THREAD_ID_WIDTH);
+		m->msgid = thread_intern(g, id);
+		g_free(id);
+	}
+
+	if (subject) {
+		base = dm_base_subject(subject);
+		m->subject = thread_intern(g, base ? base : "");
+		m->reply = subject_is_reply(subject);
+		g_free(base);
+	}
+
+	if (date)
+		m->date = date;
+}
+
+static void thread_message_reference(struct thread_graph *g, unsigned row, const char *ref)
+{
+	struct thread_message *m = M(g, row);
+
+	if (! (ref && strlen(ref)))
+		return;
+
+	if (! m->nrefs)
+		m->refs = g->refv->len;
+	g_ptr_array_add(g->refv, (gpointer)thread_intern(g, ref));
+	m->nrefs++;
+}
+
+void thread_graph_add(struct thread_graph *g, uint64_t uid, const char *messageid,
+		GList *references, const char *subject, time_t date)
+{
+	gboolean found;
+	unsigned row = thread_graph_row(g, uid, &found);
+
+	if (found) {
+		M(g, row)->msgid = NULL;
+		M(g, row)->subject = NULL;
+		M(g, row)->nrefs = 0;
+	}
+	thread_message_set(g, row, messageid, subject, date);
+
+	references = g_list_first(references);
+	while (references) {
+		thread_message_reference(g, row, (const char *)references->data);
+		references = g_list_next(references);
+	}
+}
+
+/*
+ * loading
+ */
+
+static int thread_graph_read(struct thread_graph *g)
+{
+	Connection_T c; ResultSet_T r; PreparedStatement_T stmt;
+	volatile int t = DM_SUCCESS;
+	volatile unsigned n = 0;
+	uint64_t uid, since = g->loaded, last = 0;
+	unsigned row;
+	gboolean found;
+	const char *name, *value;
+	char *msgid;
+	Field_T frag;
+	INIT_QUERY;
+
+	date2char_str("p.internal_date", &frag);
+
+	c = db_con_get();
+	TRY
+		snprintf(query, DEF_QUERYSIZE-1,
+				"SELECT m.message_idnr, %s FROM %smessages m "
+				"JOIN %sphysmessage p ON m.physmessage_id=p.id "
+				"WHERE m.mailbox_idnr = ? AND m.status IN (%d,%d) AND m.message_idnr > ? "
+				"ORDER BY m.message_idnr", frag, DBPFX, DBPFX,
+				MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN);
+		stmt = db_stmt_prepare(c, query);
+		db_stmt_set_u64(stmt, 1, g->mailbox_id);
+		db_stmt_set_u64(stmt, 2, since);
+		r = db_stmt_query(stmt);
+		while (db_result_next(r)) {
+			uid = db_result_get_u64(r, 0);
+			row = thread_graph_row(g, uid, &found);
+			M(g, row)->date = date_sql2epoch(db_result_get(r, 1));
+			g->loaded = max(g->loaded, uid);
+			n++;
+		}
+
+		if (n) {
+			db_con_clear(c);
+			memset(query, 0, sizeof(query));
+			snprintf(query, DEF_QUERYSIZE-1,
+					"SELECT m.message_idnr, n.headername, v.headervalue, v.sortfield "
+					"FROM %smessages m "
+					"JOIN %sheader h ON h.physmessage_id=m.physmessage_id "
+					"JOIN %sheadername n ON h.headername_id=n.id "
+					"JOIN %sheadervalue v ON h.headervalue_id=v.id "
+					"WHERE m.mailbox_idnr = ? AND m.status IN (%d,%d) "
+					"AND m.message_idnr > ? AND m.message_idnr <= ? "
+					"AND n.headername IN ('message-id','subject','date') "
+					"ORDER BY m.message_idnr", DBPFX, DBPFX, DBPFX, DBPFX,
+					MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN);
+			stmt = db_stmt_prepare(c, query);
+			db_stmt_set_u64(stmt, 1, g->mailbox_id);
+			db_stmt_set_u64(stmt, 2, since);
+			db_stmt_set_u64(stmt, 3, g->loaded);
+			r = db_stmt_query(stmt);
+			while (db_result_next(r)) {
+				uid = db_result_get_u64(r, 0);
+				if (! thread_graph_lookup(g, uid, &row))
+					continue;
+				name = db_result_get(r, 1);
+				value = db_result_get(r, 2);
+				if (MATCH(name, "message-id")) {
+					if (M(g, row)->msgid || ! value)
+						continue;
+					if ((msgid = g_mime_utils_decode_message_id(value))) {
+						thread_message_set(g, row, msgid, NULL, 0);
+						g_free(msgid);
+					}
+				} else if (MATCH(name, "subject")) {
+					if (! M(g, row)->subject)
+						thread_message_set(g, row, NULL, value ? value : "", 0);
+				} else if (MATCH(name, "date")) {
+					value = db_result_get(r, 3);
+					if (value && strlen(value))
+						thread_message_set(g, row, NULL, NULL, date_sql2epoch(value));
+				}
+			}
+
+			db_con_clear(c);
+			memset(query, 0, sizeof(query));
+			snprintf(query, DEF_QUERYSIZE-1,
+					"SELECT m.message_idnr, r.referencesfield FROM %smessages m "
+					"JOIN %sreferencesfield r ON r.physmessage_id=m.physmessage_id "
+					"WHERE m.mailbox_idnr = ? AND m.status IN (%d,%d) "
+					"AND m.message_idnr > ? AND m.message_idnr <= ? "
+					"ORDER BY m.message_idnr, r.id", DBPFX, DBPFX,
+					MESSAGE_STATUS_NEW, MESSAGE_STATUS_SEEN);
+			stmt = db_stmt_prepare(c, query);
+			db_stmt_set_u64(stmt, 1, g->mailbox_id);
+			db_stmt_set_u64(stmt, 2, since);
+			db_stmt_set_u64(stmt, 3, g->loaded);
+			r = db_stmt_query(stmt);
+			while (db_result_next(r)) {
+				uid = db_result_get_u64(r, 0);
+				if (! thread_graph_lookup(g, uid, &row))
+					continue;
+				if (uid != last)
+					M(g, row)->nrefs = 0;
+				last = uid;
+				thread_message_reference(g, row, db_result_get(r, 1));
+			}
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	TRACE(TRACE_DEBUG, "[%" PRIu64 "] read [%u] messages, [%u] in the graph",
+			g->mailbox_id, n, g->messages->len);
+
+	if (t == DM_EQUERY) {
+		// don't keep half read messages
+		thread_graph_clear(g);
+	}
+
+	return t;
+}
+
+struct thread_rows {
+	struct thread_graph *g;
+	GArray *rows;
+	uint64_t fingerprint;
+	gboolean missing;
+};
+
+static gboolean _graph_missing(uint64_t *uid, gpointer UNUSED msn, struct thread_rows *t)
+{
+	unsigned row;
+
+	if (thread_graph_lookup(t->g, *uid, &row))
+		return FALSE;
+	t->missing = TRUE;
+	return TRUE;
+}
+
+int thread_graph_load(struct thread_graph *g, GTree *found)
+{
+	struct thread_rows m;
+	int t;
+
+	if ((t = thread_graph_read(g)) != DM_SUCCESS)
+		return t;
+
+	// a message committed after a newer one was read
+	memset(&m, 0, sizeof(m));
+	m.g = g;
+	if (found)
+		g_tree_foreach(found, (GTraverseFunc)_graph_missing, &m);
+	if (! m.missing)
+		return t;
+
+	TRACE(TRACE_DEBUG, "[%" PRIu64 "] messages missing, reloading", g->mailbox_id);
+	thread_graph_clear(g);
+
+	return thread_graph_read(g);
+}
+
+/*
+ * threading
+ *
+ * containers are kept in one array and refer to each other by index.
+ * Tree walks use an explicit stack: reference chains in list archives
+ * can be thousands of messages deep.
+ */
+
+static int container_new(GArray *f, int msg)
+{
+	struct container c;
+	memset(&c, 0, sizeof(c));
+	c.msg = msg;
+	c.parent = c.child = c.next = -1;
+	g_array_append_val(f, c);
+	return (int)f->len - 1;
+}
+
+static void container_link(GArray *f, int parent, int child)
+{
+	C(f, child)->parent = parent;
+	C(f, child)->next = C(f, parent)->child;
+	C(f, parent)->child = child;
+}
+
+static void container_unlink(GArray *f, int child)
+{
+	int *i, parent = C(f, child)->parent;
+
+	if (parent < 0)
+		return;
+
+	for (i = &C(f, parent)->child; *i >= 0; i = &C(f, *i)->next) {
+		if (*i == child) {
+			*i = C(f, child)->next;
+			break;
+		}
+	}
+	C(f, child)->parent = -1;
+	C(f, child)->next = -1;
+}
+
+/* TRUE if a is c or one of its ancestors */
+static gboolean container_is_ancestor(GArray *f, int a, int c)
+{
+	for (; c >= 0; c = C(f, c)->parent) {
+		if (c == a)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static int container_lookup(GArray *f, GHashTable *ids, const char *msgid)
+{
+	gpointer p;
+	int c;
+
+	if ((p = g_hash_table_lookup(ids, msgid)))
+		return GPOINTER_TO_INT(p) - 1;
+
+	c = container_new(f, -1);
+	g_hash_table_insert(ids, (gpointer)msgid, GINT_TO_POINTER(c + 1));
+
+	return c;
+}
+
+/* containers below the roots, children before their parents */
+static GArray * container_postorder(GArray *f, int roots)
+{
+	GArray *stack = g_array_new(FALSE, FALSE, sizeof(int));
+	GArray *order = g_array_new(FALSE, FALSE, sizeof(int));
+	int c, i;
+
+	for (c = roots; c >= 0; c = C(f, c)->next)
+		g_array_append_val(stack, c);
+
+	while (stack->len) {
+		c = g_array_index(stack, int, stack->len - 1);
+		g_array_set_size(stack, stack->len - 1);
+		g_array_append_val(order, c);
+		for (i = C(f, c)->child; i >= 0; i = C(f, i)->next)
+			g_array_append_val(stack, i);
+	}
+	g_array_free(stack, TRUE);
+
+	// reversed preorder: every container comes after its children
+	for (i = 0; i < (int)order->len / 2; i++) {
+		c = g_array_index(order, int, i);
+		g_array_index(order, int, i) = g_array_index(order, int, order->len - 1 - i);
+		g_array_index(order, int, order->len - 1 - i) = c;
+	}
+
+	return order;
+}
+
+static int container_children(GArray *f, int c)
+{
+	int n = 0;
+	for (c = C(f, c)->child; c >= 0; c = C(f, c)->next)
+		n++;
+	return n;
+}
+
+/*
+ * drop dummies without children and move the children of other dummies
+ * up a level, except to the root set when there is more than one
+ */
+static int container_prune(GArray *f, int first, int parent)
+{
+	int head = -1, tail = -1, c, next, gc, gnext;
+
+#define APPEND(x) do { \
+	C(f, (x))->next = -1; \
+	C(f, (x))->parent = parent; \
+	if (tail < 0) head = (x); else C(f, tail)->next = (x); \
+	tail = (x); \
+} while (0)
+
+	for (c = first; c >= 0; c = next) {
+		next = C(f, c)->next;
+		if (C(f, c)->msg >= 0) {
+			APPEND(c);
+		} else if (C(f, c)->child < 0) {
+			C(f, c)->removed = TRUE;
+		} else if ((parent >= 0) || (container_children(f, c) == 1)) {
+			for (gc = C(f, c)->child; gc >= 0; gc = gnext) {
+				gnext = C(f, gc)->next;
+				APPEND(gc);
+			}
+			C(f, c)->child = -1;
+			C(f, c)->removed = TRUE;
+		} else {
+			APPEND(c);
+		}
+	}
+
+#undef APPEND
+
+	return head;
+}
+
+static const struct thread_message * container_message(struct thread_graph *g, GArray *f, int c)
+{
+	if (C(f, c)->msg < 0)
+		c = C(f, c)->child;
+	if (c < 0 || C(f, c)->msg < 0)
+		return NULL;
+	return M(g, C(f, c)->msg);
+}
+
+static const char * container_subject(struct thread_graph *g, GArray *f, int c)
+{
+	const struct thread_message *m = container_message(g, f, c);
+	if (! (m && m->subject && *m->subject))
+		return NULL;
+	return m->subject;
+}
+
+static gboolean container_reply(struct thread_graph *g, GArray *f, int c)
+{
+	if (C(f, c)->msg < 0)
+		return FALSE;
+	return M(g, C(f, c)->msg)->reply;
+}
+
+/* gather root threads that have the same base subject */
+static void container_group(struct thread_graph *g, GArray *f, GArray *roots)
+{
+	GHashTable *subjects = g_hash_table_new(g_direct_hash, g_direct_equal);
+	const char *s;
+	gpointer p;
+	int r, o, ch, next, d;
+	unsigned i;
+
+	for (i = 0; i < roots->len; i++) {
+		r = g_array_index(roots, int, i);
+		if (! (s = container_subject(g, f, r)))
+			continue;
+		if (! (p = g_hash_table_lookup(subjects, s))) {
+			g_hash_table_insert(subjects, (gpointer)s, GINT_TO_POINTER(r + 1));
+			continue;
+		}
+		o = GPOINTER_TO_INT(p) - 1;
+		if (((C(f, r)->msg < 0) && (C(f, o)->msg >= 0)) ||
+				(container_reply(g, f, o) && ! container_reply(g, f, r)))
+			g_hash_table_insert(subjects, (gpointer)s, GINT_TO_POINTER(r + 1));
+	}
+
+	for (i = 0; i < roots->len; i++) {
+		r = g_array_index(roots, int, i);
+		if (C(f, r)->removed || C(f, r)->parent >= 0)
+			continue;
+		if (! (s = container_subject(g, f, r)))
+			continue;
+		o = GPOINTER_TO_INT(g_hash_table_lookup(subjects, s)) - 1;
+		if (o == r || o < 0)
+			continue;
+
+		if ((C(f, r)->msg < 0) && (C(f, o)->msg < 0)) {
+			for (ch = C(f, r)->child; ch >= 0; ch = next) {
+				next = C(f, ch)->next;
+				container_link(f, o, ch);
+			}
+			C(f, r)->child = -1;
+			C(f, r)->removed = TRUE;
+		} else if (C(f, o)->msg < 0) {
+			container_link(f, o, r);
+		} else if (C(f, r)->msg < 0) {
+			container_link(f, r, o);
+			g_hash_table_insert(subjects, (gpointer)s, GINT_TO_POINTER(r + 1));
+		} else if (! container_reply(g, f, o) && container_reply(g, f, r)) {
+			container_link(f, o, r);
+		} else {
+			d = container_new(f, -1);
+			container_link(f, d, o);
+			container_link(f, d, r);
+			g_hash_table_insert(subjects, (gpointer)s, GINT_TO_POINTER(d + 1));
+		}
+	}
+
+	g_hash_table_destroy(subjects);
+}
+
+static int _container_cmp(gconstpointer a, gconstpointer b, gpointer data)
+{
+	GArray *f = (GArray *)data;
+	const struct container *x = C(f, *(const int *)a), *y = C(f, *(const int *)b);
+
+	if (x->date != y->date)
+		return (x->date < y->date) ? -1 : 1;
+	if (x->uid != y->uid)
+		return (x->uid < y->uid) ? -1 : 1;
+	return 0;
+}
+
+/* order a list of siblings by sent date, then by uid */
+static int container_sort(GArray *f, int first)
+{
+	GArray *list = g_array_new(FALSE, FALSE, sizeof(int));
+	int c;
+	unsigned i;
+
+	for (c = first; c >= 0; c = C(f, c)->next)
+		g_array_append_val(list, c);
+
+	if (list->len > 1)
+		g_qsort_with_data(list->data, list->len, sizeof(int), _container_cmp, f);
+
+	for (i = 0; i < list->len; i++)
+		C(f, g_array_index(list, int, i))->next = (i + 1 < list->len) ? g_array_index(list, int, i + 1) : -1;
+
+	first = list->len ? g_array_index(list, int, 0) : -1;
+	g_array_free(list, TRUE);
+
+	return first;
+}
+
+static void thread_graph_build(struct thread_graph *g, GArray *rows)
+{
+	GArray *f = g_array_new(FALSE, TRUE, sizeof(struct container));
+	GHashTable *ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+	GArray *order, *roots;
+	const struct thread_message *m;
+	int c, r, prev, row, head = -1, tail = -1;
+	unsigned i, j;
+
+	// 1: link each message to its references
+	for (i = 0; i < rows->len; i++) {
+		row = g_array_index(rows, int, i);
+		m = M(g, row);
+
+		c = -1;
+		if (m->msgid) {
+			c = container_lookup(f, ids, m->msgid);
+			if (C(f, c)->msg >= 0)
+				c = -1; // duplicate message-id
+			else
+				C(f, c)->msg = row;
+		}
+		if (c < 0)
+			c = container_new(f, row);
+
+		prev = -1;
+		for (j = 0; j < m->nrefs; j++) {
+			r = container_lookup(f, ids, g_ptr_array_index(g->refv, m->refs + j));
+			if ((prev >= 0) && (C(f, r)->parent < 0) && ! container_is_ancestor(f, r, prev))
+				container_link(f, prev, r);
+			prev = r;
+		}
+
+		// the last reference is the parent, replacing any guessed before
+		if (C(f, c)->parent != prev) {
+			if ((prev < 0) || ! container_is_ancestor(f, c, prev)) {
+				container_unlink(f, c);
+				if (prev >= 0)
+					container_link(f, prev, c);
+			}
+		}
+	}
+	g_hash_table_destroy(ids);
+
+	// 2: the root set
+	for (c = 0; c < (int)f->len; c++) {
+		if (C(f, c)->parent >= 0)
+			continue;
+		C(f, c)->next = -1;
+		if (tail < 0) head = c; else C(f, tail)->next = c;
+		tail = c;
+	}
+
+	// 4: prune dummies, bottom up
+	order = container_postorder(f, head);
+	for (i = 0; i < order->len; i++) {
+		c = g_array_index(order, int, i);
+		C(f, c)->child = container_prune(f, C(f, c)->child, c);
+	}
+	g_array_free(order, TRUE);
+	head = container_prune(f, head, -1);
+
+	// 5: gather by subject
+	roots = g_array_new(FALSE, FALSE, sizeof(int));
+	for (c = head; c >= 0; c = C(f, c)->next)
+		g_array_append_val(roots, c);
+	container_group(g, f, roots);
+	g_array_free(roots, TRUE);
+
+	head = tail = -1;
+	for (c = 0; c < (int)f->len; c++) {
+		if (C(f, c)->parent >= 0 || C(f, c)->removed)
+			continue;
+		C(f, c)->next = -1;
+		if (tail < 0) head = c; else C(f, tail)->next = c;
+		tail = c;
+	}
+
+	// 6: sort siblings, bottom up; a dummy sorts as its first child
+	order = container_postorder(f, head);
+	for (i = 0; i < order->len; i++) {
+		c = g_array_index(order, int, i);
+		C(f, c)->child = container_sort(f, C(f, c)->child);
+		if (C(f, c)->msg >= 0) {
+			C(f, c)->date = M(g, C(f, c)->msg)->date;
+			C(f, c)->uid = M(g, C(f, c)->msg)->uid;
+		} else if (C(f, c)->child >= 0) {
+			C(f, c)->date = C(f, C(f, c)->child)->date;
+			C(f, c)->uid = C(f, C(f, c)->child)->uid;
+		}
+	}
+	g_array_free(order, TRUE);
+
+	if (g->forest)
+		g_array_free(g->forest, TRUE);
+	g->forest = f;
+	g->roots = container_sort(f, head);
+}
+
+#define OP_OPEN 0
+#define OP_CLOSE 1
+#define OP_SPACE 2
+#define OP_BODY 3
+
+struct render_op {
+	int op;
+	int c;
+};
+
+static void render_push(GArray *stack, int op, int c)
+{
+	struct render_op o;
+	o.op = op;
+	o.c = c;
+	g_array_append_val(stack, o);
+}
+
+/*
+ * a message is followed by its only child, or by each of its children
+ * in parentheses; a dummy is its children in parentheses
+ */
+static char * thread_graph_render(struct thread_graph *g, GTree *found, gboolean uid)
+{
+	GArray *f = g->forest, *stack, *children;
+	GString *s = g_string_new("");
+	struct render_op o;
+	const struct thread_message *m;
+	uint64_t *msn;
+	int c, i;
+
+	stack = g_array_new(FALSE, FALSE, sizeof(struct render_op));
+	children = g_array_new(FALSE, FALSE, sizeof(int));
+
+	for (c = g->roots; c >= 0; c = C(f, c)->next)
+		g_array_append_val(children, c);
+	for (i = (int)children->len - 1; i >= 0; i--) {
+		render_push(stack, OP_CLOSE, -1);
+		render_push(stack, OP_BODY, g_array_index(children, int, i));
+		render_push(stack, OP_OPEN, -1);
+	}
+
+	while (stack->len) {
+		o = g_array_index(stack, struct render_op, stack->len - 1);
+		g_array_set_size(stack, stack->len - 1);
+
+		switch (o.op) {
+			case OP_OPEN:
+				g_string_append_c(s, '(');
+				continue;
+			case OP_CLOSE:
+				g_string_append_c(s, ')');
+				continue;
+			case OP_SPACE:
+				g_string_append_c(s, ' ');
+				continue;
+		}
+
+		c = o.c;
+		if (C(f, c)->msg >= 0) {
+			m = M(g, C(f, c)->msg);
+			if (uid || ! (msn = g_tree_lookup(found, &m->uid)))
+				g_string_append_printf(s, "%" PRIu64, m->uid);
+			else
+				g_string_append_printf(s, "%" PRIu64, *msn);
+		}
+
+		if (C(f, c)->child < 0)
+			continue;
+
+		if ((C(f, c)->msg >= 0) && (C(f, C(f, c)->child)->next < 0)) {
+			render_push(stack, OP_BODY, C(f, c)->child);
+			render_push(stack, OP_SPACE, -1);
+			continue;
+		}
+
+		g_array_set_size(children, 0);
+		for (i = C(f, c)->child; i >= 0; i = C(f, i)->next)
+			g_array_append_val(children, i);
+		for (i = (int)children->len - 1; i >= 0; i--) {
+			render_push(stack, OP_CLOSE, -1);
+			render_push(stack, OP_BODY, g_array_index(children, int, i));
+			render_push(stack, OP_OPEN, -1);
+		}
+		if (C(f, c)->msg >= 0)
+			render_push(stack, OP_SPACE, -1);
+	}
+
+	g_array_free(children, TRUE);
+	g_array_free(stack, TRUE);
+
+	return g_string_free(s, FALSE);
+}
+
+/* make sure the graph has each message, and fingerprint the set */
+static gboolean _thread_fingerprint(uint64_t *uid, gpointer UNUSED msn, struct thread_rows *t)
+{
+	gboolean found;
+	int i;
+
+	// FNV-1a over the uids
+	for (i = 0; i < 8; i++) {
+		t->fingerprint ^= (*uid >> (i * 8)) & 0xff;
+		t->fingerprint *= 1099511628211ULL;
+	}
+
+	thread_graph_row(t->g, *uid, &found);
+	if (! found) // not read yet: threaded on its own
+		t->missing = TRUE;
+
+	return FALSE;
+}
+
+static gboolean _thread_rows(uint64_t *uid, gpointer UNUSED msn, struct thread_rows *t)
+{
+	unsigned row;
+
+	if (thread_graph_lookup(t->g, *uid, &row))
+		g_array_append_val(t->rows, row);
+
+	return FALSE;
+}
+
+char * thread_graph_references(struct thread_graph *g, GTree *found, gboolean uid)
+{
+	struct thread_rows t;
+
+	if (! (found && g_tree_nnodes(found)))
+		return NULL;
+
+	memset(&t, 0, sizeof(t));
+	t.g = g;
+	t.fingerprint = 14695981039346656037ULL;
+	g_tree_foreach(found, (GTraverseFunc)_thread_fingerprint, &t);
+
+	if (g->forest && (! t.missing) && (g->fingerprint == t.fingerprint) &&
+			(g->forest_rows == g->messages->len)) {
+		TRACE(TRACE_DEBUG, "[%" PRIu64 "] cached forest", g->mailbox_id);
+	} else {
+		t.rows = g_array_new(FALSE, FALSE, sizeof(int));
+		g_tree_foreach(found, (GTraverseFunc)_thread_rows, &t);
+		thread_graph_build(g, t.rows);
+		g_array_free(t.rows, TRUE);
+		g->fingerprint = t.fingerprint;
+		g->forest_rows = g->messages->len;
+	}
+
+	return thread_graph_render(g, found, uid);
+}
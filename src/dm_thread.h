@@ -0,0 +1,63 @@
+/*
+
+ Copyright (c) 2004-2012 NFG Net Facilities Group BV support@nfg.nl
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * REFERENCES threading (RFC 5256)
+ */
+
+#ifndef DM_THREAD_H
+#define DM_THREAD_H
+
+#include "dbmail.h"
+
+struct thread_graph;
+
+struct thread_graph * thread_graph_new(uint64_t mailbox_id);
+
+void thread_graph_free(struct thread_graph *g);
+
+/**
+ * \brief read the threading data of messages new to the graph
+ * \param found messages about to be threaded, uid -> msn; if the graph
+ * still misses some of them after reading the new ones, it is reloaded
+ * \return DM_SUCCESS or DM_EQUERY
+ */
+int thread_graph_load(struct thread_graph *g, GTree *found);
+
+/**
+ * \brief add or replace a message
+ * \param messageid without angle brackets, may be NULL
+ * \param references message-ids of the ancestors, oldest first
+ * \param subject the Subject header, may be NULL
+ * \param date sent date, or the internal date if there is none
+ */
+void thread_graph_add(struct thread_graph *g, uint64_t uid, const char *messageid,
+		GList *references, const char *subject, time_t date);
+
+/**
+ * \brief thread messages by references
+ * \param found messages to thread, uid -> msn
+ * \param uid list uids instead of message sequence numbers
+ * \return the threads as sent in a THREAD response, NULL if there are
+ * no messages
+ */
+char * thread_graph_references(struct thread_graph *g, GTree *found, gboolean uid);
+
+#endif
@@ -136,7 +136,7 @@ static int mailbox_dump(uint64_t mailbox_idnr, const char *dumpfile,
 		memset(deleted_flag, 0, sizeof(deleted_flag));
 		deleted_flag[IMAP_FLAG_DELETED] = 1;
 
-		GList *ids = g_tree_keys(MailboxState_getIds(mb->mbstate));
+		GList *ids = MailboxState_getUids(mb->mbstate);
 
                 while (ids) {
 			affected = 0;
@@ -34,6 +34,8 @@
 extern ServerConfig_T *server_conf;
 extern GAsyncQueue *queue;
 extern struct event_base *evbase;
+extern int selfpipe[2];
+extern pthread_mutex_t selfpipe_lock;
 
 const char AcceptedTagChars[] =
     "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"
@@ -80,6 +82,7 @@ const char *IMAP_COMMANDS[] = {
 	"idle",
 	"starttls",
        	"id",
+	"notify",
 	"***NOMORE***"
 };
 
@@ -124,6 +127,7 @@ const IMAP_COMMAND_HANDLER imap_handler_functions[] = {
        	_ic_idle,
        	_ic_starttls,
 	_ic_id,
+	_ic_notify,
 	NULL
 };
 
@@ -134,6 +138,8 @@ static int imap4_tokenizer(ImapSession *, char *);
 static int imap4(ImapSession *);
 static void imap_handle_input(ImapSession *);
 static void imap_handle_abort(ImapSession *);
+static void imap_notify_flush(ImapSession *);
+static void imap_notify_refresh(ImapSession *);
 
 #define DEFERRED_MAX_LOOP 100
 
@@ -300,6 +306,12 @@ static void imap_session_reset(ImapSession *session)
             session, current, session->ci->timeout.tv_sec);
 
 	ci_uncork(session->ci);
+
+	if (current == CLIENTSTATE_AUTHENTICATED || current == CLIENTSTATE_SELECTED) {
+		imap_notify_refresh(session);
+		if (session->notify.pending)
+			imap_notify_flush(session);
+	}
 	
 	return;
 }
@@ -356,11 +368,15 @@ static void send_greeting(ImapSession *session)
 
 void imap_cb_time(void *arg)
 {
-	Field_T interval;
+	Field_T interval, notify_only;
 	int idle_interval = 10;
 	ImapSession *session = (ImapSession *) arg;
 	TRACE(TRACE_DEBUG,"[%p]", session);
 
+	// a change report owns the session, and checks the mailbox itself
+	if (session->notify.running)
+		return;
+
 	if ( session->command_type == IMAP_COMM_IDLE  && session->command_state == IDLE ) {
 	       	// session is in a IDLE loop
 		GETCONFIGVALUE("idle_interval", "IMAP", interval);
@@ -370,11 +386,16 @@ void imap_cb_time(void *arg)
 				idle_interval = i;
 		}
 
+		GETCONFIGVALUE("idle_notify_only", "IMAP", notify_only);
+
 		ci_cork(session->ci);
 		if (! (++session->loop % idle_interval)) {
 			imap_session_printf(session, "* OK\r\n");
+			dbmail_imap_session_mailbox_status(session,TRUE);
+		} else if (! (session->idle_mailbox && ! SMATCH(notify_only, "no"))) {
+			// only poll without change notifications, or when asked to
+			dbmail_imap_session_mailbox_status(session,TRUE);
 		}
-		dbmail_imap_session_mailbox_status(session,TRUE);
 		dbmail_imap_session_buff_flush(session);
 		ci_uncork(session->ci);
 	} else {
@@ -384,6 +405,316 @@ void imap_cb_time(void *arg)
 	}
 }
 
+/*
+ * sessions in IDLE, by selected mailbox
+ *
+ * only touched from the main thread: IDLE starts and ends there, and
+ * change notifications are delivered by the event loop.
+ */
+struct idlers {
+	uint64_t id;
+	GList *sessions;
+};
+
+static GTree *idlers = NULL;
+
+static void idlers_free(struct idlers *s)
+{
+	g_list_free(s->sessions);
+	g_free(s);
+}
+
+void imap_idle_subscribe(ImapSession *session)
+{
+	struct idlers *s;
+	uint64_t id;
+
+	if (! (notify_listening() && session->mailbox))
+		return;
+
+	imap_idle_unsubscribe(session);
+
+	if (! idlers)
+		idlers = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, NULL, (GDestroyNotify)idlers_free);
+
+	id = dbmail_mailbox_get_id(session->mailbox);
+	if (! (s = g_tree_lookup(idlers, &id))) {
+		s = g_new0(struct idlers, 1);
+		s->id = id;
+		g_tree_insert(idlers, &s->id, s);
+	}
+	s->sessions = g_list_prepend(s->sessions, session);
+	session->idle_mailbox = id;
+}
+
+void imap_idle_unsubscribe(ImapSession *session)
+{
+	struct idlers *s;
+
+	if (! session->idle_mailbox)
+		return;
+
+	if (idlers && (s = g_tree_lookup(idlers, &session->idle_mailbox))) {
+		s->sessions = g_list_remove(s->sessions, session);
+		if (! s->sessions)
+			g_tree_remove(idlers, &session->idle_mailbox);
+	}
+	session->idle_mailbox = 0;
+}
+
+/*
+ * sessions that issued NOTIFY SET, by mailbox id
+ *
+ * main thread only, like the idlers above. A session is listed under
+ * each mailbox in its NOTIFY set, and under the selected mailbox if it
+ * asked for selected events. notified keeps, by session, the entries a
+ * session is listed in.
+ */
+static GHashTable *notifiers = NULL;
+static GHashTable *notified = NULL;
+
+static uint64_t notify_selected_id(ImapSession *session)
+{
+	if (session->notify.selected && session->state == CLIENTSTATE_SELECTED && session->mailbox)
+		return dbmail_mailbox_get_id(session->mailbox);
+	return 0;
+}
+
+static void notifiers_add(ImapSession *session, uint64_t id)
+{
+	struct idlers *s;
+
+	if (! (s = g_hash_table_lookup(notifiers, &id))) {
+		s = g_new0(struct idlers, 1);
+		s->id = id;
+		g_hash_table_insert(notifiers, &s->id, s);
+	}
+	if (g_list_find(s->sessions, session))
+		return;
+
+	s->sessions = g_list_prepend(s->sessions, session);
+	g_hash_table_insert(notified, session, g_list_prepend(g_hash_table_lookup(notified, session), s));
+}
+
+static gboolean _notifiers_add(uint64_t *id, notify_mailbox *N UNUSED, ImapSession *session)
+{
+	notifiers_add(session, *id);
+	return FALSE;
+}
+
+void imap_notify_subscribe(ImapSession *session)
+{
+	imap_notify_unsubscribe(session);
+
+	if (! (session->notify.selected || session->notify.mailboxes))
+		return;
+
+	if (! notifiers) {
+		notifiers = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, (GDestroyNotify)idlers_free);
+		notified = g_hash_table_new(g_direct_hash, g_direct_equal);
+	}
+
+	if (session->notify.mailboxes)
+		g_tree_foreach(session->notify.mailboxes, (GTraverseFunc)_notifiers_add, session);
+	if ((session->notify.listed = notify_selected_id(session)))
+		notifiers_add(session, session->notify.listed);
+}
+
+void imap_notify_unsubscribe(ImapSession *session)
+{
+	GList *entries;
+
+	session->notify.listed = 0;
+
+	if (! (notified && (entries = g_hash_table_lookup(notified, session))))
+		return;
+
+	g_hash_table_remove(notified, session);
+
+	entries = g_list_first(entries);
+	while (entries) {
+		struct idlers *s = (struct idlers *)entries->data;
+		s->sessions = g_list_remove(s->sessions, session);
+		if (! s->sessions)
+			g_hash_table_remove(notifiers, &s->id);
+		if (! g_list_next(entries)) break;
+		entries = g_list_next(entries);
+	}
+	g_list_free(g_list_first(entries));
+}
+
+/* follow the selected mailbox after SELECT, EXAMINE, CLOSE or UNSELECT */
+static void imap_notify_refresh(ImapSession *session)
+{
+	if (session->notify.selected && (session->notify.listed != notify_selected_id(session)))
+		imap_notify_subscribe(session);
+}
+
+/*
+ * change reports are prepared by the thread pool, like commands. While
+ * one runs the session is corked, and further changes are held back
+ * until it is done.
+ */
+struct notify_report {
+	uint64_t mailbox_id;	// 0: everything held back
+	int command_state;	// restored when done, IDLE must survive
+};
+
+static gboolean _notify_status(uint64_t *id, notify_mailbox *N UNUSED, ImapSession *session)
+{
+	dbmail_imap_session_notify_status(session, *id, FALSE);
+	return FALSE;
+}
+
+static void _notify_report_enter(dm_thread_data *D)
+{
+	ImapSession *session = D->session;
+	struct notify_report *R = (struct notify_report *)D->data;
+	uint64_t selected = 0;
+
+	if (session->state == CLIENTSTATE_SELECTED && session->mailbox)
+		selected = dbmail_mailbox_get_id(session->mailbox);
+
+	if (selected && (session->notify.selected || session->idle_mailbox)
+			&& ((! R->mailbox_id) || (R->mailbox_id == selected)))
+		dbmail_imap_session_mailbox_status(session, TRUE);
+
+	if (! R->mailbox_id) {
+		if (session->notify.mailboxes) {
+			dbmail_imap_session_notify_probe(session, FALSE);
+			g_tree_foreach(session->notify.mailboxes, (GTraverseFunc)_notify_status, session);
+		}
+	} else if (R->mailbox_id != selected) {
+		dbmail_imap_session_notify_status(session, R->mailbox_id, FALSE);
+	}
+
+	g_async_queue_push(queue, (gpointer)D);
+	PLOCK(selfpipe_lock);
+	if (selfpipe[1] > -1) {
+		if (write(selfpipe[1], "N", 1)) { /* ignore */ }
+	}
+	PUNLOCK(selfpipe_lock);
+}
+
+static void _notify_report_leave(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	ImapSession *session = D->session;
+	struct notify_report *R = (struct notify_report *)D->data;
+	int state;
+
+	session->command_state = R->command_state;
+	session->notify.running = false;
+	g_free(R);
+
+	PLOCK(session->ci->lock);
+	state = session->ci->client_state;
+	PUNLOCK(session->ci->lock);
+
+	if (state & CLIENT_ERR) {
+		imap_handle_abort(session);
+		return;
+	}
+
+	dbmail_imap_session_buff_flush(session);
+	ci_uncork(session->ci);
+
+	if (session->notify.pending)
+		imap_notify_flush(session);
+	else if (p_string_len(session->ci->read_buffer) > 0)
+		imap_handle_input(session);
+}
+
+static void imap_notify_report(ImapSession *session, uint64_t mailbox_id)
+{
+	struct notify_report *R;
+
+	if (session->state == CLIENTSTATE_QUIT_QUEUED)
+		return;
+
+	R = g_new0(struct notify_report, 1);
+	R->mailbox_id = mailbox_id;
+	R->command_state = session->command_state;
+	session->notify.running = true;
+
+	dm_thread_data_push((gpointer)session, _notify_report_enter, _notify_report_leave, R);
+}
+
+/*
+ * report everything that changed while a command was running
+ */
+static void imap_notify_flush(ImapSession *session)
+{
+	if (session->notify.running)
+		return;
+
+	session->notify.pending = false;
+	imap_notify_report(session, 0);
+}
+
+static void imap_notify_change(ImapSession *session, uint64_t mailbox_id)
+{
+	gboolean selected = FALSE;
+
+	if (session->state == CLIENTSTATE_SELECTED && session->mailbox)
+		selected = (dbmail_mailbox_get_id(session->mailbox) == mailbox_id);
+
+	// IDLE already reported this one
+	if (selected && (session->idle_mailbox == mailbox_id))
+		return;
+
+	// a command or an earlier report owns the session until it is done
+	if (session->notify.running || (session->command_type && 
+				! (session->command_type == IMAP_COMM_IDLE && session->command_state == IDLE))) {
+		session->notify.pending = true;
+		return;
+	}
+
+	imap_notify_report(session, mailbox_id);
+}
+
+/*
+ * a mailbox changed: report to the sessions idling on it or
+ * that asked for it with NOTIFY
+ */
+void imap_handle_change(uint64_t mailbox_id, uint64_t seq)
+{
+	struct idlers *s;
+	GList *sessions;
+
+	TRACE(TRACE_DEBUG, "mailbox [%" PRIu64 "] seq [%" PRIu64 "]", mailbox_id, seq);
+
+	db_mailbox_seq_cache(mailbox_id, seq);
+
+	// reporting may end a session
+	if (notifiers && (s = g_hash_table_lookup(notifiers, &mailbox_id))) {
+		sessions = g_list_copy(s->sessions);
+		sessions = g_list_first(sessions);
+		while (sessions) {
+			imap_notify_change((ImapSession *)sessions->data, mailbox_id);
+			if (! g_list_next(sessions)) break;
+			sessions = g_list_next(sessions);
+		}
+		g_list_free(g_list_first(sessions));
+	}
+
+	if (! (idlers && (s = g_tree_lookup(idlers, &mailbox_id))))
+		return;
+
+	sessions = g_list_copy(s->sessions);
+	sessions = g_list_first(sessions);
+	while (sessions) {
+		ImapSession *session = (ImapSession *)sessions->data;
+		if (session->notify.running)
+			session->notify.pending = true;
+		else if (session->command_type == IMAP_COMM_IDLE && session->command_state == IDLE)
+			imap_notify_report(session, mailbox_id);
+		if (! g_list_next(sessions)) break;
+		sessions = g_list_next(sessions);
+	}
+	g_list_free(g_list_first(sessions));
+}
+
 static int checktag(const char *s)
 {
 	int i;
@@ -504,8 +835,8 @@ void imap_handle_input(ImapSession *session)
 		return;
 	}
 
-	// command in progress
-	if (session->command_state == FALSE && session->parser_state == TRUE) {
+	// command or change report in progress
+	if (session->notify.running || (session->command_state == FALSE && session->parser_state == TRUE)) {
 		TRACE(TRACE_DEBUG,"[%p] command in-progress", session);
 		return;
 	}
@@ -545,6 +876,7 @@ void imap_handle_input(ImapSession *session)
 			else
 				imap_session_printf(session,"%s BAD Expecting DONE\r\n", session->tag);
 
+			imap_idle_unsubscribe(session);
 			session->command_state = TRUE; // done
 			imap_session_reset(session);
 
@@ -727,6 +1059,7 @@ static void imap_unescape_args(ImapSession *session)
 		case IMAP_COMM_STATUS:
 		case IMAP_COMM_COPY:
 		case IMAP_COMM_LOGIN:
+		case IMAP_COMM_NOTIFY:
 
 		for (i = 0; session->args[i]; i++) { 
 			p_string_unescape(session->args[i]);
@@ -329,7 +329,7 @@ int _ic_authenticate(ImapSession *self)
 static gboolean mailbox_first_unseen(gpointer key, gpointer value, gpointer data)
 {
 	MessageInfo *msginfo = (MessageInfo *)value;
-	if (msginfo->flags[IMAP_FLAG_SEEN])
+	if (msginfo->flags[IMAP_FLAG_SEEN] || (msginfo->status >= MESSAGE_STATUS_DELETE))
 	       	return FALSE;
 	*(uint64_t *)data = *(uint64_t *)key;
 	return TRUE;
@@ -338,6 +338,7 @@ static gboolean mailbox_first_unseen(gpointer key, gpointer value, gpointer data
 static int imap_session_mailbox_close(ImapSession *self)
 {
 	dbmail_imap_session_set_state(self,CLIENTSTATE_AUTHENTICATED);
+	dbmail_imap_session_searchres(self, NULL);
 	if (self->mailbox) {
 		if (self->mailbox->mbstate)
 			MailboxState_clear_recent(self->mailbox->mbstate);
@@ -542,8 +543,7 @@ static int _ic_select_parse_args(ImapSession *self)
 static gboolean _do_fetch_updates(uint64_t *id, gpointer UNUSED value, dm_thread_data *D)
 {
 	ImapSession *self = D->session;
-	MessageInfo *msginfo = g_tree_lookup(
-			MailboxState_getMsginfo(self->mailbox->mbstate), id);
+	MessageInfo *msginfo = MailboxState_getMessage(self->mailbox->mbstate, *id);
 	if (! msginfo)
 		return TRUE;
 	
@@ -554,7 +554,6 @@ static gboolean _do_fetch_updates(uint64_t *id, gpointer UNUSED value, dm_thread
 
 struct expunged_helper {
 	GString *response;
-	GTree *msgs;
 	GTree *expunged;
 	GTree *known_seqset;
 	GTree *known_uidset;
@@ -564,14 +563,10 @@ struct expunged_helper {
 	bool prev_expunged;
 };
 
-static gboolean _get_expunged(uint64_t *id, gpointer UNUSED value, struct expunged_helper *data)
+static gboolean _get_expunged(uint64_t *id, MessageInfo *msg, struct expunged_helper *data)
 {
-	MessageInfo *msg = g_tree_lookup(data->msgs, id);
 	bool expunged;
 
-	if (! msg)
-		return TRUE;
-
 	//
 	if (data->known_uidset && data->known_seqset) {
 		uint64_t *msn = NULL, *knownuid = NULL;
@@ -621,7 +616,6 @@ static GTree *MailboxState_getExpunged(MailboxState_T M, qresync_args *qresync,
 	data.last_expunged = 0;
 	data.prev_expunged = false;
 	data.qresync = qresync;
-	data.msgs = MailboxState_getMsginfo(M);
 	data.expunged = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, NULL, NULL);
 	data.known_seqset = NULL;
 	data.known_uidset = NULL;
@@ -634,7 +628,7 @@ static GTree *MailboxState_getExpunged(MailboxState_T M, qresync_args *qresync,
 				M, p_string_str(qresync->known_uidset), TRUE);
 	}
 
-	g_tree_foreach(data.msgs, (GTraverseFunc) _get_expunged, &data);
+	MailboxState_foreach_message(M, (GTraverseFunc) _get_expunged, &data);
 
 	g_tree_destroy(data.known_seqset);
 	g_tree_destroy(data.known_uidset);
@@ -705,11 +699,9 @@ static void _ic_select_enter(dm_thread_data *D)
 
 	if (MailboxState_getExists(S)) { 
 		/* show msn of first unseen msg (if present) */
-		GTree *uids = MailboxState_getIds(S);
-		GTree *info = MailboxState_getMsginfo(S);
 		uint64_t key = 0, *msn = NULL;
-		g_tree_foreach(info, (GTraverseFunc)mailbox_first_unseen, &key);
-		if ( (key > 0) && (msn = g_tree_lookup(uids, &key))) {
+		MailboxState_foreach_message(S, (GTraverseFunc)mailbox_first_unseen, &key);
+		if ( (key > 0) && (msn = MailboxState_getMsn(S, key))) {
 			dbmail_imap_session_buff_printf(self, "* OK [UNSEEN %" PRIu64 "] first unseen message\r\n", *msn);
 		}
 	}
@@ -1307,6 +1299,9 @@ void _ic_list_enter(dm_thread_data *D)
 		SESSION_RETURN;
 	}
 
+	// clients tend to follow up with STATUS for each folder
+	db_mailbox_seq_probe(children);
+
 	found_folders = g_tree_new_full((GCompareDataFunc)dm_strcmpdata,NULL,g_free,free_mailboxstate);
 	found_hierarchy = g_tree_new_full((GCompareDataFunc)dm_strcmpdata,NULL,g_free,free_mailboxstate);
 
@@ -1572,6 +1567,7 @@ int _ic_idle(ImapSession *self)
 	dbmail_imap_session_buff_printf(self, "+ idling\r\n");
 	dbmail_imap_session_mailbox_status(self,TRUE);
 	dbmail_imap_session_buff_flush(self);
+	imap_idle_subscribe(self);
 
 	self->ci->timeout.tv_sec = idle_timeout;
 	ci_uncork(self->ci);
@@ -1579,6 +1575,255 @@ int _ic_idle(ImapSession *self)
 	return 0;
 }
 
+/* _ic_notify()
+ *
+ * NOTIFY NONE
+ * NOTIFY SET [STATUS] (filter events) ...
+ *
+ * mailbox sets are resolved to mailbox ids when NOTIFY SET is issued
+ */
+
+#define NOTIFY_EVENTS "MessageNew MessageExpunge FlagChange MailboxName SubscriptionChange"
+
+static const char * notify_arg(ImapSession *self)
+{
+	String_T arg = self->args[self->args_idx];
+	if (! arg)
+		return NULL;
+	self->args_idx++;
+	return p_string_str(arg);
+}
+
+/* 0: ok, -1: syntax error, 1: unsupported event */
+static int notify_parse_events(ImapSession *self, int *events)
+{
+	const char *s;
+	int depth;
+
+	*events = 0;
+	if (! (s = notify_arg(self)))
+		return -1;
+	if (MATCH(s, "NONE"))
+		return 0;
+	if (! MATCH(s, "("))
+		return -1;
+
+	while ((s = notify_arg(self)) && (! MATCH(s, ")"))) {
+		if (MATCH(s, "MessageNew"))
+			*events |= NOTIFY_MESSAGENEW;
+		else if (MATCH(s, "MessageExpunge"))
+			*events |= NOTIFY_MESSAGEEXPUNGE;
+		else if (MATCH(s, "FlagChange"))
+			*events |= NOTIFY_FLAGCHANGE;
+		else if (MATCH(s, "MailboxName"))
+			*events |= NOTIFY_MAILBOXNAME;
+		else if (MATCH(s, "SubscriptionChange"))
+			*events |= NOTIFY_SUBSCRIPTIONCHANGE;
+		else if (MATCH(s, "AnnotationChange") || MATCH(s, "MailboxMetadataChange") || MATCH(s, "ServerMetadataChange"))
+			return 1;
+		else if (MATCH(s, "(") && (*events & NOTIFY_MESSAGENEW)) {
+			// fetch-att for MessageNew: only EXISTS is sent
+			for (depth = 1; depth && (s = notify_arg(self)); ) {
+				if (MATCH(s, "(")) depth++;
+				else if (MATCH(s, ")")) depth--;
+			}
+			if (depth)
+				return -1;
+		} else
+			return -1;
+	}
+	if (! s)
+		return -1;
+
+	// MessageNew and MessageExpunge go together, FlagChange needs both
+	if ((! (*events & NOTIFY_MESSAGENEW)) != (! (*events & NOTIFY_MESSAGEEXPUNGE)))
+		return -1;
+	if ((*events & NOTIFY_FLAGCHANGE) && (! (*events & NOTIFY_MESSAGENEW)))
+		return -1;
+
+	return 0;
+}
+
+static GList * notify_parse_mailboxes(ImapSession *self)
+{
+	GList *names = NULL;
+	const char *s;
+
+	if (! (s = notify_arg(self)))
+		return NULL;
+	if (! MATCH(s, "("))
+		return g_list_append(names, (gpointer)s);
+
+	while ((s = notify_arg(self)) && (! MATCH(s, ")")))
+		names = g_list_append(names, (gpointer)s);
+	if (! s) {
+		g_list_free(names);
+		return NULL;
+	}
+	return names;
+}
+
+static void notify_add_mailbox(ImapSession *self, GTree *mailboxes, uint64_t id, const char *name, int events)
+{
+	MailboxState_T M = MailboxState_new(self->pool, 0);
+	MailboxState_setId(M, id);
+	if ((MailboxState_info(M) == DM_SUCCESS) &&
+			(acl_has_right(M, self->userid, ACL_RIGHT_LOOKUP) == 1) &&
+			(acl_has_right(M, self->userid, ACL_RIGHT_READ) == 1))
+		dbmail_imap_session_notify_add(mailboxes, id, name, events);
+	MailboxState_free(&M);
+}
+
+static void notify_add_name(ImapSession *self, GTree *mailboxes, const char *name, int events)
+{
+	uint64_t id = 0;
+	if (db_findmailbox(name, self->userid, &id) && id)
+		notify_add_mailbox(self, mailboxes, id, name, events);
+}
+
+static void notify_add_pattern(ImapSession *self, GTree *mailboxes, const char *pattern,
+		int only_subscribed, gboolean personal, int events)
+{
+	GList *children = NULL;
+	char name[IMAP_MAX_MAILBOX_NAMELEN];
+	uint64_t id, owner;
+
+	if (db_findmailbox_by_regex(self->userid, pattern, &children, only_subscribed) != DM_SUCCESS)
+		return;
+
+	children = g_list_first(children);
+	while (children) {
+		id = *(uint64_t *)children->data;
+		memset(name, 0, sizeof(name));
+		if ((db_getmailboxname(id, self->userid, name) == DM_SUCCESS) &&
+				listex_match(pattern, name, MAILBOX_SEPARATOR, 0)) {
+			if ((! personal) || ((db_get_mailbox_owner(id, &owner) == DM_SUCCESS) && (owner == self->userid)))
+				notify_add_mailbox(self, mailboxes, id, name, events);
+		}
+		if (! g_list_next(children)) break;
+		children = g_list_next(children);
+	}
+	g_list_destroy(children);
+}
+
+static gboolean _notify_status_all(uint64_t *id, notify_mailbox *N UNUSED, ImapSession *self)
+{
+	dbmail_imap_session_notify_status(self, *id, TRUE);
+	return FALSE;
+}
+
+static void _ic_notify_enter(dm_thread_data *D)
+{
+	SESSION_GET;
+	const char *s, *filter;
+	gboolean status = FALSE, bad = FALSE;
+	int events, selected = 0, result;
+	GTree *mailboxes;
+	GList *names;
+
+	s = notify_arg(self);
+	if (MATCH(s, "NONE") && (! self->args[self->args_idx])) {
+		dbmail_imap_session_notify_set(self, 0, NULL);
+		SESSION_OK;
+		SESSION_RETURN;
+	}
+	if (! MATCH(s, "SET")) {
+		dbmail_imap_session_buff_printf(self, "%s BAD expected SET or NONE\r\n", self->tag);
+		D->status = 1;
+		SESSION_RETURN;
+	}
+
+	if (self->args[self->args_idx] && MATCH(p_string_str(self->args[self->args_idx]), "STATUS")) {
+		status = TRUE;
+		self->args_idx++;
+	}
+
+	mailboxes = dbmail_imap_session_notify_new();
+	while ((s = notify_arg(self))) {
+		names = NULL;
+		bad = TRUE;
+		if ((! MATCH(s, "(")) || (! (filter = notify_arg(self))))
+			break;
+		if (MATCH(filter, "subtree") || MATCH(filter, "mailboxes")) {
+			if (! (names = notify_parse_mailboxes(self)))
+				break;
+		}
+		if ((result = notify_parse_events(self, &events)) || (! (s = notify_arg(self))) || (! MATCH(s, ")"))) {
+			g_list_free(names);
+			if (result > 0) {
+				dbmail_imap_session_buff_printf(self, "%s NO [BADEVENT (" NOTIFY_EVENTS ")] "
+						"unsupported event\r\n", self->tag);
+				g_tree_destroy(mailboxes);
+				D->status = 1;
+				SESSION_RETURN;
+			}
+			break;
+		}
+
+		if (MATCH(filter, "selected") || MATCH(filter, "selected-delayed")) {
+			// changes are only sent between commands, so both are the same here
+			selected = events;
+		} else if (MATCH(filter, "inboxes")) {
+			notify_add_name(self, mailboxes, "INBOX", events);
+		} else if (MATCH(filter, "personal")) {
+			notify_add_pattern(self, mailboxes, "*", 0, TRUE, events);
+		} else if (MATCH(filter, "subscribed")) {
+			notify_add_pattern(self, mailboxes, "*", 1, FALSE, events);
+		} else if (names) {
+			names = g_list_first(names);
+			while (names) {
+				const char *name = (const char *)names->data;
+				notify_add_name(self, mailboxes, name, events);
+				if (MATCH(filter, "subtree")) {
+					char *pattern = g_strconcat(name, MAILBOX_SEPARATOR, "*", NULL);
+					notify_add_pattern(self, mailboxes, pattern, 0, FALSE, events);
+					g_free(pattern);
+				}
+				if (! g_list_next(names)) break;
+				names = g_list_next(names);
+			}
+			g_list_free(g_list_first(names));
+		} else {
+			break;
+		}
+		bad = FALSE;
+	}
+
+	if (bad) {
+		dbmail_imap_session_buff_printf(self, "%s BAD invalid NOTIFY arguments\r\n", self->tag);
+		g_tree_destroy(mailboxes);
+		D->status = 1;
+		SESSION_RETURN;
+	}
+
+	dbmail_imap_session_notify_set(self, selected, mailboxes);
+	dbmail_imap_session_notify_probe(self, ! status);
+	if (status)
+		g_tree_foreach(mailboxes, (GTraverseFunc)_notify_status_all, self);
+
+	SESSION_OK;
+	SESSION_RETURN;
+}
+
+static void _ic_notify_leave(gpointer data)
+{
+	dm_thread_data *D = (dm_thread_data *)data;
+	// the registry is only touched from the main thread
+	imap_notify_subscribe(D->session);
+	_ic_cb_leave(data);
+}
+
+int _ic_notify(ImapSession *self)
+{
+	if (!check_state_and_args(self, 1, 0, CLIENTSTATE_AUTHENTICATED)) return 1;
+	if (! notify_listening()) {
+		dbmail_imap_session_buff_printf(self, "%s NO NOTIFY not available\r\n", self->tag);
+		return 1;
+	}
+	dm_thread_data_push((gpointer)self, _ic_notify_enter, _ic_notify_leave, NULL);
+	return 0;
+}
+
 /* _ic_append()
  *
  * append a message to a mailbox
@@ -1595,7 +1840,7 @@ void _ic_append_enter(dm_thread_data *D)
 	SESSION_GET;
 	const char *message;
 	gboolean recent = TRUE;
-	MessageInfo *info;
+	MessageInfo info;
 
 	memset(flaglist,0,sizeof(flaglist));
 
@@ -1738,20 +1983,21 @@ void _ic_append_enter(dm_thread_data *D)
 	}
 
 	// MessageInfo
-	info = g_new0(MessageInfo,1);
-	info->uid = message_id;
-	info->mailbox_id = mboxid;
+	memset(&info, 0, sizeof(MessageInfo));
+	info.uid = message_id;
 	for (flagcount = 0; flagcount < IMAP_NFLAGS; flagcount++)
-		info->flags[flagcount] = flaglist[flagcount];
-	info->flags[IMAP_FLAG_RECENT] = 1;
-	strncpy(info->internaldate, 
-			internal_date?internal_date:"01-Jan-1970 00:00:01 +0100",
-		       	IMAP_INTERNALDATE_LEN-1);
-	info->rfcsize = strlen(message);
-	info->keywords = keywords;
+		info.flags[flagcount] = flaglist[flagcount];
+	info.flags[IMAP_FLAG_RECENT] = 1;
+	info.internaldate = time(NULL);
+	if (internal_date) {
+		time_t date = g_mime_utils_header_decode_date(internal_date, NULL);
+		if (date) info.internaldate = date;
+	}
+	info.rfcsize = strlen(message);
 
 	M = dbmail_imap_session_mbxinfo_lookup(self, mboxid);
-	MailboxState_addMsginfo(M, message_id, info);
+	MailboxState_addMessage(M, &info, keywords);
+	g_list_destroy(keywords);
 
 	char buffer[1024];
 	memset(buffer, 0, sizeof(buffer));
@@ -1957,6 +2203,8 @@ static void sorted_search_enter(dm_thread_data *D)
 		if (dbmail_mailbox_build_imap_search(mb, self->args, &(self->args_idx), order) < 0) {
 			dbmail_imap_session_buff_printf(self, "%s BAD invalid arguments to %s\r\n",
 				self->tag, cmd);
+			if (self->ret.options & SEARCH_RETURN_SAVE)
+				dbmail_imap_session_searchres(self, NULL);
 			D->status = 1;
 			SESSION_RETURN;
 		}
@@ -1965,23 +2213,50 @@ static void sorted_search_enter(dm_thread_data *D)
 		switch(order) {
 			case SEARCH_SORTED:
 				dbmail_mailbox_sort(mb);
-				s = dbmail_mailbox_sorted_as_string(mb);
+				if (self->ret.options)
+					s = dbmail_mailbox_esearch(mb, &self->ret, TRUE);
+				else
+					s = dbmail_mailbox_sorted_as_string(mb);
 			break;
 			case SEARCH_UNORDERED:
-				s = dbmail_mailbox_ids_as_string(mb, FALSE, " ");
+				if (self->ret.options)
+					s = dbmail_mailbox_esearch(mb, &self->ret, FALSE);
+				else
+					s = dbmail_mailbox_ids_as_string(mb, FALSE, " ");
 			break;
 			case SEARCH_THREAD_ORDEREDSUBJECT:
 				s = dbmail_mailbox_orderedsubject(mb);
 			break;
 			case SEARCH_THREAD_REFERENCES:
-				s = NULL; // TODO: unsupported
+				s = dbmail_mailbox_references(mb);
 			break;
 		}
+		if (self->ret.options & SEARCH_RETURN_SAVE)
+			dbmail_imap_session_searchres(self, dbmail_mailbox_save(mb, &self->ret, (order == SEARCH_SORTED)));
 	} else {
 		TRACE(TRACE_DEBUG, "empty mailbox?");
+		if (self->ret.options & SEARCH_RETURN_SAVE)
+			dbmail_imap_session_searchres(self, NULL);
 	}
 
-	if (s) {
+	if (self->ret.options == (SEARCH_RETURN_ESEARCH|SEARCH_RETURN_SAVE)) {
+		// RETURN (SAVE) alone answers with just the tagged OK
+		g_free(s);
+	} else if (self->ret.options) {
+		// empty mailbox: nothing was searched
+		if (! s) {
+			GString *t = g_string_new("");
+			if (self->ret.options & SEARCH_RETURN_COUNT)
+				g_string_append(t, " COUNT 0");
+			if (self->ret.options & SEARCH_RETURN_PARTIAL)
+				g_string_append_printf(t, " PARTIAL (%" PRId64 ":%" PRId64 " NIL)",
+						self->ret.partial_lo, self->ret.partial_hi);
+			s = g_string_free(t, FALSE);
+		}
+		dbmail_imap_session_buff_printf(self, "* ESEARCH (TAG \"%s\")%s%s\r\n",
+				self->tag, self->use_uid ? " UID" : "", s ? s : "");
+		g_free(s);
+	} else if (s) {
 		dbmail_imap_session_buff_printf(self, "* %s %s\r\n", cmd, s);
 		g_free(s);
 	} else {
@@ -1992,10 +2267,79 @@ static void sorted_search_enter(dm_thread_data *D)
 	SESSION_RETURN;
 }
 
+/*
+ * RETURN (...) options of SEARCH and SORT
+ *
+ * return -1 on a syntax error
+ */
+#define SEARCH_ARG(s) ((s)->args[(s)->args_idx] ? p_string_str((s)->args[(s)->args_idx]) : NULL)
+static int search_return_parse(ImapSession *self)
+{
+	const char *arg;
+	char *end;
+	int64_t lo, hi;
+	search_return *ret = &self->ret;
+
+	memset(ret, 0, sizeof(search_return));
+
+	if (! MATCH(SEARCH_ARG(self), "RETURN"))
+		return 0;
+	self->args_idx++;
+
+	if (! MATCH(SEARCH_ARG(self), "("))
+		return -1;
+	self->args_idx++;
+
+	ret->options = SEARCH_RETURN_ESEARCH;
+	while ((arg = SEARCH_ARG(self)) && ! MATCH(arg, ")")) {
+		self->args_idx++;
+		if (MATCH(arg, "MIN"))
+			ret->options |= SEARCH_RETURN_MIN;
+		else if (MATCH(arg, "MAX"))
+			ret->options |= SEARCH_RETURN_MAX;
+		else if (MATCH(arg, "COUNT"))
+			ret->options |= SEARCH_RETURN_COUNT;
+		else if (MATCH(arg, "ALL"))
+			ret->options |= SEARCH_RETURN_ALL;
+		else if (MATCH(arg, "SAVE"))
+			ret->options |= SEARCH_RETURN_SAVE;
+		else if (MATCH(arg, "PARTIAL")) {
+			if (! (arg = SEARCH_ARG(self)))
+				return -1;
+			self->args_idx++;
+			lo = g_ascii_strtoll(arg, &end, 10);
+			if (*end++ != ':')
+				return -1;
+			hi = g_ascii_strtoll(end, &end, 10);
+			if (*end || (lo == 0) || (hi == 0) || ((lo < 0) != (hi < 0)))
+				return -1;
+			// kept as given, the response echoes it
+			ret->options |= SEARCH_RETURN_PARTIAL;
+			ret->partial_lo = lo;
+			ret->partial_hi = hi;
+		} else
+			return -1;
+	}
+	if (! arg)
+		return -1;
+	self->args_idx++;
+
+	// RETURN () is the same as RETURN (ALL)
+	if (ret->options == SEARCH_RETURN_ESEARCH)
+		ret->options |= SEARCH_RETURN_ALL;
+
+	return 0;
+}
+
 static int sorted_search(ImapSession *self, search_order order)
 {
 	if (!check_state_and_args(self, 1, 0, CLIENTSTATE_SELECTED)) return 1;
 	self->order = order;
+	memset(&self->ret, 0, sizeof(search_return));
+	if ((order == SEARCH_UNORDERED || order == SEARCH_SORTED) && search_return_parse(self) < 0) {
+		dbmail_imap_session_buff_printf(self, "%s BAD invalid RETURN options\r\n", self->tag);
+		return 1;
+	}
 	dm_thread_data_push((gpointer)self, sorted_search_enter, _ic_cb_leave, NULL);
 	return 0;
 }
@@ -2015,9 +2359,9 @@ int _ic_thread(ImapSession *self)
 	if (MATCH(p_string_str(self->args[self->args_idx]),"ORDEREDSUBJECT"))
 		return sorted_search(self,SEARCH_THREAD_ORDEREDSUBJECT);
 	if (MATCH(p_string_str(self->args[self->args_idx]),"REFERENCES"))
-		dbmail_imap_session_buff_printf(self, "%s BAD THREAD=REFERENCES not supported\r\n",self->tag);
-		//return sorted_search(self,SEARCH_THREAD_REFERENCES);
+		return sorted_search(self,SEARCH_THREAD_REFERENCES);
 
+	dbmail_imap_session_buff_printf(self, "%s BAD unknown threading algorithm\r\n",self->tag);
 	return 1;
 }
 
@@ -2036,6 +2380,10 @@ int _dm_imapsession_get_ids(ImapSession *self, const char *set)
 
 	found = ( self->ids && (g_tree_nnodes(self->ids) > 0) );
 
+	// an empty saved result is valid, like an empty uid set
+	if (MATCH(set, "$") && self->ids)
+		return DM_SUCCESS;
+
 	if ( (! self->use_uid) && (! found)) {
 		dbmail_imap_session_buff_printf(self, "%s BAD invalid sequence in msn set [%s]\r\n", self->tag, set);
 		return DM_EGENERAL;
@@ -2080,6 +2428,8 @@ static void _ic_fetch_enter(dm_thread_data *D)
 		self->args_idx++;
 	} while (state > 0);
 
+	dbmail_imap_session_fetch_plan(self);
+
 	if (self->fi->vanished && (! self->fi->changedsince)) {
 		dbmail_imap_session_buff_printf(self, "%s BAD invalid argument list to fetch\r\n", self->tag);
 		D->status = 1;
@@ -2136,7 +2486,9 @@ void _fetch_update(ImapSession *self, MessageInfo *msginfo, bool showmodseq, boo
 {
 	bool needspace = false;
 
-	uint64_t *msn = g_tree_lookup(MailboxState_getIds(self->mailbox->mbstate), &msginfo->uid);
+	uint64_t *msn = MailboxState_getMsn(self->mailbox->mbstate, msginfo->uid);
+
+	if (! msn) return;
 
 	dbmail_imap_session_buff_printf(self,"* %" PRIu64 " FETCH (", *msn);
 	if (self->use_uid) {
@@ -2170,15 +2522,15 @@ static gboolean _do_store(uint64_t *id, gpointer UNUSED value, dm_thread_data *D
 	int i;
 	int changed = 0;
 
-	if (self->mailbox && MailboxState_getMsginfo(self->mailbox->mbstate))
-		msginfo = g_tree_lookup(MailboxState_getMsginfo(self->mailbox->mbstate), id);
+	if (self->mailbox && self->mailbox->mbstate)
+		msginfo = MailboxState_editMessage(self->mailbox->mbstate, *id);
 
 	if (! msginfo)
 		return TRUE;
 
 
 	if (MailboxState_getPermission(self->mailbox->mbstate) == IMAPPERM_READWRITE) {
-		changed = db_set_msgflag(*id, cmd->flaglist, cmd->keywords, cmd->action, cmd->unchangedsince, msginfo);
+		changed = db_set_msgflag(*id, cmd->flaglist, cmd->keywords, cmd->action, cmd->unchangedsince, self->mailbox->mbstate);
 		if (changed < 0) {
 			dbmail_imap_session_buff_printf(self, "\r\n* BYE internal dbase error\r\n");
 			D->status = TRUE;
@@ -2216,7 +2568,7 @@ static gboolean _do_store(uint64_t *id, gpointer UNUSED value, dm_thread_data *D
 	}
 
 	// Set the user keywords as labels
-	g_list_merge(&(msginfo->keywords), cmd->keywords, cmd->action, (GCompareFunc)g_ascii_strcasecmp);
+	MailboxState_setMessageKeywords(self->mailbox->mbstate, msginfo, cmd->keywords, cmd->action);
 
 	// reporting callback
 	if ((! cmd->silent) || changed > 0) {
@@ -52,6 +52,7 @@ int _ic_unsubscribe(ImapSession *self);
 int _ic_list(ImapSession *self);
 int _ic_lsub(ImapSession *self);
 int _ic_status(ImapSession *self);
+int _ic_notify(ImapSession *self);
 int _ic_append(ImapSession *self);
 
 /* selected-state commands */
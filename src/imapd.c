@@ -49,6 +49,7 @@ int main(int argc, char *argv[])
 	}
 
 	config.ClientHandler = imap_handle_connection;
+	config.ChangeHandler = imap_handle_change;
 	imap_before_smtp = config.service_before_smtp;
 	result = server_mainloop(&config, "dbmail-imapd");
 shutdown:
@@ -58,6 +58,9 @@ static int do_check_iplog(const char *timespec);
 static int do_check_replycache(const char *timespec);
 static int do_vacuum_db(void);
 static int do_rehash(void);
+static int do_fulltext(void);
+static int do_trigram(void);
+static int do_dedup(void);
 static int do_migrate(int migrate_limit);
 
 int do_showhelp(void) {
@@ -71,7 +74,7 @@ int do_showhelp(void) {
 	"     -a        perform all checks (in this release: -ctubpds)\n"
 	"     -c        clean up database (optimize/vacuum)\n"
 	"     -t        test for message integrity\n"
-	"     -b        body/header/envelope cache check\n"
+	"     -b        body/header/envelope/sort key cache check\n"
 	"     -p        purge messages have the DELETE status set\n"
 	"     -d        set DELETE status for deleted messages\n"
 	"     -s        remove dangling/invalid aliases and forwards\n"
@@ -80,6 +83,9 @@ int do_showhelp(void) {
 	"               the time syntax is [<hours>h][<minutes>m]\n"
 	"               valid examples: 72h, 4h5m, 10m\n"
 	"     -M        migrate legacy 2.2.x messageblks to mimeparts table\n"
+	"     --fulltext    add unindexed messages to the full-text index\n"
+	"     --trigram     build the header value trigram index\n"
+	"     --dedup       merge mimeparts by hash and size for mimepart_dedup = digest\n"
 	"     --erase days  Delete messages older than date in INBOX/Trash \n"       
 	"     --move  days  Move messages from INBOX to INBOX/Trash\n"
 	"     --inbox name  Inbox folder to move from, used in conjunction with --move\n"
@@ -105,12 +111,16 @@ int main(int argc, char *argv[])
 	int check_iplog = 0, check_replycache = 0;
 	char *timespec_iplog = NULL, *timespec_replycache = NULL;
 	int vacuum_db = 0, purge_deleted = 0, set_deleted = 0, dangling_aliases = 0, rehash = 0, move_old = 0, erase_old = 0;
+	int fulltext = 0, trigram = 0, dedup = 0;
 	int show_help = 0;
 	int do_nothing = 1;
 	int is_header = 0;
 	int migrate = 0, migrate_limit = 10000;
 	static struct option long_options[] = {
 		{ "rehash", 0, 0, 0 },
+		{ "fulltext", 0, 0, 0 },
+		{ "trigram", 0, 0, 0 },
+		{ "dedup", 0, 0, 0 },
 		{ "move", 1, 0, 0 },
 		{ "erase", 1, 0, 0 },
 		{ "trash", 1, 0, 0 },
@@ -141,6 +151,15 @@ int main(int argc, char *argv[])
 			if (strcmp(long_options[opt_index].name,"rehash")==0)
 				rehash = 1;
 
+			if (strcmp(long_options[opt_index].name,"fulltext")==0)
+				fulltext = 1;
+
+			if (strcmp(long_options[opt_index].name,"trigram")==0)
+				trigram = 1;
+
+			if (strcmp(long_options[opt_index].name,"dedup")==0)
+				dedup = 1;
+
 			if (strcmp(long_options[opt_index].name,"move")==0) {
 				move_old = 1;
 				days_move = atoi(optarg);
@@ -319,6 +338,9 @@ int main(int argc, char *argv[])
 	if (check_replycache) do_check_replycache(timespec_replycache);
 	if (vacuum_db) do_vacuum_db();
 	if (rehash) do_rehash();
+	if (fulltext) do_fulltext();
+	if (trigram) do_trigram();
+	if (dedup) do_dedup();
 	if (migrate) do_migrate(migrate_limit);
 
 	if (!has_errors && !serious_errors) {
@@ -416,6 +438,186 @@ static int db_cleanup_replycache(TimeString_T lasttokeep)
 	return db_update("DELETE FROM %sreplycache WHERE lastseen < %s", DBPFX, to_date_str);
 }
 
+static int db_trigram_pg_index(void)
+{
+	Connection_T c; volatile int t = DM_SUCCESS;
+
+	c = db_con_get();
+	TRY
+		db_exec(c, "CREATE EXTENSION IF NOT EXISTS pg_trgm");
+		db_exec(c, "CREATE INDEX CONCURRENTLY IF NOT EXISTS %sheadervalue_trgm "
+				"ON %sheadervalue USING gin (headervalue gin_trgm_ops)", DBPFX, DBPFX);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
+}
+
+static int db_count_trigram_pending(uint64_t *rows)
+{
+	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
+	*rows = 0;
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT COUNT(*) FROM %sheadervalue v WHERE NOT EXISTS "
+				"(SELECT 1 FROM %sheadervalue_trigrams t WHERE t.headervalue_id = v.id)",
+				DBPFX, DBPFX);
+		if (db_result_next(r))
+			*rows = db_result_get_u64(r,0);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
+}
+
+static int db_count_mimepart_duplicates(uint64_t *rows)
+{
+	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
+	const char *e = db_get_sql(SQL_ESCAPE_COLUMN);
+	*rows = 0;
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT COUNT(*) FROM (SELECT hash FROM %smimeparts "
+				"GROUP BY hash, %ssize%s HAVING COUNT(*) > 1) d",
+				DBPFX, e, e);
+		if (db_result_next(r))
+			*rows = db_result_get_u64(r,0);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
+}
+
+/* point all parts with the same hash and size at the oldest one, and
+ * add the unique index that digest dedup relies on.
+ *
+ * partlists.part_id cascades on delete, so the duplicates may only be
+ * removed once every partlist pointing at them has been moved: any
+ * failure rolls the whole merge back. */
+static int db_dedup_mimeparts(void)
+{
+	Connection_T c; volatile int t = DM_SUCCESS;
+	volatile gboolean ok = FALSE;
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		switch (db_params.db_driver) {
+			case DM_DRIVER_POSTGRESQL:
+				ok = db_exec(c, "UPDATE %spartlists p SET part_id = d.keep FROM ("
+						"SELECT id, MIN(id) OVER (PARTITION BY hash, size) AS keep FROM %smimeparts"
+						") d WHERE p.part_id = d.id AND d.id <> d.keep", DBPFX, DBPFX);
+				if (ok) ok = db_exec(c, "DELETE FROM %smimeparts m USING %smimeparts k "
+						"WHERE m.hash = k.hash AND m.size = k.size AND m.id > k.id", DBPFX, DBPFX);
+				break;
+			case DM_DRIVER_MYSQL:
+				ok = db_exec(c, "UPDATE %spartlists p JOIN %smimeparts m ON p.part_id = m.id "
+						"JOIN (SELECT hash, `size`, MIN(id) AS keep FROM %smimeparts "
+						"GROUP BY hash, `size` HAVING COUNT(*) > 1) d "
+						"ON m.hash = d.hash AND m.`size` = d.`size` "
+						"SET p.part_id = d.keep WHERE m.id <> d.keep", DBPFX, DBPFX, DBPFX);
+				if (ok) ok = db_exec(c, "DELETE m FROM %smimeparts m JOIN %smimeparts k "
+						"ON m.hash = k.hash AND m.`size` = k.`size` AND m.id > k.id", DBPFX, DBPFX);
+				break;
+			default:
+				ok = db_exec(c, "UPDATE %spartlists SET part_id = ("
+						"SELECT MIN(k.id) FROM %smimeparts m, %smimeparts k "
+						"WHERE m.id = %spartlists.part_id AND k.hash = m.hash AND k.size = m.size"
+						") WHERE part_id IN (SELECT id FROM %smimeparts)",
+						DBPFX, DBPFX, DBPFX, DBPFX, DBPFX);
+				if (ok) ok = db_exec(c, "DELETE FROM %smimeparts WHERE id NOT IN "
+						"(SELECT MIN(id) FROM %smimeparts GROUP BY hash, size)", DBPFX, DBPFX);
+				break;
+		}
+		if (! ok) {
+			db_rollback_transaction(c);
+			t = DM_EQUERY;
+		} else {
+			db_commit_transaction(c);
+			/* outside the transaction: MySQL commits implicitly on DDL */
+			if (! db_exec(c, "CREATE UNIQUE INDEX %s%s ON %smimeparts(hash, %ssize%s)",
+					DBPFX, MIMEPART_DIGEST_INDEX, DBPFX,
+					db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN)))
+				t = DM_EQUERY;
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
+}
+
+/* index header values in batches, in id order */
+static int db_trigram_backfill(void)
+{
+	Connection_T c; ResultSet_T r;
+	volatile int t = DM_SUCCESS;
+	volatile uint64_t last = 0;
+	volatile int rows;
+	GList * volatile ids = NULL;
+	GList * volatile values = NULL;
+	GList *i, *v;
+
+	do {
+		rows = 0;
+		c = db_con_get();
+		TRY
+			r = db_query(c, "SELECT v.id, v.headervalue FROM %sheadervalue v WHERE v.id > %" PRIu64 " "
+					"AND NOT EXISTS (SELECT 1 FROM %sheadervalue_trigrams t WHERE t.headervalue_id = v.id) "
+					"ORDER BY v.id LIMIT 1000", DBPFX, last, DBPFX);
+			while (db_result_next(r)) {
+				uint64_t *id = g_new0(uint64_t, 1);
+				*id = db_result_get_u64(r, 0);
+				ids = g_list_prepend(ids, id);
+				values = g_list_prepend(values, g_strdup(db_result_get(r, 1)));
+				rows++;
+			}
+			db_con_clear(c);
+
+			db_begin_transaction(c);
+			ids = g_list_reverse(ids);
+			values = g_list_reverse(values);
+			for (i = ids, v = values; i && v; i = g_list_next(i), v = g_list_next(v)) {
+				trigram_index_value(c, *(uint64_t *)i->data, (char *)v->data);
+				last = *(uint64_t *)i->data;
+			}
+			db_commit_transaction(c);
+		CATCH(SQLException)
+			LOG_SQLERROR;
+			db_rollback_transaction(c);
+			t = DM_EQUERY;
+		FINALLY
+			db_con_close(c);
+		END_TRY;
+
+		g_list_destroy(ids);
+		g_list_destroy(values);
+		ids = values = NULL;
+
+		if (rows) fprintf(stderr, ".");
+	} while (rows && t == DM_SUCCESS);
+
+	return t;
+}
+
 static int db_count_deleted(uint64_t * rows)
 {
 	Connection_T c; ResultSet_T r; volatile int t = TRUE;
@@ -840,6 +1042,52 @@ static int do_envelope(void)
 		}
 	}
 
+	g_list_destroy(lost);
+	lost = NULL;
+
+	if (db_icheck_bodystructure(&lost) < 0) {
+		qerrorf("Failed. An error occured. Please check log.\n");
+		serious_errors = 1;
+		return -1;
+	}
+
+	if (g_list_length(lost) > 0) {
+		qerrorf("Ok. Found [%d] missing bodystructure values.\n", g_list_length(lost));
+		has_errors = 1;
+	} else {
+		qprintf("Ok. Found [%d] missing bodystructure values.\n", g_list_length(lost));
+	}
+
+	if (yes_to_all) {
+		if (db_set_bodystructure(lost) < 0) {
+			qerrorf("Error setting the bodystructure cache");
+			has_errors = 1;
+		}
+	}
+
+	g_list_destroy(lost);
+	lost = NULL;
+
+	if (db_icheck_sortkeys(&lost) < 0) {
+		qerrorf("Failed. An error occured. Please check log.\n");
+		serious_errors = 1;
+		return -1;
+	}
+
+	if (g_list_length(lost) > 0) {
+		qerrorf("Ok. Found [%d] missing sort keys.\n", g_list_length(lost));
+		has_errors = 1;
+	} else {
+		qprintf("Ok. Found [%d] missing sort keys.\n", g_list_length(lost));
+	}
+
+	if (yes_to_all) {
+		if (db_set_sortkeys(lost) < 0) {
+			qerrorf("Error setting the sort keys");
+			has_errors = 1;
+		}
+	}
+
 	g_list_destroy(lost);
 
 	time(&stop);
@@ -1008,6 +1256,153 @@ int do_rehash(void)
 
 }
 
+int do_fulltext(void)
+{
+	time_t start, stop;
+	GList *lost = NULL;
+
+	if (! fulltext_backend()) {
+		qerrorf("\nThe full-text index is disabled. Set fulltext_index first.\n");
+		return 0;
+	}
+
+	if (no_to_all) {
+		qprintf("\nChecking DBMAIL full-text index...\n");
+	}
+	if (yes_to_all) {
+		qprintf("\nRepairing DBMAIL full-text index...\n");
+	}
+	time(&start);
+
+	if (db_icheck_fulltext(&lost) < 0) {
+		qerrorf("Failed. An error occured. Please check log.\n");
+		serious_errors = 1;
+		return -1;
+	}
+
+	if (g_list_length(lost) > 0) {
+		qerrorf("Ok. Found [%d] unindexed messages.\n", g_list_length(lost));
+		has_errors = 1;
+	} else {
+		qprintf("Ok. Found [%d] unindexed messages.\n", g_list_length(lost));
+	}
+
+	if (yes_to_all) {
+		if (db_set_fulltext(lost) < 0) {
+			qerrorf("Error updating the full-text index");
+			has_errors = 1;
+		}
+	}
+
+	g_list_destroy(lost);
+
+	time(&stop);
+	qverbosef("--- checking full-text index took %g seconds\n",
+	       difftime(stop, start));
+
+	return 0;
+}
+
+int do_trigram(void)
+{
+	time_t start, stop;
+	uint64_t pending = 0;
+
+	if (trigram_mode() == TRIGRAM_OFF) {
+		qerrorf("\nThe header trigram index is disabled. Set header_trigram_index first.\n");
+		return 0;
+	}
+
+	time(&start);
+
+	if (db_params.db_driver == DM_DRIVER_POSTGRESQL) {
+		qprintf("\nChecking DBMAIL for the pg_trgm header value index...\n");
+		if (! yes_to_all) {
+			qprintf("\tindex creation skipped. Use -y option to create it.\n");
+			return 0;
+		}
+		if (db_trigram_pg_index() == DM_SUCCESS) {
+			qprintf("Ok. Header values are indexed by pg_trgm.\n");
+			return 0;
+		}
+		qprintf("pg_trgm is not available. Using the trigram table instead.\n");
+	}
+
+	if (no_to_all) {
+		qprintf("\nChecking DBMAIL header value trigrams...\n");
+	}
+	if (yes_to_all) {
+		qprintf("\nRepairing DBMAIL header value trigrams...\n");
+	}
+
+	if (db_count_trigram_pending(&pending) < 0) {
+		qerrorf("Failed. An error occured. Please check log.\n");
+		serious_errors = 1;
+		return -1;
+	}
+
+	// values shorter than three characters have no trigrams
+	qprintf("Ok. Found [%" PRIu64 "] header values without trigrams.\n", pending);
+
+	if (yes_to_all && pending) {
+		if (db_trigram_backfill() < 0) {
+			qerrorf("Error building the trigram index");
+			has_errors = 1;
+		}
+	}
+
+	time(&stop);
+	qverbosef("--- checking trigram index took %g seconds\n",
+	       difftime(stop, start));
+
+	return 0;
+}
+
+int do_dedup(void)
+{
+	time_t start, stop;
+	uint64_t duplicates = 0;
+	Field_T config;
+
+	config_get_value("mimepart_dedup", "DBMAIL", config);
+	if ((! SMATCH(config, "digest")) || (! db_get_sql(SQL_UPSERT_MIMEPART))) {
+		qerrorf("\nMimeparts are compared in full. Set mimepart_dedup = digest first.\n");
+		return 0;
+	}
+
+	qprintf("\nChecking DBMAIL for the unique mimeparts index...\n");
+	if (db_index_exists(MIMEPART_DIGEST_INDEX)) {
+		qprintf("Ok. Mimeparts are unique by hash and size.\n");
+		return 0;
+	}
+
+	time(&start);
+
+	if (db_count_mimepart_duplicates(&duplicates) < 0) {
+		qerrorf("Failed. An error occured. Please check log.\n");
+		serious_errors = 1;
+		return -1;
+	}
+
+	qprintf("Ok. Found [%" PRIu64 "] hash and size pairs shared by several mimeparts.\n", duplicates);
+
+	if (! yes_to_all) {
+		qprintf("\tmerge and index creation skipped. Use -y option to perform them.\n");
+		return 0;
+	}
+
+	if (db_dedup_mimeparts() < 0) {
+		qerrorf("Error creating the unique mimeparts index");
+		has_errors = 1;
+	}
+
+	time(&stop);
+	qverbosef("--- merging mimeparts took %g seconds\n",
+	       difftime(stop, start));
+
+	return 0;
+}
+
 int do_migrate(int migrate_limit)
 {
 	Connection_T c; ResultSet_T r;
@@ -1202,7 +1597,9 @@ int do_move_old (int days, char * mbinbox_name, char * mbtrash_name)
 			      DBPFX, DBPFX, DBPFX, MESSAGE_STATUS_DELETE, expire);
 
 	s1 = db_stmt_prepare(c, "SELECT mailbox_idnr FROM %smailboxes WHERE owner_idnr = ? AND name = ?", DBPFX);
-	s2 = db_stmt_prepare(c, "UPDATE %smessages SET mailbox_idnr = ? WHERE message_idnr = ?", DBPFX);
+	s2 = db_stmt_prepare(c, "UPDATE %smessages SET mailbox_idnr = ?, "
+			"seq = (SELECT seq + 1 FROM %smailboxes WHERE mailbox_idnr = ?) "
+			"WHERE message_idnr = ?", DBPFX, DBPFX);
 
 	db_stmt_set_str(s, 1, mbinbox_name);
 
@@ -1226,7 +1623,8 @@ int do_move_old (int days, char * mbinbox_name, char * mbtrash_name)
 
 			if (!skip) {
 				db_stmt_set_u64(s2,1,mailbox_to);
-				db_stmt_set_u64(s2,2,id);
+				db_stmt_set_u64(s2,2,mailbox_to);
+				db_stmt_set_u64(s2,3,id);
 				db_stmt_exec(s2);
 				db_mailbox_seq_update(mailbox_to, 0);
 				db_mailbox_seq_update(mailbox_from, 0);
@@ -511,8 +511,35 @@ static void server_close_sockets(ServerConfig_T *conf)
 	}
 }
 
+static void server_notify_cb(int fd, short what UNUSED, void *arg)
+{
+	ServerConfig_T *conf = (ServerConfig_T *)arg;
+	uint64_t mailbox_id, seq;
+
+	while (notify_recv(fd, &mailbox_id, &seq))
+		conf->ChangeHandler(mailbox_id, seq);
+}
+
+static void server_notify_listen(ServerConfig_T *conf)
+{
+	struct event *evnotify;
+	int fd;
+
+	if (! conf->ChangeHandler)
+		return;
+
+	if ((fd = notify_listen()) < 0) {
+		TRACE(TRACE_NOTICE, "change notifications unavailable, falling back to polling");
+		return;
+	}
+
+	evnotify = event_new(evbase, fd, EV_READ|EV_PERSIST, server_notify_cb, conf);
+	event_add(evnotify, NULL);
+}
+
 static void server_exit(void)
 {
+	notify_unlisten();
 	disconnect_all();
 	server_close_sockets(server_conf);
 	//event_base_free(evbase);
@@ -777,6 +804,10 @@ int server_run(ServerConfig_T *conf)
 		TRACE(TRACE_ERR, "could not connect to authentication");
 		return -1;
 	}
+
+	if (MATCH(conf->service_name, "LMTP") || MATCH(conf->service_name, "IMAP"))
+		dbmail_message_header_names_init();
+
 	srand((int) ((int) time(NULL) + (int) getpid()));
 
  	TRACE(TRACE_NOTICE, "starting main service loop for [%s]", conf->service_name);
@@ -848,6 +879,8 @@ int server_run(ServerConfig_T *conf)
 	if (MATCH(conf->service_name, "IMAP"))
 		dm_queue_heartbeat();
 
+	server_notify_listen(conf);
+
 	TRACE(TRACE_DEBUG,"dispatching event loop...");
 
 	event_base_dispatch(evbase);
@@ -74,8 +74,8 @@ END_TEST
 
 START_TEST(test_capa_add)
 {
-	char *ex1 = "IMAP4rev1 AUTH=LOGIN AUTH=CRAM-MD5 ACL RIGHTS=texk NAMESPACE CHILDREN SORT QUOTA THREAD=ORDEREDSUBJECT UNSELECT IDLE STARTTLS UIDPLUS WITHIN LOGINDISABLED CONDSTORE LITERAL+ ENABLE QRESYNC";
-	char *ex2 = "IMAP4rev1 AUTH=LOGIN AUTH=CRAM-MD5 ACL RIGHTS=texk NAMESPACE CHILDREN SORT QUOTA THREAD=ORDEREDSUBJECT UNSELECT IDLE STARTTLS UIDPLUS WITHIN LOGINDISABLED CONDSTORE LITERAL+ ENABLE QRESYNC ID";
+	char *ex1 = "IMAP4rev1 AUTH=LOGIN AUTH=CRAM-MD5 ACL RIGHTS=texk NAMESPACE CHILDREN SORT SORT=DISPLAY ESORT QUOTA THREAD=ORDEREDSUBJECT THREAD=REFERENCES UNSELECT IDLE STARTTLS UIDPLUS WITHIN ESEARCH SEARCHRES LOGINDISABLED CONDSTORE LITERAL+ ENABLE QRESYNC NOTIFY";
+	char *ex2 = "IMAP4rev1 AUTH=LOGIN AUTH=CRAM-MD5 ACL RIGHTS=texk NAMESPACE CHILDREN SORT SORT=DISPLAY ESORT QUOTA THREAD=ORDEREDSUBJECT THREAD=REFERENCES UNSELECT IDLE STARTTLS UIDPLUS WITHIN ESEARCH SEARCHRES LOGINDISABLED CONDSTORE LITERAL+ ENABLE QRESYNC NOTIFY ID";
 	Capa_remove(A, "ID");
 	fail_unless(! Capa_match(A, "ID"), "remove failed\n[%s] !=\n[%s]\n", ex1, Capa_as_string(A));
 	fail_unless(MATCH(Capa_as_string(A), ex1), "remove failed\n[%s] !=\n[%s]\n", ex1, Capa_as_string(A));
@@ -87,7 +87,7 @@ END_TEST
 
 START_TEST(test_capa_remove)
 {
-	char *ex1 = "IMAP4rev1 AUTH=LOGIN AUTH=CRAM-MD5 ACL RIGHTS=texk SORT THREAD=ORDEREDSUBJECT UNSELECT IDLE ID UIDPLUS WITHIN LOGINDISABLED CONDSTORE LITERAL+ ENABLE QRESYNC";
+	char *ex1 = "IMAP4rev1 AUTH=LOGIN AUTH=CRAM-MD5 ACL RIGHTS=texk SORT SORT=DISPLAY ESORT THREAD=ORDEREDSUBJECT THREAD=REFERENCES UNSELECT IDLE ID UIDPLUS WITHIN ESEARCH SEARCHRES LOGINDISABLED CONDSTORE LITERAL+ ENABLE QRESYNC NOTIFY";
 	Capa_remove(A, "STARTTLS");
 	fail_unless(! Capa_match(A, "STARTTLS"), "remove failed");
 	Capa_remove(A, "NAMESPACE");
@@ -181,6 +181,35 @@ START_TEST(test_db_mailbox_set_permission)
 }
 END_TEST
 
+START_TEST(test_db_mailbox_seq)
+{
+	uint64_t a, b, seq, newseq;
+	GList *ids = NULL;
+
+	db_find_create_mailbox("testseqbox1", BOX_DEFAULT, testidnr, &a);
+	db_find_create_mailbox("testseqbox2", BOX_DEFAULT, testidnr, &b);
+	fail_unless(a && b, "db_find_create_mailbox failed");
+
+	ids = g_list_append(ids, &a);
+	ids = g_list_append(ids, &b);
+	fail_unless(db_mailbox_seq_probe(ids) == DM_SUCCESS, "db_mailbox_seq_probe failed");
+	g_list_free(ids);
+
+	seq = db_mailbox_seq(a);
+	fail_unless(seq > 0, "db_mailbox_seq failed");
+
+	// updates are written through
+	newseq = db_mailbox_seq_update(a, 0);
+	fail_unless(newseq > seq, "db_mailbox_seq_update failed");
+	fail_unless(db_mailbox_seq(a) == newseq, "db_mailbox_seq returned a stale seq");
+
+	fail_unless(db_mailbox_seq(999999999) == 0, "db_mailbox_seq found a missing mailbox");
+
+	db_delete_mailbox(a, 0, 0);
+	db_delete_mailbox(b, 0, 0);
+}
+END_TEST
+
 /**
  * Produces a regexp that will case-insensitively match the mailbox name
  * according to the modified UTF-7 rules given in section 5.1.3 of IMAP.
@@ -431,6 +460,7 @@ Suite *dbmail_db_suite(void)
 	tcase_add_test(tc_db, test_db_delete_mailbox);
 	tcase_add_test(tc_db, test_db_replycache);
 	tcase_add_test(tc_db, test_db_mailbox_set_permission);
+	tcase_add_test(tc_db, test_db_mailbox_seq);
 	tcase_add_test(tc_db, test_db_mailbox_create_with_parents);
 	tcase_add_test(tc_db, test_mailbox_match_new);
 	tcase_add_test(tc_db, test_db_findmailbox_by_regex);
@@ -306,7 +306,7 @@ START_TEST(test_dbmail_mailbox_search)
 	size_t size;
 	uint64_t idx = 0;
 	gboolean sorted = 1;
-	int all, found, notfound;
+	int all, found, notfound, subset;
 	DbmailMailbox *mb;
 	Mempool_T pool = mempool_open();
 	
@@ -365,6 +365,60 @@ START_TEST(test_dbmail_mailbox_search)
 
 	fail_unless((all - found) == notfound, "dbmail_mailbox_search failed: SEARCH NOT (all: %d, found: %d, notfound: %d)", all, found, notfound);
 	
+	// candidates passed to the query as ranges
+	idx=0;
+	sorted = 0;
+	mb = dbmail_mailbox_new(pool, get_mailbox_id("INBOX"));
+	search_keys = _build_search_keys(pool, "1,3:* TEXT @", &size);
+	
+	dbmail_mailbox_build_imap_search(mb, search_keys, &idx, sorted);
+	dbmail_mailbox_search(mb);
+	subset = g_tree_nnodes(mb->found);
+	
+	dbmail_mailbox_free(mb);
+	mempool_push(pool, search_keys, size);
+	
+	idx=0;
+	sorted = 0;
+	mb = dbmail_mailbox_new(pool, get_mailbox_id("INBOX"));
+	search_keys = _build_search_keys(pool, "2 TEXT @", &size);
+	
+	dbmail_mailbox_build_imap_search(mb, search_keys, &idx, sorted);
+	dbmail_mailbox_search(mb);
+	subset += g_tree_nnodes(mb->found);
+	
+	dbmail_mailbox_free(mb);
+	mempool_push(pool, search_keys, size);
+
+	fail_unless(subset == found, "dbmail_mailbox_search failed: SEARCH 1,3:* and 2 (found: %d, subset: %d)", found, subset);
+
+	// subtrees compiled into a single query
+	idx=0;
+	sorted = 0;
+	mb = dbmail_mailbox_new(pool, get_mailbox_id("INBOX"));
+	search_keys = _build_search_keys(pool, "1:* OR FROM foo ( SUBJECT a UNSEEN )", &size);
+	
+	dbmail_mailbox_build_imap_search(mb, search_keys, &idx, sorted);
+	dbmail_mailbox_search(mb);
+	found = g_tree_nnodes(mb->found);
+	
+	dbmail_mailbox_free(mb);
+	mempool_push(pool, search_keys, size);
+	
+	idx=0;
+	sorted = 0;
+	mb = dbmail_mailbox_new(pool, get_mailbox_id("INBOX"));
+	search_keys = _build_search_keys(pool, "1:* NOT OR FROM foo ( SUBJECT a UNSEEN )", &size);
+	
+	dbmail_mailbox_build_imap_search(mb, search_keys, &idx, sorted);
+	dbmail_mailbox_search(mb);
+	notfound = g_tree_nnodes(mb->found);
+	
+	dbmail_mailbox_free(mb);
+	mempool_push(pool, search_keys, size);
+
+	fail_unless((all - found) == notfound, "dbmail_mailbox_search failed: SEARCH NOT OR (all: %d, found: %d, notfound: %d)", all, found, notfound);
+
 	// third case
 	idx=0;
 	sorted = 0;
@@ -470,6 +524,169 @@ START_TEST(test_dbmail_mailbox_orderedsubject)
 
 }
 END_TEST
+START_TEST(test_dbmail_mailbox_references)
+{
+	char *res;
+	uint64_t idx = 0;
+	size_t size;
+	String_T *search_keys;
+	Mempool_T pool = mempool_open();
+	DbmailMailbox *mb = dbmail_mailbox_new(pool, get_mailbox_id("INBOX"));
+
+	search_keys = _build_search_keys(pool, "REFERENCES UTF-8 ALL", &size);
+
+	fail_unless(dbmail_mailbox_build_imap_search(mb, search_keys, &idx, SEARCH_THREAD_REFERENCES) >= 0);
+	dbmail_mailbox_search(mb);
+
+	dbmail_mailbox_set_uid(mb,TRUE);
+	res = dbmail_mailbox_references(mb);
+	fail_unless(res != NULL, "dbmail_mailbox_references failed");
+	g_free(res);
+
+	// again, from the cached graph
+	dbmail_mailbox_set_uid(mb,FALSE);
+	res = dbmail_mailbox_references(mb);
+	fail_unless(res != NULL, "dbmail_mailbox_references failed");
+	g_free(res);
+
+	dbmail_mailbox_free(mb);
+	mempool_push(pool, search_keys, size);
+	mempool_close(&pool);
+}
+END_TEST
+
+static void thread_add(struct thread_graph *g, GTree *found, uint64_t *ids, unsigned i,
+		const char *msgid, const char *refs, const char *subject, time_t date)
+{
+	GList *references = NULL;
+	char **r = NULL;
+	int j;
+
+	if (refs) {
+		r = g_strsplit(refs, " ", 0);
+		for (j = 0; r[j]; j++)
+			references = g_list_append(references, r[j]);
+	}
+	thread_graph_add(g, i, msgid, references, subject, date);
+	g_list_free(references);
+	g_strfreev(r);
+
+	ids[i] = i;
+	g_tree_insert(found, &ids[i], &ids[i]);
+}
+
+START_TEST(test_thread_graph_references)
+{
+	struct thread_graph *g = thread_graph_new(0);
+	GTree *found = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, NULL, NULL);
+	uint64_t ids[10];
+	char *res;
+
+	thread_add(g, found, ids, 1, "a@x", NULL, "hello", 1);
+	thread_add(g, found, ids, 2, "b@x", "a@x", "Re: hello", 2);
+	thread_add(g, found, ids, 3, "c@x", "a@x b@x", "Re: hello", 3);
+	thread_add(g, found, ids, 4, "d@x", "a@x", "Re: hello", 4);
+	thread_add(g, found, ids, 5, "e@x", NULL, "other", 5);
+	// parent not in the mailbox: gathered by subject
+	thread_add(g, found, ids, 6, "f@x", "x@x", "Re: other", 6);
+	thread_add(g, found, ids, 7, "g@x", "y@x", "[list] unrelated", 0);
+
+	res = thread_graph_references(g, found, TRUE);
+	fail_unless(MATCH(res, "(7)(1 (2 3)(4))(5 6)"), "thread_graph_references failed [%s]", res);
+	g_free(res);
+
+	// the same set again comes from the kept forest
+	res = thread_graph_references(g, found, TRUE);
+	fail_unless(MATCH(res, "(7)(1 (2 3)(4))(5 6)"), "thread_graph_references failed [%s]", res);
+	g_free(res);
+
+	// without the thread root its replies are siblings under a dummy
+	g_tree_remove(found, &ids[1]);
+	res = thread_graph_references(g, found, TRUE);
+	fail_unless(MATCH(res, "(7)((2 3)(4))(5 6)"), "thread_graph_references failed [%s]", res);
+	g_free(res);
+
+	// a reference loop does not hang
+	thread_add(g, found, ids, 8, "h@x", "i@x", "loop", 8);
+	thread_add(g, found, ids, 9, "i@x", "h@x", "loop", 9);
+	res = thread_graph_references(g, found, TRUE);
+	fail_unless(res != NULL);
+	g_free(res);
+
+	g_tree_destroy(found);
+	thread_graph_free(g);
+}
+END_TEST
+
+START_TEST(test_dbmail_mailbox_esearch)
+{
+	DbmailMailbox mb;
+	search_return ret;
+	uint64_t ids[] = { 2, 3, 4, 7, 9, 10, 11 };
+	uint64_t order[] = { 9, 2, 10, 3, 11, 4, 7 };
+	uint64_t msns[7];
+	char *res;
+	int i;
+
+	memset(&mb, 0, sizeof(mb));
+	mb.uid = TRUE;
+	mb.found = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, NULL, NULL);
+	for (i = 0; i < 7; i++) {
+		msns[i] = i + 1;
+		g_tree_insert(mb.found, &ids[i], &msns[i]);
+		mb.sorted = g_list_append(mb.sorted, &order[i]);
+	}
+
+	memset(&ret, 0, sizeof(ret));
+	ret.options = SEARCH_RETURN_ESEARCH | SEARCH_RETURN_MIN | SEARCH_RETURN_MAX |
+		SEARCH_RETURN_COUNT | SEARCH_RETURN_ALL;
+	res = dbmail_mailbox_esearch(&mb, &ret, FALSE);
+	fail_unless(MATCH(res, " MIN 2 MAX 11 COUNT 7 ALL 2:4,7,9:11"), "dbmail_mailbox_esearch failed [%s]", res);
+	g_free(res);
+
+	// sort order: MIN and MAX are the first and last sorted
+	res = dbmail_mailbox_esearch(&mb, &ret, TRUE);
+	fail_unless(MATCH(res, " MIN 9 MAX 7 COUNT 7 ALL 9,2,10,3,11,4,7"), "dbmail_mailbox_esearch failed [%s]", res);
+	g_free(res);
+
+	mb.uid = FALSE;
+	ret.options = SEARCH_RETURN_ESEARCH | SEARCH_RETURN_ALL;
+	res = dbmail_mailbox_esearch(&mb, &ret, FALSE);
+	fail_unless(MATCH(res, " ALL 1:7"), "dbmail_mailbox_esearch failed [%s]", res);
+	g_free(res);
+
+	mb.uid = TRUE;
+	ret.options = SEARCH_RETURN_ESEARCH | SEARCH_RETURN_PARTIAL;
+	ret.partial_lo = 2;
+	ret.partial_hi = 4;
+	res = dbmail_mailbox_esearch(&mb, &ret, TRUE);
+	fail_unless(MATCH(res, " PARTIAL (2:4 2,10,3)"), "dbmail_mailbox_esearch failed [%s]", res);
+	g_free(res);
+
+	// the range is echoed as the client sent it
+	ret.partial_lo = 4;
+	ret.partial_hi = 2;
+	res = dbmail_mailbox_esearch(&mb, &ret, TRUE);
+	fail_unless(MATCH(res, " PARTIAL (4:2 2,10,3)"), "dbmail_mailbox_esearch failed [%s]", res);
+	g_free(res);
+
+	ret.partial_lo = -2;
+	ret.partial_hi = -1;
+	res = dbmail_mailbox_esearch(&mb, &ret, FALSE);
+	fail_unless(MATCH(res, " PARTIAL (-2:-1 10:11)"), "dbmail_mailbox_esearch failed [%s]", res);
+	g_free(res);
+
+	ret.partial_lo = 8;
+	ret.partial_hi = 10;
+	res = dbmail_mailbox_esearch(&mb, &ret, FALSE);
+	fail_unless(MATCH(res, " PARTIAL (8:10 NIL)"), "dbmail_mailbox_esearch failed [%s]", res);
+	g_free(res);
+
+	g_list_free(mb.sorted);
+	g_tree_destroy(mb.found);
+}
+END_TEST
+
 START_TEST(test_dbmail_mailbox_get_set)
 {
 	guint c, d, r;
@@ -548,7 +765,38 @@ START_TEST(test_dbmail_mailbox_get_set)
 	c = g_tree_nnodes(set);
 	fail_unless(c==0, "dbmail_mailbox_get_set failed [%d]", c);
 	g_tree_destroy(set);
-	
+
+	// saved search result
+	set = dbmail_mailbox_get_set(mb, "$", 0);
+	fail_unless(set != NULL,"dbmail_mailbox_get_set failed");
+	fail_unless(g_tree_nnodes(set) == 0, "dbmail_mailbox_get_set failed");
+	g_tree_destroy(set);
+
+	set = dbmail_mailbox_get_set(mb, "1:2", 0);
+	mb->found = set;
+	search_return ret;
+	memset(&ret, 0, sizeof(ret));
+	ret.options = SEARCH_RETURN_ESEARCH | SEARCH_RETURN_SAVE;
+	s = dbmail_mailbox_save(mb, &ret, FALSE);
+	mb->searchres = s;
+	mb->found = NULL;
+	g_tree_destroy(set);
+
+	set = dbmail_mailbox_get_set(mb, "$", 0);
+	fail_unless(set != NULL,"dbmail_mailbox_get_set failed");
+	t = tree_as_string(set);
+	fail_unless(g_tree_nnodes(set) == 2, "dbmail_mailbox_get_set failed");
+	g_tree_destroy(set);
+	mb->searchres = NULL;
+	g_free(s);
+
+	set = dbmail_mailbox_get_set(mb, "1:2", 0);
+	s = tree_as_string(set);
+	fail_unless(strncmp(s,t,1024)==0,"mismatch between <$> and <1:2>\n%s\n%s", s,t);
+	g_tree_destroy(set);
+	g_free(s);
+	g_free(t);
+
 	dbmail_mailbox_free(mb);
 
 	// empty box
@@ -620,6 +868,9 @@ Suite *dbmail_mailbox_suite(void)
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search_parsed_1);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search_parsed_2);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_orderedsubject);
+	tcase_add_test(tc_mailbox, test_dbmail_mailbox_references);
+	tcase_add_test(tc_mailbox, test_thread_graph_references);
+	tcase_add_test(tc_mailbox, test_dbmail_mailbox_esearch);
 
 	return s;
 }
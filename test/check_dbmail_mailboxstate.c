@@ -106,6 +106,424 @@ START_TEST(test_metadata)
 }
 END_TEST
 
+START_TEST(test_update)
+{
+	MailboxState_T M, N;
+	MessageInfo *info;
+	uint64_t uid, seq;
+	int flags[IMAP_NFLAGS];
+
+	M = MailboxState_new(NULL, testboxid);
+	insert_message();
+	insert_message();
+
+	// new messages
+	N = MailboxState_update(NULL, M);
+	fail_unless(MailboxState_getIdCount(N) == 2, "update failed to pick up new messages");
+	MailboxState_free(&M);
+	M = N;
+
+	// flag change
+	uid = MailboxState_getUidnext(M) - 1;
+	memset(flags, 0, sizeof(flags));
+	flags[IMAP_FLAG_FLAGGED] = 1;
+	seq = db_mailbox_seq_update(testboxid, 0);
+	db_set_msgflag(uid, flags, NULL, IMAPFA_ADD, seq, NULL);
+
+	N = MailboxState_update(NULL, M);
+	info = MailboxState_getMessage(N, uid);
+	fail_unless(info != NULL);
+	fail_unless(info->flags[IMAP_FLAG_FLAGGED] == 1, "update failed to pick up flag change");
+	MailboxState_free(&M);
+	M = N;
+
+	// expunge that does not stamp the message falls back to a full load
+	db_set_message_status(uid, MESSAGE_STATUS_DELETE);
+	db_mailbox_seq_update(testboxid, 0);
+
+	N = MailboxState_update(NULL, M);
+	fail_unless(MailboxState_getIdCount(N) == 1, "update failed to drop expunged message");
+	fail_unless(MailboxState_getMsn(N, uid) == NULL);
+
+	MailboxState_free(&M);
+	MailboxState_free(&N);
+}
+END_TEST
+
+START_TEST(test_search)
+{
+	MailboxState_T M;
+	search_key s;
+	GTree *found;
+	uint64_t uid, seq;
+	int flags[IMAP_NFLAGS];
+
+	insert_message();
+	insert_message();
+
+	M = MailboxState_new(NULL, testboxid);
+	uid = MailboxState_getUidnext(M) - 1;
+	MailboxState_free(&M);
+
+	memset(flags, 0, sizeof(flags));
+	flags[IMAP_FLAG_SEEN] = 1;
+	seq = db_mailbox_seq_update(testboxid, 0);
+	db_set_msgflag(uid, flags, NULL, IMAPFA_ADD, seq, NULL);
+
+	M = MailboxState_new(NULL, testboxid);
+
+	// not answered from the index
+	memset(&s, 0, sizeof(s));
+	s.type = IST_HDR;
+	fail_unless(MailboxState_search(M, &s) == NULL);
+
+	// UNSEEN
+	memset(&s, 0, sizeof(s));
+	s.type = IST_FLAG;
+	s.flags_mask = 1 << IMAP_FLAG_SEEN;
+	found = MailboxState_search(M, &s);
+	fail_unless(g_tree_nnodes(found) == 1, "unseen: [%d]", g_tree_nnodes(found));
+	fail_unless(g_tree_lookup(found, &uid) == NULL);
+	g_tree_destroy(found);
+
+	// SEEN
+	s.flags_set = s.flags_mask;
+	found = MailboxState_search(M, &s);
+	fail_unless(g_tree_nnodes(found) == 1);
+	fail_unless(g_tree_lookup(found, &uid) != NULL);
+	g_tree_destroy(found);
+
+	// LARGER 0, SMALLER 1
+	memset(&s, 0, sizeof(s));
+	s.type = IST_SIZE_LARGER;
+	found = MailboxState_search(M, &s);
+	fail_unless(g_tree_nnodes(found) == 2);
+	g_tree_destroy(found);
+	s.type = IST_SIZE_SMALLER;
+	s.size = 1;
+	found = MailboxState_search(M, &s);
+	fail_unless(g_tree_nnodes(found) == 0);
+	g_tree_destroy(found);
+
+	// SINCE yesterday, BEFORE yesterday
+	memset(&s, 0, sizeof(s));
+	s.type = IST_IDATE;
+	s.since = time(NULL) - 86400;
+	found = MailboxState_search(M, &s);
+	fail_unless(g_tree_nnodes(found) == 2);
+	g_tree_destroy(found);
+	s.before = s.since;
+	s.since = 0;
+	found = MailboxState_search(M, &s);
+	fail_unless(g_tree_nnodes(found) == 0);
+	g_tree_destroy(found);
+
+	// keywords nobody has set
+	memset(&s, 0, sizeof(s));
+	s.type = IST_KEYWORD;
+	strcpy(s.search, "nosuchkeyword");
+	found = MailboxState_search(M, &s);
+	fail_unless(g_tree_nnodes(found) == 0);
+	g_tree_destroy(found);
+	s.type = IST_UNKEYWORD;
+	found = MailboxState_search(M, &s);
+	fail_unless(g_tree_nnodes(found) == 2);
+	g_tree_destroy(found);
+
+	MailboxState_free(&M);
+}
+END_TEST
+
+START_TEST(test_shared)
+{
+	MailboxState_T M, N;
+	MessageInfo *a, *b;
+	struct state_cache_stats before, stats;
+	uint64_t uid;
+
+	insert_message();
+	insert_message();
+	MailboxState_cache_flush();
+	MailboxState_cache_stats(&before);
+
+	M = MailboxState_new(NULL, testboxid);
+	N = MailboxState_new(NULL, testboxid);
+	MailboxState_cache_stats(&stats);
+	fail_unless(stats.entries == 1, "state not cached");
+	fail_unless(stats.hits == before.hits + 1, "second state did not use the cache");
+
+	uid = *MailboxState_getUid(M, 1);
+	a = MailboxState_getMessage(M, uid);
+	b = MailboxState_getMessage(N, uid);
+	fail_unless(a == b, "states do not share their index");
+
+	// copy on write
+	b = MailboxState_editMessage(N, uid);
+	fail_unless(a != b, "edit did not copy the shared index");
+	b->flags[IMAP_FLAG_FLAGGED] = 1;
+	fail_unless(a->flags[IMAP_FLAG_FLAGGED] == 0, "edit changed the shared index");
+
+	// expunges stay in the session
+	fail_unless(MailboxState_removeUid(N, uid) == DM_SUCCESS);
+	fail_unless(MailboxState_getMsn(N, uid) == NULL);
+	fail_unless(MailboxState_getMsn(M, uid) != NULL, "expunge leaked into another state");
+	fail_unless(MailboxState_getIdCount(N) == 1);
+	fail_unless(MailboxState_getIdCount(M) == 2);
+
+	// eviction
+	MailboxState_cache_setLimit(0);
+	MailboxState_cache_stats(&stats);
+	fail_unless(stats.entries == 0);
+	fail_unless(stats.evictions == before.evictions + 1);
+	fail_unless(stats.bytes == 0);
+	fail_unless(MailboxState_getMessage(M, uid) == a, "evicted index freed while in use");
+
+	MailboxState_free(&M);
+	MailboxState_free(&N);
+}
+END_TEST
+
+/*
+ * micro-benchmark: the message index against the GTree maps it replaced.
+ * Benchmarks only run when DBMAIL_BENCHMARK is set in the environment.
+ */
+#define BENCH_MESSAGES 100000
+
+typedef struct {
+	uint64_t mailbox_id;
+	uint64_t msn;
+	uint64_t uid;
+	uint64_t rfcsize;
+	uint64_t seq;
+	char internaldate[IMAP_INTERNALDATE_LEN];
+	GList *keywords;
+	char flags[IMAP_NFLAGS];
+	char status;
+} LegacyMessageInfo;
+
+START_TEST(test_index_benchmark)
+{
+	MailboxState_T M;
+	GTree *msginfo, *ids, *msn;
+	GTimer *timer = g_timer_new();
+	MessageInfo info;
+	uint64_t i, *uid, *k, *v, hits = 0;
+	double tree_build, index_build, tree_lookup, index_lookup;
+
+	// legacy: three trees and a heap record per message
+	g_timer_start(timer);
+	msginfo = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, NULL, g_free);
+	ids = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, g_free, g_free);
+	msn = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, NULL, NULL);
+	for (i = 1; i <= BENCH_MESSAGES; i++) {
+		LegacyMessageInfo *m = g_new0(LegacyMessageInfo, 1);
+		m->uid = i * 2;
+		m->msn = i;
+		m->rfcsize = 1024;
+		m->flags[IMAP_FLAG_SEEN] = 1;
+		g_tree_insert(msginfo, &m->uid, m);
+		k = g_new0(uint64_t, 1);
+		v = g_new0(uint64_t, 1);
+		*k = m->uid;
+		*v = i;
+		g_tree_insert(ids, k, v);
+		g_tree_insert(msn, v, k);
+	}
+	tree_build = g_timer_elapsed(timer, NULL);
+
+	g_timer_start(timer);
+	M = MailboxState_new(NULL, 0);
+	MailboxState_setPermission(M, IMAPPERM_READ);
+	memset(&info, 0, sizeof(info));
+	info.rfcsize = 1024;
+	info.flags[IMAP_FLAG_SEEN] = 1;
+	for (i = 1; i <= BENCH_MESSAGES; i++) {
+		info.uid = i * 2;
+		MailboxState_addMessage(M, &info, NULL);
+	}
+	index_build = g_timer_elapsed(timer, NULL);
+
+	fail_unless(MailboxState_getIdCount(M) == (unsigned)g_tree_nnodes(ids));
+
+	g_timer_start(timer);
+	for (i = 1; i <= BENCH_MESSAGES; i++) {
+		uint64_t u = i * 2;
+		v = g_tree_lookup(ids, &u);
+		k = g_tree_lookup(msn, v);
+		if (k && *k == u && g_tree_lookup(msginfo, &u)) hits++;
+	}
+	tree_lookup = g_timer_elapsed(timer, NULL);
+	fail_unless(hits == BENCH_MESSAGES);
+
+	hits = 0;
+	g_timer_start(timer);
+	for (i = 1; i <= BENCH_MESSAGES; i++) {
+		uint64_t u = i * 2;
+		v = MailboxState_getMsn(M, u);
+		uid = v ? MailboxState_getUid(M, *v) : NULL;
+		if (uid && *uid == u && MailboxState_getMessage(M, u)) hits++;
+	}
+	index_lookup = g_timer_elapsed(timer, NULL);
+	fail_unless(hits == BENCH_MESSAGES);
+
+	// odd uids are not in either map
+	i = 3;
+	fail_unless(g_tree_lookup(ids, &i) == NULL);
+	fail_unless(MailboxState_getMsn(M, i) == NULL);
+
+	printf("\nMailboxState index [%d messages]\n"
+			"  build:  trees %.3fs index %.3fs\n"
+			"  lookup: trees %.3fs index %.3fs\n",
+			BENCH_MESSAGES, tree_build, index_build,
+			tree_lookup, index_lookup);
+
+	g_tree_destroy(msn);
+	g_tree_destroy(ids);
+	g_tree_destroy(msginfo);
+	g_timer_destroy(timer);
+	MailboxState_free(&M);
+}
+END_TEST
+
+static gboolean _found_copy(uint64_t *uid, uint64_t *msn, GTree *found)
+{
+	g_tree_insert(found, uid, msn);
+	return FALSE;
+}
+
+static void sort_add(MailboxState_T M, uint64_t uid, time_t arrival, uint64_t size,
+		const char *subject, const char *from, time_t sentdate)
+{
+	MessageInfo info;
+	const char *keys[SORTKEY_STRINGS] = { subject, from, from, "", "" };
+
+	memset(&info, 0, sizeof(info));
+	info.uid = uid;
+	info.internaldate = arrival;
+	info.rfcsize = size;
+	MailboxState_addMessage(M, &info, NULL);
+	MailboxState_setSortkeys(M, uid, keys, sentdate);
+}
+
+START_TEST(test_sort)
+{
+	MailboxState_T M = MailboxState_new(NULL, 0);
+	GTree *found = g_tree_new((GCompareFunc)ucmp);
+	GList *sorted = NULL;
+	int bysubject[] = { SORT_SUBJECT, -SORT_DATE, 0 };
+	int bysize[] = { -SORT_SIZE, 0 };
+	int byfrom[] = { SORT_FROM, SORT_ARRIVAL, 0 };
+	MessageInfo info;
+	uint64_t *uid;
+
+	MailboxState_setPermission(M, IMAPPERM_READ);
+	sort_add(M, 1, 400, 10, "beta", "carol", 100);
+	sort_add(M, 2, 300, 40, "alpha", "bob", 200);
+	sort_add(M, 3, 200, 30, "beta", "bob", 300);
+	sort_add(M, 4, 100, 20, "alpha", "alice", 100);
+
+	MailboxState_foreach_id(M, (GTraverseFunc)_found_copy, found);
+
+	fail_unless(MailboxState_sort(M, found, bysubject, &sorted) == DM_SUCCESS);
+	fail_unless(g_list_length(sorted) == 4);
+	uid = g_list_nth_data(sorted, 0); fail_unless(*uid == 2);
+	uid = g_list_nth_data(sorted, 1); fail_unless(*uid == 4);
+	uid = g_list_nth_data(sorted, 2); fail_unless(*uid == 3);
+	uid = g_list_nth_data(sorted, 3); fail_unless(*uid == 1);
+	g_list_destroy(sorted);
+
+	fail_unless(MailboxState_sort(M, found, bysize, &sorted) == DM_SUCCESS);
+	uid = g_list_nth_data(sorted, 0); fail_unless(*uid == 2);
+	uid = g_list_nth_data(sorted, 3); fail_unless(*uid == 1);
+	g_list_destroy(sorted);
+
+	// ties on the sender are ordered by arrival
+	fail_unless(MailboxState_sort(M, found, byfrom, &sorted) == DM_SUCCESS);
+	uid = g_list_nth_data(sorted, 0); fail_unless(*uid == 4);
+	uid = g_list_nth_data(sorted, 1); fail_unless(*uid == 3);
+	uid = g_list_nth_data(sorted, 2); fail_unless(*uid == 2);
+	uid = g_list_nth_data(sorted, 3); fail_unless(*uid == 1);
+	g_list_destroy(sorted);
+
+	// a message without sort keys can not be sorted in memory
+	memset(&info, 0, sizeof(info));
+	info.uid = 5;
+	MailboxState_addMessage(M, &info, NULL);
+	g_tree_destroy(found);
+	found = g_tree_new((GCompareFunc)ucmp);
+	MailboxState_foreach_id(M, (GTraverseFunc)_found_copy, found);
+	fail_unless(MailboxState_sort(M, found, bysubject, &sorted) == DM_EGENERAL);
+	fail_unless(sorted == NULL);
+
+	g_tree_destroy(found);
+	MailboxState_free(&M);
+}
+END_TEST
+
+static void sort_benchmark(unsigned messages)
+{
+	MailboxState_T M = MailboxState_new(NULL, 0);
+	GTree *found = g_tree_new((GCompareFunc)ucmp);
+	GTimer *timer = g_timer_new();
+	GRand *rand = g_rand_new_with_seed(messages);
+	GList *sorted = NULL;
+	int bysubject[] = { SORT_SUBJECT, 0 };
+	int bydate[] = { -SORT_DATE, SORT_FROM, 0 };
+	char subject[64], from[64];
+	double load, first, again, other;
+	unsigned i;
+
+	MailboxState_setPermission(M, IMAPPERM_READ);
+
+	g_timer_start(timer);
+	for (i = 1; i <= messages; i++) {
+		g_snprintf(subject, sizeof(subject), "subject %u", g_rand_int_range(rand, 0, max(messages / 10, 1)));
+		g_snprintf(from, sizeof(from), "user%u", g_rand_int_range(rand, 0, max(messages / 100, 1)));
+		sort_add(M, i, (time_t)i, g_rand_int_range(rand, 1, 1 << 20),
+				subject, from, (time_t)g_rand_int_range(rand, 0, 1 << 30));
+	}
+	load = g_timer_elapsed(timer, NULL);
+
+	MailboxState_foreach_id(M, (GTraverseFunc)_found_copy, found);
+
+	// the first sort ranks the strings
+	g_timer_start(timer);
+	fail_unless(MailboxState_sort(M, found, bysubject, &sorted) == DM_SUCCESS);
+	first = g_timer_elapsed(timer, NULL);
+	fail_unless(g_list_length(sorted) == messages);
+	g_list_destroy(sorted);
+
+	g_timer_start(timer);
+	fail_unless(MailboxState_sort(M, found, bysubject, &sorted) == DM_SUCCESS);
+	again = g_timer_elapsed(timer, NULL);
+	g_list_destroy(sorted);
+
+	g_timer_start(timer);
+	fail_unless(MailboxState_sort(M, found, bydate, &sorted) == DM_SUCCESS);
+	other = g_timer_elapsed(timer, NULL);
+	fail_unless(g_list_length(sorted) == messages);
+	g_list_destroy(sorted);
+
+	printf("\nMailboxState sort [%u messages]\n"
+			"  load keys %.3fs\n"
+			"  subject: first %.3fs again %.3fs\n"
+			"  reverse date, from: %.3fs\n",
+			messages, load, first, again, other);
+
+	g_rand_free(rand);
+	g_timer_destroy(timer);
+	g_tree_destroy(found);
+	MailboxState_free(&M);
+}
+
+START_TEST(test_sort_benchmark)
+{
+	sort_benchmark(10000);
+	sort_benchmark(100000);
+	sort_benchmark(1000000);
+}
+END_TEST
+
 static void mailboxstate_destroy(MailboxState_T M)
 {
 	MailboxState_free(&M);
@@ -147,6 +565,18 @@ Suite *dbmail_common_suite(void)
 	tcase_add_test(tc_state, test_createdestroy);
 	tcase_add_test(tc_state, test_metadata);
 	tcase_add_test(tc_state, test_mbxinfo);
+	tcase_add_test(tc_state, test_update);
+	tcase_add_test(tc_state, test_search);
+	tcase_add_test(tc_state, test_shared);
+	tcase_add_test(tc_state, test_sort);
+
+	if (getenv("DBMAIL_BENCHMARK")) {
+		TCase *tc_bench = tcase_create("Benchmark");
+		suite_add_tcase(s, tc_bench);
+		tcase_set_timeout(tc_bench, 120);
+		tcase_add_test(tc_bench, test_index_benchmark);
+		tcase_add_test(tc_bench, test_sort_benchmark);
+	}
 
 	return s;
 }
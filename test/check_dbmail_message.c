@@ -469,6 +469,71 @@ START_TEST(test_dbmail_message_store2)
 END_TEST
 
 
+/*
+ * benchmarks only run when DBMAIL_BENCHMARK is set in the environment
+ */
+static double store_rate(const char *message, int count, gboolean batched)
+{
+	int i;
+	double elapsed;
+	struct timeval before, after;
+	DbmailMessage *m;
+
+	gettimeofday(&before, NULL);
+	for (i = 0; i < count; i++) {
+		m = message_init(message);
+		if (batched)
+			fail_unless(dbmail_message_store_batched(m) == DM_SUCCESS, "dbmail_message_store_batched failed");
+		else
+			dbmail_message_store(m);
+		dbmail_message_free(m);
+	}
+	gettimeofday(&after, NULL);
+
+	elapsed = ((double)after.tv_sec + ((double)after.tv_usec / 1000000)) - 
+		((double)before.tv_sec + ((double)before.tv_usec / 1000000));
+
+	return elapsed > 0 ? (double)count / elapsed : 0;
+}
+
+START_TEST(test_dbmail_message_store_batched)
+{
+	DbmailMessage *m, *n;
+	uint64_t physid;
+	char *t, *e;
+
+	m = message_init(multipart_message);
+	e = dbmail_message_to_string(m);
+
+	fail_unless(dbmail_message_store_batched(m) == DM_SUCCESS, "dbmail_message_store_batched failed");
+	physid = dbmail_message_get_physid(m);
+	fail_unless(physid != 0, "dbmail_message_store_batched failed. physid [%" PRIu64 "]", physid);
+	dbmail_message_free(m);
+
+	n = dbmail_message_new(NULL);
+	dbmail_message_set_physid(n, physid);
+	n = dbmail_message_retrieve(n, physid);
+	fail_unless(n != NULL, "_mime_retrieve failed");
+
+	t = dbmail_message_to_string(n);
+	COMPARE(e,t);
+	dbmail_message_free(n);
+	g_free(e);
+	g_free(t);
+}
+END_TEST
+
+START_TEST(test_store_benchmark)
+{
+	double rate, batched_rate;
+
+	rate = store_rate(multipart_message, 50, FALSE);
+	batched_rate = store_rate(multipart_message, 50, TRUE);
+	TRACE(TRACE_NOTICE, "message store: [%.1f] messages/sec, batched: [%.1f] messages/sec", 
+			rate, batched_rate);
+}
+END_TEST
+
 //DbmailMessage * dbmail_message_retrieve(DbmailMessage *self, uint64_t physid, int filter);
 START_TEST(test_dbmail_message_retrieve)
 {
@@ -778,6 +843,48 @@ START_TEST(test_dbmail_message_cache_headers)
 }
 END_TEST
 
+START_TEST(test_dbmail_message_header_names)
+{
+	DbmailMessage *m;
+	uint64_t hits, misses, hits2, misses2;
+
+	m = message_init(multipart_message);
+	dbmail_message_store(m);
+	dbmail_message_free(m);
+
+	dbmail_message_header_names_stats(&hits, &misses);
+
+	/* all headernames are known now */
+	m = message_init(multipart_message);
+	dbmail_message_store(m);
+	dbmail_message_free(m);
+
+	dbmail_message_header_names_stats(&hits2, &misses2);
+	fail_unless(hits2 > hits, "headername cache not used [%" PRIu64 "] [%" PRIu64 "]", hits, hits2);
+	fail_unless(misses2 == misses, "headername cache missed [%" PRIu64 "] [%" PRIu64 "]", misses, misses2);
+}
+END_TEST
+
+START_TEST(test_dbmail_message_header_values)
+{
+	DbmailMessage *m;
+	uint64_t hits, misses, hits2, misses2;
+
+	m = message_init(multipart_message);
+	dbmail_message_store(m);
+	dbmail_message_free(m);
+
+	dbmail_message_header_values_stats(&hits, &misses);
+
+	m = message_init(multipart_message);
+	dbmail_message_store(m);
+	dbmail_message_free(m);
+
+	dbmail_message_header_values_stats(&hits2, &misses2);
+	fail_unless(hits2 > hits, "headervalue cache not used [%" PRIu64 "] [%" PRIu64 "]", hits, hits2);
+}
+END_TEST
+
 START_TEST(test_dbmail_message_get_header_addresses)
 {
 	GList * result;
@@ -969,6 +1076,211 @@ int test_db_get_subject(uint64_t physid, char **subject)
         return t;
 }
 
+START_TEST(test_dbmail_message_retrieve_range)
+{
+	DbmailMessage *m, *n;
+	const char *raw[] = { simple, multipart_message, rfc822, NULL };
+	uint64_t ids[3];
+	GList *physids = NULL;
+	GTree *messages;
+	int i;
+
+	for (i = 0; raw[i]; i++) {
+		m = dbmail_message_new(NULL);
+		m = dbmail_message_init_with_string(m, raw[i]);
+		dbmail_message_store(m);
+		ids[i] = dbmail_message_get_physid(m);
+		physids = g_list_append(physids, &ids[i]);
+		dbmail_message_free(m);
+	}
+
+	messages = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, 
+			(GDestroyNotify)g_free, (GDestroyNotify)dbmail_message_free);
+	fail_unless(dbmail_message_retrieve_range(physids, messages, NULL) == DM_SUCCESS, 
+			"dbmail_message_retrieve_range failed");
+	fail_unless(g_tree_nnodes(messages) == 3, "dbmail_message_retrieve_range failed");
+
+	for (i = 0; raw[i]; i++) {
+		char *e, *t;
+		m = g_tree_lookup(messages, &ids[i]);
+		fail_unless(m != NULL, "message [%" PRIu64 "] not retrieved", ids[i]);
+		n = dbmail_message_new(NULL);
+		n = dbmail_message_retrieve(n, ids[i]);
+		e = dbmail_message_to_string(n);
+		t = dbmail_message_to_string(m);
+		COMPARE(e, t);
+		g_free(e);
+		g_free(t);
+		dbmail_message_free(n);
+	}
+
+	g_tree_destroy(messages);
+	g_list_free(physids);
+}
+END_TEST
+
+START_TEST(test_fulltext_message_terms)
+{
+	DbmailMessage *m;
+	GHashTable *terms;
+	GList *q;
+	gboolean complete = FALSE;
+	GString *s;
+	int i;
+
+	m = dbmail_message_new(NULL);
+	m = dbmail_message_init_with_string(m, multipart_message);
+	terms = fulltext_message_terms(m->content, &complete);
+
+	fail_unless(complete);
+	fail_unless(GPOINTER_TO_INT(g_hash_table_lookup(terms, "spongebob")) == FULLTEXT_HEADER);
+	fail_unless(GPOINTER_TO_INT(g_hash_table_lookup(terms, "crontab")) == FULLTEXT_BODY, "base64 part not decoded");
+	fail_unless(GPOINTER_TO_INT(g_hash_table_lookup(terms, "message")) & FULLTEXT_BODY);
+	fail_unless(g_hash_table_lookup(terms, "a") == NULL);
+
+	g_hash_table_destroy(terms);
+	dbmail_message_free(m);
+
+	// a long word is stored in overlapping pieces
+	s = g_string_new("Subject: ");
+	for (i = 0; i < 10; i++)
+		g_string_append(s, "abcdefghij");
+	g_string_append(s, "\n\nbody\n");
+	m = dbmail_message_new(NULL);
+	m = dbmail_message_init_with_string(m, s->str);
+	terms = fulltext_message_terms(m->content, &complete);
+	fail_unless(complete);
+	fail_unless(g_hash_table_lookup(terms, "abcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcdefghijabcd") != NULL);
+	fail_unless(g_hash_table_lookup(terms, "efghijabcdefghijabcdefghijabcdefghij") != NULL);
+	g_hash_table_destroy(terms);
+	dbmail_message_free(m);
+	g_string_free(s, TRUE);
+
+	// the first word may start inside a stored term, the others start one
+	q = fulltext_query_terms("Vixie CRONTAB!");
+	fail_unless(g_list_length(q) == 2);
+	fail_unless(g_list_find_custom(q, "%vixie%", (GCompareFunc)strcmp) != NULL);
+	fail_unless(g_list_find_custom(q, "crontab", (GCompareFunc)strcmp) != NULL);
+	g_list_destroy(q);
+
+	q = fulltext_query_terms(" vixie");
+	fail_unless(g_list_length(q) == 1);
+	fail_unless(strcmp((char *)q->data, "vixie") == 0);
+	g_list_destroy(q);
+
+	fail_unless(fulltext_query_terms("x") == NULL);
+}
+END_TEST
+
+START_TEST(test_trigram_query_terms)
+{
+	GList *q;
+
+	fail_unless(trigram_query_terms("ab") == NULL);
+
+	q = trigram_query_terms("FOO");
+	fail_unless(g_list_length(q) == 1);
+	fail_unless(MATCH((char *)q->data, "foo"));
+	g_list_destroy(q);
+
+	// repeated trigrams are only listed once
+	q = trigram_query_terms("aaaaab");
+	fail_unless(g_list_length(q) == 2);
+	g_list_destroy(q);
+
+	// accents and case are folded, like a case and accent insensitive LIKE
+	q = trigram_query_terms("H\xc3\xa9llo");
+	fail_unless(g_list_length(q) == 3);
+	fail_unless(g_list_find_custom(q, "hel", (GCompareFunc)strcmp) != NULL);
+	g_list_destroy(q);
+
+	// not UTF-8: left to a plain scan
+	fail_unless(trigram_query_terms("h\xe9llo") == NULL);
+}
+END_TEST
+
+START_TEST(test_dbmail_message_cache_bodystructure)
+{
+	DbmailMessage *m;
+	Connection_T c; ResultSet_T r;
+	char *expect, *bodystructure = NULL, *body = NULL;
+
+	m = dbmail_message_new(NULL);
+	m = dbmail_message_init_with_string(m, multipart_message);
+	dbmail_message_store(m);
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT bodystructure, body FROM %senvelope WHERE physmessage_id = %" PRIu64 "",
+				DBPFX, dbmail_message_get_physid(m));
+		if (db_result_next(r)) {
+			bodystructure = g_strdup(db_result_get(r, 0));
+			body = g_strdup(db_result_get(r, 1));
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	expect = imap_get_structure(GMIME_MESSAGE(m->content), 1);
+	fail_unless(MATCH(bodystructure, expect), "cached bodystructure failed\n[%s] !=\n[%s]", bodystructure, expect);
+	g_free(expect);
+
+	expect = imap_get_structure(GMIME_MESSAGE(m->content), 0);
+	fail_unless(MATCH(body, expect), "cached body failed\n[%s] !=\n[%s]", body, expect);
+	g_free(expect);
+
+	g_free(bodystructure);
+	g_free(body);
+	dbmail_message_free(m);
+}
+END_TEST
+
+START_TEST(test_dbmail_message_cache_sortkeys)
+{
+	DbmailMessage *m;
+	Connection_T c; ResultSet_T r;
+	char *subject = NULL, *fromaddr = NULL, *fromname = NULL, *toaddr = NULL;
+
+	m = dbmail_message_new(NULL);
+	m = dbmail_message_init_with_string(m, "From: Paul J Stevens <Paul@Example.org>\n"
+			"To: <Tester@Example.org>, other@example.org\n"
+			"Subject: Re: [fwd: Sort Me]\n"
+			"Date: Mon, 2 Jan 2006 10:00:00 +0200\n"
+			"\n"
+			"body\n");
+	dbmail_message_store(m);
+
+	c = db_con_get();
+	TRY
+		r = db_query(c, "SELECT subject, fromaddr, fromname, toaddr FROM %ssortkeys WHERE physmessage_id = %" PRIu64 "",
+				DBPFX, dbmail_message_get_physid(m));
+		if (db_result_next(r)) {
+			subject = g_strdup(db_result_get(r, 0));
+			fromaddr = g_strdup(db_result_get(r, 1));
+			fromname = g_strdup(db_result_get(r, 2));
+			toaddr = g_strdup(db_result_get(r, 3));
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	fail_unless(MATCH(subject, "sort me"), "sort key subject failed [%s]", subject);
+	fail_unless(MATCH(fromaddr, "paul"), "sort key from failed [%s]", fromaddr);
+	fail_unless(MATCH(fromname, "paul j stevens"), "sort key display failed [%s]", fromname);
+	fail_unless(MATCH(toaddr, "tester"), "sort key to failed [%s]", toaddr);
+
+	g_free(subject);
+	g_free(fromaddr);
+	g_free(fromname);
+	g_free(toaddr);
+	dbmail_message_free(m);
+}
+END_TEST
+
 START_TEST(test_dbmail_message_utf8_headers)
 {
 	DbmailMessage *m;
@@ -1020,7 +1332,13 @@ Suite *dbmail_message_suite(void)
 	tcase_add_test(tc_message, test_g_mime_object_get_body);
 	tcase_add_test(tc_message, test_dbmail_message_store);
 	tcase_add_test(tc_message, test_dbmail_message_store2);
+	tcase_add_test(tc_message, test_dbmail_message_store_batched);
 	tcase_add_test(tc_message, test_dbmail_message_retrieve);
+	tcase_add_test(tc_message, test_dbmail_message_retrieve_range);
+	tcase_add_test(tc_message, test_dbmail_message_cache_bodystructure);
+	tcase_add_test(tc_message, test_dbmail_message_cache_sortkeys);
+	tcase_add_test(tc_message, test_fulltext_message_terms);
+	tcase_add_test(tc_message, test_trigram_query_terms);
 	tcase_add_test(tc_message, test_dbmail_message_init_with_string);
 	tcase_add_test(tc_message, test_dbmail_message_to_string);
 	tcase_add_test(tc_message, test_dbmail_message_hdrs_to_string);
@@ -1028,6 +1346,8 @@ Suite *dbmail_message_suite(void)
 	tcase_add_test(tc_message, test_dbmail_message_set_header);
 	tcase_add_test(tc_message, test_dbmail_message_get_header);
 	tcase_add_test(tc_message, test_dbmail_message_cache_headers);
+	tcase_add_test(tc_message, test_dbmail_message_header_names);
+	tcase_add_test(tc_message, test_dbmail_message_header_values);
 	tcase_add_test(tc_message, test_dbmail_message_free);
 	tcase_add_test(tc_message, test_dbmail_message_encoded);
 	tcase_add_test(tc_message, test_dbmail_message_8bit);
@@ -1038,6 +1358,15 @@ Suite *dbmail_message_suite(void)
 	tcase_add_test(tc_message, test_encoding);
 	tcase_add_test(tc_message, test_db_get_message_lines);
 	tcase_add_test(tc_message, test_dbmail_message_utf8_headers);
+
+	if (getenv("DBMAIL_BENCHMARK")) {
+		TCase *tc_bench = tcase_create("Benchmark");
+		suite_add_tcase(s, tc_bench);
+		tcase_add_checked_fixture(tc_bench, setup, teardown);
+		tcase_set_timeout(tc_bench, 120);
+		tcase_add_test(tc_bench, test_store_benchmark);
+	}
+
 	return s;
 }
 
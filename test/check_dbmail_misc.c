@@ -372,6 +372,31 @@ START_TEST(test_base64_decodev)
 }
 END_TEST
 
+START_TEST(test_dm_gzip)
+{
+	int i;
+	size_t zlen, len;
+	char *zbuf, *result;
+	GString *in = g_string_new("");
+
+	for (i = 0; i < 200; i++)
+		g_string_append_printf(in, "Line %d of a highly compressible mime part\r\n", i);
+
+	zbuf = dm_gzip(in->str, in->len, TRUE, &zlen);
+	fail_unless(zbuf != NULL, "dm_gzip compression failed");
+	fail_unless(zlen < in->len, "dm_gzip failed to compress [%zu] >= [%zu]", zlen, in->len);
+
+	result = dm_gzip(zbuf, zlen, FALSE, &len);
+	fail_unless(result != NULL, "dm_gzip decompression failed");
+	fail_unless(len == in->len, "dm_gzip length mismatch [%zu] != [%zu]", len, in->len);
+	fail_unless(MATCH(result, in->str), "dm_gzip round trip failed");
+
+	g_free(result);
+	g_free(zbuf);
+	g_string_free(in, TRUE);
+}
+END_TEST
+
 #define S1(a,b) \
 	memset(hash,0,sizeof(hash)); dm_sha1((a),hash); \
 	fail_unless(SMATCH(hash,(b)), "sha1 failed [%s] != [%s]", hash, b)
@@ -573,6 +598,7 @@ Suite *dbmail_misc_suite(void)
  	tcase_add_test(tc_misc, test_dm_strtoull);
 	tcase_add_test(tc_misc, test_base64_decode);
 	tcase_add_test(tc_misc, test_base64_decodev);
+	tcase_add_test(tc_misc, test_dm_gzip);
 	tcase_add_test(tc_misc, test_sha1);
 	tcase_add_test(tc_misc, test_sha256);
 	tcase_add_test(tc_misc, test_sha512);